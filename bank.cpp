@@ -5,6 +5,10 @@
 
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <list>
+#include <span>
+#include <charconv>
 #include <fstream>
 #include <optional>
 #include <algorithm>
@@ -14,6 +18,54 @@
 #include <iomanip>
 #include <string>
 #include <functional>
+#include <iterator>
+#include <utility>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <memory>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <random>
+#include <numeric>
+#include <sstream>
+#include <string_view>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#include <cpuid.h>
+#define BANK_HAVE_SHA_NI 1
+#define BANK_HAVE_AVX2 1
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define BANK_HAVE_MMAP 1
+#define BANK_HAVE_FSYNC 1
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define BANK_HAVE_SOCKETS 1
+#endif
 
 namespace fs = std::filesystem;
 using namespace std;
@@ -30,6 +82,24 @@ enum class Menu : int {
     UpdateName = 8,
     HighBalance = 9,
     SortAccounts = 10,
+    VerifyAudit = 11,
+    Backup = 12,
+    BalanceAsOf = 13,
+    RestoreAsOf = 14,
+    PlaceHold = 15,
+    CaptureHold = 16,
+    ReleaseHold = 17,
+    ScheduleTransfer = 18,
+    StandingOrders = 19,
+    CancelOrder = 20,
+    Products = 21,
+    DefineProduct = 22,
+    SetProduct = 23,
+    AssessFees = 24,
+    CreditLimit = 25,
+    ExchangeRates = 26,
+    Revalue = 27,
+    FraudAlerts = 28,
     Exit = 0
 };
 
@@ -69,40 +139,220 @@ bool getNonEmptyString(const string& prompt, string& value) {
     }
 }
 
+// ---------------- Fixed Account Record ----------------
+// On-disk layout shared by the paged engines; names are limited to maxName bytes.
+struct AccountRecord {
+    static constexpr size_t maxName = 51;
+
+    int32_t accountNum;
+    uint8_t nameLen;
+    char name[maxName];
+    double balance;
+    uint64_t pinHash;
+};
+static_assert(sizeof(AccountRecord) == 72 && is_trivially_copyable_v<AccountRecord>);
+
+// ---------------- Account Products ----------------
+// The kind of account a balance sits in decides its limits. Each kind is a policy type
+// with its defaults written once in ProductRules and specialised per product through
+// CRTP. An account resolves its kind and any configured credit line into Limits when
+// either changes, and keeps them, and what it can spend, next to its balance; checking
+// a debit is then one comparison, with no switch on the kind and no virtual call.
+enum class AccountKind : uint8_t { Standard, Savings, Checking, Loan };
+
+struct Limits {
+    double overdraft = 0; // how far below zero the balance may go (a loan's credit line)
+    double maxWithdrawal = numeric_limits<double>::infinity();
+    double maxBalance = numeric_limits<double>::infinity();
+};
+
+template <typename Product>
+struct ProductRules {
+    static constexpr double overdraftLimit = 0;
+    static constexpr double maxWithdrawal = numeric_limits<double>::infinity();
+    static constexpr double maxBalance = numeric_limits<double>::infinity();
+
+    // A configured credit line replaces the kind's own overdraft limit.
+    static Limits limits(optional<double> creditLine) {
+        return {creditLine.value_or(Product::overdraftLimit), Product::maxWithdrawal, Product::maxBalance};
+    }
+
+    // The cents interest accrues on, and whether it is paid (+1) or charged (-1).
+    static pair<int64_t, int> interestBasis(int64_t cents) { return {max<int64_t>(cents, 0), 1}; }
+};
+
+struct StandardProduct : ProductRules<StandardProduct> {};
+
+struct SavingsProduct : ProductRules<SavingsProduct> {
+    static constexpr double maxWithdrawal = 5'000;
+};
+
+struct CheckingProduct : ProductRules<CheckingProduct> {
+    static constexpr double overdraftLimit = 1'000;
+};
+
+// A credit line: the balance is what is owed, below zero, and repayments stop at zero.
+struct LoanProduct : ProductRules<LoanProduct> {
+    static constexpr double overdraftLimit = 25'000;
+    static constexpr double maxBalance = 0;
+
+    static pair<int64_t, int> interestBasis(int64_t cents) { return {max<int64_t>(-cents, 0), -1}; }
+};
+
+// Calls fn with the policy object for kind.
+template <typename Fn>
+decltype(auto) withProduct(AccountKind kind, Fn&& fn) {
+    switch (kind) {
+        case AccountKind::Savings: return fn(SavingsProduct{});
+        case AccountKind::Checking: return fn(CheckingProduct{});
+        case AccountKind::Loan: return fn(LoanProduct{});
+        case AccountKind::Standard: break;
+    }
+    return fn(StandardProduct{});
+}
+
+inline Limits limitsOf(AccountKind kind, optional<double> creditLine = nullopt) {
+    return withProduct(kind, [&](auto product) { return decltype(product)::limits(creditLine); });
+}
+
+inline optional<AccountKind> parseAccountKind(string_view text) {
+    if (text == "standard") return AccountKind::Standard;
+    if (text == "savings") return AccountKind::Savings;
+    if (text == "checking") return AccountKind::Checking;
+    if (text == "loan") return AccountKind::Loan;
+    return nullopt;
+}
+
+inline string_view accountKindName(AccountKind kind) {
+    switch (kind) {
+        case AccountKind::Savings: return "savings";
+        case AccountKind::Checking: return "checking";
+        case AccountKind::Loan: return "loan";
+        case AccountKind::Standard: break;
+    }
+    return "standard";
+}
+
 // ---------------- BankAccount Class ----------------
 class BankAccount {
 private:
     string name;
     int accountNum{};
     double balance{};
+    double held{};    // reserved by authorization holds; rebuilt from the audit log, not saved
     size_t pinHash{}; // store hash of PIN
+    AccountKind kind = AccountKind::Standard; // from the account's product; rebuilt, not saved
+    uint16_t currency{};                      // id in the FX tables, 0 for the base; rebuilt, not saved
+    Limits limits;                            // resolved from kind and credit line; rebuilt, not saved
+    double spendable{};                       // min(balance - held + overdraft, maxWithdrawal)
 
     static size_t hashPIN(const string& pin) {
         return hash<string>{}(pin);
     }
 
+    // Called after every change to the balance, holds or limits.
+    void refresh() { spendable = min(balance - held + limits.overdraft, limits.maxWithdrawal); }
+
+    [[noreturn]] void refuseWithdrawal(double amount) const {
+        if (amount > limits.maxWithdrawal) throw runtime_error("Withdrawal exceeds the product limit");
+        throw runtime_error("Insufficient balance");
+    }
+
 public:
     BankAccount() = default;
     BankAccount(string n, int ac, double bal, const string& pin)
-        : name(std::move(n)), accountNum(ac), balance(bal), pinHash(hashPIN(pin)) {}
+        : name(std::move(n)), accountNum(ac), balance(bal), pinHash(hashPIN(pin)) {
+        refresh();
+    }
 
     [[nodiscard]] string getName() const { return name; }
     [[nodiscard]] int getAccountNum() const { return accountNum; }
     [[nodiscard]] double getBalance() const { return balance; }
+    [[nodiscard]] double getHeld() const { return held; }
+    [[nodiscard]] AccountKind getKind() const { return kind; }
+    [[nodiscard]] uint16_t getCurrency() const { return currency; }
+
+    [[nodiscard]] const Limits& getLimits() const { return limits; }
+    [[nodiscard]] double getAvailableBalance() const { return balance - held + limits.overdraft; }
+
+    void setCurrency(uint16_t id) { currency = id; }
+
+    void setTerms(AccountKind k, optional<double> creditLine = nullopt) {
+        kind = k;
+        limits = limitsOf(k, creditLine);
+        refresh();
+    }
+
+    // Whether the balance is within limits l, before a change of product.
+    [[nodiscard]] bool fits(const Limits& l) const { return balance - held + l.overdraft >= 0 && balance <= l.maxBalance; }
 
     bool verifyPIN(const string& pin) const {
         return pinHash == hashPIN(pin);
     }
 
-    void deposit(double amount) {
+    void checkDeposit(double amount) const {
         if (amount <= 0) throw invalid_argument("Deposit must be positive");
+        if (balance + amount > limits.maxBalance) throw runtime_error("Deposit exceeds the amount owed");
+    }
+
+    void deposit(double amount) {
+        checkDeposit(amount);
         balance += amount;
+        refresh();
     }
 
-    void withdraw(double amount) {
+    void checkWithdrawal(double amount) const {
         if (amount <= 0) throw invalid_argument("Withdrawal must be positive");
-        if (balance < amount) throw runtime_error("Insufficient balance");
+        if (amount > spendable) refuseWithdrawal(amount);
+    }
+
+    void withdraw(double amount) {
+        checkWithdrawal(amount);
+        balance -= amount;
+        refresh();
+    }
+
+    // Takes money past the product's limits: bank charges, and debits replayed from the
+    // log, which were checked when they were made.
+    void debit(double amount) {
+        balance -= amount;
+        refresh();
+    }
+
+    // Adds money past the product's limits: a credit checked before it was committed.
+    void credit(double amount) {
+        balance += amount;
+        refresh();
+    }
+
+    // Reserves funds for a later capture; the balance itself is unchanged until then. A
+    // hold is checked as the withdrawal its capture will be, per-withdrawal limit included.
+    void placeHold(double amount) {
+        if (amount <= 0) throw invalid_argument("Hold must be positive");
+        if (amount > limits.maxWithdrawal) throw runtime_error("Hold exceeds the product limit");
+        if (amount > spendable) throw runtime_error("Insufficient available balance");
+        held += amount;
+        refresh();
+    }
+
+    void releaseHold(double amount) {
+        held = max(0.0, held - amount);
+        refresh();
+    }
+
+    // Settles a hold of `reserved` by taking `amount` (at most that) from the balance;
+    // whatever was not captured becomes available again.
+    void captureHold(double reserved, double amount) {
+        if (amount <= 0 || amount > reserved) throw invalid_argument("Capture must be positive and within the hold");
+        releaseHold(reserved);
         balance -= amount;
+        refresh();
+    }
+
+    // Re-establishes a hold read back from the audit log; it was checked when placed.
+    void restoreHold(double amount) {
+        held += amount;
+        refresh();
     }
 
     void updateName(const string& newName) {
@@ -110,204 +360,10381 @@ public:
         name = newName;
     }
 
-    void save(ofstream& out) const {
+    void save(ostream& out) const {
         // Store format: accountNum balance pinHash "name"
         out << accountNum << ' ' << balance << ' ' << pinHash << ' ' << quoted(name) << '\n';
     }
 
-    static optional<BankAccount> load(ifstream& in) {
+    static optional<BankAccount> load(istream& in) {
         int ac{};
         double bal{};
         size_t hash{};
         string n;
-        if (in >> ac >> bal >> hash >> quoted(n)) {
-            BankAccount acc;
-            acc.accountNum = ac;
-            acc.balance = bal;
-            acc.pinHash = hash;
-            acc.name = n;
-            return acc;
-        }
+        if (in >> ac >> bal >> hash >> quoted(n)) return restore(std::move(n), ac, bal, hash);
         return nullopt;
     }
+
+    // Rebuilds an account from persisted fields (PIN already hashed).
+    static BankAccount restore(string n, int ac, double bal, size_t pinHash) {
+        BankAccount acc;
+        acc.accountNum = ac;
+        acc.balance = bal;
+        acc.pinHash = pinHash;
+        acc.name = std::move(n);
+        acc.refresh();
+        return acc;
+    }
+
+    [[nodiscard]] size_t getPinHash() const { return pinHash; }
+
+    [[nodiscard]] AccountRecord toRecord() const {
+        if (name.size() > AccountRecord::maxName) throw runtime_error("Name too long for fixed-size record");
+        AccountRecord r{};
+        r.accountNum = accountNum;
+        r.nameLen = static_cast<uint8_t>(name.size());
+        memcpy(r.name, name.data(), name.size());
+        r.balance = balance;
+        r.pinHash = pinHash;
+        return r;
+    }
+
+    static BankAccount fromRecord(const AccountRecord& r) {
+        return restore(string(r.name, r.nameLen), r.accountNum, r.balance, r.pinHash);
+    }
 };
 
-// ---------------- BankManagement Class ----------------
-class BankManagement {
+// ---------------- SHA-256 ----------------
+// Portable implementation with a SHA-NI block function picked at runtime on x86-64.
+class Sha256 {
+public:
+    using Digest = array<uint8_t, 32>;
+
+    static Digest hash(string_view data) {
+        array<uint32_t, 8> state = initial;
+        const auto* bytes = reinterpret_cast<const uint8_t*>(data.data());
+        size_t full = data.size() / 64;
+        compress(state, bytes, full);
+
+        // Padding: 0x80, zeros, 64-bit big-endian bit length
+        array<uint8_t, 128> tail{};
+        size_t rest = data.size() - full * 64;
+        memcpy(tail.data(), bytes + full * 64, rest);
+        tail[rest] = 0x80;
+        size_t tailBlocks = rest + 9 > 64 ? 2 : 1;
+        uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+        for (int i = 0; i < 8; ++i) tail[tailBlocks * 64 - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+        compress(state, tail.data(), tailBlocks);
+
+        Digest out{};
+        for (int i = 0; i < 8; ++i)
+            for (int j = 0; j < 4; ++j) out[i * 4 + j] = static_cast<uint8_t>(state[i] >> (24 - 8 * j));
+        return out;
+    }
+
+    // Chain link: H(prev || payloadDigest)
+    static Digest link(const Digest& prev, const Digest& payload) {
+        array<char, 64> buf{};
+        memcpy(buf.data(), prev.data(), 32);
+        memcpy(buf.data() + 32, payload.data(), 32);
+        return hash(string_view(buf.data(), buf.size()));
+    }
+
+    static string toHex(const Digest& d) {
+        static constexpr char digits[] = "0123456789abcdef";
+        string s(64, '0');
+        for (size_t i = 0; i < d.size(); ++i) {
+            s[2 * i] = digits[d[i] >> 4];
+            s[2 * i + 1] = digits[d[i] & 0xF];
+        }
+        return s;
+    }
+
+    static optional<Digest> fromHex(string_view hex) {
+        if (hex.size() != 64) return nullopt;
+        auto nibble = [](char c) -> int {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            return -1;
+        };
+        Digest d{};
+        for (size_t i = 0; i < d.size(); ++i) {
+            int hi = nibble(hex[2 * i]), lo = nibble(hex[2 * i + 1]);
+            if (hi < 0 || lo < 0) return nullopt;
+            d[i] = static_cast<uint8_t>(hi << 4 | lo);
+        }
+        return d;
+    }
+
+    static bool hardwareAccelerated() { return useShaNi(); }
+
 private:
-    vector<BankAccount> accounts;
+    static constexpr array<uint32_t, 8> initial{
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
 
-    static bool authenticate(const BankAccount& acc) {
-        string pin;
-        cout << "Enter PIN for account " << acc.getAccountNum() << ": ";
-        getline(cin, pin);
-        if (!acc.verifyPIN(pin)) {
-            cout << "Authentication failed. Invalid PIN.\n";
-            return false;
+    alignas(16) static constexpr array<uint32_t, 64> K{
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    static void compress(array<uint32_t, 8>& state, const uint8_t* blocks, size_t count) {
+#ifdef BANK_HAVE_SHA_NI
+        if (useShaNi()) return compressShaNi(state, blocks, count);
+#endif
+        compressPortable(state, blocks, count);
+    }
+
+    static constexpr uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    static void compressPortable(array<uint32_t, 8>& state, const uint8_t* blocks, size_t count) {
+        for (size_t b = 0; b < count; ++b, blocks += 64) {
+            array<uint32_t, 64> w{};
+            for (int i = 0; i < 16; ++i)
+                w[i] = uint32_t(blocks[4 * i]) << 24 | uint32_t(blocks[4 * i + 1]) << 16 |
+                       uint32_t(blocks[4 * i + 2]) << 8 | uint32_t(blocks[4 * i + 3]);
+            for (int i = 16; i < 64; ++i) {
+                uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+            auto [a, b2, c, d, e, f, g, h] = state;
+            for (int i = 0; i < 64; ++i) {
+                uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+                uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b2) ^ (a & c) ^ (b2 & c));
+                h = g; g = f; f = e; e = d + t1;
+                d = c; c = b2; b2 = a; a = t1 + t2;
+            }
+            state[0] += a; state[1] += b2; state[2] += c; state[3] += d;
+            state[4] += e; state[5] += f; state[6] += g; state[7] += h;
         }
-        return true;
     }
 
-public:
-    void addAccount(const string& name, int accountNum, double balance, const string& pin) {
-        if (ranges::any_of(accounts, [&](const BankAccount& acc) { return acc.getAccountNum() == accountNum; }))
-            throw runtime_error("Account number already exists");
-        accounts.emplace_back(name, accountNum, balance, pin);
-        cout << "Account created successfully.\n";
+#ifdef BANK_HAVE_SHA_NI
+    static bool useShaNi() {
+        static const bool supported = [] {
+            unsigned a{}, b{}, c{}, d{};
+            if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1) || !(c & bit_SSSE3)) return false;
+            if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+            return (b & (1u << 29)) != 0; // SHA extensions
+        }();
+        return supported;
     }
 
-    void showAllAccounts() const {
-        cout << "\n--- All Accounts ---\n";
-        if (accounts.empty()) {
-            cout << "No accounts available.\n";
-            return;
+    __attribute__((target("sha,sse4.1,ssse3")))
+    static void compressShaNi(array<uint32_t, 8>& state, const uint8_t* blocks, size_t count) {
+        const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+        __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+        __m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+        tmp = _mm_shuffle_epi32(tmp, 0xB1);             // CDAB
+        state1 = _mm_shuffle_epi32(state1, 0x1B);       // EFGH
+        __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+        state1 = _mm_blend_epi16(state1, tmp, 0xF0);    // CDGH
+
+        for (size_t b = 0; b < count; ++b, blocks += 64) {
+            const __m128i abefSave = state0, cdghSave = state1;
+            __m128i msg[16];
+            for (int g = 0; g < 16; ++g) {
+                if (g < 4) {
+                    msg[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 16 * g)), mask);
+                } else {
+                    __m128i x = _mm_sha256msg1_epu32(msg[g - 4], msg[g - 3]);
+                    x = _mm_add_epi32(x, _mm_alignr_epi8(msg[g - 1], msg[g - 2], 4));
+                    msg[g] = _mm_sha256msg2_epu32(x, msg[g - 1]);
+                }
+                __m128i m = _mm_add_epi32(msg[g], _mm_load_si128(reinterpret_cast<const __m128i*>(&K[4 * g])));
+                state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+                state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(m, 0x0E));
+            }
+            state0 = _mm_add_epi32(state0, abefSave);
+            state1 = _mm_add_epi32(state1, cdghSave);
         }
-        for (const auto& acc : accounts) {
-            cout << "Name: " << acc.getName()
-                 << " | Account: " << acc.getAccountNum()
-                 << " | Balance: " << acc.getBalance() << '\n';
+
+        tmp = _mm_shuffle_epi32(state0, 0x1B);          // FEBA
+        state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+        state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+        state1 = _mm_alignr_epi8(state1, tmp, 8);       // HGFE
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+    }
+#else
+    static bool useShaNi() { return false; }
+#endif
+};
+
+// ---------------- Parallel Helper ----------------
+// Splits [0, count) into contiguous chunks and runs fn(begin, end) on each, one thread per chunk.
+inline void parallelFor(size_t count, size_t minChunk, const function<void(size_t, size_t)>& fn) {
+    size_t workers = max<size_t>(1, thread::hardware_concurrency());
+    workers = min(workers, max<size_t>(1, count / max<size_t>(1, minChunk)));
+    if (workers <= 1) {
+        if (count) fn(0, count);
+        return;
+    }
+    vector<jthread> pool;
+    size_t chunk = (count + workers - 1) / workers;
+    for (size_t begin = 0; begin < count; begin += chunk)
+        pool.emplace_back(fn, begin, min(count, begin + chunk));
+}
+
+// ---------------- Audit Log ----------------
+// Append-only, hash-chained record of every mutation.
+// hash = SHA256(prevHash || SHA256(payload)), so payload digests can be computed in parallel
+// for a whole batch and only the cheap 64-byte link step is sequential.
+struct AuditRecord {
+    uint64_t seq{};
+    int64_t timestamp{}; // milliseconds since epoch
+    string op;
+    int account{};
+    int other{};
+    double amount{};
+    // Operation-specific extra: the PIN hash for addAccount, the hold id for hold and
+    // release, the order id for schedule and cancelOrder, and the product id for product,
+    // setProduct and a product's creditLimit.
+    uint64_t aux{};
+    string text;
+    Sha256::Digest prev{};
+    Sha256::Digest hash{};
+
+    // For a transfer between currencies, the converted amount it credits, fixed when it was
+    // made and kept at the end of text as "fx <amount>", after any other tag.
+    [[nodiscard]] optional<double> exchanged() const {
+        const auto at = text.starts_with("fx ") ? 0 : text.rfind(" fx ");
+        if (op != "transfer" || at == string::npos) return nullopt;
+        const auto digits = text.find(' ', at + 1) + 1;
+        double credit{};
+        auto [end, ec] = from_chars(text.data() + digits, text.data() + text.size(), credit);
+        if (ec != errc{} || end != text.data() + text.size()) return nullopt;
+        return credit;
+    }
+
+    // What a transfer credits: the amount, or the exchanged amount.
+    [[nodiscard]] double credit() const { return exchanged().value_or(amount); }
+
+    // Replaces the exchanged amount, or removes it.
+    void setExchanged(optional<double> credit) {
+        if (const auto at = text.starts_with("fx ") ? 0 : text.rfind(" fx "); at != string::npos) text.erase(at);
+        if (!credit) return;
+        array<char, 32> digits{};
+        auto end = to_chars(digits.data(), digits.data() + digits.size(), *credit).ptr;
+        text += (text.empty() ? "fx " : " fx ") + string(digits.data(), end);
+    }
+
+    [[nodiscard]] string payload() const {
+        ostringstream os;
+        os << setprecision(17) << seq << ' ' << timestamp << ' ' << op << ' ' << account << ' '
+           << other << ' ' << amount << ' ' << aux << ' ' << quoted(text);
+        return os.str();
+    }
+
+    void save(ostream& out) const {
+        out << payload() << ' ' << Sha256::toHex(prev) << ' ' << Sha256::toHex(hash) << '\n';
+    }
+
+    static optional<AuditRecord> load(istream& in) {
+        AuditRecord r;
+        string prevHex, hashHex;
+        if (!(in >> r.seq >> r.timestamp >> r.op >> r.account >> r.other >> r.amount >> r.aux >> quoted(r.text) >> prevHex >> hashHex))
+            return nullopt;
+        auto prev = Sha256::fromHex(prevHex);
+        auto hash = Sha256::fromHex(hashHex);
+        if (!prev || !hash) return nullopt;
+        r.prev = *prev;
+        r.hash = *hash;
+        return r;
+    }
+};
+
+// Whether a record settles a change decided before it reached this bank: the commit of
+// a transfer leg this shard voted yes to ("2pc <tx>"), checked at the vote, or a copy of
+// an account's state moving between shards ("migrate"), checked where it was made.
+// Settlements are applied past the account's limits; refusing one would break the
+// transfer or leave the two copies apart.
+inline bool isSettlement(const AuditRecord& r) { return r.text.starts_with("2pc ") || r.text == "migrate"; }
+
+// How far a commit must get before the operation is acknowledged.
+enum class Durability : int {
+    Memory = 0, // buffered in the process; written out with a later commit
+    Async = 1,  // handed to the OS now, fsynced by the background flusher shortly after
+    Group = 2,  // waits for the flusher's next fsync, which covers every commit in its window
+    Sync = 3    // fsynced before returning
+};
+
+inline optional<Durability> parseDurability(string_view name) {
+    if (name == "memory") return Durability::Memory;
+    if (name == "async") return Durability::Async;
+    if (name == "group") return Durability::Group;
+    if (name == "sync") return Durability::Sync;
+    return nullopt;
+}
+
+struct AuditVerifyResult {
+    size_t records{};
+    optional<uint64_t> firstBadSeq;
+};
+
+class AuditLog {
+private:
+    fs::path activePath;
+    fs::path archiveDir;
+    ofstream out;
+    uint64_t nextSeq = 1;
+    uint64_t segmentFirstSeq = 1;
+    uint64_t segmentBytes = 0;
+    int64_t segmentFirstTs = 0;
+    int64_t lastTs = 0;
+    Sha256::Digest lastHash{}; // all-zero genesis link
+    vector<AuditRecord> pending;
+    function<void(const AuditRecord&)> observer; // sees each record once it is linked into the chain
+
+    // Commit pipeline shared by every durability class
+    mutex mtx;
+    condition_variable workCv;    // flusher: something asked for an fsync
+    condition_variable durableCv; // committers: durableSeq advanced
+    uint64_t flushTarget = 0;     // highest record an Async/Group commit wants on disk
+    uint64_t durableSeq = 0;      // fsynced through this record
+    bool syncing = false;
+    bool stopping = false;
+    chrono::microseconds groupWindow{0}; // extra wait to grow a group; commits arriving during an fsync join the next one anyway
+    int syncFd = -1;
+    jthread flusher; // declared last: joined before the state above is destroyed
+
+    static vector<AuditRecord> readFile(const fs::path& file) {
+        vector<AuditRecord> records;
+        ifstream in(file);
+        while (auto r = AuditRecord::load(in)) records.push_back(std::move(*r));
+        return records;
+    }
+
+    // First sequence number held by an archived segment, from its file name.
+    static uint64_t firstSeqOf(const fs::path& segment) {
+        return stoull(segment.stem().string().substr(string_view("segment-").size()));
+    }
+
+    void openSyncFd() {
+#ifdef BANK_HAVE_FSYNC
+        syncFd = ::open(activePath.c_str(), O_WRONLY);
+#endif
+    }
+
+    void closeSyncFd() {
+#ifdef BANK_HAVE_FSYNC
+        if (syncFd >= 0) ::close(syncFd);
+#endif
+        syncFd = -1;
+    }
+
+    void fsyncFile() const {
+#ifdef BANK_HAVE_FSYNC
+        if (syncFd >= 0) ::fsync(syncFd);
+#endif
+    }
+
+    // Hashes the pending batch, links it onto the chain and writes it to the stream buffer.
+    // Caller holds mtx.
+    void writePending() {
+        if (pending.empty()) return;
+        vector<Sha256::Digest> digests(pending.size());
+        parallelFor(pending.size(), 256, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) digests[i] = Sha256::hash(pending[i].payload());
+        });
+        auto before = out.tellp();
+        for (size_t i = 0; i < pending.size(); ++i) {
+            pending[i].prev = lastHash;
+            pending[i].hash = lastHash = Sha256::link(lastHash, digests[i]);
+            if (out) pending[i].save(out);
+            if (observer) observer(pending[i]);
         }
+        segmentBytes += static_cast<uint64_t>(out.tellp() - before);
+        pending.clear();
     }
 
-    [[nodiscard]] optional<reference_wrapper<BankAccount>> findAccount(int accountNum) {
-        auto it = ranges::find_if(accounts, [&](BankAccount& acc) { return acc.getAccountNum() == accountNum; });
-        if (it != accounts.end()) return std::ref(*it);
-        return nullopt;
+    // Makes everything written so far durable. The lock is dropped during fsync so other
+    // committers can keep appending; they are picked up by the next round.
+    void syncLocked(unique_lock<mutex>& lock) {
+        durableCv.wait(lock, [&] { return !syncing; });
+        if (durableSeq >= lastSeq()) return;
+        out.flush();
+        const uint64_t target = lastSeq();
+        syncing = true;
+        lock.unlock();
+        fsyncFile();
+        lock.lock();
+        syncing = false;
+        durableSeq = max(durableSeq, target);
+        durableCv.notify_all();
     }
 
-    void deposit(int accNum, double amount) {
-        auto acc = findAccount(accNum);
-        if (!acc) return (void)(cout << "Account not found.\n");
-        if (!authenticate(acc->get())) return;
-        acc->get().deposit(amount);
-        cout << "Deposit successful.\n";
+    void flushLoop() {
+        unique_lock lock(mtx);
+        while (true) {
+            workCv.wait(lock, [&] { return stopping || flushTarget > durableSeq; });
+            if (stopping) return;
+            if (groupWindow.count()) workCv.wait_for(lock, groupWindow, [&] { return stopping; });
+            syncLocked(lock);
+        }
     }
 
-    void withdraw(int accNum, double amount) {
-        auto acc = findAccount(accNum);
-        if (!acc) return (void)(cout << "Account not found.\n");
-        if (!authenticate(acc->get())) return;
-        acc->get().withdraw(amount);
-        cout << "Withdrawal successful.\n";
+public:
+    static int64_t nowMillis() {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
     }
 
-    void transfer(int fromAcc, int toAcc, double amount) {
-        auto from = findAccount(fromAcc);
-        auto to = findAccount(toAcc);
-        if (!from || !to) throw runtime_error("One or both accounts not found");
-        if (fromAcc == toAcc) throw runtime_error("Cannot transfer to same account");
-        if (!authenticate(from->get())) return;
-        from->get().withdraw(amount);
-        to->get().deposit(amount);
-        cout << "Transfer successful.\n";
+    static fs::path archiveDirFor(const fs::path& active) {
+        return active.parent_path() / (active.stem().string() + "_archive");
     }
 
-    void updateName(int accNum, const string& newName) {
-        auto acc = findAccount(accNum);
-        if (!acc) return (void)(cout << "Account not found.\n");
-        if (!authenticate(acc->get())) return;
-        acc->get().updateName(newName);
-        cout << "Account name updated.\n";
+    // Archived segments in sequence order, followed by the active file.
+    static vector<fs::path> segments(const string& filename) {
+        vector<fs::path> files;
+        if (const auto dir = archiveDirFor(filename); fs::exists(dir))
+            for (const auto& entry : fs::directory_iterator(dir))
+                if (entry.path().filename().string().starts_with("segment-")) files.push_back(entry.path());
+        ranges::sort(files, {}, &AuditLog::firstSeqOf);
+        files.emplace_back(filename);
+        return files;
+    }
+
+    // Archived segment -> timestamp of its first record, from the index written at rotation.
+    static map<uint64_t, int64_t> segmentIndex(const string& filename) {
+        map<uint64_t, int64_t> index;
+        ifstream in(archiveDirFor(filename) / "index.txt");
+        uint64_t firstSeq{}, lastSeq{};
+        int64_t firstTs{}, lastTs{};
+        while (in >> firstSeq >> lastSeq >> firstTs >> lastTs) index[firstSeq] = firstTs;
+        return index;
+    }
+
+    // Records of every segment that may hold a sequence number above afterSeq, stopping
+    // at the first record stamped after untilTs. Segments known from the index to start
+    // after untilTs are never opened.
+    static vector<AuditRecord> readAll(const string& filename, uint64_t afterSeq = 0,
+                                       int64_t untilTs = numeric_limits<int64_t>::max()) {
+        auto files = segments(filename);
+        auto index = segmentIndex(filename);
+        vector<uint64_t> starts;
+        for (size_t i = 0; i + 1 < files.size(); ++i) starts.push_back(firstSeqOf(files[i]));
+        starts.push_back(segmentStart(filename));
+        vector<AuditRecord> records;
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (i + 1 < files.size() && starts[i + 1] <= afterSeq + 1) continue; // wholly at or before afterSeq
+            if (auto it = index.find(starts[i]); i + 1 < files.size() && it != index.end() && it->second > untilTs) break;
+            for (auto& r : readFile(files[i])) {
+                if (r.timestamp > untilTs) return records;
+                records.push_back(std::move(r));
+            }
+        }
+        return records;
+    }
+
+    // First sequence number in the active file (UINT64_MAX if it is empty).
+    static uint64_t segmentStart(const string& filename) {
+        ifstream in(filename);
+        auto r = AuditRecord::load(in);
+        return r ? r->seq : numeric_limits<uint64_t>::max();
     }
 
-    void closeAccount(int accNum) {
-        auto it = ranges::find_if(accounts, [&](const BankAccount& acc) {
-            return acc.getAccountNum() == accNum;
+    // Index of the first record in [from, end) whose link or checksum is wrong, or
+    // records.size() if all are intact. Segments are checked concurrently.
+    static size_t firstBroken(const vector<AuditRecord>& records, size_t from = 0) {
+        size_t firstBad = records.size();
+        mutex m;
+        parallelFor(records.size() - from, 1024, [&](size_t begin, size_t end) {
+            for (size_t i = from + begin; i < from + end; ++i) {
+                const auto& r = records[i];
+                // The first record read is only anchored when it is the genesis record
+                const Sha256::Digest expectedPrev = i > 0 ? records[i - 1].hash : r.seq == 1 ? Sha256::Digest{} : r.prev;
+                bool seqOk = i == 0 || r.seq == records[i - 1].seq + 1;
+                if (!seqOk || r.prev != expectedPrev || r.hash != Sha256::link(r.prev, Sha256::hash(r.payload()))) {
+                    lock_guard lock(m);
+                    firstBad = min(firstBad, i);
+                    return;
+                }
+            }
         });
-        if (it == accounts.end()) return (void)(cout << "Account not found.\n");
+        return firstBad;
+    }
 
-        if (!authenticate(*it)) return;
-        accounts.erase(it);
-        cout << "Account closed successfully.\n";
+    AuditLog() = default;
+    AuditLog(const AuditLog&) = delete;
+    AuditLog& operator=(const AuditLog&) = delete;
+
+    ~AuditLog() {
+        {
+            lock_guard lock(mtx);
+            stopping = true;
+            out.flush();
+        }
+        workCv.notify_all();
+        if (flusher.joinable()) flusher.join();
+        fsyncFile();
+        closeSyncFd();
     }
 
-    void showHighBalance(double threshold) const {
-        cout << "--- Accounts above " << threshold << " ---\n";
-        bool found = false;
-        for (const auto& acc : accounts) {
-            if (acc.getBalance() >= threshold) {
-                found = true;
-                cout << "Name: " << acc.getName()
-                     << " | Account: " << acc.getAccountNum()
-                     << " | Balance: " << acc.getBalance() << '\n';
+    [[nodiscard]] uint64_t lastSeq() const { return nextSeq - 1; }
+    [[nodiscard]] uint64_t activeBytes() const { return segmentBytes; }
+    [[nodiscard]] uint64_t activeRecords() const { return nextSeq - segmentFirstSeq; }
+    [[nodiscard]] uint64_t activeFirstSeq() const { return segmentFirstSeq; }
+    [[nodiscard]] int64_t lastTimestamp() const { return lastTs; }
+
+    void open(const string& filename) {
+        activePath = filename;
+        archiveDir = archiveDirFor(activePath);
+        auto records = readFile(activePath);
+        if (records.empty()) {
+            // Fresh segment after a rotation: the chain continues from the newest archive
+            auto files = segments(filename);
+            if (files.size() > 1) records = readFile(files[files.size() - 2]);
+            if (!records.empty()) {
+                nextSeq = records.back().seq + 1;
+                lastHash = records.back().hash;
+                lastTs = records.back().timestamp;
             }
+            segmentFirstSeq = nextSeq;
+        } else {
+            segmentFirstSeq = records.front().seq;
+            segmentFirstTs = records.front().timestamp;
+            nextSeq = records.back().seq + 1;
+            lastHash = records.back().hash;
+            lastTs = records.back().timestamp;
         }
-        if (!found) cout << "No accounts meet the threshold.\n";
+        out.open(activePath, ios::app);
+        if (!out) throw runtime_error("Cannot open audit log");
+        segmentBytes = fs::file_size(activePath);
+        durableSeq = lastSeq();
+        openSyncFd();
+        flusher = jthread([this] { flushLoop(); });
     }
 
-    void sortAccountsByBalance() {
-        ranges::sort(accounts, {}, &BankAccount::getBalance);
-        cout << "Accounts sorted by balance.\n";
+    void append(string op, int account, int other = 0, double amount = 0.0, string text = {}, uint64_t aux = 0) {
+        AuditRecord r;
+        r.op = std::move(op);
+        r.account = account;
+        r.other = other;
+        r.amount = amount;
+        r.aux = aux;
+        r.text = std::move(text);
+        appendRecord(std::move(r));
     }
 
-    void saveToFile(const string& filename) const {
-        ofstream out(filename);
-        if (!out) throw runtime_error("Cannot open file for saving");
-        for (const auto& acc : accounts) acc.save(out);
+    // Appends a prepared record; a zero timestamp is filled in with the current time.
+    void appendRecord(AuditRecord r) {
+        lock_guard lock(mtx);
+        r.seq = nextSeq++;
+        if (!r.timestamp) r.timestamp = nowMillis();
+        if (r.seq == segmentFirstSeq) segmentFirstTs = r.timestamp;
+        lastTs = r.timestamp;
+        pending.push_back(std::move(r));
     }
 
-    void loadFromFile(const string& filename) {
-        if (!fs::exists(filename)) return;
-        ifstream in(filename);
-        accounts.clear();
-        while (true) {
-            auto acc = BankAccount::load(in);
-            if (!acc) break;
-            accounts.push_back(*acc);
+    // Commits everything appended so far at the requested durability.
+    void commit(Durability durability = Durability::Async) {
+        unique_lock lock(mtx);
+        writePending();
+        const uint64_t target = lastSeq();
+        switch (durability) {
+            case Durability::Memory:
+                break;
+            case Durability::Async:
+                out.flush();
+                flushTarget = max(flushTarget, target);
+                workCv.notify_one();
+                break;
+            case Durability::Group:
+                out.flush();
+                flushTarget = max(flushTarget, target);
+                workCv.notify_one();
+                durableCv.wait(lock, [&] { return durableSeq >= target; });
+                break;
+            case Durability::Sync:
+                syncLocked(lock);
+                break;
         }
     }
+
+    // Adds a record produced by another log (a replication primary) verbatim. It must
+    // continue this chain exactly; commit() then makes it durable as usual.
+    void appendReplicated(const AuditRecord& r) {
+        lock_guard lock(mtx);
+        writePending();
+        if (r.seq != nextSeq || r.prev != lastHash || r.hash != Sha256::link(lastHash, Sha256::hash(r.payload())))
+            throw runtime_error("Record " + to_string(r.seq) + " does not extend the local audit chain");
+        auto before = out.tellp();
+        r.save(out);
+        segmentBytes += static_cast<uint64_t>(out.tellp() - before);
+        if (r.seq == segmentFirstSeq) segmentFirstTs = r.timestamp;
+        nextSeq = r.seq + 1;
+        lastHash = r.hash;
+        lastTs = r.timestamp;
+    }
+
+    void setObserver(function<void(const AuditRecord&)> fn) {
+        lock_guard lock(mtx);
+        observer = std::move(fn);
+    }
+
+    void setGroupWindow(chrono::microseconds window) {
+        lock_guard lock(mtx);
+        groupWindow = window;
+    }
+
+    // Moves the active segment into the archive and starts a new one. The hash chain
+    // carries on across segments, so archived history stays verifiable.
+    void rotate() {
+        unique_lock lock(mtx);
+        if (!out.is_open() || activeRecords() == 0) return;
+        syncLocked(lock); // archived segments are always durable
+        out.close();
+        closeSyncFd();
+        fs::create_directories(archiveDir);
+        ostringstream name;
+        name << "segment-" << setw(12) << setfill('0') << segmentFirstSeq << ".txt";
+        fs::rename(activePath, archiveDir / name.str());
+        ofstream(archiveDir / "index.txt", ios::app)
+            << segmentFirstSeq << ' ' << lastSeq() << ' ' << segmentFirstTs << ' ' << lastTs << '\n';
+        out.open(activePath, ios::trunc);
+        if (!out) throw runtime_error("Cannot open audit log");
+        openSyncFd();
+        segmentFirstSeq = nextSeq;
+        segmentBytes = 0;
+    }
+
+    // Checks every link of the chain across all segments.
+    static AuditVerifyResult verify(const string& filename) {
+        auto records = readAll(filename);
+        AuditVerifyResult result{records.size(), nullopt};
+        if (!records.empty() && records.front().seq != 1) result.firstBadSeq = records.front().seq; // missing history
+        else if (size_t bad = firstBroken(records); bad < records.size()) result.firstBadSeq = records[bad].seq;
+        return result;
+    }
 };
 
-// ---------------- Menu Helper ----------------
-inline void printMenu() {
-    cout << "\n=== Bank Management System (C++23) with PIN ===\n";
-    cout << "1. Create Account\n"
-         << "2. Show All Accounts\n"
-         << "3. Search Account\n"
-         << "4. Deposit Money\n"
-         << "5. Withdraw Money\n"
-         << "6. Transfer Money\n"
-         << "7. Close Account\n"
-         << "8. Update Account Name\n"
-         << "9. Show High Balance Accounts\n"
-         << "10. Sort Accounts by Balance\n"
-         << "0. Exit\n";
+// ---------------- Account Store Interface ----------------
+// Optional backing engine for BankManagement. When one is attached the in-memory
+// vector only holds the accounts touched by the current operation.
+class AccountStore {
+public:
+    virtual ~AccountStore() = default;
+    virtual optional<BankAccount> get(int accountNum) = 0;
+    virtual void put(const BankAccount& acc) = 0;
+    virtual void erase(int accountNum) = 0;
+    virtual void forEach(const function<void(const BankAccount&)>& fn) = 0;
+    [[nodiscard]] virtual bool empty() = 0;
+    virtual void flush() = 0;
+};
+
+// ---------------- Key Hashing ----------------
+// splitmix64 finalizer: cheap, well-mixed hash for integer keys.
+inline uint64_t hashKey(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
 }
 
-// ---------------- Main ----------------
-int main() {
-    BankManagement bank;
-    const string filename = "accounts_secure.txt";
+// ---------------- Bloom Filter ----------------
+class BloomFilter {
+private:
+    vector<uint64_t> bits;
+    uint32_t hashes{};
 
-    bank.loadFromFile(filename);
+public:
+    BloomFilter() = default;
+    explicit BloomFilter(size_t expectedKeys, size_t bitsPerKey = 10)
+        : bits(max<size_t>(1, (expectedKeys * bitsPerKey + 63) / 64)),
+          hashes(static_cast<uint32_t>(max<size_t>(1, bitsPerKey * 69 / 100))) {}
 
-    int choice{};
-    do {
-        printMenu();
-        if (!getInt("Enter choice: ", choice, 0, 10)) continue;
-        try {
-            switch (static_cast<Menu>(choice)) {
-                case Menu::CreateAccount: {
-                    string name, pin;
-                    int num;
-                    double bal;
-                    getNonEmptyString("Name: ", name);
+    void add(int key) {
+        uint64_t h = hashKey(static_cast<uint32_t>(key)), h2 = (h >> 32) | 1;
+        const uint64_t n = bits.size() * 64;
+        for (uint32_t i = 0; i < hashes; ++i, h += h2) bits[(h % n) / 64] |= 1ULL << (h % 64);
+    }
+
+    [[nodiscard]] bool mayContain(int key) const {
+        if (bits.empty()) return true;
+        uint64_t h = hashKey(static_cast<uint32_t>(key)), h2 = (h >> 32) | 1;
+        const uint64_t n = bits.size() * 64;
+        for (uint32_t i = 0; i < hashes; ++i, h += h2)
+            if (!(bits[(h % n) / 64] & (1ULL << (h % 64)))) return false;
+        return true;
+    }
+
+    void save(ostream& out) const {
+        uint64_t words = bits.size();
+        out.write(reinterpret_cast<const char*>(&hashes), sizeof hashes);
+        out.write(reinterpret_cast<const char*>(&words), sizeof words);
+        out.write(reinterpret_cast<const char*>(bits.data()), static_cast<streamsize>(words * sizeof(uint64_t)));
+    }
+
+    static optional<BloomFilter> load(istream& in) {
+        BloomFilter f;
+        uint64_t words{};
+        if (!in.read(reinterpret_cast<char*>(&f.hashes), sizeof f.hashes)) return nullopt;
+        if (!in.read(reinterpret_cast<char*>(&words), sizeof words)) return nullopt;
+        f.bits.resize(words);
+        if (!in.read(reinterpret_cast<char*>(f.bits.data()), static_cast<streamsize>(words * sizeof(uint64_t)))) return nullopt;
+        return f;
+    }
+};
+
+// ---------------- LSM Store ----------------
+// Log-structured merge tree: writes go to a logged memtable, which is flushed to an
+// immutable sorted run when full. Each run carries a Bloom filter and a sparse index;
+// a background thread merges runs once too many pile up.
+//
+// Files under dir: MANIFEST (live run ids), memtable.log, run-<id>.dat, run-<id>.idx
+// Record lines: "P <account>" for a put, "D <accountNum>" for a tombstone.
+class LsmStore : public AccountStore {
+private:
+    using Entry = optional<BankAccount>; // nullopt = tombstone
+
+    struct Run {
+        uint64_t id{};
+        fs::path data;
+        fs::path index;
+        BloomFilter bloom;
+        vector<pair<int, int64_t>> sparse; // every indexStride-th key -> file offset
+        int minKey{}, maxKey{};
+        bool obsolete = false;
+
+        ~Run() {
+            if (obsolete) {
+                error_code ec;
+                fs::remove(data, ec);
+                fs::remove(index, ec);
+            }
+        }
+    };
+
+    struct Cursor {
+        ifstream in;
+        optional<pair<int, Entry>> cur;
+    };
+
+    static constexpr size_t indexStride = 64;
+
+    fs::path dir;
+    size_t memtableLimit;
+    size_t compactionTrigger;
+    map<int, Entry> memtable;
+    ofstream memtableLog;
+    vector<shared_ptr<Run>> runs; // oldest first
+    uint64_t nextRunId = 1;
+
+    mutex mtx;
+    condition_variable cv;
+    bool stopping = false;
+    bool compacting = false;
+    jthread compactor;
+
+    static void writeEntry(ostream& out, int key, const Entry& e) {
+        if (e) {
+            out << "P ";
+            e->save(out);
+        } else {
+            out << "D " << key << '\n';
+        }
+    }
+
+    static optional<pair<int, Entry>> readEntry(istream& in) {
+        char type{};
+        if (!(in >> type)) return nullopt;
+        if (type == 'P') {
+            auto acc = BankAccount::load(in);
+            if (!acc) return nullopt;
+            return pair<int, Entry>{acc->getAccountNum(), std::move(*acc)};
+        }
+        int key{};
+        if (type != 'D' || !(in >> key)) return nullopt;
+        return pair<int, Entry>{key, nullopt};
+    }
+
+    fs::path runPath(uint64_t id, const char* ext) const {
+        return dir / ("run-" + to_string(id) + ext);
+    }
+
+    // Writes entries (sorted by key) as a new run; nothing is published until the manifest is updated.
+    template <typename Source>
+    shared_ptr<Run> writeRun(uint64_t id, size_t expectedKeys, Source&& next) {
+        auto run = make_shared<Run>();
+        run->id = id;
+        run->data = runPath(id, ".dat");
+        run->index = runPath(id, ".idx");
+        run->bloom = BloomFilter(expectedKeys);
+        ofstream out(run->data, ios::trunc);
+        if (!out) throw runtime_error("Cannot create LSM run");
+        out << setprecision(17);
+        size_t count = 0;
+        while (auto kv = next()) {
+            if (count % indexStride == 0) run->sparse.emplace_back(kv->first, static_cast<int64_t>(out.tellp()));
+            if (count == 0) run->minKey = kv->first;
+            run->maxKey = kv->first;
+            run->bloom.add(kv->first);
+            writeEntry(out, kv->first, kv->second);
+            ++count;
+        }
+        out.close();
+
+        ofstream idx(run->index, ios::binary | ios::trunc);
+        uint64_t n = run->sparse.size();
+        idx.write(reinterpret_cast<const char*>(&run->minKey), sizeof run->minKey);
+        idx.write(reinterpret_cast<const char*>(&run->maxKey), sizeof run->maxKey);
+        idx.write(reinterpret_cast<const char*>(&n), sizeof n);
+        idx.write(reinterpret_cast<const char*>(run->sparse.data()), static_cast<streamsize>(n * sizeof(run->sparse[0])));
+        run->bloom.save(idx);
+        if (!idx) throw runtime_error("Cannot write LSM run index");
+        return run;
+    }
+
+    shared_ptr<Run> openRun(uint64_t id) const {
+        auto run = make_shared<Run>();
+        run->id = id;
+        run->data = runPath(id, ".dat");
+        run->index = runPath(id, ".idx");
+        ifstream idx(run->index, ios::binary);
+        uint64_t n{};
+        idx.read(reinterpret_cast<char*>(&run->minKey), sizeof run->minKey);
+        idx.read(reinterpret_cast<char*>(&run->maxKey), sizeof run->maxKey);
+        idx.read(reinterpret_cast<char*>(&n), sizeof n);
+        run->sparse.resize(n);
+        idx.read(reinterpret_cast<char*>(run->sparse.data()), static_cast<streamsize>(n * sizeof(run->sparse[0])));
+        auto bloom = BloomFilter::load(idx);
+        if (!idx || !bloom) throw runtime_error("Corrupt LSM run index: " + run->index.string());
+        run->bloom = std::move(*bloom);
+        return run;
+    }
+
+    // Caller holds mtx.
+    void writeManifest() const {
+        const auto tmp = dir / "MANIFEST.tmp";
+        {
+            ofstream out(tmp, ios::trunc);
+            out << nextRunId << '\n';
+            for (const auto& r : runs) out << r->id << '\n';
+            if (!out) throw runtime_error("Cannot write LSM manifest");
+        }
+        fs::rename(tmp, dir / "MANIFEST");
+    }
+
+    static optional<Entry> lookupRun(const Run& run, int key) {
+        if (key < run.minKey || key > run.maxKey || !run.bloom.mayContain(key)) return nullopt;
+        auto it = ranges::upper_bound(run.sparse, key, {}, &pair<int, int64_t>::first);
+        if (it == run.sparse.begin()) return nullopt;
+        ifstream in(run.data);
+        in.seekg(prev(it)->second);
+        for (size_t i = 0; i < indexStride; ++i) {
+            auto kv = readEntry(in);
+            if (!kv || kv->first > key) break;
+            if (kv->first == key) return kv->second;
+        }
+        return nullopt;
+    }
+
+    static vector<Cursor> openCursors(const vector<shared_ptr<Run>>& sources) {
+        vector<Cursor> cursors(sources.size());
+        for (size_t i = 0; i < sources.size(); ++i) {
+            cursors[i].in.open(sources[i]->data);
+            cursors[i].cur = readEntry(cursors[i].in);
+        }
+        return cursors;
+    }
+
+    void logEntry(int key, const Entry& e) {
+        writeEntry(memtableLog, key, e);
+        memtableLog.flush();
+    }
+
+    void flushMemtable() {
+        if (memtable.empty()) return;
+        uint64_t id;
+        {
+            lock_guard lock(mtx);
+            id = nextRunId++;
+        }
+        auto it = memtable.begin();
+        auto run = writeRun(id, memtable.size(), [&]() -> optional<pair<int, Entry>> {
+            if (it == memtable.end()) return nullopt;
+            return *it++;
+        });
+        {
+            lock_guard lock(mtx);
+            runs.push_back(run);
+            writeManifest();
+        }
+        memtable.clear();
+        memtableLog.close();
+        memtableLog.open(dir / "memtable.log", ios::trunc);
+        memtableLog << setprecision(17);
+        cv.notify_all();
+    }
+
+    // Merges every live run into one. Newest entry per key wins; tombstones can be
+    // dropped because the merged set always includes the oldest run.
+    void compactionLoop(stop_token) {
+        unique_lock lock(mtx);
+        while (true) {
+            cv.wait(lock, [&] { return stopping || runs.size() >= compactionTrigger; });
+            if (stopping) return;
+            compacting = true;
+            auto inputs = runs;
+            uint64_t id = nextRunId++;
+            lock.unlock();
+
+            auto cursors = openCursors(inputs);
+            size_t expected = 0;
+            for (const auto& r : inputs) expected += r->sparse.size() * indexStride;
+            auto merged = writeRun(id, expected, [&]() -> optional<pair<int, Entry>> {
+                while (true) {
+                    optional<int> minKey;
+                    for (auto& c : cursors)
+                        if (c.cur && (!minKey || c.cur->first < *minKey)) minKey = c.cur->first;
+                    if (!minKey) return nullopt;
+                    optional<pair<int, Entry>> winner;
+                    for (auto& c : cursors) { // oldest to newest: last match wins
+                        if (c.cur && c.cur->first == *minKey) {
+                            winner = std::move(c.cur);
+                            c.cur = readEntry(c.in);
+                        }
+                    }
+                    if (winner->second) return winner;
+                }
+            });
+
+            lock.lock();
+            erase_if(runs, [&](const shared_ptr<Run>& r) {
+                return ranges::find(inputs, r) != inputs.end();
+            });
+            runs.insert(runs.begin(), merged);
+            writeManifest();
+            for (auto& r : inputs) r->obsolete = true;
+            compacting = false;
+            cv.notify_all();
+        }
+    }
+
+public:
+    explicit LsmStore(fs::path directory, size_t memtableEntries = 65536, size_t runsBeforeCompaction = 4)
+        : dir(std::move(directory)), memtableLimit(memtableEntries), compactionTrigger(runsBeforeCompaction) {
+        fs::create_directories(dir);
+        if (ifstream manifest(dir / "MANIFEST"); manifest) {
+            manifest >> nextRunId;
+            uint64_t id;
+            while (manifest >> id) runs.push_back(openRun(id));
+        }
+        // Remove runs orphaned by a crash mid-flush or mid-compaction
+        for (const auto& entry : fs::directory_iterator(dir)) {
+            auto name = entry.path().filename().string();
+            if (!name.starts_with("run-")) continue;
+            uint64_t id = stoull(name.substr(4));
+            if (ranges::none_of(runs, [&](const auto& r) { return r->id == id; })) fs::remove(entry.path());
+        }
+        if (ifstream log(dir / "memtable.log"); log) {
+            while (auto kv = readEntry(log)) memtable[kv->first] = std::move(kv->second);
+        }
+        memtableLog.open(dir / "memtable.log", ios::app);
+        if (!memtableLog) throw runtime_error("Cannot open LSM memtable log");
+        memtableLog << setprecision(17);
+        compactor = jthread([this](stop_token st) { compactionLoop(st); });
+    }
+
+    ~LsmStore() override {
+        {
+            lock_guard lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+    }
+
+    optional<BankAccount> get(int accountNum) override {
+        if (auto it = memtable.find(accountNum); it != memtable.end()) return it->second;
+        vector<shared_ptr<Run>> snapshot;
+        {
+            lock_guard lock(mtx);
+            snapshot = runs;
+        }
+        for (const auto& run : views::reverse(snapshot))
+            if (auto e = lookupRun(*run, accountNum)) return *e;
+        return nullopt;
+    }
+
+    void put(const BankAccount& acc) override {
+        logEntry(acc.getAccountNum(), acc);
+        memtable[acc.getAccountNum()] = acc;
+        if (memtable.size() >= memtableLimit) flushMemtable();
+    }
+
+    void erase(int accountNum) override {
+        logEntry(accountNum, nullopt);
+        memtable[accountNum] = nullopt;
+        if (memtable.size() >= memtableLimit) flushMemtable();
+    }
+
+    // Streams every live account in key order with a k-way merge; memory stays O(runs).
+    void forEach(const function<void(const BankAccount&)>& fn) override {
+        vector<shared_ptr<Run>> snapshot;
+        {
+            lock_guard lock(mtx);
+            snapshot = runs;
+        }
+        auto cursors = openCursors(snapshot);
+        auto mem = memtable.begin();
+        while (true) {
+            optional<int> minKey;
+            for (auto& c : cursors)
+                if (c.cur && (!minKey || c.cur->first < *minKey)) minKey = c.cur->first;
+            if (mem != memtable.end() && (!minKey || mem->first < *minKey)) minKey = mem->first;
+            if (!minKey) return;
+            Entry winner;
+            for (auto& c : cursors) {
+                if (c.cur && c.cur->first == *minKey) {
+                    winner = std::move(c.cur->second);
+                    c.cur = readEntry(c.in);
+                }
+            }
+            if (mem != memtable.end() && mem->first == *minKey) winner = (mem++)->second;
+            if (winner) fn(*winner);
+        }
+    }
+
+    [[nodiscard]] bool empty() override {
+        lock_guard lock(mtx);
+        return memtable.empty() && runs.empty();
+    }
+
+    void flush() override {
+        flushMemtable();
+        unique_lock lock(mtx);
+        cv.wait(lock, [&] { return !compacting; });
+    }
+};
+
+// ---------------- Buffer Pool ----------------
+// Fixed number of 4 KiB frames over a page file. Eviction uses the clock algorithm;
+// dirty pages are written back when evicted or on flush.
+class BufferPool {
+public:
+    static constexpr size_t pageSize = 4096;
+    static constexpr uint32_t noPage = numeric_limits<uint32_t>::max();
+
+    struct Stats {
+        uint64_t hits{};
+        uint64_t misses{};
+        uint64_t writeBacks{};
+    };
+
+private:
+    struct Frame {
+        alignas(16) array<char, pageSize> data{};
+        uint32_t pageId = noPage;
+        uint32_t pins = 0;
+        bool dirty = false;
+        bool referenced = false;
+    };
+
+    fstream file;
+    vector<Frame> frames;
+    unordered_map<uint32_t, size_t> table; // pageId -> frame
+    size_t hand = 0;
+    uint32_t pageCount = 0;
+    Stats counters;
+
+    void writeFrame(Frame& f) {
+        file.seekp(static_cast<streamoff>(f.pageId) * pageSize);
+        file.write(f.data.data(), pageSize);
+        if (!file) throw runtime_error("Page write failed");
+        f.dirty = false;
+        ++counters.writeBacks;
+    }
+
+    size_t victim() {
+        for (size_t scanned = 0; scanned < frames.size() * 2; ++scanned) {
+            size_t i = hand;
+            hand = (hand + 1) % frames.size();
+            Frame& f = frames[i];
+            if (f.pins) continue;
+            if (f.referenced) {
+                f.referenced = false;
+                continue;
+            }
+            if (f.pageId != noPage) {
+                if (f.dirty) writeFrame(f);
+                table.erase(f.pageId);
+                f.pageId = noPage;
+            }
+            return i;
+        }
+        throw runtime_error("Buffer pool exhausted: all frames pinned");
+    }
+
+public:
+    // Pinned handle to a resident page; unpins on destruction.
+    class PageRef {
+    private:
+        BufferPool* pool{};
+        size_t frame{};
+
+    public:
+        PageRef(BufferPool* p, size_t f) : pool(p), frame(f) {}
+        PageRef(PageRef&& other) noexcept : pool(exchange(other.pool, nullptr)), frame(other.frame) {}
+        PageRef& operator=(PageRef&&) = delete;
+        ~PageRef() {
+            if (pool) --pool->frames[frame].pins;
+        }
+
+        template <typename T>
+        [[nodiscard]] T* as() const { return reinterpret_cast<T*>(pool->frames[frame].data.data()); }
+        [[nodiscard]] uint32_t id() const { return pool->frames[frame].pageId; }
+        void markDirty() const { pool->frames[frame].dirty = true; }
+    };
+
+    BufferPool(const fs::path& path, size_t frameCount) : frames(max<size_t>(frameCount, 8)) {
+        if (!fs::exists(path)) ofstream(path, ios::binary);
+        file.open(path, ios::in | ios::out | ios::binary);
+        if (!file) throw runtime_error("Cannot open page file");
+        pageCount = static_cast<uint32_t>(fs::file_size(path) / pageSize);
+    }
+
+    [[nodiscard]] uint32_t pages() const { return pageCount; }
+
+    PageRef fetch(uint32_t id) {
+        if (auto it = table.find(id); it != table.end()) {
+            ++counters.hits;
+            Frame& f = frames[it->second];
+            f.referenced = true;
+            ++f.pins;
+            return {this, it->second};
+        }
+        ++counters.misses;
+        size_t i = victim();
+        Frame& f = frames[i];
+        file.seekg(static_cast<streamoff>(id) * pageSize);
+        if (!file.read(f.data.data(), pageSize)) {
+            file.clear();
+            f.data.fill(0); // allocated but never written back
+        }
+        f.pageId = id;
+        f.pins = 1;
+        f.dirty = false;
+        f.referenced = true;
+        table[id] = i;
+        return {this, i};
+    }
+
+    PageRef allocate() {
+        size_t i = victim();
+        Frame& f = frames[i];
+        f.data.fill(0);
+        f.pageId = pageCount++;
+        f.pins = 1;
+        f.dirty = true;
+        f.referenced = true;
+        table[f.pageId] = i;
+        return {this, i};
+    }
+
+    void flushAll() {
+        for (auto& f : frames)
+            if (f.pageId != noPage && f.dirty) writeFrame(f);
+        file.flush();
+    }
+
+    [[nodiscard]] Stats stats() const { return counters; }
+    void resetStats() { counters = {}; }
+};
+
+// ---------------- B+Tree Store ----------------
+// Paged B+tree keyed by account number. Page 0 holds the metadata, leaves are chained
+// for ordered scans. Deletes leave underfull leaves in place rather than rebalancing.
+class BPlusTreeStore : public AccountStore {
+private:
+    struct Meta {
+        static constexpr uint32_t expectedMagic = 0x42414e4b; // "BANK"
+        uint32_t magic;
+        uint32_t root;
+        uint64_t count;
+    };
+
+    struct Node {
+        static constexpr size_t header = 16;
+        static constexpr size_t leafCapacity = (BufferPool::pageSize - header) / sizeof(AccountRecord);
+        static constexpr size_t innerCapacity = (BufferPool::pageSize - header) / 8 - 1;
+
+        uint32_t leaf;
+        uint32_t count;
+        uint32_t next; // right sibling for leaves
+        uint32_t reserved;
+        union {
+            AccountRecord records[leafCapacity];
+            struct {
+                int32_t keys[innerCapacity];
+                uint32_t children[innerCapacity + 1];
+            } inner;
+        };
+    };
+    static_assert(sizeof(Node) <= BufferPool::pageSize && sizeof(Meta) <= BufferPool::pageSize);
+
+    using Split = optional<pair<int32_t, uint32_t>>; // separator key, new right page
+
+    BufferPool pool;
+
+    uint32_t root() { return pool.fetch(0).as<Meta>()->root; }
+
+    void adjustCount(int64_t delta) {
+        auto meta = pool.fetch(0);
+        meta.as<Meta>()->count += delta;
+        meta.markDirty();
+    }
+
+    static size_t childIndex(const Node* n, int key) {
+        return static_cast<size_t>(ranges::upper_bound(n->inner.keys, n->inner.keys + n->count, key) - n->inner.keys);
+    }
+
+    static size_t recordIndex(const Node* n, int key) {
+        return static_cast<size_t>(ranges::lower_bound(n->records, n->records + n->count, key, {}, &AccountRecord::accountNum) - n->records);
+    }
+
+    uint32_t findLeaf(int key) {
+        uint32_t id = root();
+        while (true) {
+            auto ref = pool.fetch(id);
+            const auto* n = ref.as<Node>();
+            if (n->leaf) return id;
+            id = n->inner.children[childIndex(n, key)];
+        }
+    }
+
+    Split insert(uint32_t id, const AccountRecord& rec, bool& inserted) {
+        auto ref = pool.fetch(id);
+        auto* n = ref.as<Node>();
+        if (n->leaf) {
+            size_t pos = recordIndex(n, rec.accountNum);
+            ref.markDirty();
+            if (pos < n->count && n->records[pos].accountNum == rec.accountNum) {
+                n->records[pos] = rec;
+                return nullopt;
+            }
+            inserted = true;
+            vector<AccountRecord> all(n->records, n->records + n->count);
+            all.insert(all.begin() + static_cast<ptrdiff_t>(pos), rec);
+            if (all.size() <= Node::leafCapacity) {
+                ranges::copy(all, n->records);
+                n->count = static_cast<uint32_t>(all.size());
+                return nullopt;
+            }
+            auto right = pool.allocate();
+            auto* r = right.as<Node>();
+            size_t mid = all.size() / 2;
+            r->leaf = 1;
+            r->count = static_cast<uint32_t>(all.size() - mid);
+            r->next = n->next;
+            ranges::copy(all.begin() + static_cast<ptrdiff_t>(mid), all.end(), r->records);
+            n->count = static_cast<uint32_t>(mid);
+            n->next = right.id();
+            ranges::copy(all.begin(), all.begin() + static_cast<ptrdiff_t>(mid), n->records);
+            return pair{r->records[0].accountNum, right.id()};
+        }
+
+        size_t pos = childIndex(n, rec.accountNum);
+        auto split = insert(n->inner.children[pos], rec, inserted);
+        if (!split) return nullopt;
+        ref.markDirty();
+        vector<int32_t> keys(n->inner.keys, n->inner.keys + n->count);
+        vector<uint32_t> children(n->inner.children, n->inner.children + n->count + 1);
+        keys.insert(keys.begin() + static_cast<ptrdiff_t>(pos), split->first);
+        children.insert(children.begin() + static_cast<ptrdiff_t>(pos) + 1, split->second);
+        if (keys.size() <= Node::innerCapacity) {
+            ranges::copy(keys, n->inner.keys);
+            ranges::copy(children, n->inner.children);
+            n->count = static_cast<uint32_t>(keys.size());
+            return nullopt;
+        }
+        auto right = pool.allocate();
+        auto* r = right.as<Node>();
+        size_t mid = keys.size() / 2; // keys[mid] moves up
+        r->leaf = 0;
+        r->count = static_cast<uint32_t>(keys.size() - mid - 1);
+        ranges::copy(keys.begin() + static_cast<ptrdiff_t>(mid) + 1, keys.end(), r->inner.keys);
+        ranges::copy(children.begin() + static_cast<ptrdiff_t>(mid) + 1, children.end(), r->inner.children);
+        n->count = static_cast<uint32_t>(mid);
+        ranges::copy(keys.begin(), keys.begin() + static_cast<ptrdiff_t>(mid), n->inner.keys);
+        ranges::copy(children.begin(), children.begin() + static_cast<ptrdiff_t>(mid) + 1, n->inner.children);
+        return pair{keys[mid], right.id()};
+    }
+
+public:
+    BPlusTreeStore(const fs::path& path, size_t frames) : pool(path, frames) {
+        if (pool.pages() == 0) {
+            auto meta = pool.allocate();
+            auto leaf = pool.allocate();
+            leaf.as<Node>()->leaf = 1;
+            *meta.as<Meta>() = {Meta::expectedMagic, leaf.id(), 0};
+            return;
+        }
+        if (pool.fetch(0).as<Meta>()->magic != Meta::expectedMagic)
+            throw runtime_error("Not a B+tree account file: " + path.string());
+    }
+
+    ~BPlusTreeStore() override {
+        try {
+            pool.flushAll();
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << '\n';
+        }
+    }
+
+    optional<BankAccount> get(int accountNum) override {
+        auto ref = pool.fetch(findLeaf(accountNum));
+        const auto* n = ref.as<Node>();
+        size_t pos = recordIndex(n, accountNum);
+        if (pos < n->count && n->records[pos].accountNum == accountNum) return BankAccount::fromRecord(n->records[pos]);
+        return nullopt;
+    }
+
+    void put(const BankAccount& acc) override {
+        bool inserted = false;
+        uint32_t oldRoot = root();
+        auto split = insert(oldRoot, acc.toRecord(), inserted);
+        if (split) {
+            auto top = pool.allocate();
+            auto* n = top.as<Node>();
+            n->leaf = 0;
+            n->count = 1;
+            n->inner.keys[0] = split->first;
+            n->inner.children[0] = oldRoot;
+            n->inner.children[1] = split->second;
+            auto meta = pool.fetch(0);
+            meta.as<Meta>()->root = top.id();
+            meta.markDirty();
+        }
+        if (inserted) adjustCount(1);
+    }
+
+    void erase(int accountNum) override {
+        auto ref = pool.fetch(findLeaf(accountNum));
+        auto* n = ref.as<Node>();
+        size_t pos = recordIndex(n, accountNum);
+        if (pos == n->count || n->records[pos].accountNum != accountNum) return;
+        copy(n->records + pos + 1, n->records + n->count, n->records + pos);
+        --n->count;
+        ref.markDirty();
+        adjustCount(-1);
+    }
+
+    void forEach(const function<void(const BankAccount&)>& fn) override {
+        uint32_t id = findLeaf(numeric_limits<int>::min());
+        while (id) {
+            auto ref = pool.fetch(id);
+            const auto* n = ref.as<Node>();
+            for (uint32_t i = 0; i < n->count; ++i) fn(BankAccount::fromRecord(n->records[i]));
+            id = n->next;
+        }
+    }
+
+    [[nodiscard]] bool empty() override { return pool.fetch(0).as<Meta>()->count == 0; }
+
+    void flush() override { pool.flushAll(); }
+
+    [[nodiscard]] BufferPool::Stats stats() const { return pool.stats(); }
+    void resetStats() { pool.resetStats(); }
+};
+
+// ---------------- Tiered Store ----------------
+// Cold tier: a disk-resident open-addressing hash table of fixed records. Nothing but
+// the header is kept in memory, so its footprint does not grow with the book.
+class ColdSegment {
+private:
+    enum : uint32_t { Empty = 0, Used = 1, Deleted = 2 };
+
+    struct Slot {
+        uint32_t state;
+        uint32_t reserved;
+        AccountRecord rec;
+    };
+
+    struct Header {
+        static constexpr uint64_t expectedMagic = 0x434f4c44424e4b31; // "COLDBNK1"
+        uint64_t magic;
+        uint64_t slots;
+        uint64_t used;
+        uint64_t deleted;
+    };
+
+    fs::path path;
+    fstream file;
+    Header hdr{};
+
+    static streamoff offsetOf(uint64_t slot) {
+        return static_cast<streamoff>(sizeof(Header) + slot * sizeof(Slot));
+    }
+
+    Slot readSlot(uint64_t i) {
+        Slot s{};
+        file.seekg(offsetOf(i));
+        file.read(reinterpret_cast<char*>(&s), sizeof s);
+        if (!file) throw runtime_error("Cold segment read failed");
+        return s;
+    }
+
+    void writeSlot(uint64_t i, const Slot& s) {
+        file.seekp(offsetOf(i));
+        file.write(reinterpret_cast<const char*>(&s), sizeof s);
+    }
+
+    void writeHeader() {
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&hdr), sizeof hdr);
+        if (!file) throw runtime_error("Cold segment write failed");
+    }
+
+    static void create(const fs::path& p, uint64_t slots) {
+        ofstream out(p, ios::binary | ios::trunc);
+        Header h{Header::expectedMagic, slots, 0, 0};
+        out.write(reinterpret_cast<const char*>(&h), sizeof h);
+        const Slot empty{};
+        for (uint64_t i = 0; i < slots; ++i) out.write(reinterpret_cast<const char*>(&empty), sizeof empty);
+        if (!out) throw runtime_error("Cannot create cold segment");
+    }
+
+    void open() {
+        file.open(path, ios::in | ios::out | ios::binary);
+        file.read(reinterpret_cast<char*>(&hdr), sizeof hdr);
+        if (!file || hdr.magic != Header::expectedMagic || hdr.slots == 0)
+            throw runtime_error("Not a cold segment: " + path.string());
+    }
+
+    // Returns the slot holding key, or the first reusable slot on its probe chain.
+    pair<uint64_t, bool> probe(int key) {
+        uint64_t i = hashKey(static_cast<uint32_t>(key)) % hdr.slots;
+        optional<uint64_t> reusable;
+        for (uint64_t n = 0; n < hdr.slots; ++n, i = (i + 1) % hdr.slots) {
+            Slot s = readSlot(i);
+            if (s.state == Used && s.rec.accountNum == key) return {i, true};
+            if (s.state == Deleted && !reusable) reusable = i;
+            if (s.state == Empty) return {reusable.value_or(i), false};
+        }
+        if (!reusable) throw runtime_error("Cold segment full");
+        return {*reusable, false};
+    }
+
+    // Rebuilds into a table twice the size (tombstones are dropped on the way).
+    void grow() {
+        const fs::path tmp = path.string() + ".grow";
+        create(tmp, hdr.slots * 2);
+        {
+            ColdSegment bigger(tmp);
+            for (uint64_t i = 0; i < hdr.slots; ++i)
+                if (Slot s = readSlot(i); s.state == Used) bigger.put(s.rec);
+            bigger.flush();
+        }
+        file.close();
+        fs::rename(tmp, path);
+        open();
+    }
+
+public:
+    explicit ColdSegment(fs::path p, uint64_t initialSlots = 1024) : path(std::move(p)) {
+        if (!fs::exists(path)) create(path, initialSlots);
+        open();
+    }
+
+    [[nodiscard]] uint64_t size() const { return hdr.used; }
+
+    optional<AccountRecord> get(int key) {
+        auto [slot, found] = probe(key);
+        if (!found) return nullopt;
+        return readSlot(slot).rec;
+    }
+
+    void put(const AccountRecord& rec) {
+        if ((hdr.used + hdr.deleted + 1) * 10 > hdr.slots * 7) grow();
+        auto [slot, found] = probe(rec.accountNum);
+        if (!found) {
+            if (readSlot(slot).state == Deleted) --hdr.deleted;
+            ++hdr.used;
+            writeHeader();
+        }
+        writeSlot(slot, Slot{Used, 0, rec});
+    }
+
+    void erase(int key) {
+        auto [slot, found] = probe(key);
+        if (!found) return;
+        writeSlot(slot, Slot{Deleted, 0, {}});
+        --hdr.used;
+        ++hdr.deleted;
+        writeHeader();
+    }
+
+    void forEach(const function<void(const AccountRecord&)>& fn) {
+        for (uint64_t i = 0; i < hdr.slots; ++i)
+            if (Slot s = readSlot(i); s.state == Used) fn(s.rec);
+    }
+
+    void flush() { file.flush(); }
+};
+
+// Hot tier: LRU cache of recently used accounts, bounded by an approximate byte budget.
+// Writes go through to the cold segment, so evicting a hot account never needs I/O.
+class TieredStore : public AccountStore {
+private:
+    ColdSegment cold;
+    size_t budget;
+    size_t resident = 0;
+    list<BankAccount> lru; // most recent first
+    unordered_map<int, list<BankAccount>::iterator> hot;
+
+    static size_t footprint(const BankAccount& acc) {
+        // list node + hash node + heap-allocated name beyond the SSO buffer
+        constexpr size_t overhead = sizeof(BankAccount) + 2 * sizeof(void*) + sizeof(pair<const int, void*>) + 3 * sizeof(void*);
+        auto name = acc.getName();
+        return overhead + (name.size() > 15 ? name.capacity() + 1 : 0);
+    }
+
+    void drop(unordered_map<int, list<BankAccount>::iterator>::iterator it) {
+        resident -= footprint(*it->second);
+        lru.erase(it->second);
+        hot.erase(it);
+    }
+
+    void promote(const BankAccount& acc) {
+        if (auto it = hot.find(acc.getAccountNum()); it != hot.end()) drop(it);
+        lru.push_front(acc);
+        hot[acc.getAccountNum()] = lru.begin();
+        resident += footprint(acc);
+        while (resident > budget && lru.size() > 1) drop(hot.find(lru.back().getAccountNum()));
+    }
+
+public:
+    TieredStore(const fs::path& coldPath, size_t memoryBudgetBytes)
+        : cold(coldPath), budget(memoryBudgetBytes) {}
+
+    optional<BankAccount> get(int accountNum) override {
+        if (auto it = hot.find(accountNum); it != hot.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            return *it->second;
+        }
+        auto rec = cold.get(accountNum);
+        if (!rec) return nullopt;
+        auto acc = BankAccount::fromRecord(*rec);
+        promote(acc);
+        return acc;
+    }
+
+    void put(const BankAccount& acc) override {
+        cold.put(acc.toRecord());
+        promote(acc);
+    }
+
+    void erase(int accountNum) override {
+        if (auto it = hot.find(accountNum); it != hot.end()) drop(it);
+        cold.erase(accountNum);
+    }
+
+    void forEach(const function<void(const BankAccount&)>& fn) override {
+        cold.forEach([&](const AccountRecord& r) { fn(BankAccount::fromRecord(r)); });
+    }
+
+    [[nodiscard]] bool empty() override { return cold.size() == 0; }
+
+    void flush() override { cold.flush(); }
+
+    [[nodiscard]] size_t residentBytes() const { return resident; }
+    [[nodiscard]] size_t hotAccounts() const { return hot.size(); }
+};
+
+// ---------------- Mapped Store ----------------
+#ifdef BANK_HAVE_MMAP
+
+// Read-only view of a record living inside a mapping. Valid until the store grows.
+class AccountView {
+private:
+    const AccountRecord* rec;
+
+public:
+    explicit AccountView(const AccountRecord* r) : rec(r) {}
+
+    [[nodiscard]] int getAccountNum() const { return rec->accountNum; }
+    [[nodiscard]] string_view getName() const { return {rec->name, rec->nameLen}; }
+    [[nodiscard]] double getBalance() const { return rec->balance; }
+};
+
+// The account table itself is a memory-mapped open-addressing hash of fixed records:
+// opening is just mmap (no parsing) and puts overwrite the record in place. BankManagement
+// commits the audit log before calling put, which keeps log-before-data ordering.
+class MappedStore : public AccountStore {
+private:
+    enum : uint32_t { Empty = 0, Used = 1, Deleted = 2 };
+
+    struct Slot {
+        uint32_t state;
+        uint32_t reserved;
+        AccountRecord rec;
+    };
+
+    struct Header {
+        static constexpr uint64_t expectedMagic = 0x4d4150424e4b3031; // "MAPBNK01"
+        uint64_t magic;
+        uint64_t slots;
+        uint64_t used;
+        uint64_t deleted;
+    };
+
+    fs::path path;
+    int fd = -1;
+    size_t mappedBytes = 0;
+    Header* hdr = nullptr;
+    Slot* slots = nullptr;
+
+    static size_t bytesFor(uint64_t slotCount) { return sizeof(Header) + slotCount * sizeof(Slot); }
+
+    void map() {
+        fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0) throw runtime_error("Cannot open mapped store: " + path.string());
+        mappedBytes = fs::file_size(path);
+        void* p = ::mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) throw runtime_error("mmap failed: " + path.string());
+        hdr = static_cast<Header*>(p);
+        slots = reinterpret_cast<Slot*>(static_cast<char*>(p) + sizeof(Header));
+        if (hdr->magic != Header::expectedMagic || bytesFor(hdr->slots) != mappedBytes)
+            throw runtime_error("Not a mapped account store: " + path.string());
+    }
+
+    void unmap() {
+        if (hdr) ::munmap(hdr, mappedBytes);
+        if (fd >= 0) ::close(fd);
+        hdr = nullptr;
+        slots = nullptr;
+        fd = -1;
+    }
+
+    static void create(const fs::path& p, uint64_t slotCount) {
+        {
+            ofstream out(p, ios::binary | ios::trunc);
+            Header h{Header::expectedMagic, slotCount, 0, 0};
+            out.write(reinterpret_cast<const char*>(&h), sizeof h);
+        }
+        fs::resize_file(p, bytesFor(slotCount)); // zero-filled: every slot Empty
+    }
+
+    [[nodiscard]] pair<uint64_t, bool> probe(int key) const {
+        uint64_t i = hashKey(static_cast<uint32_t>(key)) % hdr->slots;
+        optional<uint64_t> reusable;
+        for (uint64_t n = 0; n < hdr->slots; ++n, i = (i + 1) % hdr->slots) {
+            const Slot& s = slots[i];
+            if (s.state == Used && s.rec.accountNum == key) return {i, true};
+            if (s.state == Deleted && !reusable) reusable = i;
+            if (s.state == Empty) return {reusable.value_or(i), false};
+        }
+        if (!reusable) throw runtime_error("Mapped store full");
+        return {*reusable, false};
+    }
+
+    void grow() {
+        const fs::path tmp = path.string() + ".grow";
+        create(tmp, hdr->slots * 2);
+        {
+            MappedStore bigger(tmp);
+            for (uint64_t i = 0; i < hdr->slots; ++i)
+                if (slots[i].state == Used) bigger.putRecord(slots[i].rec);
+            bigger.flush();
+        }
+        unmap();
+        fs::rename(tmp, path);
+        map();
+    }
+
+    void putRecord(const AccountRecord& rec) {
+        if ((hdr->used + hdr->deleted + 1) * 10 > hdr->slots * 7) grow();
+        auto [i, found] = probe(rec.accountNum);
+        if (!found) {
+            if (slots[i].state == Deleted) --hdr->deleted;
+            ++hdr->used;
+        }
+        slots[i].rec = rec;
+        slots[i].state = Used;
+    }
+
+public:
+    explicit MappedStore(fs::path p, uint64_t initialSlots = 1024) : path(std::move(p)) {
+        if (!fs::exists(path)) create(path, initialSlots);
+        map();
+    }
+
+    MappedStore(const MappedStore&) = delete;
+    MappedStore& operator=(const MappedStore&) = delete;
+
+    ~MappedStore() override {
+        if (hdr) ::msync(hdr, mappedBytes, MS_SYNC);
+        unmap();
+    }
+
+    [[nodiscard]] optional<AccountView> view(int accountNum) const {
+        auto [i, found] = probe(accountNum);
+        if (!found) return nullopt;
+        return AccountView(&slots[i].rec);
+    }
+
+    void forEachView(const function<void(AccountView)>& fn) const {
+        for (uint64_t i = 0; i < hdr->slots; ++i)
+            if (slots[i].state == Used) fn(AccountView(&slots[i].rec));
+    }
+
+    optional<BankAccount> get(int accountNum) override {
+        auto [i, found] = probe(accountNum);
+        if (!found) return nullopt;
+        return BankAccount::fromRecord(slots[i].rec);
+    }
+
+    void put(const BankAccount& acc) override { putRecord(acc.toRecord()); }
+
+    void erase(int accountNum) override {
+        auto [i, found] = probe(accountNum);
+        if (!found) return;
+        slots[i].state = Deleted;
+        --hdr->used;
+        ++hdr->deleted;
+    }
+
+    void forEach(const function<void(const BankAccount&)>& fn) override {
+        for (uint64_t i = 0; i < hdr->slots; ++i)
+            if (slots[i].state == Used) fn(BankAccount::fromRecord(slots[i].rec));
+    }
+
+    [[nodiscard]] bool empty() override { return hdr->used == 0; }
+
+    void flush() override {
+        if (::msync(hdr, mappedBytes, MS_SYNC) != 0) throw runtime_error("msync failed");
+    }
+};
+#endif
+
+// ---------------- Shared-Memory Book ----------------
+#ifdef BANK_HAVE_MMAP
+// The teller publishes every account into a POSIX shared-memory hash table so that
+// reporting processes can query it without parsing files or talking to the teller.
+// Each slot is guarded by its own seqlock: the writer never waits, readers retry
+// while a slot is being rewritten. When the table fills up, the writer builds a
+// bigger segment under the same name and marks the old one retired; readers remap.
+struct SharedLayout {
+    static constexpr uint64_t expectedMagic = 0x53485244424e4b31; // "SHRDBNK1"
+    static constexpr const char* defaultName = "/bank_accounts";
+
+    enum : uint32_t { Empty = 0, Used = 1, Deleted = 2 };
+
+    struct Header {
+        uint64_t magic;
+        uint64_t capacity;
+        uint64_t occupied; // used + deleted
+        uint32_t retired;
+        uint32_t owner; // pid of the publishing teller
+    };
+
+    struct Slot {
+        uint32_t seq; // odd while the writer is inside the slot
+        uint32_t state;
+        AccountRecord rec;
+    };
+
+    static size_t bytesFor(uint64_t capacity) { return sizeof(Header) + capacity * sizeof(Slot); }
+
+    static Slot* slotsOf(Header* h) {
+        return reinterpret_cast<Slot*>(reinterpret_cast<char*>(h) + sizeof(Header));
+    }
+
+    // Consistent copy of a slot; spins only while the writer is mid-update.
+    static Slot readSlot(const Slot& s) {
+        auto& seq = const_cast<uint32_t&>(s.seq);
+        while (true) {
+            uint32_t before = atomic_ref(seq).load(memory_order_acquire);
+            if (before & 1) continue;
+            Slot copy;
+            memcpy(static_cast<void*>(&copy), &s, sizeof copy);
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_ref(seq).load(memory_order_relaxed) == before) return copy;
+        }
+    }
+};
+
+class SharedBookWriter {
+private:
+    string name;
+    SharedLayout::Header* hdr = nullptr;
+    size_t mappedBytes = 0;
+    bool live = false; // ready() has been called: rebuilt segments are published when full
+
+    // Whether the segment under name was left by a teller that is no longer running.
+    [[nodiscard]] bool abandoned() const {
+        int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) return false;
+        SharedLayout::Header h{};
+        const bool read = ::pread(fd, &h, sizeof h, 0) == static_cast<ssize_t>(sizeof h);
+        ::close(fd);
+        return read && h.owner && ::kill(static_cast<pid_t>(h.owner), 0) != 0 && errno == ESRCH;
+    }
+
+    // The first segment is created exclusively, so a name another teller is serving is
+    // never taken from it; only one whose teller has died is replaced. A rebuild replaces
+    // this writer's own segment. Readers accept a segment once its magic is stored.
+    void create(uint64_t capacity, bool replacing) {
+        if (replacing || abandoned()) ::shm_unlink(name.c_str());
+        int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0 && errno == EEXIST) throw runtime_error("Another teller is publishing the live book as " + name);
+        if (fd < 0) throw runtime_error("shm_open failed: " + name);
+        mappedBytes = SharedLayout::bytesFor(capacity);
+        if (::ftruncate(fd, static_cast<off_t>(mappedBytes)) != 0) {
+            ::close(fd);
+            throw runtime_error("Cannot size shared segment");
+        }
+        void* p = ::mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) throw runtime_error("mmap failed: " + name);
+        hdr = static_cast<SharedLayout::Header*>(p);
+        hdr->capacity = capacity;
+        hdr->occupied = 0;
+        hdr->retired = 0;
+        hdr->owner = static_cast<uint32_t>(::getpid());
+    }
+
+    void retire() {
+        if (!hdr) return;
+        atomic_ref(hdr->retired).store(1, memory_order_release);
+        ::munmap(hdr, mappedBytes);
+        hdr = nullptr;
+    }
+
+    static void writeSlot(SharedLayout::Slot& s, uint32_t state, const AccountRecord& rec) {
+        atomic_ref seq(s.seq);
+        uint32_t v = seq.load(memory_order_relaxed);
+        seq.store(v + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        s.state = state;
+        s.rec = rec;
+        seq.store(v + 2, memory_order_release);
+    }
+
+    pair<uint64_t, bool> probe(int key) const {
+        auto* slots = SharedLayout::slotsOf(hdr);
+        uint64_t i = hashKey(static_cast<uint32_t>(key)) % hdr->capacity;
+        optional<uint64_t> reusable;
+        for (uint64_t n = 0; n < hdr->capacity; ++n, i = (i + 1) % hdr->capacity) {
+            const auto& s = slots[i];
+            if (s.state == SharedLayout::Used && s.rec.accountNum == key) return {i, true};
+            if (s.state == SharedLayout::Deleted && !reusable) reusable = i;
+            if (s.state == SharedLayout::Empty) return {reusable.value_or(i), false};
+        }
+        return {reusable.value_or(0), false};
+    }
+
+    void rebuild(uint64_t capacity) {
+        vector<AccountRecord> rows;
+        auto* slots = SharedLayout::slotsOf(hdr);
+        for (uint64_t i = 0; i < hdr->capacity; ++i)
+            if (slots[i].state == SharedLayout::Used) rows.push_back(slots[i].rec);
+        auto* old = hdr;
+        size_t oldBytes = mappedBytes;
+        create(capacity, true);
+        for (const auto& rec : rows) publish(rec);
+        if (live) atomic_ref(hdr->magic).store(SharedLayout::expectedMagic, memory_order_release);
+        atomic_ref(old->retired).store(1, memory_order_release);
+        ::munmap(old, oldBytes);
+    }
+
+public:
+    explicit SharedBookWriter(string segmentName = SharedLayout::defaultName, uint64_t capacity = 1024)
+        : name(std::move(segmentName)) {
+        create(max<uint64_t>(capacity, 16), false);
+    }
+
+    SharedBookWriter(const SharedBookWriter&) = delete;
+    SharedBookWriter& operator=(const SharedBookWriter&) = delete;
+
+    ~SharedBookWriter() {
+        retire();
+        ::shm_unlink(name.c_str());
+    }
+
+    void publish(const AccountRecord& rec) {
+        if ((hdr->occupied + 1) * 10 > hdr->capacity * 7) rebuild(hdr->capacity * 2);
+        auto [i, found] = probe(rec.accountNum);
+        auto& slot = SharedLayout::slotsOf(hdr)[i];
+        if (!found && slot.state == SharedLayout::Empty) ++hdr->occupied;
+        writeSlot(slot, SharedLayout::Used, rec);
+    }
+
+    void unpublish(int accountNum) {
+        auto [i, found] = probe(accountNum);
+        if (found) writeSlot(SharedLayout::slotsOf(hdr)[i], SharedLayout::Deleted, {});
+    }
+
+    // Opens the segment to readers, once the whole book has been published into it.
+    void ready() {
+        live = true;
+        atomic_ref(hdr->magic).store(SharedLayout::expectedMagic, memory_order_release);
+    }
+};
+
+class SharedBookReader {
+private:
+    string name;
+    SharedLayout::Header* hdr = nullptr;
+    size_t mappedBytes = 0;
+
+    void attach() {
+        int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) throw runtime_error("No live book published (is the teller running?)");
+        struct stat st {};
+        ::fstat(fd, &st);
+        mappedBytes = static_cast<size_t>(st.st_size);
+        void* p = mappedBytes ? ::mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (p == MAP_FAILED) throw runtime_error("Cannot map shared book");
+        hdr = static_cast<SharedLayout::Header*>(p);
+        // A segment still being filled (at start, or in a rebuild) is given a moment.
+        auto ready = [&] { return atomic_ref(hdr->magic).load(memory_order_acquire) == SharedLayout::expectedMagic; };
+        for (int tries = 0; tries < 1000 && !ready(); ++tries) this_thread::sleep_for(chrono::milliseconds(1));
+        if (!ready() || SharedLayout::bytesFor(hdr->capacity) != mappedBytes) {
+            detach();
+            throw runtime_error("Shared book is not initialised");
+        }
+    }
+
+    void detach() {
+        if (hdr) ::munmap(hdr, mappedBytes);
+        hdr = nullptr;
+    }
+
+    void refresh() {
+        if (atomic_ref(hdr->retired).load(memory_order_acquire)) {
+            detach();
+            attach();
+        }
+    }
+
+public:
+    explicit SharedBookReader(string segmentName = SharedLayout::defaultName) : name(std::move(segmentName)) {
+        attach();
+    }
+
+    SharedBookReader(const SharedBookReader&) = delete;
+    SharedBookReader& operator=(const SharedBookReader&) = delete;
+
+    ~SharedBookReader() { detach(); }
+
+    optional<AccountRecord> find(int accountNum) {
+        refresh();
+        auto* slots = SharedLayout::slotsOf(hdr);
+        uint64_t i = hashKey(static_cast<uint32_t>(accountNum)) % hdr->capacity;
+        for (uint64_t n = 0; n < hdr->capacity; ++n, i = (i + 1) % hdr->capacity) {
+            auto s = SharedLayout::readSlot(slots[i]);
+            if (s.state == SharedLayout::Empty) break;
+            if (s.state == SharedLayout::Used && s.rec.accountNum == accountNum) return s.rec;
+        }
+        return nullopt;
+    }
+
+    void forEach(const function<void(const AccountRecord&)>& fn) {
+        refresh();
+        auto* slots = SharedLayout::slotsOf(hdr);
+        for (uint64_t i = 0; i < hdr->capacity; ++i)
+            if (auto s = SharedLayout::readSlot(slots[i]); s.state == SharedLayout::Used) fn(s.rec);
+    }
+};
+#endif
+
+// ---------------- Crash Recovery ----------------
+// Snapshot header: "#seq N" names the last audit record folded in, "#time T" its timestamp.
+struct SnapshotHeader {
+    optional<uint64_t> seq; // unset for files written before the header existed
+    int64_t time = 0;
+};
+
+inline SnapshotHeader readSnapshotHeader(istream& in) {
+    SnapshotHeader header;
+    string line;
+    while (in.peek() == '#' && getline(in, line)) {
+        istringstream fields(line);
+        string tag;
+        uint64_t seq{};
+        int64_t time{};
+        if (line.starts_with("#seq ") && fields >> tag >> seq) header.seq = seq;
+        else if (line.starts_with("#time ") && fields >> tag >> time) header.time = time;
+    }
+    return header;
+}
+
+struct RecoveryStats {
+    size_t records{};
+    size_t partitions{};
+    size_t anomalies{};  // records that did not match the snapshot state
+    double seconds{};
+    optional<uint64_t> damagedAt; // first record rejected by its checksum
+};
+
+// Replays the log tail onto a snapshot. Records are split into per-account effects
+// (a transfer becomes a debit and a credit), effects are partitioned by account and
+// each partition is applied on its own thread in log order. Because every effect
+// touches exactly one account, the result does not depend on thread scheduling.
+class LogReplayer {
+private:
+    struct Effect {
+        size_t record;
+        int account;
+        double delta; // signed amount for transfer legs
+    };
+
+    struct Partition {
+        unordered_map<int, BankAccount> live;
+        unordered_map<int, uint64_t> createdAt; // accounts (re)opened during replay
+        vector<Effect> effects;
+        size_t anomalies = 0;
+    };
+
+    static void apply(Partition& part, const vector<AuditRecord>& log) {
+        for (const auto& e : part.effects) {
+            const auto& r = log[e.record];
+            if (r.op == "addAccount") {
+                part.live.insert_or_assign(r.account, BankAccount::restore(r.text, r.account, r.amount, r.aux));
+                part.createdAt[r.account] = r.seq;
+                continue;
+            }
+            auto it = part.live.find(e.account);
+            if (it == part.live.end()) {
+                ++part.anomalies;
+                continue;
+            }
+            try {
+                if (r.op == "deposit") it->second.deposit(r.amount);
+                else if (r.op == "withdraw") it->second.debit(r.amount);
+                else if (r.op == "transfer") e.delta < 0 ? it->second.debit(-e.delta) : it->second.deposit(e.delta);
+                else if (r.op == "updateName") it->second.updateName(r.text);
+                else if (r.op == "closeAccount") part.live.erase(it);
+            } catch (const exception&) {
+                ++part.anomalies;
+            }
+        }
+    }
+
+public:
+    static RecoveryStats replay(deque<BankAccount>& book, const vector<AuditRecord>& log, uint64_t afterSeq) {
+        auto start = chrono::steady_clock::now();
+        RecoveryStats stats;
+        size_t from = static_cast<size_t>(ranges::find_if(log, [&](const AuditRecord& r) { return r.seq > afterSeq; }) - log.begin());
+        size_t end = AuditLog::firstBroken(log, from);
+        if (end < log.size()) stats.damagedAt = log[end].seq;
+        if (from == end) return stats;
+
+        const size_t count = max<size_t>(1, thread::hardware_concurrency());
+        auto partOf = [&](int account) { return hashKey(static_cast<uint32_t>(account)) % count; };
+        vector<Partition> parts(count);
+        for (const auto& acc : book) parts[partOf(acc.getAccountNum())].live.emplace(acc.getAccountNum(), acc);
+        for (size_t i = from; i < end; ++i) {
+            const auto& r = log[i];
+            if (r.op == "transfer") {
+                parts[partOf(r.account)].effects.push_back({i, r.account, -r.amount});
+                parts[partOf(r.other)].effects.push_back({i, r.other, r.credit()});
+            } else if (r.account) { // book-wide records, such as products, touch no account
+                parts[partOf(r.account)].effects.push_back({i, r.account, 0.0});
+            }
+        }
+
+        parallelFor(count, 1, [&](size_t begin, size_t last) {
+            for (size_t p = begin; p < last; ++p) apply(parts[p], log);
+        });
+
+        // Keep the snapshot's order for surviving accounts, then append new ones in creation order.
+        deque<BankAccount> recovered;
+        for (const auto& acc : book) {
+            auto& part = parts[partOf(acc.getAccountNum())];
+            auto it = part.live.find(acc.getAccountNum());
+            if (it != part.live.end() && !part.createdAt.contains(acc.getAccountNum())) {
+                recovered.push_back(std::move(it->second));
+                part.live.erase(it);
+            }
+        }
+        vector<pair<uint64_t, BankAccount>> opened;
+        for (auto& part : parts) {
+            for (auto& [num, acc] : part.live)
+                if (auto c = part.createdAt.find(num); c != part.createdAt.end()) opened.emplace_back(c->second, std::move(acc));
+            stats.anomalies += part.anomalies;
+        }
+        ranges::sort(opened, {}, &pair<uint64_t, BankAccount>::first);
+        for (auto& [seq, acc] : opened) recovered.push_back(std::move(acc));
+        book = std::move(recovered);
+
+        stats.records = end - from;
+        stats.partitions = count;
+        stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+};
+
+// ---------------- Point-in-Time Queries ----------------
+// Reconstructs the book as it stood at a past moment: start from the newest retained
+// checkpoint taken at or before that moment and roll the audit log forward to it.
+class PointInTime {
+public:
+    struct Base {
+        fs::path file; // empty: start from an empty book at the beginning of the log
+        uint64_t seq = 0;
+        int64_t time = 0;
+    };
+
+    static fs::path checkpointDirFor(const string& snapshotFile) {
+        return fs::path(snapshotFile).parent_path() / "checkpoints";
+    }
+
+    // Newest of the retained checkpoints and the current snapshot taken at or before time.
+    static Base nearestCheckpoint(const string& snapshotFile, int64_t time) {
+        vector<fs::path> candidates{snapshotFile};
+        if (auto dir = checkpointDirFor(snapshotFile); fs::exists(dir))
+            for (const auto& entry : fs::directory_iterator(dir)) candidates.push_back(entry.path());
+        Base best;
+        for (const auto& file : candidates) {
+            ifstream in(file);
+            if (!in) continue;
+            auto header = readSnapshotHeader(in);
+            if (header.seq && header.time <= time && *header.seq > best.seq) best = {file, *header.seq, header.time};
+        }
+        return best;
+    }
+
+    // Balance of one account at time, or nullopt if it did not exist then. Only that
+    // account is read from the checkpoint; the log tail is still verified link by link.
+    static optional<BankAccount> accountAt(const string& snapshotFile, const string& auditFile, int accountNum, int64_t time) {
+        auto base = nearestCheckpoint(snapshotFile, time);
+        optional<BankAccount> acc;
+        if (!base.file.empty()) {
+            ifstream in(base.file);
+            readSnapshotHeader(in);
+            while (auto next = BankAccount::load(in))
+                if (next->getAccountNum() == accountNum) {
+                    acc = std::move(next);
+                    break;
+                }
+        }
+        auto log = tail(auditFile, base.seq, time);
+        for (const auto& r : log) {
+            if (r.account != accountNum && !(r.op == "transfer" && r.other == accountNum)) continue;
+            if (r.op == "addAccount") {
+                acc = BankAccount::restore(r.text, r.account, r.amount, r.aux);
+                continue;
+            }
+            if (!acc) continue;
+            try {
+                if (r.op == "deposit") acc->deposit(r.amount);
+                else if (r.op == "withdraw") acc->debit(r.amount);
+                else if (r.op == "transfer") r.account == accountNum ? acc->debit(r.amount) : acc->deposit(r.credit());
+                else if (r.op == "updateName") acc->updateName(r.text);
+                else if (r.op == "closeAccount") acc.reset();
+            } catch (const exception&) {
+                // the live bank rejected the same operation; the record has no effect
+            }
+        }
+        return acc;
+    }
+
+    // The whole book at time, replayed in parallel onto the nearest checkpoint.
+    static deque<BankAccount> bookAt(const string& snapshotFile, const string& auditFile, int64_t time) {
+        auto base = nearestCheckpoint(snapshotFile, time);
+        deque<BankAccount> book;
+        if (!base.file.empty()) {
+            ifstream in(base.file);
+            readSnapshotHeader(in);
+            while (auto acc = BankAccount::load(in)) book.push_back(std::move(*acc));
+        }
+        LogReplayer::replay(book, tail(auditFile, base.seq, time), base.seq);
+        return book;
+    }
+
+    // "YYYY-MM-DD HH:MM:SS" in local time -> milliseconds since epoch at the end of that second.
+    static optional<int64_t> parseLocalTime(const string& text) {
+        tm parts{};
+        istringstream in(text);
+        in >> get_time(&parts, "%Y-%m-%d %H:%M:%S");
+        if (in.fail()) return nullopt;
+        parts.tm_isdst = -1;
+        time_t secs = mktime(&parts);
+        if (secs == -1) return nullopt;
+        return static_cast<int64_t>(secs) * 1000 + 999;
+    }
+
+private:
+    // Log records after seq up to time, checked to be complete and unbroken.
+    static vector<AuditRecord> tail(const string& auditFile, uint64_t afterSeq, int64_t time) {
+        auto log = AuditLog::readAll(auditFile, afterSeq, time);
+        size_t from = static_cast<size_t>(ranges::find_if(log, [&](const AuditRecord& r) { return r.seq > afterSeq; }) - log.begin());
+        if (from < log.size() && log[from].seq != afterSeq + 1)
+            throw runtime_error("Audit history before record " + to_string(log[from].seq) + " is no longer available");
+        if (size_t end = AuditLog::firstBroken(log, from); end < log.size())
+            throw runtime_error("Audit chain broken at record " + to_string(log[end].seq));
+        log.erase(log.begin(), log.begin() + static_cast<ptrdiff_t>(from));
+        return log;
+    }
+};
+
+// ---------------- Backup ----------------
+// Token bucket that paces background I/O to a byte rate (0 = unthrottled).
+class Throttle {
+private:
+    double bytesPerSecond;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t consumed = 0;
+
+public:
+    explicit Throttle(double rate) : bytesPerSecond(rate) {}
+
+    void consume(size_t bytes) {
+        consumed += bytes;
+        if (bytesPerSecond <= 0) return;
+        auto due = start + chrono::duration_cast<chrono::steady_clock::duration>(
+                               chrono::duration<double>(static_cast<double>(consumed) / bytesPerSecond));
+        this_thread::sleep_until(due);
+    }
+
+    [[nodiscard]] size_t total() const { return consumed; }
+};
+
+inline void copyFileThrottled(const fs::path& from, const fs::path& to, Throttle& throttle) {
+    ifstream in(from, ios::binary);
+    ofstream out(to, ios::binary | ios::trunc);
+    if (!in || !out) throw runtime_error("Cannot copy " + from.string());
+    array<char, 64 * 1024> buf{};
+    while (in.read(buf.data(), buf.size()) || in.gcount()) {
+        out.write(buf.data(), in.gcount());
+        throttle.consume(static_cast<size_t>(in.gcount()));
+    }
+    if (!out) throw runtime_error("Cannot write " + to.string());
+}
+
+// ---------------- Replication ----------------
+#ifdef BANK_HAVE_SOCKETS
+// Log shipping over a Unix domain socket. The wire format is line based:
+//   follower -> primary   "FROM <seq>"            last record the follower holds
+//   primary  -> follower  <audit record line>      exactly as stored in the log
+//                         "#hb <lastSeq> <ms>"     heartbeat while idle
+//                         "#error <text>"          the follower cannot be served
+namespace net {
+
+inline bool sendAll(int fd, string_view data) {
+    while (!data.empty()) {
+        auto n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+// TCP connection to 127.0.0.1:port with Nagle disabled, or -1.
+inline int connectLoopback(uint16_t port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    timeval timeout{1, 0}; // a stuck peer is dropped rather than stalling the sender
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+    return fd;
+}
+
+inline int listenLoopback(uint16_t port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0 || ::listen(fd, 16) != 0) {
+        if (fd >= 0) ::close(fd);
+        throw runtime_error("Cannot listen on 127.0.0.1:" + to_string(port));
+    }
+    return fd;
+}
+
+inline sockaddr_un addressOf(const string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw runtime_error("Socket path too long: " + path);
+    ranges::copy(path, addr.sun_path);
+    return addr;
+}
+
+// Buffered line reader that gives up waiting when stop is requested.
+class LineReader {
+private:
+    int fd;
+    string buf;
+    size_t pos = 0;
+
+public:
+    explicit LineReader(int socket) : fd(socket) {}
+
+    // Exactly n further bytes; nullopt on EOF, error or stop.
+    optional<string> take(size_t n, const stop_token& stop) {
+        while (buf.size() - pos < n) {
+            pollfd p{fd, POLLIN, 0};
+            int ready = 0;
+            while (!ready) {
+                if (stop.stop_requested()) return nullopt;
+                ready = ::poll(&p, 1, 100);
+                if (ready < 0) return nullopt;
+            }
+            char chunk[64 * 1024];
+            auto got = ::recv(fd, chunk, sizeof chunk, 0);
+            if (got <= 0) return nullopt;
+            buf.append(chunk, static_cast<size_t>(got));
+        }
+        string data = buf.substr(pos, n);
+        pos += n;
+        return data;
+    }
+
+    // True if a complete line is already waiting in the buffer.
+    [[nodiscard]] bool buffered() const { return buf.find('\n', pos) != string::npos; }
+
+    // Next complete line without its newline; nullopt on EOF, error or stop.
+    optional<string> next(const stop_token& stop) {
+        while (true) {
+            if (auto nl = buf.find('\n', pos); nl != string::npos) {
+                string line = buf.substr(pos, nl - pos);
+                pos = nl + 1;
+                return line;
+            }
+            buf.erase(0, pos);
+            pos = 0;
+            pollfd p{fd, POLLIN, 0};
+            while (true) {
+                if (stop.stop_requested()) return nullopt;
+                int ready = ::poll(&p, 1, 100);
+                if (ready < 0) return nullopt;
+                if (ready > 0) break;
+            }
+            char chunk[64 * 1024];
+            auto n = ::recv(fd, chunk, sizeof chunk, 0);
+            if (n <= 0) return nullopt;
+            buf.append(chunk, static_cast<size_t>(n));
+        }
+    }
+};
+
+} // namespace net
+
+// Primary side: accepts followers and streams every committed audit record to them.
+// Recent records are served from memory; a follower further behind is caught up
+// from the log files first.
+class LogShipper {
+private:
+    static constexpr size_t recentCapacity = 1 << 16;
+    static constexpr auto heartbeatInterval = chrono::milliseconds(200);
+
+    string socketPath;
+    string auditFile;
+    int listenFd = -1;
+    mutex mtx;
+    condition_variable_any cv;
+    deque<pair<uint64_t, string>> recent; // consecutive records, oldest first
+    uint64_t lastSeq;
+    struct Sender {
+        atomic<bool> done = false;
+        jthread thread;
+    };
+    list<Sender> senders;
+    jthread acceptor; // declared last: stopped before the state above goes away
+
+    void acceptLoop(const stop_token& stop) {
+        pollfd p{listenFd, POLLIN, 0};
+        while (!stop.stop_requested()) {
+            if (::poll(&p, 1, 100) <= 0) continue;
+            int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd < 0) continue;
+            timeval timeout{1, 0}; // a stuck follower is dropped rather than stalling its sender
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+            erase_if(senders, [](const Sender& s) { return s.done.load(); });
+            auto& sender = senders.emplace_back();
+            sender.thread = jthread([this, fd, &sender](stop_token st) {
+                serve(st, fd);
+                sender.done = true;
+            });
+        }
+    }
+
+    void serve(const stop_token& stop, int fd) {
+        net::LineReader in(fd);
+        uint64_t next = 0;
+        if (auto hello = in.next(stop); hello && hello->starts_with("FROM ")) {
+            uint64_t from{};
+            auto digits = string_view(*hello).substr(5);
+            if (from_chars(digits.data(), digits.data() + digits.size(), from).ec == errc{}) next = from + 1;
+        }
+        while (next && !stop.stop_requested()) {
+            string batch;
+            uint64_t fileUntil = 0; // catch up from the files below this sequence number
+            {
+                unique_lock lock(mtx);
+                if (next > lastSeq + 1) {
+                    net::sendAll(fd, "#error follower is ahead of the primary (diverged history)\n");
+                    break;
+                }
+                cv.wait_for(lock, stop, heartbeatInterval, [&] { return lastSeq >= next; });
+                if (lastSeq < next) {
+                    batch = "#hb " + to_string(lastSeq) + ' ' + to_string(AuditLog::nowMillis()) + '\n';
+                } else if (!recent.empty() && recent.front().first <= next) {
+                    for (size_t i = next - recent.front().first; i < recent.size(); ++i) batch += recent[i].second;
+                    next = lastSeq + 1;
+                } else {
+                    fileUntil = recent.empty() ? lastSeq + 1 : recent.front().first;
+                }
+            }
+            if (fileUntil) {
+                ostringstream lines;
+                for (const auto& r : AuditLog::readAll(auditFile, next - 1)) {
+                    if (r.seq < next) continue;
+                    if (r.seq >= fileUntil || r.seq != next) break;
+                    r.save(lines);
+                    ++next;
+                }
+                batch = lines.str();
+                if (batch.empty()) {
+                    net::sendAll(fd, "#error history before record " + to_string(next) + " is not available\n");
+                    break;
+                }
+            }
+            if (!net::sendAll(fd, batch)) break;
+        }
+        ::close(fd);
+    }
+
+public:
+    LogShipper(string path, string logFile, uint64_t committedSeq)
+        : socketPath(std::move(path)), auditFile(std::move(logFile)), lastSeq(committedSeq) {
+        auto addr = net::addressOf(socketPath);
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0) throw runtime_error("Cannot create replication socket");
+        ::unlink(socketPath.c_str());
+        if (::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0 || ::listen(listenFd, 16) != 0) {
+            ::close(listenFd);
+            throw runtime_error("Cannot listen on " + socketPath);
+        }
+        acceptor = jthread([this](stop_token st) { acceptLoop(st); });
+    }
+
+    LogShipper(const LogShipper&) = delete;
+    LogShipper& operator=(const LogShipper&) = delete;
+
+    ~LogShipper() {
+        acceptor = {};
+        senders.clear();
+        ::close(listenFd);
+        ::unlink(socketPath.c_str());
+    }
+
+    // Called by the audit log for every committed record, in sequence order.
+    void publish(const AuditRecord& r) {
+        ostringstream line;
+        r.save(line);
+        {
+            lock_guard lock(mtx);
+            recent.emplace_back(r.seq, line.str());
+            if (recent.size() > recentCapacity) recent.pop_front();
+            lastSeq = r.seq;
+        }
+        cv.notify_all();
+    }
+};
+
+struct ReplicationStatus {
+    bool connected = false;
+    uint64_t appliedSeq = 0;
+    uint64_t primarySeq = 0;
+    int64_t lastLagMs = 0; // primary commit to local apply of the newest record; 0 once caught up
+    int64_t maxLagMs = 0;
+    double avgLagMs = 0;   // moving average
+    string error;
+};
+
+// Follower side: connects to a primary, resumes after the last record held locally and
+// hands each received batch to apply. Reconnects whenever the primary goes away.
+class LogFollower {
+private:
+    string socketPath;
+    function<uint64_t()> lastApplied;
+    function<void(const vector<AuditRecord>&)> apply;
+    mutable mutex mtx;
+    ReplicationStatus state;
+    jthread worker;
+
+    void session(const stop_token& stop, int fd) {
+        const uint64_t from = lastApplied();
+        {
+            lock_guard lock(mtx);
+            state.connected = true;
+            state.appliedSeq = from;
+            state.error.clear();
+        }
+        if (!net::sendAll(fd, "FROM " + to_string(from) + '\n')) return;
+        net::LineReader in(fd);
+        vector<AuditRecord> batch;
+        while (auto line = in.next(stop)) {
+            if (line->starts_with("#hb ")) {
+                istringstream hb(line->substr(4));
+                uint64_t seq{};
+                if (hb >> seq) {
+                    lock_guard lock(mtx);
+                    state.primarySeq = seq;
+                    if (state.appliedSeq >= seq) state.lastLagMs = 0;
+                }
+                continue;
+            }
+            if (line->starts_with("#error ")) {
+                lock_guard lock(mtx);
+                state.error = line->substr(7);
+                return;
+            }
+            istringstream fields(*line);
+            auto r = AuditRecord::load(fields);
+            if (!r) continue;
+            batch.push_back(std::move(*r));
+            if (in.buffered()) continue; // apply whatever has arrived as one batch
+            apply(batch);
+            const int64_t now = AuditLog::nowMillis();
+            lock_guard lock(mtx);
+            for (const auto& rec : batch) {
+                state.lastLagMs = max<int64_t>(0, now - rec.timestamp);
+                state.maxLagMs = max(state.maxLagMs, state.lastLagMs);
+                state.avgLagMs += (static_cast<double>(state.lastLagMs) - state.avgLagMs) / 16;
+            }
+            state.appliedSeq = batch.back().seq;
+            state.primarySeq = max(state.primarySeq, state.appliedSeq);
+            batch.clear();
+        }
+    }
+
+    void run(const stop_token& stop) {
+        auto addr = net::addressOf(socketPath);
+        while (!stop.stop_requested()) {
+            int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == 0) {
+                try {
+                    session(stop, fd);
+                } catch (const exception& e) {
+                    lock_guard lock(mtx);
+                    state.error = e.what();
+                }
+            }
+            if (fd >= 0) ::close(fd);
+            {
+                lock_guard lock(mtx);
+                state.connected = false;
+            }
+            for (int i = 0; i < 5 && !stop.stop_requested(); ++i) this_thread::sleep_for(chrono::milliseconds(100));
+        }
+    }
+
+public:
+    LogFollower(string path, function<uint64_t()> lastAppliedSeq, function<void(const vector<AuditRecord>&)> applyBatch)
+        : socketPath(std::move(path)), lastApplied(std::move(lastAppliedSeq)), apply(std::move(applyBatch)) {
+        worker = jthread([this](stop_token st) { run(st); });
+    }
+
+    [[nodiscard]] ReplicationStatus status() const {
+        lock_guard lock(mtx);
+        return state;
+    }
+};
+#endif
+
+// ---------------- Raft Consensus ----------------
+#ifdef BANK_HAVE_SOCKETS
+// Callbacks through which a RaftNode drives the replicated book. Commands are audit
+// records without their chain fields; the state machine links them into its own log.
+struct RaftStateMachine {
+    function<optional<string>(const AuditRecord&)> apply;          // error text if the command is rejected
+    function<void(ostream&)> save;                                  // snapshot of everything applied so far
+    function<void(istream&, const vector<AuditRecord>&)> load;      // snapshot plus the audit records it covers
+    function<uint64_t()> auditSeq;                                  // last record in the local audit log
+};
+
+struct RaftOptions {
+    chrono::milliseconds electionTimeout{300}; // randomised in [t, 2t)
+    chrono::milliseconds heartbeat{50};
+    size_t maxBatch = 512;        // entries per AppendEntries
+    size_t maxInflight = 8;       // AppendEntries pipelined to a follower ahead of its replies
+    size_t compactAfter = 50'000; // applied entries kept in the log before it is snapshotted
+};
+
+struct RaftStatus {
+    string role;
+    uint64_t term{};
+    int leader = -1; // node index, -1 while unknown
+    uint64_t lastIndex{};
+    uint64_t commitIndex{};
+    uint64_t lastApplied{};
+    uint64_t snapshotIndex{};
+};
+
+// One member of a Raft cluster on the loopback interface. Frames are a header line
+// "TYPE <bodyBytes> fields..." followed by the body; replies are a single line:
+//   RV  term candidate lastIndex lastTerm                 -> RVR term granted
+//   AE  term leader prevIndex prevTerm commit  + entries  -> AER term ok matchIndex auditSeq
+//   IS  term leader index term  + snapshot, "#tail", log  -> ISR term matchIndex auditSeq
+// Term, vote, log and the latest snapshot are persisted in dir.
+class RaftNode {
+public:
+    enum class Role { Follower, Candidate, Leader };
+
+private:
+    struct Entry {
+        uint64_t term{};
+        AuditRecord cmd;
+    };
+
+    struct Peer {
+        uint16_t port{};
+        uint64_t nextIndex = 1;
+        uint64_t matchIndex = 0;
+        uint64_t auditSeq = 0;
+        size_t inflight = 0;
+        bool voteNeeded = false;
+        bool snapshotPending = false;
+        chrono::steady_clock::time_point lastSent{};
+        jthread thread;
+    };
+
+    struct Waiter {
+        uint64_t term{};
+        promise<optional<string>> result;
+    };
+
+    struct Connection {
+        atomic<bool> done = false;
+        jthread thread;
+    };
+
+    fs::path dir;
+    int self;
+    RaftStateMachine sm;
+    RaftOptions options;
+    string auditFile;
+
+    mutex mtx; // Raft state below
+    condition_variable_any cv;
+    Role role = Role::Follower;
+    uint64_t currentTerm = 0;
+    int votedFor = -1;
+    int leaderId = -1;
+    size_t votes = 0;
+    deque<Entry> log; // entries after snapshotIndex
+    uint64_t snapshotIndex = 0;
+    uint64_t snapshotTerm = 0;
+    uint64_t commitIndex = 0;
+    uint64_t lastApplied = 0;
+    uint64_t durableIndex = 0; // fsynced through this entry
+    chrono::steady_clock::time_point electionDeadline;
+    map<uint64_t, Waiter> waiters;
+    mt19937 rng{random_device{}()};
+    vector<Peer> peers; // indexed by node; this node's slot is unused
+
+    mutex syncMtx; // held across an fsync of the log file
+    mutex fileMtx; // the log file stream
+    ofstream logOut;
+    int logFd = -1;
+    uint64_t writtenIndex = 0;
+    uint64_t logEpoch = 0; // bumped whenever the file is rewritten
+
+    mutex applyMtx; // the state machine
+    atomic<uint64_t> localAuditSeq = 0; // sm.auditSeq() as of the last apply, reported to the leader
+    int listenFd = -1;
+    list<Connection> connections;
+    jthread acceptor, ticker, applier, persister; // declared last: stopped before the state above goes away
+
+    // ---- log helpers (caller holds mtx) ----
+    [[nodiscard]] uint64_t lastIndex() const { return snapshotIndex + log.size(); }
+    [[nodiscard]] uint64_t termAt(uint64_t index) const {
+        return index == snapshotIndex ? snapshotTerm : log[index - snapshotIndex - 1].term;
+    }
+    [[nodiscard]] size_t majority() const { return peers.size() / 2 + 1; }
+
+    static void writeEntry(ostream& out, uint64_t index, const Entry& e) {
+        const auto& c = e.cmd;
+        out << index << ' ' << e.term << ' ' << c.timestamp << ' ' << c.op << ' ' << c.account << ' ' << c.other
+            << ' ' << c.amount << ' ' << c.aux << ' ' << quoted(c.text) << '\n';
+    }
+
+    static optional<pair<uint64_t, Entry>> readEntry(istream& in) {
+        uint64_t index{};
+        Entry e;
+        auto& c = e.cmd;
+        if (in >> index >> e.term >> c.timestamp >> c.op >> c.account >> c.other >> c.amount >> c.aux >> quoted(c.text))
+            return pair{index, std::move(e)};
+        return nullopt;
+    }
+
+    void resetElectionDeadline() {
+        uniform_int_distribution<long> jitter(0, options.electionTimeout.count());
+        electionDeadline = chrono::steady_clock::now() + options.electionTimeout + chrono::milliseconds(jitter(rng));
+    }
+
+    void persistState() {
+        const auto path = dir / "raft_state.txt";
+        {
+            ofstream out(path.string() + ".tmp", ios::trunc);
+            out << currentTerm << ' ' << votedFor << '\n';
+            if (!out.flush()) throw runtime_error("Cannot persist Raft state");
+        }
+        fs::rename(path.string() + ".tmp", path);
+    }
+
+    void openLogFile() {
+        logOut.open(dir / "raft_log.txt", ios::app);
+        logOut << setprecision(17);
+#ifdef BANK_HAVE_FSYNC
+        logFd = ::open((dir / "raft_log.txt").c_str(), O_WRONLY);
+#endif
+    }
+
+    // Appends to the file buffer only; syncLog() makes it durable. Caller holds mtx.
+    void writeToLog(uint64_t index, const Entry& e) {
+        lock_guard lock(fileMtx);
+        writeEntry(logOut, index, e);
+        writtenIndex = index;
+    }
+
+    // Replaces the file with the entries now held in memory. Caller holds mtx.
+    void rewriteLog() {
+        lock_guard sync(syncMtx);
+        lock_guard lock(fileMtx);
+        logOut.close();
+#ifdef BANK_HAVE_FSYNC
+        if (logFd >= 0) ::close(logFd);
+#endif
+        const auto path = dir / "raft_log.txt";
+        {
+            ofstream out(path.string() + ".tmp", ios::trunc);
+            out << setprecision(17);
+            for (size_t i = 0; i < log.size(); ++i) writeEntry(out, snapshotIndex + 1 + i, log[i]);
+            if (!out.flush()) throw runtime_error("Cannot rewrite Raft log");
+        }
+        fs::rename(path.string() + ".tmp", path);
+        openLogFile();
+#ifdef BANK_HAVE_FSYNC
+        if (logFd >= 0) ::fsync(logFd);
+#endif
+        writtenIndex = durableIndex = lastIndex();
+        ++logEpoch;
+    }
+
+    // Flushes and fsyncs what has been written; returns the index covered and the file epoch.
+    pair<uint64_t, uint64_t> syncLog() {
+        lock_guard sync(syncMtx);
+        uint64_t target{}, epoch{};
+        {
+            lock_guard lock(fileMtx);
+            logOut.flush();
+            target = writtenIndex;
+            epoch = logEpoch;
+        }
+#ifdef BANK_HAVE_FSYNC
+        if (logFd >= 0) ::fsync(logFd);
+#endif
+        return {target, epoch};
+    }
+
+    // ---- role changes (caller holds mtx) ----
+    void observeTerm(uint64_t term) {
+        if (term <= currentTerm) return;
+        currentTerm = term;
+        votedFor = -1;
+        leaderId = -1;
+        role = Role::Follower;
+        persistState();
+        resetElectionDeadline();
+    }
+
+    void appendLocal(AuditRecord cmd) {
+        log.push_back({currentTerm, std::move(cmd)});
+        writeToLog(lastIndex(), log.back());
+        cv.notify_all();
+    }
+
+    void becomeLeader() {
+        role = Role::Leader;
+        leaderId = self;
+        for (auto& p : peers) {
+            p.nextIndex = lastIndex() + 1;
+            p.matchIndex = 0;
+            p.inflight = 0;
+            p.snapshotPending = false;
+            p.lastSent = {};
+        }
+        AuditRecord noop;
+        noop.op = "noop"; // commits entries left over from earlier terms
+        appendLocal(std::move(noop));
+    }
+
+    void startElection() {
+        ++currentTerm;
+        role = Role::Candidate;
+        votedFor = self;
+        votes = 1;
+        leaderId = -1;
+        persistState();
+        resetElectionDeadline();
+        for (size_t i = 0; i < peers.size(); ++i) peers[i].voteNeeded = static_cast<int>(i) != self;
+        if (votes >= majority()) becomeLeader();
+        cv.notify_all();
+    }
+
+    // Highest index held by a majority; only an entry of the current term commits by counting.
+    void advanceCommit() {
+        if (role != Role::Leader) return;
+        vector<uint64_t> held;
+        for (size_t i = 0; i < peers.size(); ++i)
+            held.push_back(static_cast<int>(i) == self ? durableIndex : peers[i].matchIndex);
+        ranges::nth_element(held, held.begin() + static_cast<ptrdiff_t>(majority() - 1), greater{});
+        const uint64_t n = held[majority() - 1];
+        if (n > commitIndex && n > snapshotIndex && termAt(n) == currentTerm) {
+            commitIndex = n;
+            cv.notify_all();
+        }
+    }
+
+    // ---- incoming requests ----
+    string onRequestVote(istream& h) {
+        uint64_t term{}, candidateLast{}, candidateLastTerm{};
+        int candidate{};
+        h >> term >> candidate >> candidateLast >> candidateLastTerm;
+        lock_guard lock(mtx);
+        observeTerm(term);
+        const uint64_t myLastTerm = termAt(lastIndex());
+        const bool upToDate = candidateLastTerm > myLastTerm || (candidateLastTerm == myLastTerm && candidateLast >= lastIndex());
+        const bool grant = term == currentTerm && (votedFor == -1 || votedFor == candidate) && upToDate;
+        if (grant) {
+            votedFor = candidate;
+            persistState();
+            resetElectionDeadline();
+        }
+        return "RVR " + to_string(currentTerm) + ' ' + (grant ? '1' : '0') + '\n';
+    }
+
+    string onAppendEntries(istream& h, const string& body) {
+        uint64_t term{}, prevIndex{}, prevTerm{}, leaderCommit{};
+        int leader{};
+        h >> term >> leader >> prevIndex >> prevTerm >> leaderCommit;
+        vector<Entry> entries;
+        istringstream in(body);
+        while (auto e = readEntry(in)) entries.push_back(std::move(e->second));
+
+        lock_guard lock(mtx);
+        auto reply = [&](bool ok, uint64_t match) {
+            return "AER " + to_string(currentTerm) + ' ' + (ok ? '1' : '0') + ' ' + to_string(match) + ' ' +
+                   to_string(localAuditSeq.load()) + '\n';
+        };
+        if (term < currentTerm) return reply(false, 0);
+        observeTerm(term);
+        role = Role::Follower;
+        leaderId = leader;
+        resetElectionDeadline();
+        if (prevIndex > lastIndex()) return reply(false, commitIndex);
+        if (prevIndex >= snapshotIndex && termAt(prevIndex) != prevTerm) return reply(false, commitIndex);
+
+        bool appended = false;
+        uint64_t index = prevIndex;
+        for (auto& e : entries) {
+            if (++index <= snapshotIndex) continue; // already folded into the snapshot
+            if (index <= lastIndex()) {
+                if (termAt(index) == e.term) continue;
+                log.erase(log.begin() + static_cast<ptrdiff_t>(index - snapshotIndex - 1), log.end());
+                rewriteLog();
+            }
+            log.push_back(std::move(e));
+            writeToLog(index, log.back());
+            appended = true;
+        }
+        if (appended) {
+            auto [target, epoch] = syncLog();
+            durableIndex = max(durableIndex, target);
+        }
+        if (leaderCommit > commitIndex) {
+            commitIndex = max(commitIndex, min(leaderCommit, index));
+            cv.notify_all();
+        }
+        return reply(true, index);
+    }
+
+    string onInstallSnapshot(istream& h, const string& body) {
+        uint64_t term{}, index{}, indexTerm{};
+        int leader{};
+        h >> term >> leader >> index >> indexTerm;
+        auto reply = [&](uint64_t match) {
+            return "ISR " + to_string(currentTerm) + ' ' + to_string(match) + ' ' + to_string(localAuditSeq.load()) + '\n';
+        };
+        {
+            lock_guard lock(mtx);
+            if (term < currentTerm) return reply(0);
+            observeTerm(term);
+            role = Role::Follower;
+            leaderId = leader;
+            resetElectionDeadline();
+        }
+        lock_guard apply(applyMtx);
+        {
+            lock_guard lock(mtx);
+            if (index <= lastApplied) return reply(index); // already past it
+        }
+        const auto split = body.find("\n#tail\n");
+        const string snapshot = body.substr(0, split);
+        vector<AuditRecord> tail;
+        if (split != string::npos) {
+            istringstream in(body.substr(split + 7));
+            while (auto r = AuditRecord::load(in)) tail.push_back(std::move(*r));
+        }
+        {
+            const auto path = dir / "raft_snapshot.txt";
+            ofstream out(path.string() + ".tmp", ios::trunc);
+            out << "#raft " << index << ' ' << indexTerm << '\n' << snapshot;
+            if (!out.flush()) throw runtime_error("Cannot write Raft snapshot");
+            out.close();
+            fs::rename(path.string() + ".tmp", path);
+        }
+        istringstream in(snapshot);
+        sm.load(in, tail);
+        localAuditSeq = sm.auditSeq();
+
+        lock_guard lock(mtx);
+        if (index < lastIndex() && termAt(index) == indexTerm) {
+            log.erase(log.begin(), log.begin() + static_cast<ptrdiff_t>(index - snapshotIndex));
+        } else {
+            log.clear();
+        }
+        snapshotIndex = index;
+        snapshotTerm = indexTerm;
+        commitIndex = max(commitIndex, index);
+        lastApplied = index;
+        for (auto it = waiters.begin(); it != waiters.end() && it->first <= index;) {
+            it->second.result.set_value("superseded by a snapshot from the leader");
+            it = waiters.erase(it);
+        }
+        rewriteLog();
+        return reply(index);
+    }
+
+    void serveConnection(const stop_token& stop, int fd) {
+        net::LineReader in(fd);
+        while (auto header = in.next(stop)) {
+            istringstream h(*header);
+            string type;
+            size_t bodyBytes{};
+            h >> type >> bodyBytes;
+            auto body = in.take(bodyBytes, stop);
+            if (!body) break;
+            string reply;
+            if (type == "RV") reply = onRequestVote(h);
+            else if (type == "AE") reply = onAppendEntries(h, *body);
+            else if (type == "IS") reply = onInstallSnapshot(h, *body);
+            if (!net::sendAll(fd, reply)) break;
+        }
+        ::close(fd);
+    }
+
+    void acceptLoop(const stop_token& stop) {
+        pollfd p{listenFd, POLLIN, 0};
+        while (!stop.stop_requested()) {
+            if (::poll(&p, 1, 100) <= 0) continue;
+            int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd < 0) continue;
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+            erase_if(connections, [](const Connection& c) { return c.done.load(); });
+            auto& conn = connections.emplace_back();
+            conn.thread = jthread([this, fd, &conn](stop_token st) {
+                serveConnection(st, fd);
+                conn.done = true;
+            });
+        }
+    }
+
+    // ---- outgoing requests ----
+    void onReply(size_t id, const string& line) {
+        istringstream h(line);
+        string type;
+        uint64_t term{};
+        h >> type >> term;
+        lock_guard lock(mtx);
+        observeTerm(term);
+        auto& p = peers[id];
+        if (type == "RVR") {
+            int granted{};
+            h >> granted;
+            if (role == Role::Candidate && term == currentTerm && granted && ++votes >= majority()) becomeLeader();
+        } else if (role == Role::Leader && term == currentTerm) {
+            int ok = 1;
+            uint64_t match{};
+            if (type == "AER") h >> ok;
+            h >> match >> p.auditSeq;
+            if (p.inflight) --p.inflight;
+            if (type == "ISR") {
+                p.snapshotPending = false;
+                p.inflight = 0;
+            }
+            if (ok) {
+                p.matchIndex = max(p.matchIndex, match);
+                p.nextIndex = max(p.nextIndex, p.matchIndex + 1);
+                advanceCommit();
+            } else {
+                p.nextIndex = min(p.nextIndex, match + 1); // resend from the follower's commit point
+                p.inflight = 0;
+            }
+        }
+        cv.notify_all();
+    }
+
+    [[nodiscard]] bool hasWork(const Peer& p) const {
+        if (role == Role::Candidate) return p.voteNeeded;
+        if (role != Role::Leader || p.snapshotPending) return false;
+        if (chrono::steady_clock::now() - p.lastSent >= options.heartbeat) return true;
+        return p.inflight < options.maxInflight && p.nextIndex <= lastIndex();
+    }
+
+    // Builds the next frame for a peer; caller holds mtx. Snapshots are read from disk by
+    // the caller after the lock is released.
+    string nextFrame(Peer& p, bool& snapshot) {
+        if (role == Role::Candidate) {
+            p.voteNeeded = false;
+            return "RV 0 " + to_string(currentTerm) + ' ' + to_string(self) + ' ' + to_string(lastIndex()) + ' ' +
+                   to_string(termAt(lastIndex())) + '\n';
+        }
+        p.lastSent = chrono::steady_clock::now();
+        ++p.inflight;
+        if (p.nextIndex <= snapshotIndex) {
+            p.snapshotPending = true;
+            snapshot = true;
+            return {};
+        }
+        const uint64_t prev = p.nextIndex - 1;
+        const uint64_t count = p.inflight <= options.maxInflight ? min<uint64_t>(options.maxBatch, lastIndex() - prev) : 0;
+        ostringstream body;
+        body << setprecision(17);
+        for (uint64_t i = 1; i <= count; ++i) writeEntry(body, prev + i, log[prev + i - snapshotIndex - 1]);
+        p.nextIndex += count; // pipelined: the next frame continues from here without waiting
+        const string entries = body.str();
+        return "AE " + to_string(entries.size()) + ' ' + to_string(currentTerm) + ' ' + to_string(self) + ' ' +
+               to_string(prev) + ' ' + to_string(termAt(prev)) + ' ' + to_string(commitIndex) + '\n' + entries;
+    }
+
+    string snapshotFrame(uint64_t peerAuditSeq) {
+        ifstream in(dir / "raft_snapshot.txt");
+        string header;
+        getline(in, header);
+        istringstream h(header);
+        string tag;
+        uint64_t index{}, indexTerm{};
+        h >> tag >> index >> indexTerm;
+        string body{istreambuf_iterator<char>(in), {}};
+        istringstream snap(body);
+        const uint64_t snapshotSeq = readSnapshotHeader(snap).seq.value_or(0);
+        ostringstream tail;
+        if (peerAuditSeq < snapshotSeq)
+            for (const auto& r : AuditLog::readAll(auditFile, peerAuditSeq))
+                if (r.seq > peerAuditSeq && r.seq <= snapshotSeq) r.save(tail);
+        body += "\n#tail\n" + tail.str();
+        lock_guard lock(mtx);
+        return "IS " + to_string(body.size()) + ' ' + to_string(currentTerm) + ' ' + to_string(self) + ' ' +
+               to_string(index) + ' ' + to_string(indexTerm) + '\n' + body;
+    }
+
+    // Owns the connection to one peer: sends requests as they become due and hands
+    // replies, read on a second thread, to onReply.
+    void peerLoop(const stop_token& stop, size_t id) {
+        auto& p = peers[id];
+        while (!stop.stop_requested()) {
+            int fd = net::connectLoopback(p.port);
+            if (fd < 0) {
+                this_thread::sleep_for(chrono::milliseconds(50));
+                continue;
+            }
+            atomic<bool> broken = false;
+            jthread reader([&, fd](stop_token rs) {
+                net::LineReader in(fd);
+                while (auto line = in.next(rs)) onReply(id, *line);
+                broken = true;
+                lock_guard lock(mtx);
+                cv.notify_all();
+            });
+            {
+                lock_guard lock(mtx);
+                p.inflight = 0;
+                p.snapshotPending = false;
+                p.nextIndex = min(p.nextIndex, p.matchIndex + 1);
+                if (role == Role::Candidate) p.voteNeeded = true;
+            }
+            while (!stop.stop_requested() && !broken) {
+                string frame;
+                bool snapshot = false;
+                uint64_t peerAuditSeq{};
+                {
+                    unique_lock lock(mtx);
+                    cv.wait_for(lock, stop, options.heartbeat, [&] { return broken || hasWork(p); });
+                    if (broken || stop.stop_requested() || !hasWork(p)) continue;
+                    frame = nextFrame(p, snapshot);
+                    peerAuditSeq = p.auditSeq;
+                }
+                if (snapshot) frame = snapshotFrame(peerAuditSeq);
+                if (!net::sendAll(fd, frame)) break;
+            }
+            ::shutdown(fd, SHUT_RDWR);
+            reader = {};
+            ::close(fd);
+        }
+    }
+
+    void tick(const stop_token& stop) {
+        while (!stop.stop_requested()) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+            lock_guard lock(mtx);
+            if (role != Role::Leader && chrono::steady_clock::now() >= electionDeadline) startElection();
+        }
+    }
+
+    // Makes the leader's own appends durable in batches; followers sync before replying.
+    void persist(const stop_token& stop) {
+        while (!stop.stop_requested()) {
+            {
+                unique_lock lock(mtx);
+                if (!cv.wait(lock, stop, [&] { return lastIndex() > durableIndex; })) return;
+            }
+            auto [target, epoch] = syncLog();
+            lock_guard lock(mtx);
+            if (epoch == logEpoch) durableIndex = max(durableIndex, target);
+            advanceCommit();
+        }
+    }
+
+    void compact() {
+        uint64_t index{}, indexTerm{};
+        {
+            lock_guard lock(mtx);
+            index = lastApplied;
+            indexTerm = termAt(index);
+        }
+        const auto path = dir / "raft_snapshot.txt";
+        {
+            ofstream out(path.string() + ".tmp", ios::trunc);
+            out << "#raft " << index << ' ' << indexTerm << '\n';
+            sm.save(out);
+            if (!out.flush()) throw runtime_error("Cannot write Raft snapshot");
+        }
+        fs::rename(path.string() + ".tmp", path);
+        lock_guard lock(mtx);
+        log.erase(log.begin(), log.begin() + static_cast<ptrdiff_t>(index - snapshotIndex));
+        snapshotIndex = index;
+        snapshotTerm = indexTerm;
+        rewriteLog();
+    }
+
+    void applyLoop(const stop_token& stop) {
+        while (!stop.stop_requested()) {
+            {
+                unique_lock lock(mtx);
+                if (!cv.wait(lock, stop, [&] { return commitIndex > lastApplied; })) return;
+            }
+            lock_guard apply(applyMtx);
+            vector<pair<uint64_t, Entry>> batch;
+            {
+                lock_guard lock(mtx);
+                for (uint64_t i = lastApplied + 1; i <= commitIndex && batch.size() < 4096; ++i)
+                    batch.emplace_back(i, log[i - snapshotIndex - 1]);
+            }
+            vector<optional<string>> results;
+            results.reserve(batch.size());
+            for (const auto& [index, e] : batch) results.push_back(sm.apply(e.cmd));
+            localAuditSeq = sm.auditSeq();
+            bool compactNow = false;
+            {
+                lock_guard lock(mtx);
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    auto it = waiters.find(batch[i].first);
+                    if (it == waiters.end()) continue;
+                    if (it->second.term == batch[i].second.term) it->second.result.set_value(results[i]);
+                    else it->second.result.set_value("leadership changed before the command committed");
+                    waiters.erase(it);
+                }
+                if (!batch.empty()) lastApplied = batch.back().first;
+                compactNow = lastApplied - snapshotIndex >= options.compactAfter;
+            }
+            if (compactNow) compact();
+        }
+    }
+
+    void load() {
+        if (ifstream in(dir / "raft_state.txt"); in) in >> currentTerm >> votedFor;
+        if (ifstream in(dir / "raft_snapshot.txt"); in) {
+            string tag;
+            in >> tag >> snapshotIndex >> snapshotTerm;
+            in.ignore(numeric_limits<streamsize>::max(), '\n');
+            sm.load(in, {});
+        } else {
+            istringstream empty;
+            sm.load(empty, {});
+        }
+        ifstream in(dir / "raft_log.txt");
+        while (auto e = readEntry(in)) {
+            if (e->first <= snapshotIndex) continue;
+            if (e->first != lastIndex() + 1) break; // torn or stale tail
+            log.push_back(std::move(e->second));
+        }
+        localAuditSeq = sm.auditSeq();
+        commitIndex = lastApplied = snapshotIndex;
+        durableIndex = writtenIndex = lastIndex();
+    }
+
+public:
+    // ports lists every member on 127.0.0.1; self is this node's position in it.
+    RaftNode(fs::path directory, const vector<uint16_t>& ports, int selfIndex, RaftStateMachine machine,
+             string logFile, RaftOptions opts = {})
+        : dir(std::move(directory)), self(selfIndex), sm(std::move(machine)), options(opts), auditFile(std::move(logFile)) {
+        if (self < 0 || static_cast<size_t>(self) >= ports.size()) throw runtime_error("Raft node index out of range");
+        fs::create_directories(dir);
+        load();
+        rewriteLog(); // drop any torn tail before appending
+        peers = vector<Peer>(ports.size());
+        for (size_t i = 0; i < ports.size(); ++i) peers[i].port = ports[i];
+
+        listenFd = net::listenLoopback(ports[self]);
+        {
+            lock_guard lock(mtx);
+            resetElectionDeadline();
+        }
+        for (size_t i = 0; i < peers.size(); ++i)
+            if (static_cast<int>(i) != self) peers[i].thread = jthread([this, i](stop_token st) { peerLoop(st, i); });
+        acceptor = jthread([this](stop_token st) { acceptLoop(st); });
+        applier = jthread([this](stop_token st) { applyLoop(st); });
+        persister = jthread([this](stop_token st) { persist(st); });
+        ticker = jthread([this](stop_token st) { tick(st); });
+    }
+
+    RaftNode(const RaftNode&) = delete;
+    RaftNode& operator=(const RaftNode&) = delete;
+
+    ~RaftNode() {
+        ticker = {};
+        acceptor = {};
+        for (auto& p : peers) p.thread = {};
+        connections.clear();
+        persister = {};
+        applier = {};
+        ::close(listenFd);
+        lock_guard lock(mtx);
+        for (auto& [index, w] : waiters) w.result.set_value("node shut down");
+        waiters.clear();
+#ifdef BANK_HAVE_FSYNC
+        if (logFd >= 0) ::close(logFd);
+#endif
+    }
+
+    // Replicates a command and waits until it has been applied here. Returns the state
+    // machine's verdict; throws if this node is not the leader or the outcome is unknown.
+    optional<string> propose(AuditRecord cmd, chrono::milliseconds timeout = chrono::seconds(5)) {
+        future<optional<string>> done;
+        {
+            lock_guard lock(mtx);
+            if (role != Role::Leader)
+                throw runtime_error(leaderId >= 0 ? "Not the leader; node " + to_string(leaderId + 1) + " on port " +
+                                                        to_string(peers[leaderId].port) + " is"
+                                                  : "No leader elected yet");
+            cmd.timestamp = AuditLog::nowMillis();
+            appendLocal(std::move(cmd));
+            auto& w = waiters[lastIndex()];
+            w.term = currentTerm;
+            done = w.result.get_future();
+        }
+        if (done.wait_for(timeout) != future_status::ready)
+            throw runtime_error("Timed out waiting for the cluster; the command may still commit");
+        return done.get();
+    }
+
+    // Runs fn with the state machine quiescent, for local (possibly stale) reads.
+    void read(const function<void()>& fn) {
+        lock_guard lock(applyMtx);
+        fn();
+    }
+
+    [[nodiscard]] RaftStatus status() {
+        lock_guard lock(mtx);
+        RaftStatus s;
+        s.role = role == Role::Leader ? "leader" : role == Role::Candidate ? "candidate" : "follower";
+        s.term = currentTerm;
+        s.leader = leaderId;
+        s.lastIndex = lastIndex();
+        s.commitIndex = commitIndex;
+        s.lastApplied = lastApplied;
+        s.snapshotIndex = snapshotIndex;
+        return s;
+    }
+
+    [[nodiscard]] bool isLeader() {
+        lock_guard lock(mtx);
+        return role == Role::Leader;
+    }
+};
+#endif
+
+// ---------------- Checkpoint Policy ----------------
+// A checkpoint is due once the active log segment is large, or would take too long to replay.
+struct CheckpointPolicy {
+    uint64_t maxLogBytes = 8ull << 20;
+    double maxReplaySeconds = 2.0;
+    double replayRecordsPerSecond = 250'000; // refined from the last measured recovery
+    size_t retainedCheckpoints = 48;          // copies kept for point-in-time queries
+
+    [[nodiscard]] bool due(uint64_t logBytes, uint64_t logRecords) const {
+        return logBytes >= maxLogBytes || static_cast<double>(logRecords) / replayRecordsPerSecond >= maxReplaySeconds;
+    }
+};
+
+// ---------------- Durability Policy ----------------
+// Default durability per operation type; any call can override it.
+struct DurabilityPolicy {
+    Durability addAccount = Durability::Sync;
+    Durability deposit = Durability::Group;
+    Durability withdraw = Durability::Group;
+    Durability transfer = Durability::Group;
+    Durability updateName = Durability::Async;
+    Durability closeAccount = Durability::Sync;
+    Durability hold = Durability::Group;
+    Durability release = Durability::Async; // a lost release only leaves the hold to expire
+    Durability schedule = Durability::Sync; // standing orders set up or cancelled
+    double largeTransfer = 10'000; // transfers at or above this are always synchronous
+
+    // Sets one operation's class from "op:class", e.g. "updateName:memory".
+    bool set(string_view spec) {
+        auto colon = spec.find(':');
+        if (colon == string_view::npos) return false;
+        auto level = parseDurability(spec.substr(colon + 1));
+        if (!level) return false;
+        auto op = spec.substr(0, colon);
+        if (op == "addAccount") addAccount = *level;
+        else if (op == "deposit") deposit = *level;
+        else if (op == "withdraw") withdraw = *level;
+        else if (op == "transfer") transfer = *level;
+        else if (op == "updateName") updateName = *level;
+        else if (op == "closeAccount") closeAccount = *level;
+        else if (op == "hold") hold = *level;
+        else if (op == "release") release = *level;
+        else if (op == "schedule") schedule = *level;
+        else return false;
+        return true;
+    }
+
+    [[nodiscard]] Durability of(string_view op, double amount) const {
+        if (op == "addAccount") return addAccount;
+        if (op == "deposit") return deposit;
+        if (op == "withdraw") return withdraw;
+        if (op == "transfer") return amount >= largeTransfer ? Durability::Sync : transfer;
+        if (op == "updateName") return updateName;
+        if (op == "hold") return hold;
+        if (op == "release") return release;
+        if (op == "schedule" || op == "cancelOrder") return schedule;
+        return closeAccount;
+    }
+};
+
+// ---------------- Idempotency ----------------
+// Outcomes of recent requests that carried an idempotency key, so a client retrying after
+// a timeout gets the first attempt's result instead of a second posting. Bounded by age
+// and by count, oldest first; lookups and inserts are O(1).
+//
+// A key is stored in the text of the audit record its operation produced ("key <k>",
+// after any tag already there), so it is exactly as durable as the operation and the
+// cache can be rebuilt from the log. Only money movements take keys: their text carries
+// no account data, and the other operations fail or change nothing when repeated.
+class IdempotencyCache {
+public:
+    using Outcome = optional<string>; // error text; nullopt for success
+
+private:
+    struct Entry {
+        int64_t time{};
+        Outcome outcome;
+    };
+
+    int64_t windowMs;
+    size_t capacity;
+    unordered_map<string, Entry> entries;
+    deque<pair<int64_t, string>> order; // insertion order, for eviction
+
+public:
+    explicit IdempotencyCache(chrono::milliseconds window = chrono::hours(24), size_t maxKeys = 1'000'000)
+        : windowMs(window.count()), capacity(maxKeys) {}
+
+    static bool validKey(string_view key) {
+        return !key.empty() && key.size() <= 64 &&
+               ranges::all_of(key, [](char c) { return isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_' || c == '.' || c == ':'; });
+    }
+
+    static bool takesKey(string_view op) {
+        return op == "deposit" || op == "withdraw" || op == "transfer";
+    }
+
+    static string tag(const string& text, const string& key) { return text.empty() ? "key " + key : text + " key " + key; }
+
+    static optional<string> keyOf(const AuditRecord& r) {
+        if (!takesKey(r.op)) return nullopt;
+        // A key holds no spaces; an exchanged amount may follow it (AuditRecord::exchanged).
+        size_t at = 4;
+        if (!r.text.starts_with("key ")) {
+            at = r.text.find(" key ");
+            if (at == string::npos) return nullopt;
+            at += 5;
+        }
+        return r.text.substr(at, r.text.find(' ', at) - at);
+    }
+
+    void setWindow(chrono::milliseconds window) { windowMs = window.count(); }
+    [[nodiscard]] int64_t horizon(int64_t now) const { return now - windowMs; }
+    [[nodiscard]] size_t size() const { return entries.size(); }
+
+    void clear() {
+        entries.clear();
+        order.clear();
+    }
+
+    [[nodiscard]] optional<Outcome> find(const string& key, int64_t now) const {
+        auto it = entries.find(key);
+        if (it == entries.end() || it->second.time < horizon(now)) return nullopt;
+        return it->second.outcome;
+    }
+
+    // Keeps the first outcome seen for a key.
+    void remember(const string& key, int64_t time, Outcome outcome) {
+        if (!entries.try_emplace(key, Entry{time, std::move(outcome)}).second) return;
+        order.emplace_back(time, key);
+        while (!order.empty() && (order.size() > capacity || order.front().first < horizon(time))) {
+            entries.erase(order.front().second);
+            order.pop_front();
+        }
+    }
+};
+
+// ---------------- Timer Wheel ----------------
+// Hierarchical timing wheel: four levels of 64 slots, tickMs per slot at the bottom and
+// 64 times coarser at each level up (at one-second ticks: 64 s, 68 min, 3 days, 194
+// days). An entry goes into the lowest level whose current turn still reaches it and
+// moves down one level when that slot comes round, so scheduling is O(1) and an entry is
+// moved at most once per level before it fires. Nothing is ever scanned: advancing
+// looks only at the slots it passes. Entries are not removed when cancelled; the caller
+// ignores ids that no longer matter when they fire.
+template <typename Id>
+class TimerWheel {
+private:
+    static constexpr int levels = 4;
+    static constexpr int bits = 6;
+    static constexpr uint64_t mask = (uint64_t{1} << bits) - 1;
+
+    struct Entry {
+        Id id;
+        uint64_t tick;
+    };
+
+    int64_t tickMs;
+    uint64_t current; // next tick to process
+    array<array<vector<Entry>, mask + 1>, levels> slots;
+    vector<Entry> overflow; // beyond the top level's turn; re-placed once per top-level turn
+    size_t pending = 0;
+
+    void place(Entry e) {
+        e.tick = max(e.tick, current);
+        for (int level = 0; level < levels; ++level) {
+            const int above = bits * (level + 1);
+            if ((e.tick >> above) == (current >> above)) {
+                slots[level][(e.tick >> (bits * level)) & mask].push_back(e);
+                return;
+            }
+        }
+        overflow.push_back(e);
+    }
+
+    void replace(vector<Entry>& from) {
+        auto moving = std::exchange(from, {});
+        for (const auto& e : moving) place(e);
+    }
+
+public:
+    TimerWheel(chrono::milliseconds tick, int64_t nowMs)
+        : tickMs(tick.count()), current(static_cast<uint64_t>(max<int64_t>(0, nowMs) / tickMs)) {}
+
+    void schedule(Id id, int64_t dueMs) {
+        // Rounded up, so an entry never fires before its time.
+        place({id, static_cast<uint64_t>((max<int64_t>(0, dueMs) + tickMs - 1) / tickMs)});
+        ++pending;
+    }
+
+    // Calls fire(id) for every entry due at or before nowMs.
+    template <typename Fn>
+    void advance(int64_t nowMs, Fn&& fire) {
+        const auto last = static_cast<uint64_t>(max<int64_t>(0, nowMs) / tickMs);
+        for (; current <= last; ++current) {
+            if (!pending) {
+                current = last + 1;
+                break;
+            }
+            // Cascade from the top: an entry can fall through several levels at once.
+            if ((current & ((uint64_t{1} << (bits * levels)) - 1)) == 0) replace(overflow);
+            for (int level = levels - 1; level > 0; --level)
+                if ((current & ((uint64_t{1} << (bits * level)) - 1)) == 0)
+                    replace(slots[level][(current >> (bits * level)) & mask]);
+            auto due = std::exchange(slots[0][current & mask], {});
+            pending -= due.size();
+            for (const auto& e : due) fire(e.id);
+        }
+    }
+
+    [[nodiscard]] size_t size() const { return pending; }
+};
+
+// ---------------- Authorization Holds ----------------
+// Open holds by id, with their expiry on a timer wheel. A hold is the audit record
+// "hold" (amount, aux = id, text "until <ms>"); it ends with "release" (text "expired"
+// when it timed out) or is captured by a withdraw tagged "hold <id>". A capture is an
+// ordinary withdrawal to everything that replays the ledger, which needs no hold state.
+class HoldBook {
+public:
+    struct Hold {
+        int account{};
+        double amount{};
+        int64_t expiresAt{};
+    };
+
+    static constexpr chrono::milliseconds maxLifetime = chrono::days(30);
+
+private:
+    unordered_map<uint64_t, Hold> holds;
+    TimerWheel<uint64_t> expiry{chrono::seconds(1), AuditLog::nowMillis()};
+    uint64_t nextId = 1;
+
+public:
+    static AuditRecord holdCommand(int accountNum, double amount, uint64_t id, int64_t until) {
+        AuditRecord cmd;
+        cmd.op = "hold";
+        cmd.account = accountNum;
+        cmd.amount = amount;
+        cmd.aux = id;
+        cmd.text = "until " + to_string(until);
+        return cmd;
+    }
+
+    static string captureText(uint64_t id) { return "hold " + to_string(id); }
+
+    static optional<int64_t> untilOf(const AuditRecord& r) {
+        int64_t until{};
+        if (r.op != "hold" || !r.text.starts_with("until ")) return nullopt;
+        if (from_chars(r.text.data() + 6, r.text.data() + r.text.size(), until).ec != errc{}) return nullopt;
+        return until;
+    }
+
+    // The hold a withdraw captures, if it is a capture.
+    static optional<uint64_t> capturedBy(const AuditRecord& r) {
+        uint64_t id{};
+        if (r.op != "withdraw" || !r.text.starts_with("hold ")) return nullopt;
+        if (from_chars(r.text.data() + 5, r.text.data() + r.text.size(), id).ec != errc{}) return nullopt;
+        return id;
+    }
+
+    uint64_t newId() { return nextId++; }
+    void skipPast(uint64_t id) { nextId = max(nextId, id + 1); }
+
+    [[nodiscard]] const Hold* find(uint64_t id) const {
+        auto it = holds.find(id);
+        return it == holds.end() ? nullptr : &it->second;
+    }
+
+    bool add(uint64_t id, const Hold& hold) {
+        if (!holds.try_emplace(id, hold).second) return false;
+        skipPast(id);
+        expiry.schedule(id, hold.expiresAt);
+        return true;
+    }
+
+    void erase(uint64_t id) { holds.erase(id); }
+
+    void clear() { holds.clear(); }
+
+    // Holds whose time has passed; wheel entries of holds already settled are dropped.
+    vector<uint64_t> due(int64_t now) {
+        vector<uint64_t> out;
+        expiry.advance(now, [&](uint64_t id) {
+            if (auto* h = find(id); h && h->expiresAt <= now) out.push_back(id);
+        });
+        return out;
+    }
+
+    [[nodiscard]] size_t size() const { return holds.size(); }
+};
+
+// ---------------- Calendar Queue ----------------
+// Timed entries filed like a desk calendar: `days` buckets of `width` make a year and an
+// entry goes into the bucket of its day whatever its year, each bucket a min-heap by due
+// time. Serving walks the days from the last one served up to now (every day once at
+// most) and pops only the due entries at the top of each, so a tick touches the entries
+// due then plus one look per day it passes. Entries due in later years wait in place.
+template <typename Id>
+class CalendarQueue {
+private:
+    struct Entry {
+        int64_t due;
+        Id id;
+        bool operator>(const Entry& other) const { return due > other.due; }
+    };
+
+    int64_t width;
+    vector<vector<Entry>> days;
+    int64_t served; // everything due before this has been popped
+    size_t count = 0;
+
+    vector<Entry>& dayOf(int64_t time) { return days[static_cast<size_t>(time / width) % days.size()]; }
+
+public:
+    CalendarQueue(chrono::milliseconds dayWidth, size_t daysPerYear, int64_t now)
+        : width(dayWidth.count()), days(daysPerYear), served(max<int64_t>(0, now)) {}
+
+    void push(Id id, int64_t due) {
+        // Already-past entries are filed under the current day so the next pop sees them.
+        auto& day = dayOf(max(due, served));
+        day.push_back({due, id});
+        ranges::push_heap(day, greater<>{});
+        ++count;
+    }
+
+    // Calls fn(id, due) for every entry due at or before now.
+    template <typename Fn>
+    void popDue(int64_t now, Fn&& fn) {
+        if (now < served) return;
+        const int64_t first = served / width, last = now / width;
+        const int64_t span = min<int64_t>(last - first + 1, static_cast<int64_t>(days.size()));
+        for (int64_t d = 0; d < span && count; ++d) {
+            auto& day = days[static_cast<size_t>(first + d) % days.size()];
+            while (!day.empty() && day.front().due <= now) {
+                ranges::pop_heap(day, greater<>{});
+                auto e = day.back();
+                day.pop_back();
+                --count;
+                fn(e.id, e.due);
+            }
+        }
+        served = now + 1;
+    }
+
+    [[nodiscard]] size_t size() const { return count; }
+};
+
+// ---------------- Standing Orders ----------------
+// Recurring or one-off transfers run by the bank itself. An order is the audit record
+// "schedule" (from, to, amount, aux = id, text "<period> <first due ms>") and ends with
+// "cancelOrder" or, for a one-off, its only run. Each run is an ordinary transfer tagged
+// "order <id> <n>" for the n-th occurrence, and an occurrence given up after failing is a
+// "skipOrder" record with the same tag, so the ledger needs nothing else and the log
+// tells exactly which occurrences were settled. Occurrences fall on the first due time
+// advanced by whole periods in local time: the same time of day, and for monthly orders
+// the same day of the month, or the month's last day when it is shorter.
+class StandingOrders {
+public:
+    enum class Period { Once, Daily, Weekly, Monthly };
+
+    struct Order {
+        int from{};
+        int to{};
+        double amount{};
+        Period period{};
+        int64_t firstDue{};
+        uint64_t runs{};      // occurrences settled (paid, or skipped after failing)
+        int64_t wakeAt{};     // next look: the next occurrence, or a retry after a failure
+        string lastError;
+    };
+
+    static constexpr chrono::minutes retryDelay{60};
+
+private:
+    map<uint64_t, Order> orders;
+    CalendarQueue<uint64_t> queue{chrono::minutes(1), 24 * 60, AuditLog::nowMillis()};
+    uint64_t nextId = 1;
+
+public:
+    static optional<Period> parsePeriod(string_view name) {
+        if (name == "once") return Period::Once;
+        if (name == "daily") return Period::Daily;
+        if (name == "weekly") return Period::Weekly;
+        if (name == "monthly") return Period::Monthly;
+        return nullopt;
+    }
+
+    static string_view periodName(Period period) {
+        static constexpr array<string_view, 4> names{"once", "daily", "weekly", "monthly"};
+        return names[static_cast<size_t>(period)];
+    }
+
+    static int64_t occurrence(const Order& order, uint64_t n) {
+        if (n == 0 || order.period == Period::Once) return order.firstDue;
+        const time_t secs = static_cast<time_t>(order.firstDue / 1000);
+        tm parts = *localtime(&secs);
+        if (order.period == Period::Daily) {
+            parts.tm_mday += static_cast<int>(n);
+        } else if (order.period == Period::Weekly) {
+            parts.tm_mday += 7 * static_cast<int>(n);
+        } else {
+            const int day = parts.tm_mday;
+            parts.tm_mday = 1;
+            parts.tm_mon += static_cast<int>(n);
+            parts.tm_isdst = -1;
+            mktime(&parts); // normalises the month and year
+            chrono::year_month_day_last last{chrono::year(parts.tm_year + 1900) / chrono::month(parts.tm_mon + 1) / chrono::last};
+            parts.tm_mday = min(day, static_cast<int>(static_cast<unsigned>(last.day())));
+        }
+        parts.tm_isdst = -1;
+        return static_cast<int64_t>(mktime(&parts)) * 1000 + order.firstDue % 1000;
+    }
+
+    static int64_t nextDue(const Order& order) { return occurrence(order, order.runs); }
+
+    static AuditRecord scheduleCommand(uint64_t id, int from, int to, double amount, Period period, int64_t firstDue) {
+        AuditRecord cmd;
+        cmd.op = "schedule";
+        cmd.account = from;
+        cmd.other = to;
+        cmd.amount = amount;
+        cmd.aux = id;
+        cmd.text = string(periodName(period)) + ' ' + to_string(firstDue);
+        return cmd;
+    }
+
+    static optional<Order> orderOf(const AuditRecord& r) {
+        if (r.op != "schedule") return nullopt;
+        istringstream in(r.text);
+        string period;
+        Order order;
+        if (!(in >> period >> order.firstDue)) return nullopt;
+        auto p = parsePeriod(period);
+        if (!p) return nullopt;
+        order.from = r.account;
+        order.to = r.other;
+        order.amount = r.amount;
+        order.period = *p;
+        return order;
+    }
+
+    static string runText(uint64_t id, uint64_t n) { return "order " + to_string(id) + ' ' + to_string(n); }
+
+    static AuditRecord skipCommand(uint64_t id, const Order& order, uint64_t n) {
+        AuditRecord cmd;
+        cmd.op = "skipOrder";
+        cmd.account = order.from;
+        cmd.other = order.to;
+        cmd.amount = order.amount;
+        cmd.aux = id;
+        cmd.text = runText(id, n);
+        return cmd;
+    }
+
+    // The order and occurrence a record settled, if it was a standing order's run (a
+    // transfer) or a skipped occurrence.
+    static optional<pair<uint64_t, uint64_t>> runOf(const AuditRecord& r) {
+        if ((r.op != "transfer" && r.op != "skipOrder") || !r.text.starts_with("order ")) return nullopt;
+        istringstream in(r.text.substr(6));
+        uint64_t id{}, n{};
+        if (!(in >> id >> n)) return nullopt;
+        return pair{id, n};
+    }
+
+    uint64_t newId() { return nextId++; }
+    void skipPast(uint64_t id) { nextId = max(nextId, id + 1); }
+
+    Order* find(uint64_t id) {
+        auto it = orders.find(id);
+        return it == orders.end() ? nullptr : &it->second;
+    }
+
+    bool add(uint64_t id, Order order) {
+        order.wakeAt = nextDue(order);
+        auto [it, added] = orders.try_emplace(id, std::move(order));
+        if (!added) return false;
+        skipPast(id);
+        queue.push(id, it->second.wakeAt);
+        return true;
+    }
+
+    void erase(uint64_t id) { orders.erase(id); }
+
+    void clear() { orders.clear(); }
+
+    // Records occurrence n as settled and files the order under its next occurrence;
+    // a one-off order is finished.
+    void settle(uint64_t id, uint64_t n) {
+        auto* order = find(id);
+        if (!order || n < order->runs) return;
+        order->runs = n + 1;
+        if (order->period == Period::Once) return erase(id);
+        wake(id, nextDue(*order));
+    }
+
+    void wake(uint64_t id, int64_t at) {
+        if (auto* order = find(id)) {
+            order->wakeAt = at;
+            queue.push(id, at);
+        }
+    }
+
+    // Orders due now, in id order. Calendar entries left by cancelled orders or by an
+    // earlier wake time are dropped here.
+    vector<uint64_t> due(int64_t now) {
+        vector<uint64_t> out;
+        queue.popDue(now, [&](uint64_t id, int64_t at) {
+            if (auto* order = find(id); order && order->wakeAt == at) out.push_back(id);
+        });
+        ranges::sort(out);
+        out.erase(ranges::unique(out).begin(), out.end());
+        return out;
+    }
+
+    [[nodiscard]] const map<uint64_t, Order>& all() const { return orders; }
+
+    // "#seq N", the next id, then one line per order; the log after N brings it up to date.
+    void save(ostream& out, uint64_t seq) const {
+        out << "#seq " << seq << "\nnext " << nextId << '\n' << setprecision(17);
+        for (const auto& [id, o] : orders)
+            out << id << ' ' << o.from << ' ' << o.to << ' ' << o.amount << ' ' << periodName(o.period) << ' '
+                << o.firstDue << ' ' << o.runs << '\n';
+    }
+
+    // Returns the sequence number the file reflects.
+    uint64_t load(istream& in) {
+        auto header = readSnapshotHeader(in);
+        uint64_t id{};
+        Order o;
+        string period;
+        // The next id, so that a cancelled order's is not reused; older files lack it.
+        if (in >> ws; in.peek() == 'n') {
+            if (!(in >> period >> id) || period != "next") throw runtime_error("Malformed standing orders file");
+            nextId = max(nextId, id);
+        }
+        while (in >> id >> o.from >> o.to >> o.amount >> period >> o.firstDue >> o.runs)
+            if (auto p = parsePeriod(period)) {
+                o.period = *p;
+                add(id, o);
+            }
+        return header.seq.value_or(0);
+    }
+};
+
+// ---------------- Interest Accrual ----------------
+// Products carry an annual rate in basis points, and an account on a product earns it on
+// a positive balance, accrued daily at actual/365. The sum is exact in integer cents: a
+// day pays floor((cents * bp + carry) / 3,650,000) cents and the remainder is the
+// account's carry into the next day, so no fraction of a cent is lost or made up.
+// accrue() runs over columns of cents, rates and carries, four accounts per AVX2
+// instruction where the CPU has it, on every core.
+class InterestBook {
+public:
+    static constexpr int64_t divisor = 10'000 * 365; // basis points * days a year
+    static constexpr int32_t maxRateBp = 10'000;
+    static constexpr double maxCreditLine = 100'000'000;
+
+    struct Product {
+        string name;
+        int32_t rateBp;
+        AccountKind kind = AccountKind::Standard;
+    };
+
+    struct Terms {
+        uint32_t product;
+        int64_t carry; // earned but not yet paid, in 1/divisor cent
+    };
+
+    int64_t lastDay = 0; // local day (days since 1970-01-01) accrued last
+
+    static void accrueOne(int64_t cents, int32_t rateBp, int64_t& carry, int64_t& interest) {
+        cents = max<int64_t>(cents, 0);
+        const int64_t part = cents % divisor * rateBp + carry; // split so no product overflows
+        interest = cents / divisor * rateBp + part / divisor;
+        carry = part % divisor;
+    }
+
+    // One day's interest for every row: writes interest[i] and advances carry[i].
+    static void accrue(span<const int64_t> cents, span<const int32_t> rateBp, span<int64_t> carry, span<int64_t> interest) {
+        parallelFor(cents.size(), 1 << 16, [&](size_t begin, size_t end) {
+            accrueRange(cents.data(), rateBp.data(), carry.data(), interest.data(), begin, end);
+        });
+    }
+
+    static void accrueRange(const int64_t* cents, const int32_t* rateBp, int64_t* carry, int64_t* interest, size_t begin,
+                            size_t end) {
+#ifdef BANK_HAVE_AVX2
+        if (useAvx2()) return accrueAvx2(cents, rateBp, carry, interest, begin, end);
+#endif
+        for (size_t i = begin; i < end; ++i) accrueOne(cents[i], rateBp[i], carry[i], interest[i]);
+    }
+
+    static int64_t dayOf(int64_t ms) {
+        const auto t = static_cast<time_t>(ms / 1000);
+        const tm local = *localtime(&t);
+        const chrono::year_month_day date{chrono::year(local.tm_year + 1900), chrono::month(local.tm_mon + 1),
+                                          chrono::day(local.tm_mday)};
+        return chrono::sys_days(date).time_since_epoch().count();
+    }
+
+    static string dayName(int64_t day) {
+        const chrono::year_month_day date{chrono::sys_days(chrono::days(day))};
+        ostringstream out;
+        out << int(date.year()) << '-' << setfill('0') << setw(2) << unsigned(date.month()) << '-' << setw(2)
+            << unsigned(date.day());
+        return out.str();
+    }
+
+    // "product": aux = id, amount = rate in basis points, other = AccountKind, text = name.
+    static AuditRecord productCommand(uint32_t id, const string& name, int32_t rateBp, AccountKind kind) {
+        AuditRecord cmd;
+        cmd.op = "product";
+        cmd.aux = id;
+        cmd.amount = rateBp;
+        cmd.other = static_cast<int>(kind);
+        cmd.text = name;
+        return cmd;
+    }
+
+    static optional<Product> productOf(const AuditRecord& r) {
+        if (r.op != "product" || r.other < 0 || r.other > static_cast<int>(AccountKind::Loan)) return nullopt;
+        return Product{r.text, static_cast<int32_t>(r.amount), static_cast<AccountKind>(r.other)};
+    }
+
+    // "setProduct": account, aux = product id.
+    static AuditRecord assignCommand(int account, uint32_t product) {
+        AuditRecord cmd;
+        cmd.op = "setProduct";
+        cmd.account = account;
+        cmd.aux = product;
+        return cmd;
+    }
+
+    // "creditLimit": account, or 0 and aux = product id; amount = the credit line, and
+    // other = 0 to go back to the default of the product, then of the kind.
+    static AuditRecord creditLimitCommand(int account, uint32_t product, optional<double> line) {
+        AuditRecord cmd;
+        cmd.op = "creditLimit";
+        cmd.account = account;
+        cmd.aux = account ? 0 : product;
+        cmd.amount = line.value_or(0);
+        cmd.other = line.has_value();
+        return cmd;
+    }
+
+    static optional<double> creditLineOf(const AuditRecord& r) { return r.other ? optional(r.amount) : nullopt; }
+
+    static string postingText(int64_t day) { return "interest " + dayName(day); }
+
+    // The day an interest posting paid or charged, if r is one.
+    static optional<int64_t> postingDayOf(const AuditRecord& r) {
+        if ((r.op != "deposit" && r.op != "withdraw") || !r.text.starts_with("interest ")) return nullopt;
+        int y{};
+        unsigned m{}, d{};
+        char dash1{}, dash2{};
+        istringstream in(r.text.substr(9));
+        if (!(in >> y >> dash1 >> m >> dash2 >> d) || dash1 != '-' || dash2 != '-') return nullopt;
+        const chrono::year_month_day date{chrono::year(y), chrono::month(m), chrono::day(d)};
+        if (!date.ok()) return nullopt;
+        return chrono::sys_days(date).time_since_epoch().count();
+    }
+
+    [[nodiscard]] const Product* product(uint32_t id) const {
+        auto it = products.find(id);
+        return it == products.end() ? nullptr : &it->second;
+    }
+
+    [[nodiscard]] uint32_t productOf(int account) const {
+        auto it = terms.find(account);
+        return it == terms.end() ? 0 : it->second.product;
+    }
+
+    [[nodiscard]] AccountKind kindOf(int account) const {
+        const auto* p = product(productOf(account));
+        return p ? p->kind : AccountKind::Standard;
+    }
+
+    // An account's own credit line, else its product's; nullopt leaves the kind's default.
+    [[nodiscard]] optional<double> creditLine(int account) const { return creditLine(account, productOf(account)); }
+
+    // The credit line the account has, or would have, on product.
+    [[nodiscard]] optional<double> creditLine(int account, uint32_t product) const {
+        if (auto it = accountLines.find(account); it != accountLines.end()) return it->second;
+        return productCreditLine(product);
+    }
+
+    [[nodiscard]] optional<double> productCreditLine(uint32_t id) const {
+        auto it = productLines.find(id);
+        return it == productLines.end() ? nullopt : optional(it->second);
+    }
+
+    void setCreditLine(int account, uint32_t product, optional<double> line) {
+        if (account && line) accountLines.insert_or_assign(account, *line);
+        else if (account) accountLines.erase(account);
+        else if (line) productLines.insert_or_assign(product, *line);
+        else productLines.erase(product);
+    }
+
+    [[nodiscard]] Terms* termsOf(int account) {
+        auto it = terms.find(account);
+        return it == terms.end() ? nullptr : &it->second;
+    }
+
+    [[nodiscard]] const map<uint32_t, Product>& allProducts() const { return products; }
+    [[nodiscard]] size_t accountCount() const { return terms.size(); }
+
+    void define(uint32_t id, Product p) { products.insert_or_assign(id, std::move(p)); }
+
+    // A change of product keeps what the account has already earned.
+    void assign(int account, uint32_t product) { terms.try_emplace(account, Terms{product, 0}).first->second.product = product; }
+
+    void drop(int account) {
+        terms.erase(account);
+        accountLines.erase(account);
+    }
+
+    void clear(int64_t day) {
+        products.clear();
+        terms.clear();
+        productLines.clear();
+        accountLines.clear();
+        lastDay = day;
+    }
+
+    void save(ostream& out, uint64_t seq) const {
+        out << "#seq " << seq << "\nday " << lastDay << '\n';
+        for (const auto& [id, p] : products)
+            out << "P " << id << ' ' << p.rateBp << ' ' << accountKindName(p.kind) << ' ' << quoted(p.name) << '\n';
+        for (const auto& [account, t] : terms) out << "A " << account << ' ' << t.product << ' ' << t.carry << '\n';
+        out << setprecision(17);
+        for (const auto& [id, line] : productLines) out << "LP " << id << ' ' << line << '\n';
+        for (const auto& [account, line] : accountLines) out << "LA " << account << ' ' << line << '\n';
+    }
+
+    // Returns the sequence number the file reflects.
+    uint64_t load(istream& in) {
+        auto header = readSnapshotHeader(in);
+        string tag;
+        if (!(in >> tag >> lastDay) || tag != "day") throw runtime_error("Malformed interest file");
+        while (in >> tag) {
+            if (tag == "P") {
+                uint32_t id{};
+                Product p;
+                string kind;
+                if (!(in >> id >> p.rateBp >> kind >> quoted(p.name)) || !parseAccountKind(kind))
+                    throw runtime_error("Malformed interest file");
+                p.kind = *parseAccountKind(kind);
+                define(id, std::move(p));
+            } else if (tag == "A") {
+                int account{};
+                Terms t{};
+                if (!(in >> account >> t.product >> t.carry)) break;
+                if (t.carry < 0 || t.carry >= divisor) throw runtime_error("Malformed interest file");
+                terms.insert_or_assign(account, t);
+            } else if (tag == "LP" || tag == "LA") {
+                int64_t key{};
+                double line{};
+                if (!(in >> key >> line) || line < 0) throw runtime_error("Malformed interest file");
+                if (tag == "LP") productLines.insert_or_assign(static_cast<uint32_t>(key), line);
+                else accountLines.insert_or_assign(static_cast<int>(key), line);
+            }
+        }
+        return header.seq.value_or(0);
+    }
+
+private:
+    map<uint32_t, Product> products;
+    unordered_map<int, Terms> terms;
+    map<uint32_t, double> productLines; // credit lines set for a product's accounts
+    unordered_map<int, double> accountLines; // and for single accounts, which take precedence
+
+#ifdef BANK_HAVE_AVX2
+    static bool useAvx2() {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+
+    // Integers below 2^52 move to and from doubles exactly by way of the 2^52 exponent.
+    __attribute__((target("avx2"))) static __m256d toDouble(__m256i x) {
+        const __m256i bits = _mm256_set1_epi64x(0x4330000000000000);
+        return _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(x, bits)), _mm256_set1_pd(0x1p52));
+    }
+
+    __attribute__((target("avx2"))) static __m256i toInt(__m256d x) {
+        const __m256i bits = _mm256_set1_epi64x(0x4330000000000000);
+        return _mm256_xor_si256(_mm256_castpd_si256(_mm256_add_pd(x, _mm256_set1_pd(0x1p52))), bits);
+    }
+
+    // The same sum in doubles: cents * bp + carry stays an integer below 2^53, so it is
+    // exact, and the quotient from the reciprocal is off by at most one, which the
+    // remainder corrects. Blocks with a balance too large for that use accrueOne.
+    __attribute__((target("avx2")))
+    static void accrueAvx2(const int64_t* cents, const int32_t* rateBp, int64_t* carry, int64_t* interest, size_t begin,
+                           size_t end) {
+        constexpr int64_t exactBelow = ((int64_t{1} << 53) - divisor) / maxRateBp;
+        const __m256i zero = _mm256_setzero_si256(), limit = _mm256_set1_epi64x(exactBelow);
+        const __m256d d = _mm256_set1_pd(double(divisor)), inverse = _mm256_set1_pd(1.0 / divisor);
+        const __m256d one = _mm256_set1_pd(1.0), none = _mm256_setzero_pd();
+        size_t i = begin;
+        for (; i + 4 <= end; i += 4) {
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cents + i));
+            c = _mm256_andnot_si256(_mm256_cmpgt_epi64(zero, c), c);
+            if (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(c, limit)))) {
+                for (size_t j = i; j < i + 4; ++j) accrueOne(cents[j], rateBp[j], carry[j], interest[j]);
+                continue;
+            }
+            const __m256d rate = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rateBp + i)));
+            const __m256d owed = toDouble(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(carry + i)));
+            const __m256d x = _mm256_add_pd(_mm256_mul_pd(toDouble(c), rate), owed);
+            __m256d q = _mm256_floor_pd(_mm256_mul_pd(x, inverse));
+            __m256d r = _mm256_sub_pd(x, _mm256_mul_pd(q, d));
+            const __m256d under = _mm256_cmp_pd(r, none, _CMP_LT_OQ);
+            q = _mm256_sub_pd(q, _mm256_and_pd(under, one));
+            r = _mm256_add_pd(r, _mm256_and_pd(under, d));
+            const __m256d over = _mm256_cmp_pd(r, d, _CMP_GE_OQ);
+            q = _mm256_add_pd(q, _mm256_and_pd(over, one));
+            r = _mm256_sub_pd(r, _mm256_and_pd(over, d));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(interest + i), toInt(q));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(carry + i), toInt(r));
+        }
+        for (; i < end; ++i) accrueOne(cents[i], rateBp[i], carry[i], interest[i]);
+    }
+#endif
+};
+
+// ---------------- Fee Assessment ----------------
+// Monthly fees from a rule table, one rule a line: "<kind> <product> <threshold> <fee>".
+// minimum-balance charges the fee when the balance is below the threshold,
+// per-transaction charges it for each transaction past the threshold in the period, and
+// dormancy charges it when the account has had no activity for threshold days. Product
+// 0 applies a rule to every account. Activity is read back from the audit log since the
+// last run: money movements count as transactions and any customer record as activity,
+// but the bank's own postings (interest, fees) do not. A fee is charged only as far as
+// the available balance goes; the rest is reported as not collected.
+class FeeBook {
+public:
+    enum class Kind { MinimumBalance, PerTransaction, Dormancy };
+
+    struct Rule {
+        Kind kind;
+        uint32_t product; // 0: every account
+        double threshold;
+        double fee;
+    };
+
+    struct Activity {
+        int64_t lastActive{};
+        uint32_t transactions{}; // since the last run
+    };
+
+    struct Charge {
+        size_t index; // into the book
+        size_t rule;
+        double amount;
+    };
+
+    struct Totals {
+        vector<Rule> rules;
+        vector<size_t> count; // per rule
+        vector<double> charged;
+        double uncollected = 0;
+
+        void add(const Totals& other) {
+            for (size_t k = 0; k < count.size(); ++k) {
+                count[k] += other.count[k];
+                charged[k] += other.charged[k];
+            }
+            uncollected += other.uncollected;
+        }
+    };
+
+    uint64_t scannedSeq = 0; // activity is folded in up to this audit record
+    int64_t lastMonth = 0;   // local months since 1970 of the last run
+    int64_t since = 0;       // when tracking started: the last activity of accounts not seen since
+
+    static optional<Kind> parseKind(string_view text) {
+        if (text == "minimum-balance") return Kind::MinimumBalance;
+        if (text == "per-transaction") return Kind::PerTransaction;
+        if (text == "dormancy") return Kind::Dormancy;
+        return nullopt;
+    }
+
+    static string_view kindName(Kind kind) {
+        switch (kind) {
+            case Kind::MinimumBalance: return "minimum-balance";
+            case Kind::PerTransaction: return "per-transaction";
+            case Kind::Dormancy: return "dormancy";
+        }
+        return "?";
+    }
+
+    // Lines starting with '#' are comments.
+    static vector<Rule> loadRules(istream& in) {
+        vector<Rule> rules;
+        string line;
+        while (getline(in, line)) {
+            if (line.empty() || line.starts_with('#')) continue;
+            istringstream fields(line);
+            string kind;
+            Rule r{};
+            auto k = fields >> kind >> r.product >> r.threshold >> r.fee ? parseKind(kind) : nullopt;
+            if (!k || r.threshold < 0 || r.fee <= 0) throw runtime_error("Malformed fee rule: " + line);
+            r.kind = *k;
+            rules.push_back(r);
+        }
+        return rules;
+    }
+
+    static int64_t monthOf(int64_t ms) {
+        const auto t = static_cast<time_t>(ms / 1000);
+        const tm local = *localtime(&t);
+        return int64_t(local.tm_year - 70) * 12 + local.tm_mon;
+    }
+
+    static bool isBankPosting(const AuditRecord& r) { return r.text.starts_with("fee ") || r.text.starts_with("interest "); }
+
+    static string postingText(Kind kind) { return "fee " + string(kindName(kind)); }
+
+    static void observe(unordered_map<int, Activity>& activity, const AuditRecord& r) {
+        if (r.op == "closeAccount") return (void)activity.erase(r.account);
+        if (r.op == "addAccount") return (void)(activity[r.account] = {r.timestamp, 0});
+        if (!r.account || isBankPosting(r) || r.op == "skipOrder") return;
+        const bool moves = r.op == "deposit" || r.op == "withdraw" || r.op == "transfer";
+        for (int num : {r.account, r.op == "transfer" ? r.other : 0}) {
+            if (!num) continue;
+            auto& a = activity[num];
+            a.lastActive = max(a.lastActive, r.timestamp);
+            a.transactions += moves;
+        }
+    }
+
+    [[nodiscard]] const unordered_map<int, Activity>& allActivity() const { return activity; }
+
+    void replace(unordered_map<int, Activity> updated) { activity = std::move(updated); }
+
+    // What fees may take from an account: its own funds, less holds. A fee never draws on
+    // an overdraft or a loan's credit line, so it cannot take a balance below zero.
+    static double collectable(const BankAccount& acc) { return max(0.0, acc.getBalance() - acc.getHeld()); }
+
+    // The fees one account owes under the rules, as far as collectable() goes.
+    void assess(const vector<Rule>& rules, const BankAccount& acc, uint32_t product, const Activity& a, int64_t now,
+                size_t index, vector<Charge>& charges, Totals& totals) const {
+        double available = collectable(acc);
+        for (size_t k = 0; k < rules.size(); ++k) {
+            const auto& r = rules[k];
+            if (r.product && r.product != product) continue;
+            double owed = 0;
+            switch (r.kind) {
+                case Kind::MinimumBalance:
+                    if (acc.getBalance() < r.threshold) owed = r.fee;
+                    break;
+                case Kind::PerTransaction:
+                    if (a.transactions > r.threshold) owed = (a.transactions - floor(r.threshold)) * r.fee;
+                    break;
+                case Kind::Dormancy:
+                    if (now - a.lastActive >= static_cast<int64_t>(r.threshold * 86'400'000)) owed = r.fee;
+                    break;
+            }
+            owed = round(owed * 100) / 100;
+            if (owed <= 0) continue;
+            const double taken = min(owed, floor(available * 100) / 100);
+            ++totals.count[k];
+            totals.charged[k] += taken;
+            totals.uncollected += owed - taken;
+            available -= taken;
+            if (taken > 0) charges.push_back({index, k, taken});
+        }
+    }
+
+    void save(ostream& out) const {
+        out << "#seq " << scannedSeq << "\nmonth " << lastMonth << "\nsince " << since << '\n';
+        for (const auto& [account, a] : activity) out << "A " << account << ' ' << a.lastActive << '\n';
+    }
+
+    // Returns the sequence number the file reflects.
+    uint64_t load(istream& in) {
+        scannedSeq = readSnapshotHeader(in).seq.value_or(0);
+        string tag;
+        if (!(in >> tag >> lastMonth) || tag != "month" || !(in >> tag >> since) || tag != "since")
+            throw runtime_error("Malformed fee file");
+        activity.clear();
+        int account{};
+        int64_t lastActive{};
+        while (in >> tag >> account >> lastActive) activity[account] = {lastActive, 0};
+        return scannedSeq;
+    }
+
+    void clear(int64_t now) {
+        activity.clear();
+        scannedSeq = 0;
+        lastMonth = monthOf(now);
+        since = now;
+    }
+
+private:
+    unordered_map<int, Activity> activity;
+};
+
+// ---------------- Currencies ----------------
+// A balance is an amount of its account's currency. The base currency (--base-currency,
+// USD unless set) is what balances were before accounts had currencies, and what an
+// account created without one holds. Codes are three letters packed into the low 24
+// bits of an int, so an addAccount record carries one in its other field; 0 stands for
+// the base currency.
+inline optional<int> packCurrency(string_view code) {
+    if (code.size() != 3 || !ranges::all_of(code, [](char c) { return c >= 'A' && c <= 'Z'; })) return nullopt;
+    return code[0] << 16 | code[1] << 8 | code[2];
+}
+
+inline string currencyCode(int packed) {
+    return {char(packed >> 16 & 0xFF), char(packed >> 8 & 0xFF), char(packed & 0xFF)};
+}
+
+// Exchange rates into the base currency, read from fx_rates.txt ("<code> <rate>" a line,
+// rate = base units per unit) and published RCU-style. Readers take the current table
+// with one atomic load and keep their reference for as long as they use it; a reload
+// builds the next table beside it and swaps it in with one atomic store. A transfer
+// never waits for a reload and never sees half of one, and an old table is freed when
+// its last reader lets go. Every currency keeps its index (id) in all later tables, so
+// an account resolves its currency to an id once; a reload that leaves a currency out
+// keeps its last rate.
+class FxRates {
+public:
+    struct Table {
+        uint64_t version = 0;
+        vector<int> codes;     // by id; id 0 is the base currency
+        vector<double> toBase; // by id; toBase[0] = 1, and NaN until a currency has a rate
+
+        [[nodiscard]] optional<uint16_t> idOf(int code) const {
+            auto it = ranges::find(codes, code);
+            return it == codes.end() ? nullopt : optional(static_cast<uint16_t>(it - codes.begin()));
+        }
+
+        [[nodiscard]] bool hasRate(uint16_t id) const { return id < toBase.size() && !isnan(toBase[id]); }
+    };
+
+    static constexpr uint16_t maxCurrencies = 1024;
+
+    FxRates() { setBase(*packCurrency("USD")); }
+
+    // Starts over with only the base currency; before any account has resolved an id.
+    void setBase(int code) {
+        auto first = make_shared<Table>();
+        first->codes = {code};
+        first->toBase = {1.0};
+        table.store(std::move(first), memory_order_release);
+    }
+
+    [[nodiscard]] shared_ptr<const Table> current() const { return table.load(memory_order_acquire); }
+
+    [[nodiscard]] int base() const { return current()->codes[0]; }
+
+    [[nodiscard]] string name(uint16_t id) const {
+        auto t = current();
+        return id < t->codes.size() ? currencyCode(t->codes[id]) : "?";
+    }
+
+    // Publishes rates (code, base units per unit) as the next table; returns its version.
+    uint64_t publish(const vector<pair<int, double>>& rates) {
+        lock_guard lock(writer); // writers take turns; readers never wait for them
+        auto next = make_shared<Table>(*current());
+        ++next->version;
+        for (auto [code, rate] : rates) {
+            if (code == next->codes[0]) continue;
+            if (auto id = next->idOf(code)) next->toBase[*id] = rate;
+            else add(*next, code, rate);
+        }
+        table.store(std::move(next), memory_order_release);
+        return current()->version;
+    }
+
+    // The id of code, registered without a rate if it is new (an account's currency that
+    // fx_rates.txt does not list).
+    uint16_t idFor(int code) {
+        if (!code) return 0;
+        if (auto id = current()->idOf(code)) return *id;
+        lock_guard lock(writer);
+        auto next = make_shared<Table>(*current());
+        if (auto id = next->idOf(code)) return *id;
+        ++next->version;
+        const auto id = add(*next, code, numeric_limits<double>::quiet_NaN());
+        table.store(std::move(next), memory_order_release);
+        return id;
+    }
+
+    static vector<pair<int, double>> parse(istream& in) {
+        vector<pair<int, double>> rates;
+        string line;
+        while (getline(in, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            istringstream fields(line);
+            string code;
+            double rate{};
+            auto packed = fields >> code >> rate ? packCurrency(code) : nullopt;
+            if (!packed || !(rate > 0) || !isfinite(rate)) throw runtime_error("Malformed exchange rate: " + line);
+            rates.emplace_back(*packed, rate);
+        }
+        return rates;
+    }
+
+    // What amount of currency `from` buys of currency `to` at table t, to the cent.
+    static optional<double> convert(const Table& t, uint16_t from, uint16_t to, double amount) {
+        if (!t.hasRate(from) || !t.hasRate(to)) return nullopt;
+        return round(amount * (t.toBase[from] / t.toBase[to]) * 100) / 100;
+    }
+
+    // Revalues rows of a book: values[i] = balances[i] * factor[currency[i]]. Returns the
+    // sum. Blocks of rows run on every core, each summed in four lanes, and the block sums
+    // are added in order, so the AVX2 and portable paths agree to the bit.
+    static double revalue(span<const double> balances, span<const int32_t> currency, span<const double> factor,
+                          span<double> values) {
+        constexpr size_t block = 1 << 16;
+        vector<double> sums((balances.size() + block - 1) / block);
+        parallelFor(sums.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t b = begin; b < end; ++b)
+                sums[b] = revalueRange(balances.data(), currency.data(), factor.data(), values.data(), b * block,
+                                       min(balances.size(), (b + 1) * block));
+        });
+        double total = 0;
+        for (double s : sums) total += s;
+        return total;
+    }
+
+    static double revalueRange(const double* balances, const int32_t* currency, const double* factor, double* values,
+                               size_t begin, size_t end) {
+#ifdef BANK_HAVE_AVX2
+        if (useAvx2()) return revalueAvx2(balances, currency, factor, values, begin, end);
+#endif
+        return revaluePortable(balances, currency, factor, values, begin, end);
+    }
+
+    static double revaluePortable(const double* balances, const int32_t* currency, const double* factor, double* values,
+                                  size_t begin, size_t end) {
+        array<double, 4> lane{};
+        size_t i = begin;
+        for (; i + 4 <= end; i += 4)
+            for (size_t k = 0; k < 4; ++k) lane[k] += values[i + k] = balances[i + k] * factor[currency[i + k]];
+        double sum = (lane[0] + lane[2]) + (lane[1] + lane[3]);
+        for (; i < end; ++i) sum += values[i] = balances[i] * factor[currency[i]];
+        return sum;
+    }
+
+private:
+    atomic<shared_ptr<const Table>> table;
+    mutex writer;
+
+    static uint16_t add(Table& t, int code, double rate) {
+        if (t.codes.size() >= maxCurrencies) throw runtime_error("Too many currencies");
+        t.codes.push_back(code);
+        t.toBase.push_back(rate);
+        return static_cast<uint16_t>(t.codes.size() - 1);
+    }
+
+#ifdef BANK_HAVE_AVX2
+    static bool useAvx2() {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+
+    __attribute__((target("avx2")))
+    static double revalueAvx2(const double* balances, const int32_t* currency, const double* factor, double* values,
+                              size_t begin, size_t end) {
+        const __m256d zero = _mm256_setzero_pd(), all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        __m256d lanes = zero;
+        size_t i = begin;
+        for (; i + 4 <= end; i += 4) {
+            const __m128i ids = _mm_loadu_si128(reinterpret_cast<const __m128i*>(currency + i));
+            const __m256d rate = _mm256_mask_i32gather_pd(zero, factor, ids, all, 8);
+            const __m256d v = _mm256_mul_pd(_mm256_loadu_pd(balances + i), rate);
+            _mm256_storeu_pd(values + i, v);
+            lanes = _mm256_add_pd(lanes, v);
+        }
+        const __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(lanes), _mm256_extractf128_pd(lanes, 1));
+        double sum = _mm_cvtsd_f64(pair) + _mm_cvtsd_f64(_mm_unpackhi_pd(pair, pair));
+        for (; i < end; ++i) sum += values[i] = balances[i] * factor[currency[i]];
+        return sum;
+    }
+#endif
+};
+
+// Which accounts hold a currency other than the base, kept in account_currencies.txt
+// ("A <account> <code>" lines) as of an audit record, and caught up from the
+// addAccount and closeAccount records after it.
+class CurrencyBook {
+public:
+    [[nodiscard]] int codeOf(int account) const {
+        auto it = codes.find(account);
+        return it == codes.end() ? 0 : it->second;
+    }
+
+    void set(int account, int code) {
+        if (code) codes.insert_or_assign(account, code);
+        else codes.erase(account);
+    }
+
+    void drop(int account) { codes.erase(account); }
+    void clear() { codes.clear(); }
+
+    void save(ostream& out, uint64_t seq) const {
+        out << "#seq " << seq << '\n';
+        for (const auto& [account, code] : codes) out << "A " << account << ' ' << currencyCode(code) << '\n';
+    }
+
+    // Returns the sequence number the file reflects.
+    uint64_t load(istream& in) {
+        const auto seq = readSnapshotHeader(in).seq.value_or(0);
+        string tag, code;
+        int account{};
+        while (in >> tag >> account >> code) {
+            auto packed = packCurrency(code);
+            if (tag != "A" || !packed) throw runtime_error("Malformed currency file");
+            codes.insert_or_assign(account, *packed);
+        }
+        return seq;
+    }
+
+private:
+    unordered_map<int, int> codes;
+};
+
+// ---------------- Fraud Screening ----------------
+// Velocity rules from fraud_rules.txt, one a line: "<measure> <limit> <minutes> [flag|block]".
+// `count` breaks when an account makes more than limit debits within the window, and
+// `total` when they add up to more than limit; a broken rule raises an alert, and a
+// `block` rule also refuses the debit. Debits are the customer's withdrawals and
+// transfers out, not the bank's postings or standing order runs.
+//
+// Each rule keeps, per account, a ring of 16 buckets spanning its window with running
+// sums over the ring, so a debit is checked and counted in constant time: moving to the
+// current bucket clears the buckets that have fallen out, at most the ring's length and
+// on average one. Windows slide a bucket (1/16 of the window) at a time.
+class FraudMonitor {
+public:
+    enum class Measure : uint8_t { Count, Total };
+
+    struct Rule {
+        Measure measure;
+        double limit;
+        int minutes;
+        bool block;
+    };
+
+    struct Alert {
+        int64_t time;
+        int account;
+        size_t rule;     // index into rules()
+        double observed; // debits or amount in the window, this one included
+        double amount;
+    };
+
+    static constexpr size_t buckets = 16, maxRules = 64;
+    static constexpr uint32_t maxCount = 0xFFFF; // debits a bucket holds; count limits stay below it
+
+    static vector<Rule> loadRules(istream& in) {
+        vector<Rule> rules;
+        string line;
+        while (getline(in, line)) {
+            if (line.empty() || line.starts_with('#')) continue;
+            istringstream fields(line);
+            string measure, action = "flag";
+            Rule r{};
+            if (!(fields >> measure >> r.limit >> r.minutes) || (measure != "count" && measure != "total") || r.limit < 0 ||
+                (measure == "count" && r.limit >= maxCount) || r.minutes <= 0 || r.minutes > 7 * 24 * 60 || ((fields >> action) && action != "flag" && action != "block"))
+                throw runtime_error("Malformed fraud rule: " + line);
+            r.measure = measure == "count" ? Measure::Count : Measure::Total;
+            r.block = action == "block";
+            rules.push_back(r);
+        }
+        if (rules.size() > maxRules) throw runtime_error("At most 64 fraud rules");
+        return rules;
+    }
+
+    static string describe(const Rule& r) {
+        ostringstream out;
+        out << (r.measure == Measure::Count ? "more than " : "over ") << r.limit
+            << (r.measure == Measure::Count ? " debits" : " in debits") << " within " << r.minutes << " min"
+            << (r.block ? " (block)" : "");
+        return out.str();
+    }
+
+    // Whether a record is a debit the rules screen before it is made: a customer's
+    // withdrawal or transfer. Settlements are not; the debit leg of a transfer between
+    // shards was screened when its shard voted, and a migration only copies an account.
+    static bool screened(const AuditRecord& r) {
+        return (r.op == "withdraw" || r.op == "transfer") && !FeeBook::isBankPosting(r) && !StandingOrders::runOf(r) &&
+               !isSettlement(r);
+    }
+
+    // Whether a record counts in the windows: a screened debit, or the commit of a debit leg.
+    static bool counted(const AuditRecord& r) { return screened(r) || (r.op == "withdraw" && r.text.starts_with("2pc ")); }
+
+    // Replaces the rules and forgets every window.
+    void setRules(vector<Rule> next) {
+        rules_ = std::move(next);
+        width.clear();
+        limitCents.clear();
+        blocking_ = 0;
+        for (size_t k = 0; k < rules_.size(); ++k) {
+            width.push_back(max<int64_t>(1, int64_t(rules_[k].minutes) * 60'000 / buckets));
+            limitCents.push_back(llround(rules_[k].limit * 100));
+            if (rules_[k].block) blocking_ |= uint64_t{1} << k;
+        }
+        clear();
+    }
+
+    void clear() {
+        rows.clear();
+        windows.clear();
+    }
+
+    [[nodiscard]] const vector<Rule>& rules() const { return rules_; }
+    [[nodiscard]] bool active() const { return !rules_.empty(); }
+    [[nodiscard]] uint64_t blocking() const { return blocking_; }
+    [[nodiscard]] size_t accountCount() const { return rows.size(); }
+
+    [[nodiscard]] int64_t longestWindow() const {
+        int64_t longest = 0;
+        for (const auto& r : rules_) longest = max<int64_t>(longest, int64_t(r.minutes) * 60'000);
+        return longest;
+    }
+
+    // The rules a debit of amount at time now would break, as a bit per rule. The debit
+    // is not counted until record().
+    uint64_t check(int account, double amount, int64_t now) {
+        auto it = rows.find(account);
+        const int64_t cents = llround(amount * 100);
+        uint64_t broken = 0;
+        if (it == rows.end()) {
+            for (size_t k = 0; k < rules_.size(); ++k) broken |= uint64_t{breaks(k, 1, cents)} << k;
+            return broken;
+        }
+        for (size_t k = 0; k < rules_.size(); ++k) {
+            auto& w = window(it->second, k);
+            advance(w, now / width[k]);
+            broken |= uint64_t{breaks(k, w.count + 1, w.cents + cents)} << k;
+        }
+        return broken;
+    }
+
+    // Counts a debit; returns the rules the account now breaks, as check() does.
+    uint64_t record(int account, double amount, int64_t now) {
+        auto [it, added] = rows.try_emplace(account, static_cast<uint32_t>(rows.size()));
+        if (added) windows.resize(windows.size() + rules_.size());
+        const auto cents = static_cast<uint64_t>(max<int64_t>(0, llround(amount * 100)));
+        uint64_t broken = 0;
+        for (size_t k = 0; k < rules_.size(); ++k) {
+            auto& w = window(it->second, k);
+            advance(w, now / width[k]);
+            // A full bucket stops counting; its window already breaks any count rule.
+            auto& slot = w.slots[static_cast<size_t>(w.head % buckets)];
+            const uint64_t added = (slot & maxCount) < maxCount, more = min(cents, maxCents - (slot >> 16));
+            slot += added | more << 16;
+            w.count += static_cast<uint32_t>(added);
+            w.cents += static_cast<int64_t>(more);
+            broken |= uint64_t{breaks(k, w.count, w.cents)} << k;
+        }
+        return broken;
+    }
+
+    // What rule k has seen from the account in its window, with a debit of amount not yet
+    // recorded added (0 for none).
+    [[nodiscard]] double observed(int account, size_t k, double amount) const {
+        auto it = rows.find(account);
+        const auto* w = it == rows.end() ? nullptr : &windows[size_t(it->second) * rules_.size() + k];
+        if (rules_[k].measure == Measure::Count) return (w ? w->count : 0) + (amount > 0);
+        return ((w ? w->cents : 0) + llround(amount * 100)) / 100.0;
+    }
+
+private:
+    // A slot packs a bucket's debit count into its low 16 bits and their cents above.
+    static constexpr uint64_t maxCents = (uint64_t{1} << 48) - 1;
+
+    struct Window {
+        int64_t head = 0;   // bucket number of the newest slot
+        uint32_t count = 0; // sums over the ring
+        int64_t cents = 0;
+        array<uint64_t, buckets> slots{};
+    };
+
+    vector<Rule> rules_;
+    vector<int64_t> width;      // bucket width per rule, ms
+    vector<int64_t> limitCents; // per rule, for total rules
+    uint64_t blocking_ = 0;
+    unordered_map<int, uint32_t> rows; // account -> row of rules_.size() windows
+    vector<Window> windows;
+
+    Window& window(uint32_t row, size_t k) { return windows[size_t(row) * rules_.size() + k]; }
+
+    bool breaks(size_t k, uint32_t count, int64_t cents) const {
+        return rules_[k].measure == Measure::Count ? count > rules_[k].limit : cents > limitCents[k];
+    }
+
+    // Moves the ring on to bucket, emptying the buckets it passes. Buckets are only ever
+    // moved forward; a clock that steps back keeps counting into the newest.
+    static void advance(Window& w, int64_t bucket) {
+        if (bucket <= w.head) return;
+        const auto steps = static_cast<size_t>(min<int64_t>(bucket - w.head, buckets));
+        for (size_t s = 1; s <= steps; ++s) {
+            auto& slot = w.slots[static_cast<size_t>((w.head + s) % buckets)];
+            w.count -= static_cast<uint32_t>(slot & maxCount);
+            w.cents -= static_cast<int64_t>(slot >> 16);
+            slot = 0;
+        }
+        w.head = bucket;
+    }
+};
+
+// ---------------- BankManagement Class ----------------
+class BankManagement {
+private:
+    deque<BankAccount> accounts; // whole book, or the working set when a store is attached
+    unique_ptr<AccountStore> store;
+#ifdef BANK_HAVE_MMAP
+    unique_ptr<SharedBookWriter> shared; // live copy for reporting processes
+#endif
+#ifdef BANK_HAVE_SOCKETS
+    unique_ptr<LogShipper> shipper; // declared before audit, whose observer points at it
+#endif
+    AuditLog audit;
+    string auditFile;
+    optional<uint64_t> snapshotSeq; // last log record folded into the loaded snapshot
+    uint64_t raftAuditSeq = 0;      // audit record produced by the last Raft command applied
+    string snapshotFile;
+    CheckpointPolicy checkpointPolicy;
+    DurabilityPolicy durability;
+    IdempotencyCache recentKeys;
+    HoldBook holds;
+    StandingOrders standing;
+    InterestBook interest;
+    FeeBook fees;
+    FxRates fx;
+    CurrencyBook currencies;
+    atomic<int64_t> ratesStamp{}; // modification time of the rates file last published
+    FraudMonitor fraud;
+    deque<FraudMonitor::Alert> alerts; // the most recent, for the menu; all of them go to fraud_alerts.txt
+    ofstream alertLog;
+    jthread checkpointWriter; // declared last: joined before the members it reads go away
+    jthread backupWriter;
+
+    // The teller's PIN is read before the book is taken, so no prompt waits holding it.
+    static bool authenticate(const BankAccount& acc, const string& pin) {
+        if (!acc.verifyPIN(pin)) {
+            cout << "Authentication failed. Invalid PIN.\n";
+            return false;
+        }
+        return true;
+    }
+
+    // With a store attached, accounts faulted in by the previous operation are dropped;
+    // every mutation has already been written back.
+    void releaseWorkingSet() {
+        if (store) accounts.clear();
+    }
+
+    // Called only after the audit record is committed, so a store never holds a
+    // change the log does not.
+    void writeBack(const BankAccount& acc) {
+        if (store) store->put(acc);
+#ifdef BANK_HAVE_MMAP
+        if (shared) shared->publish(acc.toRecord());
+#endif
+    }
+
+    [[nodiscard]] fs::path ordersFile() const {
+        return snapshotFile.empty() ? fs::path() : fs::path(snapshotFile).parent_path() / "standing_orders.txt";
+    }
+
+    // Writes the standing orders as of the last audit record, so startup replays only the
+    // log written after it.
+    void saveOrders() const {
+        const auto file = ordersFile();
+        if (file.empty()) return;
+        const auto tmp = file.string() + ".tmp";
+        {
+            ofstream out(tmp, ios::trunc);
+            standing.save(out, audit.lastSeq());
+            if (!out.flush()) throw runtime_error("Cannot write standing orders");
+        }
+        fs::rename(tmp, file);
+    }
+
+    [[nodiscard]] fs::path currenciesFile() const {
+        return snapshotFile.empty() ? fs::path() : fs::path(snapshotFile).parent_path() / "account_currencies.txt";
+    }
+
+    [[nodiscard]] fs::path ratesFile() const {
+        return snapshotFile.empty() ? fs::path() : fs::path(snapshotFile).parent_path() / "fx_rates.txt";
+    }
+
+    // The currency of every account not in the base, as of the last audit record.
+    void saveCurrencies() const {
+        const auto file = currenciesFile();
+        if (file.empty()) return;
+        const auto tmp = file.string() + ".tmp";
+        {
+            ofstream out(tmp, ios::trunc);
+            currencies.save(out, audit.lastSeq());
+            if (!out.flush()) throw runtime_error("Cannot write account currencies");
+        }
+        fs::rename(tmp, file);
+    }
+
+    [[nodiscard]] fs::path fraudRulesFile() const {
+        return snapshotFile.empty() ? fs::path() : fs::path(snapshotFile).parent_path() / "fraud_rules.txt";
+    }
+
+    [[nodiscard]] fs::path fraudAlertsFile() const {
+        return snapshotFile.empty() ? fs::path() : fs::path(snapshotFile).parent_path() / "fraud_alerts.txt";
+    }
+
+    // Alerts for the rules in broken; pending is a debit not yet recorded in the windows.
+    void raiseAlerts(int account, double amount, double pending, int64_t now, uint64_t broken) {
+        if (!alertLog.is_open()) alertLog.open(fraudAlertsFile(), ios::app);
+        for (size_t k = 0; k < fraud.rules().size(); ++k) {
+            if (!(broken >> k & 1)) continue;
+            const FraudMonitor::Alert alert{now, account, k, fraud.observed(account, k, pending), amount};
+            alertLog << alert.time << ' ' << alert.account << ' ' << k + 1 << ' ' << alert.amount << ' ' << alert.observed << '\n';
+            alerts.push_back(alert);
+            if (alerts.size() > 1000) alerts.pop_front();
+        }
+        alertLog.flush();
+    }
+
+    // Checks a customer's debit against the fraud rules before it is made, and refuses
+    // it when it breaks a blocking rule; that refusal raises its alerts. Otherwise the
+    // alerts are raised by countDebit(), once the debit has been made, so a debit that
+    // fails for another reason raises none.
+    optional<string> screenDebit(int account, double amount, int64_t now) {
+        if (!fraud.active()) return nullopt;
+        const auto broken = fraud.check(account, amount, now);
+        const auto blocked = broken & fraud.blocking();
+        if (!blocked) return nullopt;
+        raiseAlerts(account, amount, amount, now, broken);
+        return "Refused by fraud rule " + to_string(countr_zero(blocked) + 1);
+    }
+
+    void countDebit(int account, double amount, int64_t now) {
+        if (!fraud.active()) return;
+        if (const auto broken = fraud.record(account, amount, now)) raiseAlerts(account, amount, 0, now, broken);
+    }
+
+    [[nodiscard]] fs::path interestFile() const {
+        return snapshotFile.empty() ? fs::path() : fs::path(snapshotFile).parent_path() / "interest.txt";
+    }
+
+    [[nodiscard]] fs::path feesFile() const {
+        return snapshotFile.empty() ? fs::path() : fs::path(snapshotFile).parent_path() / "fees.txt";
+    }
+
+    [[nodiscard]] fs::path feeRulesFile() const {
+        return snapshotFile.empty() ? fs::path() : fs::path(snapshotFile).parent_path() / "fee_rules.txt";
+    }
+
+    // Replaces file, keeping the one before it as <file>.prev: a batch of postings saves
+    // its file before the postings are committed, and if they never are, startup goes
+    // back to the previous generation.
+    static void saveGeneration(const fs::path& file, const function<void(ostream&)>& write) {
+        if (file.empty()) return;
+        const auto tmp = file.string() + ".tmp";
+        {
+            ofstream out(tmp, ios::trunc);
+            write(out);
+            if (!out.flush()) throw runtime_error("Cannot write " + file.string());
+        }
+        if (fs::exists(file)) fs::rename(file, file.string() + ".prev");
+        fs::rename(tmp, file);
+    }
+
+    // Loads the newest generation of file that the audit log has caught up with, after
+    // reset(); returns the sequence number it reflects, or nothing when there is none.
+    optional<uint64_t> loadGeneration(const fs::path& file, const function<uint64_t(istream&)>& read,
+                                      const function<void()>& reset) const {
+        for (const auto& candidate : {file, fs::path(file.string() + ".prev")}) {
+            reset();
+            ifstream in(candidate);
+            if (!in) continue;
+            if (auto seq = read(in); seq <= audit.lastSeq()) return seq;
+        }
+        reset();
+        return nullopt;
+    }
+
+    // Products, account terms and carries as of the last audit record.
+    void saveInterest() const {
+        saveGeneration(interestFile(), [&](ostream& out) { interest.save(out, audit.lastSeq()); });
+    }
+
+    void saveFees() const {
+        saveGeneration(feesFile(), [&](ostream& out) { fees.save(out); });
+    }
+
+    // Rebuilds, onto a freshly loaded book, what only the audit log keeps: the idempotency
+    // keys inside their window, the holds still open, and the standing orders and interest
+    // terms changed since their files were written, from the records up to upToSeq.
+    // Archived segments that end before all of that are not read.
+    void reloadFromLog(uint64_t upToSeq = numeric_limits<uint64_t>::max()) {
+        recentKeys.clear();
+        holds.clear();
+        standing.clear();
+        currencies.clear();
+        fraud.setRules({});
+        alertLog.close(); // reopened next to the snapshot on the next alert
+        if (auditFile.empty()) return;
+        if (const auto file = fraudRulesFile(); !file.empty())
+            if (ifstream in(file); in) fraud.setRules(FraudMonitor::loadRules(in));
+        const auto now = AuditLog::nowMillis();
+        const auto keyHorizon = recentKeys.horizon(now), fraudHorizon = now - fraud.longestWindow();
+        const auto horizon = min({keyHorizon, fraudHorizon, now - HoldBook::maxLifetime.count()});
+        uint64_t afterSeq = 0;
+        for (auto [firstSeq, firstTs] : AuditLog::segmentIndex(auditFile))
+            if (firstTs <= horizon) afterSeq = firstSeq - 1;
+        optional<uint64_t> ordersSeq, interestSeq, currenciesSeq; // unset: this bank keeps none (Raft)
+        if (const auto file = ordersFile(); !file.empty()) {
+            ifstream in(file);
+            ordersSeq = in ? standing.load(in) : 0;
+            afterSeq = min(afterSeq, *ordersSeq);
+        }
+        if (const auto file = currenciesFile(); !file.empty()) {
+            ifstream in(file);
+            currenciesSeq = in ? currencies.load(in) : 0;
+            afterSeq = min(afterSeq, *currenciesSeq);
+        }
+        if (const auto file = interestFile(); !file.empty()) {
+            const auto yesterday = InterestBook::dayOf(now) - 1;
+            interestSeq = loadGeneration(file, [&](istream& in) { return interest.load(in); },
+                                         [&] { interest.clear(yesterday); }).value_or(0);
+            afterSeq = min(afterSeq, *interestSeq);
+        }
+        if (const auto file = feesFile(); !file.empty()) {
+            // Fee activity is read from the log when fees are assessed; a new file starts
+            // the first period now.
+            if (!loadGeneration(file, [&](istream& in) { return fees.load(in); }, [&] { fees.clear(now); })) {
+                fees.scannedSeq = audit.lastSeq();
+                saveFees();
+            }
+        }
+        map<uint64_t, HoldBook::Hold> open;
+        for (const auto& r : AuditLog::readAll(auditFile, afterSeq)) {
+            if (r.seq > upToSeq) break;
+            if (ordersSeq && r.seq > *ordersSeq) {
+                if (auto order = StandingOrders::orderOf(r)) standing.add(r.aux, *order);
+                else if (r.op == "cancelOrder") standing.erase(r.aux);
+                else if (auto run = StandingOrders::runOf(r)) standing.settle(run->first, run->second);
+            }
+            if (interestSeq && r.seq > *interestSeq) {
+                if (auto product = InterestBook::productOf(r)) interest.define(static_cast<uint32_t>(r.aux), *product);
+                else if (r.op == "setProduct") interest.assign(r.account, static_cast<uint32_t>(r.aux));
+                else if (r.op == "creditLimit")
+                    interest.setCreditLine(r.account, static_cast<uint32_t>(r.aux), InterestBook::creditLineOf(r));
+                else if (r.op == "closeAccount") interest.drop(r.account);
+            }
+            if (currenciesSeq && r.seq > *currenciesSeq) {
+                if (r.op == "addAccount") currencies.set(r.account, r.other);
+                else if (r.op == "closeAccount") currencies.drop(r.account);
+            }
+            if (auto key = IdempotencyCache::keyOf(r); key && r.timestamp >= keyHorizon) recentKeys.remember(*key, r.timestamp, nullopt);
+            if (fraud.active() && r.timestamp >= fraudHorizon && FraudMonitor::counted(r)) fraud.record(r.account, r.amount, r.timestamp);
+            if (auto until = HoldBook::untilOf(r)) {
+                open[r.aux] = {r.account, r.amount, *until};
+                holds.skipPast(r.aux); // ids stay unique after the holds using them are settled
+            } else if (r.op == "release") open.erase(r.aux);
+            else if (auto id = HoldBook::capturedBy(r)) open.erase(*id);
+        }
+        for (const auto& [id, hold] : open)
+            if (auto acc = findAccount(hold.account); acc && holds.add(id, hold)) acc->get().restoreHold(hold.amount);
+        reloadRates();
+        for (auto& acc : accounts) {
+            applyTerms(acc);
+            acc.setCurrency(fx.idFor(currencies.codeOf(acc.getAccountNum())));
+        }
+    }
+
+    // Resolves the account's limits from its product and credit lines.
+    void applyTerms(BankAccount& acc) const {
+        acc.setTerms(interest.kindOf(acc.getAccountNum()), interest.creditLine(acc.getAccountNum()));
+    }
+
+    // Mirrors a hold record already checked elsewhere (by a primary) onto the hold book.
+    void followHold(const AuditRecord& r) {
+        auto acc = findAccount(r.account);
+        if (auto until = HoldBook::untilOf(r)) {
+            if (acc && holds.add(r.aux, {r.account, r.amount, *until})) acc->get().restoreHold(r.amount);
+            return;
+        }
+        auto id = r.op == "release" ? optional(r.aux) : HoldBook::capturedBy(r);
+        if (const auto* h = id ? holds.find(*id) : nullptr) {
+            if (acc) acc->get().releaseHold(h->amount);
+            holds.erase(*id);
+        }
+    }
+
+    struct Accrual {
+        vector<BankAccount*> who;
+        vector<int64_t> earned;
+        vector<int8_t> direction; // +1 paid, -1 charged (loans)
+    };
+
+    // One day's interest on the balances as they are now. Each account's fraction of a
+    // cent is carried into its terms; the whole cents are returned, for posting.
+    Accrual accrueDay() {
+        Accrual day;
+        vector<InterestBook::Terms*> terms;
+        vector<int64_t> cents, carry;
+        vector<int32_t> rates;
+        for (auto& acc : accounts) {
+            auto* t = interest.termsOf(acc.getAccountNum());
+            if (!t) continue;
+            const auto [basis, sign] = withProduct(acc.getKind(), [&](auto product) {
+                return decltype(product)::interestBasis(llround(acc.getBalance() * 100));
+            });
+            day.who.push_back(&acc);
+            terms.push_back(t);
+            cents.push_back(basis);
+            day.direction.push_back(static_cast<int8_t>(sign));
+            rates.push_back(interest.product(t->product)->rateBp);
+            carry.push_back(t->carry);
+        }
+        day.earned.resize(day.who.size());
+        InterestBook::accrue(cents, rates, carry, day.earned);
+        for (size_t i = 0; i < terms.size(); ++i) terms[i]->carry = carry[i];
+        return day;
+    }
+
+    void maybeCheckpoint() {
+        if (checkpointPolicy.due(audit.activeBytes(), audit.activeRecords())) checkpoint();
+    }
+
+    static void writeSnapshotTo(ostream& out, const deque<BankAccount>& book, uint64_t seq, int64_t time,
+                                Throttle* throttle = nullptr) {
+        // Header: last audit record reflected in this snapshot, used by crash recovery
+        out << "#seq " << seq << "\n#time " << time << '\n' << setprecision(17);
+        auto written = out.tellp();
+        for (size_t i = 0; i < book.size(); ++i) {
+            book[i].save(out);
+            if (throttle && i % 1024 == 1023) {
+                throttle->consume(static_cast<size_t>(out.tellp() - written));
+                written = out.tellp();
+            }
+        }
+    }
+
+    // Writes to a temporary file and renames it into place, so a crash never leaves a torn snapshot.
+    static void writeSnapshot(const string& filename, const deque<BankAccount>& book, uint64_t seq, int64_t time,
+                              Throttle* throttle = nullptr) {
+        const string tmp = filename + ".tmp";
+        {
+            ofstream out(tmp, ios::trunc);
+            if (!out) throw runtime_error("Cannot open file for saving");
+            writeSnapshotTo(out, book, seq, time, throttle);
+            if (!out.flush()) throw runtime_error("Snapshot write failed");
+        }
+        fs::rename(tmp, filename);
+    }
+
+    // Fixes what a transfer between currencies credits, at the rates published now, in
+    // the command itself, so its record replays without them.
+    optional<string> priceTransfer(AuditRecord& cmd) {
+        cmd.setExchanged(nullopt); // only ever set here, never taken from the caller
+        auto from = findAccount(cmd.account);
+        auto to = findAccount(cmd.other);
+        if (!from || !to || from->get().getCurrency() == to->get().getCurrency()) return nullopt;
+        const auto rates = fx.current();
+        auto credit = FxRates::convert(*rates, from->get().getCurrency(), to->get().getCurrency(), cmd.amount);
+        if (!credit) return "No exchange rate between " + fx.name(from->get().getCurrency()) + " and " + fx.name(to->get().getCurrency());
+        if (*credit <= 0) return "Transfer is too small to convert";
+        cmd.setExchanged(*credit);
+        return nullopt;
+    }
+
+    // Validates a command and applies it to the book (or working set); no logging.
+    optional<string> applyEffect(const AuditRecord& cmd) {
+        try {
+            if (cmd.op == "addAccount") {
+                if (findAccount(cmd.account)) return "Account number already exists";
+                if (cmd.other && packCurrency(currencyCode(cmd.other)) != cmd.other) return "Malformed currency";
+                if (cmd.other && store) return "Currencies need the in-memory book";
+                accounts.push_back(BankAccount::restore(cmd.text, cmd.account, cmd.amount, cmd.aux));
+                accounts.back().setCurrency(fx.idFor(cmd.other));
+                currencies.set(cmd.account, cmd.other);
+                return nullopt;
+            }
+            if (cmd.op == "product") {
+                auto product = InterestBook::productOf(cmd);
+                if (!product || cmd.text.empty() || !cmd.aux) return "Malformed product";
+                if (cmd.amount < 0 || cmd.amount > InterestBook::maxRateBp || cmd.amount != floor(cmd.amount))
+                    return "Rate must be whole basis points from 0 to 10000";
+                const auto* old = interest.product(static_cast<uint32_t>(cmd.aux));
+                if (old && old->kind != product->kind) return "A product's kind cannot change";
+                interest.define(static_cast<uint32_t>(cmd.aux), *product);
+                return nullopt;
+            }
+            if (cmd.op == "creditLimit") {
+                if (store) return "Credit limits need the in-memory book";
+                if (cmd.other && !(cmd.amount >= 0 && cmd.amount <= InterestBook::maxCreditLine))
+                    return "Credit limit must be from 0 to 100000000";
+                if (cmd.account ? !findAccount(cmd.account) : !interest.product(static_cast<uint32_t>(cmd.aux)))
+                    return cmd.account ? "Account not found" : "Product not found";
+                // A lower line than the account already uses stops new spending; nothing is clawed back.
+                interest.setCreditLine(cmd.account, static_cast<uint32_t>(cmd.aux), InterestBook::creditLineOf(cmd));
+                for (auto& acc : accounts)
+                    if (cmd.account ? acc.getAccountNum() == cmd.account : interest.productOf(acc.getAccountNum()) == cmd.aux)
+                        applyTerms(acc);
+                return nullopt;
+            }
+            auto acc = findAccount(cmd.account);
+            if (!acc) return cmd.op == "transfer" ? "One or both accounts not found" : "Account not found";
+            if (cmd.op == "deposit") {
+                isSettlement(cmd) ? acc->get().credit(cmd.amount) : acc->get().deposit(cmd.amount);
+            } else if (auto captured = HoldBook::capturedBy(cmd)) {
+                const auto* h = holds.find(*captured);
+                if (!h || h->account != cmd.account) return "Hold not found";
+                acc->get().captureHold(h->amount, cmd.amount);
+                holds.erase(*captured);
+            } else if (cmd.op == "withdraw") {
+                isSettlement(cmd) ? acc->get().debit(cmd.amount) : acc->get().withdraw(cmd.amount);
+            } else if (cmd.op == "hold") {
+                if (store) return "Holds need the in-memory book";
+                auto until = HoldBook::untilOf(cmd);
+                if (!cmd.aux || !until) return "Malformed hold";
+                if (*until > AuditLog::nowMillis() + HoldBook::maxLifetime.count()) return "Holds last at most 30 days";
+                if (holds.find(cmd.aux)) return "Hold " + to_string(cmd.aux) + " already exists";
+                acc->get().placeHold(cmd.amount);
+                holds.add(cmd.aux, {cmd.account, cmd.amount, *until});
+            } else if (cmd.op == "release") {
+                const auto* h = holds.find(cmd.aux);
+                if (!h || h->account != cmd.account) return "Hold not found";
+                acc->get().releaseHold(h->amount);
+                holds.erase(cmd.aux);
+            } else if (cmd.op == "transfer") {
+                auto to = findAccount(cmd.other);
+                if (!to) return "One or both accounts not found";
+                if (cmd.other == cmd.account) return "Cannot transfer to same account";
+                const bool exchange = acc->get().getCurrency() != to->get().getCurrency();
+                if (exchange != cmd.exchanged().has_value())
+                    return exchange ? "Transfer between currencies has no rate" : "Malformed transfer";
+                to->get().checkDeposit(cmd.credit());
+                acc->get().withdraw(cmd.amount);
+                to->get().deposit(cmd.credit());
+            } else if (cmd.op == "updateName") {
+                acc->get().updateName(cmd.text);
+            } else if (cmd.op == "schedule") {
+                auto order = StandingOrders::orderOf(cmd);
+                if (!order || !cmd.aux || order->amount <= 0) return "Malformed standing order";
+                if (!findAccount(cmd.other)) return "One or both accounts not found";
+                if (cmd.other == cmd.account) return "Cannot transfer to same account";
+                if (!standing.add(cmd.aux, *order)) return "Standing order " + to_string(cmd.aux) + " already exists";
+            } else if (cmd.op == "cancelOrder") {
+                const auto* order = standing.find(cmd.aux);
+                if (!order || order->from != cmd.account) return "Standing order not found";
+                standing.erase(cmd.aux);
+            } else if (cmd.op == "setProduct") {
+                if (store) return "Interest needs the in-memory book";
+                const auto* product = interest.product(static_cast<uint32_t>(cmd.aux));
+                if (!product) return "Product not found";
+                const auto line = interest.creditLine(cmd.account, static_cast<uint32_t>(cmd.aux));
+                if (!isSettlement(cmd) && !acc->get().fits(limitsOf(product->kind, line)))
+                    return "Balance is outside what a " + string(accountKindName(product->kind)) + " account allows";
+                interest.assign(cmd.account, static_cast<uint32_t>(cmd.aux));
+                applyTerms(acc->get());
+            } else if (cmd.op == "closeAccount") {
+                if (acc->get().getHeld() > 0) return "Account has open holds";
+                if (acc->get().getBalance() < 0 && !isSettlement(cmd)) return "Account has a balance owing";
+                if (ranges::any_of(standing.all(), [&](const auto& o) { return o.second.from == cmd.account || o.second.to == cmd.account; }))
+                    return "Account has standing orders";
+                erase_if(accounts, [&](const BankAccount& a) { return a.getAccountNum() == cmd.account; });
+                interest.drop(cmd.account);
+                currencies.drop(cmd.account);
+            } else {
+                return "Unknown operation " + cmd.op;
+            }
+        } catch (const exception& e) {
+            return e.what();
+        }
+        return nullopt;
+    }
+
+public:
+    void forEachAccount(const function<void(const BankAccount&)>& fn) const {
+        if (store) return store->forEach(fn);
+        for (const auto& acc : accounts) fn(acc);
+    }
+
+    void useStore(unique_ptr<AccountStore> engine) {
+        store = std::move(engine);
+        accounts.clear();
+    }
+
+#ifdef BANK_HAVE_MMAP
+    // Publishes the whole book to shared memory and keeps it updated from then on.
+    void publishShared() {
+        shared = make_unique<SharedBookWriter>();
+        forEachAccount([&](const BankAccount& acc) { shared->publish(acc.toRecord()); });
+        shared->ready();
+    }
+#endif
+
+#ifdef BANK_HAVE_SOCKETS
+    // Streams every committed audit record to followers connecting on socketPath.
+    void startShipping(const string& socketPath) {
+        if (auditFile.empty()) throw runtime_error("Open the audit log before replicating it");
+        shipper = make_unique<LogShipper>(socketPath, auditFile, audit.lastSeq());
+        audit.setObserver([s = shipper.get()](const AuditRecord& r) { s->publish(r); });
+    }
+#endif
+
+    [[nodiscard]] uint64_t lastAuditSeq() const { return audit.lastSeq(); }
+
+    // Applies a batch shipped from a primary: each record goes into the local log verbatim
+    // (so this copy can later be started as a primary) and then onto the book, and onto
+    // the holds, standing orders, interest terms and account currencies, which are saved
+    // with it and must match the log.
+    void applyReplicated(const vector<AuditRecord>& batch) {
+        releaseWorkingSet();
+        vector<int> touched;
+        for (const auto& r : batch) {
+            audit.appendReplicated(r);
+            if (auto key = IdempotencyCache::keyOf(r)) recentKeys.remember(*key, r.timestamp, nullopt);
+            touched.push_back(r.account);
+            if (r.op == "transfer") touched.push_back(r.other);
+            if (r.op == "hold" || r.op == "release" || HoldBook::capturedBy(r)) followHold(r);
+            if (r.op == "hold" || r.op == "release") continue;
+            if (auto run = StandingOrders::runOf(r)) standing.settle(run->first, run->second);
+            if (r.op == "schedule" || r.op == "cancelOrder") {
+                applyEffect(r); // accepted by the primary, so only a diverged replica refuses it
+                continue;
+            }
+            if (r.op == "skipOrder") continue;
+            if (r.op == "product" || r.op == "setProduct" || r.op == "creditLimit") {
+                applyEffect(r);
+                continue;
+            }
+            if (auto day = InterestBook::postingDayOf(r); day && *day > interest.lastDay) {
+                // The primary accrued the day on the balances before its first posting, which
+                // are this book's now, so accruing it here keeps the carries level. A day that
+                // paid nothing logs nothing; a promoted copy accrues that one again itself.
+                accrueDay();
+                interest.lastDay = *day;
+            }
+            if (r.op == "addAccount") {
+                erase_if(accounts, [&](const BankAccount& a) { return a.getAccountNum() == r.account; });
+                accounts.push_back(BankAccount::restore(r.text, r.account, r.amount, r.aux));
+                accounts.back().setCurrency(fx.idFor(r.other));
+                currencies.set(r.account, r.other);
+                continue;
+            }
+            if (r.op == "closeAccount") {
+                erase_if(accounts, [&](const BankAccount& a) { return a.getAccountNum() == r.account; });
+                interest.drop(r.account);
+                currencies.drop(r.account);
+                continue;
+            }
+            auto acc = findAccount(r.account);
+            auto other = r.op == "transfer" ? findAccount(r.other) : nullopt;
+            if (!acc || (r.op == "transfer" && !other)) continue;
+            try {
+                if (r.op == "deposit") acc->get().credit(r.amount); // checked against the limits by the primary
+                else if (r.op == "withdraw") acc->get().debit(r.amount);
+                else if (r.op == "transfer") {
+                    acc->get().debit(r.amount);
+                    other->get().credit(r.credit());
+                } else if (r.op == "updateName") acc->get().updateName(r.text);
+            } catch (const exception&) {
+                // the primary accepted this operation, so only a diverged replica gets here
+            }
+        }
+        audit.commit(Durability::Async);
+        ranges::sort(touched);
+        touched.erase(ranges::unique(touched).begin(), touched.end());
+        for (int num : touched) {
+            auto it = ranges::find_if(accounts, [&](const BankAccount& a) { return a.getAccountNum() == num; });
+            if (it != accounts.end()) {
+                writeBack(*it);
+                continue;
+            }
+            if (store) store->erase(num);
+#ifdef BANK_HAVE_MMAP
+            if (shared) shared->unpublish(num);
+#endif
+        }
+        maybeCheckpoint();
+    }
+
+#ifdef BANK_HAVE_SOCKETS
+    // Applies a committed Raft command. Every node runs the same commands in the same
+    // order with the leader's timestamp, so every node builds the same audit chain.
+    // Records already in the local log (from before a restart) are not appended again;
+    // the Raft log is the durable history, so the audit log is only buffered here.
+    // Keyed commands are deduplicated by the leader's timestamp, so every node agrees.
+    optional<string> applyCommand(const AuditRecord& cmd) {
+        if (cmd.op == "noop") return nullopt;
+        auto key = IdempotencyCache::keyOf(cmd);
+        if (key)
+            if (auto seen = recentKeys.find(*key, cmd.timestamp)) return *seen;
+        auto error = applyEffect(cmd);
+        if (key) recentKeys.remember(*key, cmd.timestamp, error);
+        if (error) return error;
+        if (++raftAuditSeq > audit.lastSeq()) {
+            audit.appendRecord(cmd);
+            audit.commit(Durability::Memory);
+        }
+        return nullopt;
+    }
+
+    // Hooks for a RaftNode; the replicated book lives in memory only.
+    RaftStateMachine raftStateMachine() {
+        if (store) throw runtime_error("Raft replication supports the in-memory book only");
+        return {
+            [this](const AuditRecord& cmd) { return applyCommand(cmd); },
+            [this](ostream& out) {
+                writeSnapshotTo(out, accounts, raftAuditSeq, audit.lastTimestamp());
+                audit.rotate(); // the snapshot bounds what the active segment has to cover
+            },
+            [this](istream& in, const vector<AuditRecord>& tail) {
+                accounts.clear();
+                raftAuditSeq = readSnapshotHeader(in).seq.value_or(0);
+                while (auto acc = BankAccount::load(in)) accounts.push_back(std::move(*acc));
+                for (const auto& r : tail)
+                    if (r.seq == audit.lastSeq() + 1) audit.appendReplicated(r);
+                audit.commit(Durability::Async);
+                reloadFromLog(raftAuditSeq); // the Raft log replays everything after the snapshot
+            },
+            [this] { return audit.lastSeq(); },
+        };
+    }
+#endif
+
+    // Executes a command sent by another process, without prompting. The PIN is checked
+    // when one is given (for addAccount it sets the new account's PIN); the router omits
+    // it for the credit leg of a transfer it has already authorised. A command whose text
+    // carries an idempotency key (IdempotencyCache::tag) runs at most once per key.
+    optional<string> submit(AuditRecord cmd, const optional<string>& pin, optional<Durability> level = nullopt) {
+        auto key = IdempotencyCache::keyOf(cmd);
+        if (!key) return execute(std::move(cmd), pin, level);
+        auto now = AuditLog::nowMillis();
+        if (auto seen = recentKeys.find(*key, now)) return *seen;
+        auto outcome = execute(std::move(cmd), pin, level);
+        recentKeys.remember(*key, now, outcome);
+        return outcome;
+    }
+
+    // The first outcome recorded for an idempotency key, if it is still remembered.
+    [[nodiscard]] optional<IdempotencyCache::Outcome> priorOutcome(const string& key) const {
+        return recentKeys.find(key, AuditLog::nowMillis());
+    }
+
+    void setIdempotencyWindow(chrono::seconds window) { recentKeys.setWindow(window); }
+
+    // Screens the debit leg of a transfer between shards as its shard votes, so that a
+    // blocking rule refuses it then rather than at the commit; the commit counts it.
+    optional<string> screenDebitLeg(int account, double amount) { return screenDebit(account, amount, AuditLog::nowMillis()); }
+
+    // What an account has beyond its balance, name and PIN, for copying it to another shard.
+    struct AccountTerms {
+        string currency; // its code, e.g. EUR
+        uint32_t product{};
+        optional<InterestBook::Product> definition; // of the product
+        optional<double> productLine, accountLine;
+    };
+
+    [[nodiscard]] AccountTerms accountTerms(const BankAccount& acc) const {
+        const int num = acc.getAccountNum();
+        AccountTerms t{fx.name(acc.getCurrency()), interest.productOf(num), {}, {}, interest.creditLine(num, 0)};
+        if (const auto* p = interest.product(t.product)) {
+            t.definition = *p;
+            t.productLine = interest.productCreditLine(t.product);
+        }
+        return t;
+    }
+
+    // The packed code addAccount takes for a currency named in AccountTerms.
+    [[nodiscard]] int currencyFor(const string& code) const {
+        const auto packed = packCurrency(code);
+        if (!packed) throw runtime_error("Malformed currency " + code);
+        return *packed == fx.base() ? 0 : *packed;
+    }
+
+    // The records that give an account copied from another shard the product and credit
+    // line it has there, where they differ from its terms here; all but a product's
+    // definition are tagged "migrate". A product this bank lacks is defined as it is
+    // there; one of another kind here is an error, as the account would change kind.
+    [[nodiscard]] vector<AuditRecord> termsCommands(int num, const AccountTerms& t) const {
+        vector<AuditRecord> ops;
+        if (t.product && t.definition) {
+            if (const auto* here = interest.product(t.product)) {
+                if (here->kind != t.definition->kind)
+                    throw runtime_error("Product " + to_string(t.product) + " is a different kind of account here");
+            } else {
+                ops.push_back(InterestBook::productCommand(t.product, t.definition->name, t.definition->rateBp, t.definition->kind));
+                if (t.productLine) ops.push_back(InterestBook::creditLimitCommand(0, t.product, t.productLine));
+            }
+        }
+        if (interest.creditLine(num, 0) != t.accountLine) ops.push_back(InterestBook::creditLimitCommand(num, 0, t.accountLine));
+        if (t.product && t.definition && interest.productOf(num) != t.product)
+            ops.push_back(InterestBook::assignCommand(num, t.product));
+        for (auto& cmd : ops)
+            if (cmd.op != "product") cmd.text = "migrate";
+        return ops;
+    }
+
+    // Why the accounts covers() picks cannot leave this bank for another shard, if they
+    // cannot: their open holds and standing orders are kept here and do not move.
+    [[nodiscard]] optional<string> unmovable(const function<bool(int)>& covers) const {
+        for (const auto& [id, o] : standing.all())
+            if (covers(o.from) || covers(o.to))
+                return "Account " + to_string(covers(o.from) ? o.from : o.to) + " has standing orders";
+        optional<string> reason;
+        forEachAccount([&](const BankAccount& acc) {
+            if (!reason && acc.getHeld() > 0 && covers(acc.getAccountNum()))
+                reason = "Account " + to_string(acc.getAccountNum()) + " has open holds";
+        });
+        return reason;
+    }
+
+private:
+    optional<string> execute(AuditRecord cmd, const optional<string>& pin, optional<Durability> level) {
+        releaseWorkingSet();
+        expireHolds();
+        if (cmd.op == "addAccount" && pin) {
+            try {
+                cmd.aux = BankAccount(cmd.text, cmd.account, cmd.amount, *pin).getPinHash();
+            } catch (const exception& e) {
+                return e.what();
+            }
+        } else if (pin) {
+            auto acc = findAccount(cmd.account);
+            if (!acc) return "Account not found";
+            if (!acc->get().verifyPIN(*pin)) return "Authentication failed. Invalid PIN";
+        }
+        if (cmd.op == "transfer")
+            if (auto error = priceTransfer(cmd)) return error;
+        const auto now = AuditLog::nowMillis();
+        if (FraudMonitor::screened(cmd))
+            if (auto error = screenDebit(cmd.account, cmd.amount, now)) return error;
+        if (auto error = applyEffect(cmd)) return error;
+        if (FraudMonitor::counted(cmd)) countDebit(cmd.account, cmd.amount, now);
+        cmd.timestamp = 0;
+        audit.appendRecord(cmd);
+        audit.commit(level.value_or(durability.of(cmd.op, cmd.amount)));
+        for (int num : {cmd.account, cmd.other}) {
+            if (num == 0) continue;
+            auto it = ranges::find_if(accounts, [&](const BankAccount& a) { return a.getAccountNum() == num; });
+            if (it != accounts.end()) {
+                writeBack(*it);
+                continue;
+            }
+            if (store) store->erase(num);
+#ifdef BANK_HAVE_MMAP
+            if (shared) shared->unpublish(num);
+#endif
+        }
+        maybeCheckpoint();
+        return nullopt;
+    }
+
+public:
+    void setDurabilityPolicy(const DurabilityPolicy& policy) { durability = policy; }
+
+    // currency is a packed code, 0 (or the base's own code) for the base currency; any
+    // other must have an exchange rate.
+    void addAccount(const string& name, int accountNum, double balance, const string& pin, int currency = 0,
+                    optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        if (findAccount(accountNum)) throw runtime_error("Account number already exists");
+        if (currency == fx.base()) currency = 0;
+        if (currency && store) throw runtime_error("Currencies need the in-memory book");
+        if (auto id = fx.current()->idOf(currency); currency && !(id && fx.current()->hasRate(*id)))
+            throw runtime_error("No exchange rate for " + currencyCode(currency));
+        auto& acc = accounts.emplace_back(name, accountNum, balance, pin);
+        acc.setCurrency(fx.idFor(currency));
+        audit.append("addAccount", accountNum, currency, balance, name, acc.getPinHash());
+        audit.commit(level.value_or(durability.addAccount));
+        writeBack(acc);
+        if (currency) {
+            currencies.set(accountNum, currency);
+            saveCurrencies();
+        }
+        maybeCheckpoint();
+        cout << "Account created successfully.\n";
+    }
+
+    void showAllAccounts() const {
+        cout << "\n--- All Accounts ---\n";
+        bool any = false;
+        forEachAccount([&](const BankAccount& acc) {
+            any = true;
+            cout << "Name: " << acc.getName()
+                 << " | Account: " << acc.getAccountNum()
+                 << " | Balance: " << acc.getBalance();
+            if (acc.getCurrency()) cout << ' ' << fx.name(acc.getCurrency());
+            cout << '\n';
+        });
+        if (!any) cout << "No accounts available.\n";
+    }
+
+    [[nodiscard]] optional<reference_wrapper<BankAccount>> findAccount(int accountNum) {
+        auto it = ranges::find_if(accounts, [&](BankAccount& acc) { return acc.getAccountNum() == accountNum; });
+        if (it != accounts.end()) return std::ref(*it);
+        if (store) {
+            if (auto acc = store->get(accountNum)) return std::ref(accounts.emplace_back(std::move(*acc)));
+        }
+        return nullopt;
+    }
+
+    void deposit(int accNum, double amount, const string& pin, optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        auto acc = findAccount(accNum);
+        if (!acc) return (void)(cout << "Account not found.\n");
+        if (!authenticate(acc->get(), pin)) return;
+        acc->get().deposit(amount);
+        audit.append("deposit", accNum, 0, amount);
+        audit.commit(level.value_or(durability.deposit));
+        writeBack(acc->get());
+        maybeCheckpoint();
+        cout << "Deposit successful.\n";
+    }
+
+    void withdraw(int accNum, double amount, const string& pin, optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        auto acc = findAccount(accNum);
+        if (!acc) return (void)(cout << "Account not found.\n");
+        if (!authenticate(acc->get(), pin)) return;
+        const auto now = AuditLog::nowMillis();
+        if (auto error = screenDebit(accNum, amount, now)) throw runtime_error(*error);
+        acc->get().withdraw(amount);
+        countDebit(accNum, amount, now);
+        audit.append("withdraw", accNum, 0, amount);
+        audit.commit(level.value_or(durability.withdraw));
+        writeBack(acc->get());
+        maybeCheckpoint();
+        cout << "Withdrawal successful.\n";
+    }
+
+    void transfer(int fromAcc, int toAcc, double amount, const string& pin, optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        auto from = findAccount(fromAcc);
+        auto to = findAccount(toAcc);
+        if (!from || !to) throw runtime_error("One or both accounts not found");
+        if (fromAcc == toAcc) throw runtime_error("Cannot transfer to same account");
+        if (!authenticate(from->get(), pin)) return;
+        AuditRecord cmd;
+        cmd.account = fromAcc;
+        cmd.other = toAcc;
+        cmd.amount = amount;
+        if (auto error = priceTransfer(cmd)) throw runtime_error(*error);
+        const auto now = AuditLog::nowMillis();
+        if (auto error = screenDebit(fromAcc, amount, now)) throw runtime_error(*error);
+        to->get().checkDeposit(cmd.credit());
+        from->get().withdraw(amount);
+        to->get().deposit(cmd.credit());
+        countDebit(fromAcc, amount, now);
+        audit.append("transfer", fromAcc, toAcc, amount, cmd.text);
+        audit.commit(level.value_or(amount >= durability.largeTransfer ? Durability::Sync : durability.transfer));
+        writeBack(from->get());
+        writeBack(to->get());
+        maybeCheckpoint();
+        cout << "Transfer successful.\n";
+    }
+
+    void updateName(int accNum, const string& newName, const string& pin, optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        auto acc = findAccount(accNum);
+        if (!acc) return (void)(cout << "Account not found.\n");
+        if (!authenticate(acc->get(), pin)) return;
+        acc->get().updateName(newName);
+        audit.append("updateName", accNum, 0, 0.0, newName);
+        audit.commit(level.value_or(durability.updateName));
+        writeBack(acc->get());
+        maybeCheckpoint();
+        cout << "Account name updated.\n";
+    }
+
+    void closeAccount(int accNum, const string& pin, optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        auto acc = findAccount(accNum);
+        if (!acc) return (void)(cout << "Account not found.\n");
+
+        if (!authenticate(acc->get(), pin)) return;
+        if (acc->get().getHeld() > 0) return (void)(cout << "Account has open holds; capture or release them first.\n");
+        if (ranges::any_of(standing.all(), [&](const auto& o) { return o.second.from == accNum || o.second.to == accNum; }))
+            return (void)(cout << "Account has standing orders; cancel them first.\n");
+        if (acc->get().getBalance() < 0) return (void)(cout << "Account has a balance owing; repay it first.\n");
+        audit.append("closeAccount", accNum, 0, acc->get().getBalance(), acc->get().getName());
+        audit.commit(level.value_or(durability.closeAccount));
+        if (store) store->erase(accNum);
+#ifdef BANK_HAVE_MMAP
+        if (shared) shared->unpublish(accNum);
+#endif
+        erase_if(accounts, [&](const BankAccount& a) { return a.getAccountNum() == accNum; });
+        interest.drop(accNum);
+        currencies.drop(accNum);
+        maybeCheckpoint();
+        cout << "Account closed successfully.\n";
+    }
+
+    // Releases every hold whose time has passed. Runs at the start of each operation and
+    // from runScheduled(); with nothing due it costs one look at the wheel.
+    void expireHolds() {
+        auto due = holds.due(AuditLog::nowMillis());
+        if (due.empty()) return;
+        for (auto id : due) {
+            const auto* h = holds.find(id);
+            AuditRecord cmd;
+            cmd.op = "release";
+            cmd.account = h->account;
+            cmd.amount = h->amount;
+            cmd.aux = id;
+            cmd.text = "expired";
+            if (applyEffect(cmd)) continue;
+            audit.appendRecord(cmd);
+            if (auto acc = findAccount(cmd.account)) writeBack(acc->get());
+        }
+        audit.commit(durability.release);
+        maybeCheckpoint();
+    }
+
+    void placeHold(int accNum, double amount, chrono::seconds lifetime, const string& pin, optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        auto acc = findAccount(accNum);
+        if (!acc) return (void)(cout << "Account not found.\n");
+        if (!authenticate(acc->get(), pin)) return;
+        const auto id = holds.newId();
+        auto cmd = HoldBook::holdCommand(accNum, amount, id, AuditLog::nowMillis() + chrono::milliseconds(lifetime).count());
+        if (auto error = execute(std::move(cmd), nullopt, level)) throw runtime_error(*error);
+        cout << "Hold " << id << " placed. Available balance: " << findAccount(accNum)->get().getAvailableBalance() << '\n';
+    }
+
+    void captureHold(uint64_t id, double amount, const string& pin, optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        const auto* h = holds.find(id);
+        if (!h) return (void)(cout << "Hold not found (it may have expired).\n");
+        auto acc = findAccount(h->account);
+        if (!acc || !authenticate(acc->get(), pin)) return;
+        AuditRecord cmd;
+        cmd.op = "withdraw";
+        cmd.account = h->account;
+        cmd.amount = amount;
+        cmd.text = HoldBook::captureText(id);
+        if (auto error = execute(std::move(cmd), nullopt, level)) throw runtime_error(*error);
+        cout << "Captured " << amount << " from hold " << id << ".\n";
+    }
+
+    void releaseHold(uint64_t id, const string& pin, optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        const auto* h = holds.find(id);
+        if (!h) return (void)(cout << "Hold not found (it may have expired).\n");
+        auto acc = findAccount(h->account);
+        if (!acc || !authenticate(acc->get(), pin)) return;
+        AuditRecord cmd;
+        cmd.op = "release";
+        cmd.account = h->account;
+        cmd.amount = h->amount;
+        cmd.aux = id;
+        if (auto error = execute(std::move(cmd), nullopt, level)) throw runtime_error(*error);
+        cout << "Hold " << id << " released.\n";
+    }
+
+    [[nodiscard]] size_t openHolds() const { return holds.size(); }
+
+    // Runs the standing orders due now as one batch through the transfer path: each run
+    // is checked and applied like a transfer, and the runs share one commit. A run that
+    // fails (insufficient funds, say) is retried after retryDelay, and skipped once the
+    // next occurrence would come first; the skip is logged with the runs, so a restart
+    // does not bring the occurrence back. Returns the number of transfers made.
+    size_t runDueOrders() {
+        const auto now = AuditLog::nowMillis();
+        auto due = standing.due(now);
+        if (due.empty()) return 0;
+        releaseWorkingSet();
+        vector<int> touched;
+        bool large = false, skipped = false;
+        for (auto id : due) {
+            auto* order = standing.find(id);
+            const auto n = order->runs;
+            AuditRecord cmd;
+            cmd.op = "transfer";
+            cmd.account = order->from;
+            cmd.other = order->to;
+            cmd.amount = order->amount;
+            cmd.text = StandingOrders::runText(id, n);
+            auto error = priceTransfer(cmd);
+            if (!error) error = applyEffect(cmd);
+            if (error) {
+                order->lastError = *error;
+                const auto retry = now + chrono::milliseconds(StandingOrders::retryDelay).count();
+                if (order->period != StandingOrders::Period::Once && StandingOrders::occurrence(*order, n + 1) <= retry) {
+                    audit.appendRecord(StandingOrders::skipCommand(id, *order, n));
+                    standing.settle(id, n);
+                    skipped = true;
+                } else
+                    standing.wake(id, retry);
+                continue;
+            }
+            order->lastError.clear();
+            audit.appendRecord(cmd);
+            large |= cmd.amount >= durability.largeTransfer;
+            touched.insert(touched.end(), {cmd.account, cmd.other});
+            standing.settle(id, n);
+        }
+        if (touched.empty() && !skipped) return 0;
+        audit.commit(large ? Durability::Sync : durability.transfer);
+        for (int num : touched)
+            if (auto acc = findAccount(num)) writeBack(acc->get());
+        maybeCheckpoint();
+        return touched.size() / 2;
+    }
+
+    // Assesses the fee rules in fee_rules.txt against every account, on partitions of the
+    // book in parallel, with activity read from the log since the last run. Without post
+    // nothing changes. With post the fees are withdrawn and logged as "fee <rule>" under
+    // one commit, and a new period starts. Returns the totals either way.
+    FeeBook::Totals assessFees(bool post) {
+        if (store) throw runtime_error("Fees need the in-memory book");
+        FeeBook::Totals totals;
+        if (const auto file = feeRulesFile(); !file.empty()) {
+            if (ifstream in(file); in) totals.rules = FeeBook::loadRules(in);
+        }
+        totals.count.assign(totals.rules.size(), 0);
+        totals.charged.assign(totals.rules.size(), 0.0);
+
+        audit.commit(Durability::Async); // the scan reads the file
+        auto activity = fees.allActivity();
+        const uint64_t through = audit.lastSeq();
+        if (!auditFile.empty())
+            for (const auto& r : AuditLog::readAll(auditFile, fees.scannedSeq))
+                if (r.seq > fees.scannedSeq && r.seq <= through) FeeBook::observe(activity, r);
+
+        const auto now = AuditLog::nowMillis();
+        map<size_t, vector<FeeBook::Charge>> charges; // by partition start, to post in book order
+        mutex merge;
+        parallelFor(accounts.size(), 1 << 14, [&](size_t begin, size_t end) {
+            vector<FeeBook::Charge> part;
+            FeeBook::Totals partTotals{{}, vector<size_t>(totals.rules.size()), vector<double>(totals.rules.size())};
+            for (size_t i = begin; i < end; ++i) {
+                const auto& acc = accounts[i];
+                auto it = activity.find(acc.getAccountNum());
+                const auto a = it != activity.end() ? it->second : FeeBook::Activity{fees.since, 0};
+                fees.assess(totals.rules, acc, interest.productOf(acc.getAccountNum()), a, now, i, part, partTotals);
+            }
+            lock_guard lock(merge);
+            totals.add(partTotals);
+            charges.emplace(begin, std::move(part));
+        });
+        if (!post) return totals;
+
+        // Nothing is changed until every charge has been checked: a run stopped half way
+        // would be committed with the next record and charged again by the next run.
+        for (const auto& [begin, part] : charges)
+            for (size_t i = 0; i < part.size();) {
+                const size_t index = part[i].index; // an account's charges are adjacent
+                double total = 0;
+                for (; i < part.size() && part[i].index == index; ++i)
+                    total += part[i].amount > 0 ? part[i].amount : numeric_limits<double>::infinity();
+                if (total > FeeBook::collectable(accounts[index]) + 0.005)
+                    throw runtime_error("Fees for account " + to_string(accounts[index].getAccountNum()) + " exceed what it can pay");
+            }
+        // Bank charges, so past the limits a customer's withdrawal meets.
+        AuditRecord posting;
+        posting.op = "withdraw";
+        vector<size_t> charged;
+        for (const auto& [begin, part] : charges)
+            for (const auto& c : part) {
+                auto& acc = accounts[c.index];
+                acc.debit(c.amount);
+                posting.account = acc.getAccountNum();
+                posting.amount = c.amount;
+                posting.text = FeeBook::postingText(totals.rules[c.rule].kind);
+                audit.appendRecord(posting);
+                charged.push_back(c.index);
+            }
+        for (auto& [num, a] : activity) a.transactions = 0;
+        fees.replace(std::move(activity));
+        fees.scannedSeq = audit.lastSeq();
+        fees.lastMonth = FeeBook::monthOf(now);
+        saveFees();
+        audit.commit(Durability::Sync);
+        for (auto index : charged) writeBack(accounts[index]);
+        maybeCheckpoint();
+        return totals;
+    }
+
+    static void printFees(const FeeBook::Totals& totals, bool posted) {
+        ostringstream out;
+        out << (posted ? "\n--- Fees Posted ---\n" : "\n--- Fee Assessment (dry run) ---\n") << fixed << setprecision(2);
+        if (totals.rules.empty()) out << "No rules in fee_rules.txt.\n";
+        double sum = 0;
+        for (size_t k = 0; k < totals.rules.size(); ++k) {
+            const auto& r = totals.rules[k];
+            out << FeeBook::kindName(r.kind) << " (product " << r.product << ", threshold " << r.threshold << ", fee "
+                << r.fee << "): " << totals.count[k] << " accounts, " << totals.charged[k] << '\n';
+            sum += totals.charged[k];
+        }
+        out << "Total " << sum << "; not collectable " << totals.uncollected << '\n';
+        cout << out.str();
+    }
+
+    // Everything that happens on time rather than on request; called about once a second.
+    void runScheduled() {
+        const auto now = AuditLog::nowMillis();
+        expireHolds();
+        runDueOrders();
+        accrueInterest(InterestBook::dayOf(now) - 1);
+        if (!store && !feesFile().empty() && fees.lastMonth < FeeBook::monthOf(now)) assessFees(true);
+    }
+
+    void scheduleTransfer(int fromAcc, int toAcc, double amount, StandingOrders::Period period, int64_t firstDue,
+                          const string& pin, optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        auto from = findAccount(fromAcc);
+        if (!from) return (void)(cout << "Account not found.\n");
+        if (!authenticate(from->get(), pin)) return;
+        const auto id = standing.newId();
+        if (auto error = execute(StandingOrders::scheduleCommand(id, fromAcc, toAcc, amount, period, firstDue), nullopt, level))
+            throw runtime_error(*error);
+        saveOrders();
+        cout << "Standing order " << id << " scheduled.\n";
+    }
+
+    void cancelStandingOrder(uint64_t id, const string& pin, optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        const auto* order = standing.find(id);
+        if (!order) return (void)(cout << "Standing order not found.\n");
+        auto from = findAccount(order->from);
+        if (!from || !authenticate(from->get(), pin)) return;
+        AuditRecord cmd;
+        cmd.op = "cancelOrder";
+        cmd.account = order->from;
+        cmd.other = order->to;
+        cmd.amount = order->amount;
+        cmd.aux = id;
+        if (auto error = execute(std::move(cmd), nullopt, level)) throw runtime_error(*error);
+        saveOrders();
+        cout << "Standing order " << id << " cancelled.\n";
+    }
+
+    void showStandingOrders() const {
+        cout << "\n--- Standing Orders ---\n";
+        if (standing.all().empty()) cout << "No standing orders.\n";
+        for (const auto& [id, o] : standing.all()) {
+            const auto next = static_cast<time_t>(StandingOrders::nextDue(o) / 1000);
+            cout << "Order " << id << ": " << o.amount << " from " << o.from << " to " << o.to << ", "
+                 << StandingOrders::periodName(o.period) << " | next " << put_time(localtime(&next), "%Y-%m-%d %H:%M:%S")
+                 << " | runs " << o.runs;
+            if (!o.lastError.empty()) cout << " | last attempt failed: " << o.lastError;
+            cout << '\n';
+        }
+    }
+
+    [[nodiscard]] size_t standingOrderCount() const { return standing.all().size(); }
+
+    // End of day: accrues every whole day since the last accrual up to and including
+    // throughDay, one batch per day. Each batch gathers the accounts on a product into
+    // columns, runs InterestBook::accrue over them and posts the interest as deposits
+    // tagged "interest <date>" under one commit; on loans the product charges it instead,
+    // as a withdrawal with the same tag. Catching up on missed days compounds on today's
+    // balances. Returns the net cents paid.
+    int64_t accrueInterest(int64_t throughDay) {
+        if (interest.accountCount() == 0 || store) {
+            interest.lastDay = max(interest.lastDay, throughDay);
+            return 0;
+        }
+        int64_t paid = 0;
+        for (auto day = interest.lastDay + 1; day <= throughDay; ++day) {
+            const auto accrual = accrueDay();
+            AuditRecord posting;
+            posting.text = InterestBook::postingText(day);
+            vector<BankAccount*> credited;
+            for (size_t i = 0; i < accrual.who.size(); ++i) {
+                if (accrual.earned[i] <= 0) continue;
+                auto* acc = accrual.who[i];
+                posting.account = acc->getAccountNum();
+                posting.amount = static_cast<double>(accrual.earned[i]) / 100;
+                if (accrual.direction[i] > 0) {
+                    posting.op = "deposit";
+                    acc->deposit(posting.amount);
+                } else {
+                    posting.op = "withdraw";
+                    acc->debit(posting.amount); // charged even past the credit line
+                }
+                audit.appendRecord(posting);
+                credited.push_back(acc);
+                paid += accrual.direction[i] * accrual.earned[i];
+            }
+            interest.lastDay = day;
+            saveInterest();
+            audit.commit(Durability::Sync);
+            for (auto* acc : credited) writeBack(*acc);
+        }
+        maybeCheckpoint();
+        return paid;
+    }
+
+    void defineProduct(uint32_t id, const string& name, double ratePercent, AccountKind kind,
+                       optional<Durability> level = nullopt) {
+        auto cmd = InterestBook::productCommand(id, name, static_cast<int32_t>(llround(ratePercent * 100)), kind);
+        if (auto error = execute(std::move(cmd), nullopt, level)) throw runtime_error(*error);
+        saveInterest();
+        cout << "Product " << id << " defined.\n";
+    }
+
+    void setAccountProduct(int accNum, uint32_t product, const string& pin, optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        auto acc = findAccount(accNum);
+        if (!acc) return (void)(cout << "Account not found.\n");
+        if (!authenticate(acc->get(), pin)) return;
+        if (auto error = execute(InterestBook::assignCommand(accNum, product), nullopt, level)) throw runtime_error(*error);
+        saveInterest();
+        cout << "Account " << accNum << " is now on product " << product << ".\n";
+    }
+
+    // Sets the credit line of one account, or with accNum 0 of every account on product
+    // (pin then goes unused); nullopt goes back to the default.
+    void setCreditLimit(int accNum, uint32_t product, optional<double> line, const string& pin,
+                        optional<Durability> level = nullopt) {
+        releaseWorkingSet();
+        if (accNum) {
+            auto acc = findAccount(accNum);
+            if (!acc) return (void)(cout << "Account not found.\n");
+            if (!authenticate(acc->get(), pin)) return;
+        }
+        if (auto error = execute(InterestBook::creditLimitCommand(accNum, product, line), nullopt, level))
+            throw runtime_error(*error);
+        saveInterest();
+        if (accNum) cout << "Account " << accNum << " can now spend " << findAccount(accNum)->get().getAvailableBalance() << ".\n";
+        else cout << "Credit limit of product " << product << " updated.\n";
+    }
+
+    void showProducts() const {
+        ostringstream out;
+        out << "\n--- Interest Products ---\n" << fixed << setprecision(2);
+        if (interest.allProducts().empty()) out << "No products.\n";
+        for (const auto& [id, p] : interest.allProducts())
+            out << "Product " << id << ": " << p.name << " | " << accountKindName(p.kind) << " | " << p.rateBp / 100.0
+                << "% a year | credit limit " << limitsOf(p.kind, interest.productCreditLine(id)).overdraft << '\n';
+        out << "Last accrual: " << InterestBook::dayName(interest.lastDay) << '\n';
+        cout << out.str();
+    }
+
+    void setBaseCurrency(int code) { fx.setBase(code); }
+    [[nodiscard]] int baseCurrency() const { return fx.base(); }
+    [[nodiscard]] string currencyName(uint16_t id) const { return fx.name(id); }
+
+    // Publishes fx_rates.txt as the next rate table when it has changed since the last
+    // reload. It touches only the rate tables, so it runs without holding the book.
+    bool reloadRates() {
+        const auto file = ratesFile();
+        error_code ec;
+        const auto stamp = file.empty() ? fs::file_time_type() : fs::last_write_time(file, ec);
+        if (file.empty() || ec || ratesStamp.exchange(stamp.time_since_epoch().count()) == stamp.time_since_epoch().count())
+            return false;
+        ifstream in(file);
+        fx.publish(FxRates::parse(in));
+        return true;
+    }
+
+    void showRates() const {
+        const auto rates = fx.current();
+        ostringstream out;
+        out << "\n--- Exchange Rates (table " << rates->version << ") ---\n" << setprecision(8);
+        const auto base = currencyCode(rates->codes[0]);
+        out << "Base currency: " << base << '\n';
+        for (uint16_t id = 1; id < rates->codes.size(); ++id) {
+            out << currencyCode(rates->codes[id]) << ": ";
+            if (rates->hasRate(id)) out << rates->toBase[id] << ' ' << base << '\n';
+            else out << "no rate\n";
+        }
+        if (rates->codes.size() == 1) out << "No other currencies.\n";
+        cout << out.str();
+    }
+
+    struct Revaluation {
+        uint64_t version; // of the rate table used
+        size_t accounts;
+        double total;
+        vector<tuple<int, double, double>> byCurrency; // code, total in it, and in the reporting currency
+        vector<pair<int, double>> largest;             // accounts with the largest values
+        double seconds;
+    };
+
+    // Values the whole book in one currency at the rates published now. Balances and
+    // currency ids are laid out as columns and revalued in one parallel, vectorized pass.
+    Revaluation revalueBook(int currency) {
+        if (store) throw runtime_error("Revaluation needs the in-memory book");
+        const auto rates = fx.current();
+        const auto report = rates->idOf(currency);
+        if (!report || !rates->hasRate(*report)) throw runtime_error("No exchange rate for " + currencyCode(currency));
+        const auto start = chrono::steady_clock::now();
+        const size_t n = accounts.size(), currencies = rates->codes.size();
+        vector<double> balances(n), values(n), native(currencies), factor(currencies);
+        vector<int32_t> ids(n);
+        vector<size_t> holders(currencies);
+        for (size_t i = 0; i < n; ++i) {
+            balances[i] = accounts[i].getBalance();
+            ids[i] = accounts[i].getCurrency();
+            native[ids[i]] += balances[i];
+            ++holders[ids[i]];
+        }
+        for (size_t id = 0; id < currencies; ++id) {
+            factor[id] = rates->toBase[id] / rates->toBase[*report];
+            if (holders[id] && isnan(factor[id])) throw runtime_error("No exchange rate for " + currencyCode(rates->codes[id]));
+        }
+        Revaluation result{rates->version, n, FxRates::revalue(balances, ids, factor, values), {}, {}, 0};
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        for (size_t id = 0; id < currencies; ++id)
+            if (holders[id]) result.byCurrency.emplace_back(rates->codes[id], native[id], native[id] * factor[id]);
+        vector<size_t> order(n);
+        iota(order.begin(), order.end(), size_t{0});
+        const auto top = min<size_t>(n, 5);
+        ranges::partial_sort(order, order.begin() + top, ranges::greater{}, [&](size_t i) { return values[i]; });
+        for (size_t k = 0; k < top; ++k) result.largest.emplace_back(accounts[order[k]].getAccountNum(), values[order[k]]);
+        return result;
+    }
+
+    static void printRevaluation(const Revaluation& r, int currency) {
+        ostringstream out;
+        const auto code = currencyCode(currency);
+        out << "\n--- Book in " << code << " (rate table " << r.version << ") ---\n" << fixed << setprecision(2);
+        for (const auto& [c, native, value] : r.byCurrency)
+            out << currencyCode(c) << ": " << native << " = " << value << ' ' << code << '\n';
+        out << "Total: " << r.total << ' ' << code << " over " << r.accounts << " accounts (" << setprecision(1)
+            << r.seconds * 1000 << " ms)\n" << setprecision(2);
+        for (const auto& [account, value] : r.largest) out << "  account " << account << ": " << value << ' ' << code << '\n';
+        cout << out.str();
+    }
+
+    void showFraudAlerts() const {
+        ostringstream out;
+        out << "\n--- Fraud Rules ---\n";
+        if (!fraud.active()) out << "No rules (see fraud_rules.txt).\n";
+        for (size_t k = 0; k < fraud.rules().size(); ++k) out << "Rule " << k + 1 << ": " << FraudMonitor::describe(fraud.rules()[k]) << '\n';
+        out << "--- Recent Alerts ---\n" << fixed << setprecision(2);
+        if (alerts.empty()) out << "No alerts.\n";
+        for (const auto& a : alerts | views::reverse | views::take(20)) {
+            const auto t = static_cast<time_t>(a.time / 1000);
+            out << put_time(localtime(&t), "%Y-%m-%d %H:%M:%S") << " | Account " << a.account << " | rule " << a.rule + 1
+                << " | debit " << a.amount << " | ";
+            if (fraud.rules()[a.rule].measure == FraudMonitor::Measure::Count) out << setprecision(0) << a.observed << " debits";
+            else out << a.observed << " in the window";
+            out << setprecision(2) << '\n';
+        }
+        cout << out.str();
+    }
+
+    void showHighBalance(double threshold) const {
+        cout << "--- Accounts above " << threshold << " ---\n";
+        bool found = false;
+        forEachAccount([&](const BankAccount& acc) {
+            if (acc.getBalance() >= threshold) {
+                found = true;
+                cout << "Name: " << acc.getName()
+                     << " | Account: " << acc.getAccountNum()
+                     << " | Balance: " << acc.getBalance() << '\n';
+            }
+        });
+        if (!found) cout << "No accounts meet the threshold.\n";
+    }
+
+    void sortAccountsByBalance() {
+        if (store) throw runtime_error("Sorting is not available with a storage engine (accounts are kept in key order)");
+        ranges::sort(accounts, {}, &BankAccount::getBalance);
+        cout << "Accounts sorted by balance.\n";
+    }
+
+    // Re-applies log records written after the snapshot was saved, e.g. after a crash.
+    // Storage engines persist every write themselves and are not replayed.
+    void recoverFromLog(const string& logFile) {
+        if (store || !snapshotSeq) return;
+        auto log = AuditLog::readAll(logFile, *snapshotSeq);
+        auto stats = LogReplayer::replay(accounts, log, *snapshotSeq);
+        if (stats.records >= 10'000) checkpointPolicy.replayRecordsPerSecond = stats.records / max(stats.seconds, 1e-9);
+        if (stats.damagedAt)
+            cout << "Audit log damaged at record " << *stats.damagedAt << "; recovery stopped before it.\n";
+        if (!stats.records) return;
+        ostringstream line;
+        line << "Recovered " << stats.records << " log records in " << fixed << setprecision(1)
+             << stats.seconds * 1000 << " ms (" << setprecision(0) << stats.records / max(stats.seconds, 1e-9)
+             << " records/s, " << stats.partitions << " partitions)\n";
+        cout << line.str();
+        if (stats.anomalies) cout << stats.anomalies << " records did not match the snapshot and were skipped.\n";
+    }
+
+    void openAuditLog(const string& filename) {
+        auditFile = filename;
+        audit.open(filename);
+        reloadFromLog();
+    }
+
+    void verifyAuditLog() const {
+        auto result = AuditLog::verify(auditFile);
+        cout << "Audit records checked: " << result.records
+             << " (SHA-256 " << (Sha256::hardwareAccelerated() ? "SHA-NI" : "portable") << ")\n";
+        if (result.firstBadSeq)
+            cout << "Audit chain BROKEN at record " << *result.firstBadSeq << ".\n";
+        else
+            cout << "Audit chain intact.\n";
+    }
+
+    // Account as it stood at time (milliseconds since epoch), without touching the live book.
+    [[nodiscard]] optional<BankAccount> accountAsOf(int accountNum, int64_t time) {
+        audit.commit(Durability::Sync);
+        return PointInTime::accountAt(snapshotFile, auditFile, accountNum, time);
+    }
+
+    // Writes the book as it stood at time into targetDir as a fresh bank: starting the
+    // program there opens a new audit chain on top of the restored snapshot.
+    size_t restoreAsOf(int64_t time, const fs::path& targetDir) {
+        if (snapshotFile.empty() || auditFile.empty()) throw runtime_error("No book loaded");
+        audit.commit(Durability::Sync);
+        auto book = PointInTime::bookAt(snapshotFile, auditFile, time);
+        fs::create_directories(targetDir);
+        writeSnapshot((targetDir / fs::path(snapshotFile).filename()).string(), book, 0, time);
+        return book.size();
+    }
+
+    void saveToFile(const string& filename) {
+        if (checkpointWriter.joinable()) checkpointWriter.join();
+        if (backupWriter.joinable()) backupWriter.join();
+        saveOrders();
+        saveInterest();
+        saveCurrencies();
+        if (store) return store->flush(); // the engine persists incrementally
+        writeSnapshot(filename, accounts, audit.lastSeq(), audit.lastTimestamp());
+    }
+
+    void setCheckpointPolicy(const CheckpointPolicy& policy) { checkpointPolicy = policy; }
+
+    // Streams a consistent copy of the bank into targetDir while operations continue:
+    // the archived audit segments, a snapshot of the book as of now, and the log tail
+    // written meanwhile. Starting the bank inside targetDir recovers to the tail's end.
+    // Only the in-memory copy of the book is taken on this thread; all I/O happens in
+    // the background at bytesPerSecond.
+    void startBackup(const fs::path& targetDir, double bytesPerSecond) {
+        if (store) throw runtime_error("Online backup supports the in-memory book only");
+        if (snapshotFile.empty() || auditFile.empty()) throw runtime_error("No book loaded");
+        if (backupWriter.joinable()) backupWriter.join();
+        fs::create_directories(targetDir);
+        audit.commit(Durability::Sync); // everything acknowledged so far is on disk
+        const uint64_t seq = audit.lastSeq();
+        const int64_t time = audit.lastTimestamp();
+        const uint64_t tailFrom = audit.activeFirstSeq();
+        auto archived = AuditLog::segments(auditFile);
+        archived.pop_back(); // the active file is copied as the tail instead
+        backupWriter = jthread([book = accounts, seq, time, tailFrom, archived, targetDir, bytesPerSecond,
+                                logFile = auditFile, snapshotName = fs::path(snapshotFile).filename()] {
+            try {
+                auto start = chrono::steady_clock::now();
+                Throttle throttle(bytesPerSecond);
+                const fs::path logName = fs::path(logFile).filename();
+                const fs::path archiveDir = targetDir / AuditLog::archiveDirFor(logName);
+                if (!archived.empty()) fs::create_directories(archiveDir);
+                for (const auto& segment : archived) copyFileThrottled(segment, archiveDir / segment.filename(), throttle);
+                writeSnapshot((targetDir / snapshotName).string(), book, seq, time, &throttle);
+
+                // Tail: every record from the active segment as of the start, up to now
+                uint64_t lastCopied = seq;
+                ofstream tail(targetDir / logName, ios::trunc);
+                for (const auto& r : AuditLog::readAll(logFile, tailFrom - 1)) {
+                    if (r.seq < tailFrom) continue;
+                    r.save(tail);
+                    lastCopied = r.seq;
+                }
+                if (!tail.flush()) throw runtime_error("Cannot write log tail");
+                throttle.consume(static_cast<size_t>(tail.tellp()));
+
+                auto secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                ostringstream msg;
+                msg << "\n[backup] " << targetDir.string() << ": snapshot at record " << seq << ", log through "
+                    << lastCopied << ", " << throttle.total() / 1024 << " KiB in " << fixed << setprecision(2) << secs << " s\n";
+                cout << msg.str() << flush;
+            } catch (const exception& e) {
+                cerr << "\n[backup] failed: " << e.what() << '\n';
+            }
+        });
+    }
+
+    // Folds the log into a fresh snapshot and rotates the audit segment, which bounds
+    // what recovery has to replay. The snapshot itself is written on a background
+    // thread from a copy of the book; until it lands, recovery still finds the rotated
+    // segment in the archive. A copy of each snapshot is retained for point-in-time queries.
+    void checkpoint() {
+        if (checkpointWriter.joinable()) checkpointWriter.join();
+        saveOrders(); // keeps the log replayed for them at startup short
+        saveInterest();
+        saveCurrencies();
+        if (store) {
+            store->flush();
+            audit.rotate();
+            return;
+        }
+        if (snapshotFile.empty()) return;
+        uint64_t seq = audit.lastSeq();
+        int64_t time = audit.lastTimestamp();
+        audit.rotate();
+        checkpointWriter = jthread([book = accounts, seq, time, file = snapshotFile, retain = checkpointPolicy.retainedCheckpoints] {
+            try {
+                writeSnapshot(file, book, seq, time);
+                if (!retain) return;
+                auto dir = PointInTime::checkpointDirFor(file);
+                fs::create_directories(dir);
+                ostringstream name;
+                name << "checkpoint-" << setw(12) << setfill('0') << seq << ".txt";
+                fs::copy_file(file, dir / name.str(), fs::copy_options::overwrite_existing);
+                vector<fs::path> kept;
+                for (const auto& entry : fs::directory_iterator(dir))
+                    if (entry.path().filename().string().starts_with("checkpoint-")) kept.push_back(entry.path());
+                ranges::sort(kept); // zero-padded sequence numbers sort chronologically
+                for (size_t i = 0; i + retain < kept.size(); ++i) fs::remove(kept[i]);
+            } catch (const exception& e) {
+                cerr << "Checkpoint failed: " << e.what() << '\n';
+            }
+        });
+    }
+
+    void loadFromFile(const string& filename) {
+        snapshotFile = filename;
+        snapshotSeq = 0;
+        if (!fs::exists(filename)) return;
+        if (store && !store->empty()) return; // the engine already holds the book
+        ifstream in(filename);
+        accounts.clear();
+        snapshotSeq = readSnapshotHeader(in).seq; // unset: cannot be replayed onto
+        while (true) {
+            auto acc = BankAccount::load(in);
+            if (!acc) break;
+            if (store) store->put(*acc);
+            else accounts.push_back(*acc);
+        }
+    }
+};
+
+// ---------------- Sharding ----------------
+#ifdef BANK_HAVE_SOCKETS
+// Consistent-hash ring: each shard (named by its port) owns virtualNodes points and an
+// account belongs to the first point at or after its hash. Adding a shard only takes
+// over the arcs in front of its points, about 1/N of the accounts.
+class HashRing {
+private:
+    int virtualNodes;
+    map<uint64_t, uint16_t> points;
+
+public:
+    explicit HashRing(int vnodes = 64) : virtualNodes(vnodes) {}
+
+    void add(uint16_t shard) {
+        for (int v = 0; v < virtualNodes; ++v) points[hashKey((uint64_t{shard} << 16) | static_cast<uint64_t>(v))] = shard;
+    }
+
+    void remove(uint16_t shard) {
+        erase_if(points, [&](const auto& p) { return p.second == shard; });
+    }
+
+    [[nodiscard]] uint16_t owner(int accountNum) const {
+        if (points.empty()) throw runtime_error("No shards configured");
+        auto it = points.lower_bound(hashKey(static_cast<uint32_t>(accountNum)));
+        return it == points.end() ? points.begin()->second : it->second;
+    }
+
+    [[nodiscard]] vector<uint16_t> members() const {
+        vector<uint16_t> shards;
+        for (const auto& [point, shard] : points) shards.push_back(shard);
+        ranges::sort(shards);
+        shards.erase(ranges::unique(shards).begin(), shards.end());
+        return shards;
+    }
+
+    // "<virtualNodes> <port,port,...>", the form shards are told about a new layout in.
+    [[nodiscard]] string spec() const {
+        string out = to_string(virtualNodes) + ' ';
+        for (auto shard : members()) out += to_string(shard) + ',';
+        out.pop_back();
+        return out;
+    }
+
+    static HashRing parse(istream& in) {
+        int vnodes{};
+        string list;
+        in >> vnodes >> list;
+        HashRing ring(vnodes);
+        for (auto part : views::split(list, ',')) ring.add(static_cast<uint16_t>(stoul(string(part.begin(), part.end()))));
+        return ring;
+    }
+};
+
+struct AccountRange {
+    int first{};
+    int last{};
+    uint16_t shard{};
+};
+
+// Where every account lives: ranges of account numbers pinned to a shard by an explicit
+// move, and the hash ring for everything else. Later pins win over earlier ones.
+class ShardLayout {
+private:
+    HashRing ring;
+    vector<AccountRange> pinned;
+
+public:
+    explicit ShardLayout(const vector<uint16_t>& ringShards = {}, int vnodes = 64) : ring(vnodes) {
+        for (auto shard : ringShards) ring.add(shard);
+    }
+
+    void addToRing(uint16_t shard) { ring.add(shard); }
+    void pin(const AccountRange& range) { pinned.push_back(range); }
+
+    [[nodiscard]] uint16_t owner(int accountNum) const {
+        for (const auto& range : views::reverse(pinned))
+            if (accountNum >= range.first && accountNum <= range.last) return range.shard;
+        return ring.owner(accountNum);
+    }
+
+    [[nodiscard]] vector<uint16_t> ringMembers() const { return ring.members(); }
+    [[nodiscard]] const vector<AccountRange>& pins() const { return pinned; }
+
+    [[nodiscard]] vector<uint16_t> shards() const {
+        auto all = ring.members();
+        for (const auto& range : pinned) all.push_back(range.shard);
+        ranges::sort(all);
+        all.erase(ranges::unique(all).begin(), all.end());
+        return all;
+    }
+
+    // Ring spec followed by "<first>-<last>:<port>,..." or "-" when nothing is pinned.
+    [[nodiscard]] string spec() const {
+        string out = ring.spec() + ' ';
+        for (const auto& range : pinned)
+            out += to_string(range.first) + '-' + to_string(range.last) + ':' + to_string(range.shard) + ',';
+        if (pinned.empty()) out += '-';
+        else out.pop_back();
+        return out;
+    }
+
+    static ShardLayout parse(istream& in) {
+        ShardLayout layout;
+        layout.ring = HashRing::parse(in);
+        string list;
+        in >> list;
+        if (list == "-") return layout;
+        for (auto part : views::split(list, ',')) {
+            AccountRange range;
+            char dash{}, colon{};
+            istringstream fields(string(part.begin(), part.end()));
+            fields >> range.first >> dash >> range.last >> colon >> range.shard;
+            layout.pin(range);
+        }
+        return layout;
+    }
+};
+
+// Append-only file of text lines made durable in batches: append() only buffers and a
+// single sync() flushes and fsyncs everything appended before it. Holds the prepare
+// records of shards and the commit decisions of the router.
+class TxLog {
+private:
+    fs::path path;
+    ofstream out;
+    int fd = -1;
+
+    void openFile() {
+        out.open(path, ios::app);
+        if (!out) throw runtime_error("Cannot open " + path.string());
+#ifdef BANK_HAVE_FSYNC
+        fd = ::open(path.c_str(), O_WRONLY);
+#endif
+    }
+
+    void closeFile() {
+        out.close();
+#ifdef BANK_HAVE_FSYNC
+        if (fd >= 0) ::close(fd);
+#endif
+        fd = -1;
+    }
+
+public:
+    explicit TxLog(fs::path file) : path(std::move(file)) { openFile(); }
+
+    TxLog(const TxLog&) = delete;
+    TxLog& operator=(const TxLog&) = delete;
+
+    ~TxLog() { closeFile(); }
+
+    [[nodiscard]] vector<string> lines() const {
+        vector<string> all;
+        ifstream in(path);
+        for (string line; getline(in, line);)
+            if (!line.empty()) all.push_back(std::move(line));
+        return all;
+    }
+
+    void append(string_view line) { out << line << '\n'; }
+
+    void sync() {
+        if (!out.flush()) throw runtime_error("Cannot write " + path.string());
+#ifdef BANK_HAVE_FSYNC
+        if (fd >= 0) ::fsync(fd);
+#endif
+    }
+
+    // Replaces the file with just these lines, durably.
+    void rewrite(const vector<string>& keep) {
+        closeFile();
+        {
+            ofstream tmp(path.string() + ".tmp", ios::trunc);
+            for (const auto& line : keep) tmp << line << '\n';
+            if (!tmp.flush()) throw runtime_error("Cannot rewrite " + path.string());
+        }
+        fs::rename(path.string() + ".tmp", path);
+        openFile();
+        sync();
+    }
+
+    [[nodiscard]] uintmax_t size() {
+        out.flush();
+        error_code ec;
+        auto bytes = fs::file_size(path, ec);
+        return ec ? 0 : bytes;
+    }
+};
+
+// Serves one shard's book to the router over loopback TCP. Requests are single lines
+// "<id> <verb> ..." and may be pipelined; replies carry the same id:
+//   get <acc>                                   -> OK <balance> "<name>"
+//   count                                       -> OK <n>
+//   list                                        -> LIST <n> + n account lines
+//   cmd <op> <acc> <other> <amount> "<pin>" "<text>" [<key>]  -> OK | ERR "<reason>"   (empty PIN: none)
+// for moving accounts while they stay available, on the source shard:
+//   migrate <id> <target> <layout spec>         -> DELTA of every account the layout gives the target
+//   delta <id>                                  -> DELTA of those accounts changed since the last reply
+//   freeze <id>                                 -> final DELTA; the accounts refuse further changes
+//                                                  (ERR while one has holds or standing orders)
+//   finish <id> <max>                           -> OK <n>: closed n of the moved accounts, done once n < max
+//   cancel <id>                                 -> OK
+// where a DELTA <n> is followed by n lines "+ <account line> <terms>" or "- <acc>", the terms
+// being "<currency> <product> [<kind> <rate bp> \"<name>\" <product line>] <account line>"
+// (the bracketed part only for a product other than 0, a line absent as "-"), and on the target:
+//   install <n> + n delta lines                 -> OK
+// and, for transfers between shards, the participant side of two-phase commit:
+//   prepare <n> + n lines "<tx> debit|credit <acc> <amount> \"<pin>\" [<key>]"
+//                                               -> VOTES <n> + n lines Y <currency> | N "<reason>" | R "<first result>"
+//   commit <tx>... | abort <tx>...              -> OK
+//   indoubt                                     -> OK <tx>...
+// A yes vote locks the account and is fsynced to the transaction file before it is sent;
+// the commit itself is the withdraw or deposit in the audit log, tagged "2pc <tx>", and
+// skips the limits the vote already checked, so it cannot fail. An idempotency key
+// travels with the debit leg, and R answers a key already used ("" for success): the
+// router aborts the retry and returns the first result.
+// Shards listen on loopback only and trust their router.
+class ShardServer {
+private:
+    struct Connection {
+        atomic<bool> done = false;
+        jthread thread;
+    };
+
+    struct PreparedTx {
+        string op; // debit or credit
+        int account{};
+        double amount{};
+        string key; // idempotency key, if any
+    };
+
+    // Accounts being copied to another shard, with those changed since the last copy.
+    struct Migration {
+        ShardLayout layout;
+        uint16_t target{};
+        set<int> dirty;
+        bool frozen = false;
+
+        [[nodiscard]] bool covers(int accountNum) const { return accountNum && layout.owner(accountNum) == target; }
+    };
+
+    static constexpr uintmax_t compactTxLogBytes = 1 << 20;
+    static constexpr string_view accountBusy = "Account has a transfer in progress";
+    static constexpr string_view accountMoving = "Account is moving to another shard";
+
+    BankManagement& bank;
+    mutex bankMtx;
+    TxLog txLog;
+    map<string, PreparedTx> prepared;  // voted yes, outcome not yet known
+    unordered_map<int, string> locked; // account -> transaction holding it
+    map<string, Migration> migrations;
+    int listenFd;
+    list<Connection> connections;
+    jthread acceptor; // declared last: stopped before the state above goes away
+
+    static string prepareLine(const string& tx, const PreparedTx& p) {
+        ostringstream out;
+        out << setprecision(17) << "P " << tx << ' ' << p.op << ' ' << p.account << ' ' << p.amount;
+        if (!p.key.empty()) out << ' ' << p.key;
+        return out.str();
+    }
+
+    // Reloads transactions that voted yes before a restart and are still undecided, and
+    // locks their accounts again. One whose effect already reached the audit log committed.
+    void recoverPrepared(const string& auditFile) {
+        for (const auto& line : txLog.lines()) {
+            istringstream in(line);
+            string kind, tx;
+            in >> kind >> tx;
+            if (kind != "P") {
+                prepared.erase(tx);
+                continue;
+            }
+            PreparedTx p;
+            in >> p.op >> p.account >> p.amount >> p.key;
+            prepared[tx] = p;
+        }
+        if (!prepared.empty())
+            for (const auto& r : AuditLog::readAll(auditFile))
+                if (r.text.starts_with("2pc ")) prepared.erase(r.text.substr(4, r.text.find(' ', 4) - 4));
+        vector<string> keep;
+        for (const auto& [tx, p] : prepared) {
+            locked[p.account] = tx;
+            keep.push_back(prepareLine(tx, p));
+        }
+        txLog.rewrite(keep);
+    }
+
+    // Every change to the book goes through here so migrations see what they must re-copy.
+    optional<string> apply(const AuditRecord& cmd, const optional<string>& pin, optional<Durability> level = nullopt) {
+        if (auto error = bank.submit(cmd, pin, level)) return error;
+        for (auto& [id, m] : migrations)
+            for (int num : {cmd.account, cmd.other})
+                if (m.covers(num)) m.dirty.insert(num);
+        return nullopt;
+    }
+
+    [[nodiscard]] bool moving(int accountNum) const {
+        return ranges::any_of(migrations, [&](const auto& m) { return m.second.frozen && m.second.covers(accountNum); });
+    }
+
+    static void writeTerms(ostream& out, const BankManagement::AccountTerms& t) {
+        auto line = [&](const optional<double>& l) { l ? out << *l : out << '-'; };
+        out << t.currency << ' ' << (t.definition ? t.product : 0);
+        if (t.definition) {
+            out << ' ' << static_cast<int>(t.definition->kind) << ' ' << t.definition->rateBp << ' '
+                << quoted(t.definition->name) << ' ';
+            line(t.productLine);
+        }
+        out << ' ';
+        line(t.accountLine);
+    }
+
+    static optional<BankManagement::AccountTerms> readTerms(istream& in) {
+        auto line = [&](optional<double>& l) {
+            string text;
+            in >> text;
+            if (text == "-") return;
+            double value{};
+            if (istringstream(text) >> value) l = value;
+            else in.setstate(ios::failbit);
+        };
+        BankManagement::AccountTerms t;
+        in >> t.currency >> t.product;
+        if (t.product) {
+            int kind{};
+            InterestBook::Product p;
+            in >> kind >> p.rateBp >> quoted(p.name);
+            if (kind < 0 || kind > static_cast<int>(AccountKind::Loan)) return nullopt;
+            p.kind = static_cast<AccountKind>(kind);
+            t.definition = p;
+            line(t.productLine);
+        }
+        line(t.accountLine);
+        return in ? optional(t) : nullopt;
+    }
+
+    // Current state of each account: "+ <account line> <terms>", or "- <acc>" once it is gone.
+    string deltaReply(uint64_t id, const set<int>& nums) {
+        ostringstream out;
+        out << id << " DELTA " << nums.size() << '\n' << setprecision(17);
+        for (int num : nums) {
+            if (auto acc = bank.findAccount(num)) {
+                ostringstream line;
+                line << setprecision(17);
+                acc->get().save(line);
+                auto text = std::move(line).str();
+                text.pop_back(); // the terms follow on the same line
+                out << "+ " << text << ' ';
+                writeTerms(out, bank.accountTerms(acc->get()));
+                out << '\n';
+            } else {
+                out << "- " << num << '\n';
+            }
+        }
+        return out.str();
+    }
+
+    // Brings the target's copy of each account to the state given, as ordinary audited
+    // operations: addAccount in the account's currency, deposit or withdraw of the
+    // difference, updateName, closeAccount, and the product and credit line records of
+    // BankManagement::termsCommands. The differences are settlements (isSettlement),
+    // applied whatever the account's limits.
+    optional<string> install(const vector<string>& lines) {
+        vector<AuditRecord> ops;
+        for (const auto& line : lines) {
+            istringstream fields(line);
+            char sign{};
+            fields >> sign;
+            if (sign == '-') {
+                AuditRecord cmd;
+                cmd.op = "closeAccount";
+                cmd.text = "migrate";
+                fields >> cmd.account;
+                if (bank.findAccount(cmd.account)) ops.push_back(cmd);
+                continue;
+            }
+            auto incoming = BankAccount::load(fields);
+            auto terms = incoming ? readTerms(fields) : nullopt;
+            if (!terms) return "Malformed account line";
+            AuditRecord cmd;
+            cmd.account = incoming->getAccountNum();
+            cmd.text = "migrate";
+            auto current = bank.findAccount(cmd.account);
+            vector<AuditRecord> termsOps;
+            try {
+                termsOps = bank.termsCommands(cmd.account, *terms);
+                if (!current) cmd.other = bank.currencyFor(terms->currency);
+            } catch (const exception& e) {
+                return e.what();
+            }
+            if (!current) {
+                cmd.op = "addAccount";
+                cmd.amount = incoming->getBalance();
+                cmd.text = incoming->getName();
+                cmd.aux = incoming->getPinHash();
+                ops.push_back(cmd);
+                ranges::move(termsOps, back_inserter(ops));
+                continue;
+            }
+            ranges::move(termsOps, back_inserter(ops));
+            if (double diff = incoming->getBalance() - current->get().getBalance(); diff != 0) {
+                cmd.op = diff > 0 ? "deposit" : "withdraw";
+                cmd.amount = abs(diff);
+                ops.push_back(cmd);
+            }
+            if (incoming->getName() != current->get().getName()) {
+                cmd.op = "updateName";
+                cmd.amount = 0;
+                cmd.text = incoming->getName();
+                ops.push_back(cmd);
+            }
+        }
+        for (size_t i = 0; i < ops.size(); ++i) {
+            // One sync at the end of the batch makes the whole install durable.
+            auto level = i + 1 == ops.size() ? Durability::Sync : Durability::Async;
+            if (auto error = apply(ops[i], nullopt, level)) return error;
+        }
+        return nullopt;
+    }
+
+    optional<string> vote(const string& tx, const PreparedTx& p, const string& pin) {
+        if (prepared.contains(tx)) return "Duplicate transaction " + tx;
+        if (!p.key.empty() && !IdempotencyCache::validKey(p.key)) return "Invalid idempotency key";
+        if (!p.key.empty() && ranges::any_of(prepared, [&](const auto& e) { return e.second.key == p.key; }))
+            return "Request " + p.key + " is already in progress";
+        if (locked.contains(p.account)) return string(accountBusy);
+        if (moving(p.account)) return string(accountMoving);
+        auto acc = bank.findAccount(p.account);
+        if (!acc) return "Account not found";
+        // The same checks the leg would meet on its own: once this shard votes yes, the
+        // commit applies the leg without them (isSettlement) and cannot fail.
+        try {
+            if (p.op == "debit") {
+                if (!acc->get().verifyPIN(pin)) return "Authentication failed. Invalid PIN";
+                acc->get().checkWithdrawal(p.amount);
+                if (auto refusal = bank.screenDebitLeg(p.account, p.amount)) return refusal;
+            } else if (p.op == "credit") {
+                acc->get().checkDeposit(p.amount);
+            } else {
+                return "Malformed prepare";
+            }
+        } catch (const exception& e) {
+            return e.what();
+        }
+        return nullopt;
+    }
+
+    // Applies committed transactions or releases aborted ones. Unknown ids were resolved
+    // earlier and are skipped, so the router may repeat a decision.
+    optional<string> finish(const vector<string>& txs, bool commit) {
+        vector<map<string, PreparedTx>::iterator> known;
+        for (const auto& tx : txs)
+            if (auto it = prepared.find(tx); it != prepared.end()) known.push_back(it);
+        for (size_t i = 0; i < known.size(); ++i) {
+            const auto& [tx, p] = *known[i];
+            if (commit) {
+                AuditRecord cmd;
+                cmd.op = p.op == "debit" ? "withdraw" : "deposit";
+                cmd.account = p.account;
+                cmd.amount = p.amount;
+                cmd.text = p.key.empty() ? "2pc " + tx : IdempotencyCache::tag("2pc " + tx, p.key);
+                // Durable before the acknowledgement lets the router forget its decision.
+                auto level = i + 1 == known.size() ? Durability::Sync : Durability::Async;
+                if (auto error = apply(cmd, nullopt, level)) return error;
+            }
+            txLog.append("E " + tx);
+            locked.erase(p.account);
+            prepared.erase(known[i]);
+        }
+        if (prepared.empty() && txLog.size() > compactTxLogBytes) txLog.rewrite({});
+        return nullopt;
+    }
+
+    static string listReply(uint64_t id, const vector<BankAccount>& accounts) {
+        ostringstream out;
+        out << id << " LIST " << accounts.size() << '\n' << setprecision(17);
+        for (const auto& acc : accounts) acc.save(out);
+        return out.str();
+    }
+
+    string handle(const string& line, net::LineReader& in, const stop_token& stop) {
+        istringstream req(line);
+        uint64_t id{};
+        string verb;
+        req >> id >> verb;
+        auto ok = [&](const string& rest = {}) { return to_string(id) + " OK" + (rest.empty() ? "" : " " + rest) + '\n'; };
+        auto err = [&](const string& reason) {
+            ostringstream out;
+            out << id << " ERR " << quoted(reason) << '\n';
+            return out.str();
+        };
+        vector<string> lines; // the extra lines of install and prepare
+        if (verb == "install" || verb == "prepare") {
+            size_t n{};
+            req >> n;
+            for (size_t i = 0; i < n; ++i) {
+                auto extra = in.next(stop);
+                if (!extra) return {};
+                lines.push_back(std::move(*extra));
+            }
+        }
+
+        lock_guard lock(bankMtx);
+        if (verb == "install") {
+            if (auto error = install(lines)) return err(*error);
+            return ok();
+        }
+        if (verb == "prepare") {
+            ostringstream votes;
+            votes << id << " VOTES " << lines.size() << '\n';
+            bool yes = false;
+            for (const auto& line : lines) {
+                istringstream fields(line);
+                string tx, pin;
+                PreparedTx p;
+                fields >> tx >> p.op >> p.account >> p.amount >> quoted(pin);
+                const bool wellFormed = !fields.fail();
+                fields >> p.key;
+                if (!p.key.empty())
+                    if (auto seen = bank.priorOutcome(p.key)) {
+                        votes << "R " << quoted(seen->value_or("")) << '\n';
+                        continue;
+                    }
+                auto refusal = wellFormed ? vote(tx, p, pin) : optional<string>("Malformed prepare");
+                if (refusal) {
+                    votes << "N " << quoted(*refusal) << '\n';
+                    continue;
+                }
+                txLog.append(prepareLine(tx, p));
+                locked[p.account] = tx;
+                // The router refuses a transfer whose legs hold different currencies.
+                votes << "Y " << bank.currencyName(bank.findAccount(p.account)->get().getCurrency()) << '\n';
+                prepared.emplace(tx, std::move(p));
+                yes = true;
+            }
+            if (yes) txLog.sync(); // one fsync covers every yes vote in the batch
+            return votes.str();
+        }
+        if (verb == "commit" || verb == "abort") {
+            vector<string> txs{istream_iterator<string>(req), istream_iterator<string>()};
+            if (auto error = finish(txs, verb == "commit")) return err(*error);
+            return ok();
+        }
+        if (verb == "indoubt") {
+            string txs;
+            for (const auto& [tx, p] : prepared) txs += (txs.empty() ? "" : " ") + tx;
+            return ok(txs);
+        }
+        if (verb == "get") {
+            int num{};
+            req >> num;
+            auto acc = bank.findAccount(num);
+            if (!acc) return err("Account not found");
+            ostringstream out;
+            out << setprecision(17) << acc->get().getBalance() << ' ' << quoted(acc->get().getName());
+            return ok(out.str());
+        }
+        if (verb == "count") {
+            size_t n = 0;
+            bank.forEachAccount([&](const BankAccount&) { ++n; });
+            return ok(to_string(n));
+        }
+        if (verb == "list") {
+            vector<BankAccount> out;
+            bank.forEachAccount([&](const BankAccount& acc) { out.push_back(acc); });
+            return listReply(id, out);
+        }
+        if (verb == "migrate") {
+            string mig;
+            Migration m;
+            req >> mig >> m.target;
+            m.layout = ShardLayout::parse(req);
+            if (!req) return err("Malformed migration");
+            set<int> nums;
+            bank.forEachAccount([&](const BankAccount& acc) {
+                if (m.covers(acc.getAccountNum())) nums.insert(acc.getAccountNum());
+            });
+            migrations.insert_or_assign(mig, std::move(m));
+            return deltaReply(id, nums);
+        }
+        if (verb == "delta" || verb == "freeze" || verb == "finish" || verb == "cancel") {
+            string mig;
+            req >> mig;
+            auto it = migrations.find(mig);
+            if (it == migrations.end()) return verb == "cancel" ? ok() : err("Unknown migration " + mig);
+            auto& m = it->second;
+            if (verb == "cancel") {
+                migrations.erase(it);
+                return ok();
+            }
+            if (verb == "finish") {
+                size_t most{};
+                req >> most;
+                vector<int> nums;
+                bank.forEachAccount([&](const BankAccount& acc) {
+                    if (nums.size() < most && m.covers(acc.getAccountNum())) nums.push_back(acc.getAccountNum());
+                });
+                if (nums.size() < most) migrations.erase(it);
+                for (size_t i = 0; i < nums.size(); ++i) {
+                    AuditRecord cmd;
+                    cmd.op = "closeAccount";
+                    cmd.account = nums[i];
+                    cmd.text = "migrate";
+                    auto level = i + 1 == nums.size() ? Durability::Sync : Durability::Async;
+                    if (auto error = apply(cmd, nullopt, level)) return err(*error);
+                }
+                return ok(to_string(nums.size()));
+            }
+            if (verb == "freeze") {
+                if (ranges::any_of(locked, [&](const auto& l) { return m.covers(l.first); })) return err(string(accountBusy));
+                // Refused before the layout switches; the source could not close these afterwards.
+                if (auto reason = bank.unmovable([&](int num) { return m.covers(num); })) return err(*reason);
+                m.frozen = true;
+            }
+            return deltaReply(id, std::exchange(m.dirty, {}));
+        }
+        if (verb == "cmd") {
+            AuditRecord cmd;
+            string pin, key;
+            req >> cmd.op >> cmd.account >> cmd.other >> cmd.amount >> quoted(pin) >> quoted(cmd.text);
+            if (!req) return err("Malformed command");
+            if (req >> key; !key.empty()) {
+                if (!IdempotencyCache::validKey(key) || !IdempotencyCache::takesKey(cmd.op)) return err("Invalid idempotency key");
+                if (auto seen = bank.priorOutcome(key)) return *seen ? err(**seen) : ok();
+                cmd.text = IdempotencyCache::tag(cmd.text, key);
+            }
+            if (locked.contains(cmd.account) || locked.contains(cmd.other)) return err(string(accountBusy));
+            if (moving(cmd.account) || moving(cmd.other)) return err(string(accountMoving));
+            if (auto error = apply(cmd, pin.empty() ? nullopt : optional(pin))) return err(*error);
+            return ok();
+        }
+        return err("Unknown request " + verb);
+    }
+
+    void serve(const stop_token& stop, int fd) {
+        net::LineReader in(fd);
+        string replies;
+        while (auto line = in.next(stop)) {
+            replies += handle(*line, in, stop);
+            if (in.buffered()) continue; // answer a pipelined burst with one write
+            if (!net::sendAll(fd, replies)) break;
+            replies.clear();
+        }
+        ::close(fd);
+    }
+
+    void acceptLoop(const stop_token& stop) {
+        pollfd p{listenFd, POLLIN, 0};
+        while (!stop.stop_requested()) {
+            if (::poll(&p, 1, 100) <= 0) continue;
+            int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd < 0) continue;
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+            erase_if(connections, [](const Connection& c) { return c.done.load(); });
+            auto& conn = connections.emplace_back();
+            conn.thread = jthread([this, fd, &conn](stop_token st) {
+                serve(st, fd);
+                conn.done = true;
+            });
+        }
+    }
+
+public:
+    ShardServer(BankManagement& book, uint16_t listenPort, const fs::path& txFile = "shard_tx.txt",
+                const string& auditFile = "audit_log.txt")
+        : bank(book), txLog(txFile), listenFd(net::listenLoopback(listenPort)) {
+        recoverPrepared(auditFile);
+        acceptor = jthread([this](stop_token st) { acceptLoop(st); });
+    }
+
+    ShardServer(const ShardServer&) = delete;
+    ShardServer& operator=(const ShardServer&) = delete;
+
+    ~ShardServer() {
+        acceptor = {};
+        connections.clear();
+        ::close(listenFd);
+    }
+};
+
+// One pipelined connection from the router to a shard: any number of requests may be
+// outstanding; a reader thread matches replies to them by id.
+class ShardClient {
+private:
+    uint16_t port;
+    int fd;
+    mutex sendMtx;
+    mutex mtx;
+    unordered_map<uint64_t, promise<string>> pending;
+    uint64_t nextId = 1;
+    bool closed = false;
+    jthread reader; // declared last: joined before the state above goes away
+
+    void readLoop(const stop_token& stop) {
+        net::LineReader in(fd);
+        while (auto line = in.next(stop)) {
+            istringstream head(*line);
+            uint64_t id{};
+            string status;
+            head >> id >> status;
+            string reply = line->substr(min(line->size(), line->find(' ') + 1));
+            if (status == "LIST" || status == "VOTES" || status == "DELTA") {
+                size_t n{};
+                head >> n;
+                for (size_t i = 0; i < n; ++i) {
+                    auto rec = in.next(stop);
+                    if (!rec) break;
+                    reply += '\n' + *rec;
+                }
+            }
+            lock_guard lock(mtx);
+            if (auto it = pending.find(id); it != pending.end()) {
+                it->second.set_value(std::move(reply));
+                pending.erase(it);
+            }
+        }
+        lock_guard lock(mtx);
+        closed = true;
+        for (auto& [id, p] : pending)
+            p.set_exception(make_exception_ptr(runtime_error("Shard on port " + to_string(port) + " disconnected")));
+        pending.clear();
+    }
+
+public:
+    explicit ShardClient(uint16_t shardPort) : port(shardPort), fd(net::connectLoopback(shardPort)) {
+        if (fd < 0) throw runtime_error("Cannot reach shard on port " + to_string(shardPort));
+        reader = jthread([this](stop_token st) { readLoop(st); });
+    }
+
+    ShardClient(const ShardClient&) = delete;
+    ShardClient& operator=(const ShardClient&) = delete;
+
+    ~ShardClient() {
+        ::shutdown(fd, SHUT_RDWR);
+        reader = {};
+        ::close(fd);
+    }
+
+    // Sends "<id> request" (request may carry extra lines) and returns the reply after the id.
+    future<string> call(const string& request) {
+        promise<string> p;
+        auto reply = p.get_future();
+        uint64_t id{};
+        {
+            lock_guard lock(mtx);
+            if (closed) throw runtime_error("Shard on port " + to_string(port) + " disconnected");
+            id = nextId++;
+            pending.emplace(id, std::move(p));
+        }
+        lock_guard lock(sendMtx);
+        if (!net::sendAll(fd, to_string(id) + ' ' + request + '\n')) {
+            lock_guard state(mtx);
+            if (auto it = pending.find(id); it != pending.end()) {
+                it->second.set_exception(make_exception_ptr(runtime_error("Cannot send to shard on port " + to_string(port))));
+                pending.erase(it);
+            }
+        }
+        return reply;
+    }
+};
+
+struct RebalanceStats {
+    size_t moved{};    // accounts now served by the target
+    size_t total{};    // accounts in the bank when the move began
+    size_t copied{};   // account states sent to the target, bulk copy and catch-up together
+    int rounds{};      // catch-up rounds before the cutover
+    double pausedMs{}; // operations held back during the cutover
+    double totalMs{};
+};
+
+// Front end of a sharded bank: routes each operation to the shard that owns the account.
+// Transfers between shards are coordinated here with two-phase commit: a coordinator
+// thread gathers waiting transfers into rounds, sends each shard one prepare and one
+// commit/abort per round, and fsyncs the round's commit decisions once, between the two.
+class ShardRouter {
+private:
+    static constexpr uintmax_t compactTxLogBytes = 1 << 20;
+    static constexpr size_t cutoverChanges = 64; // catch up until a round copies no more than this
+    static constexpr int maxCatchUpRounds = 8;
+    static constexpr size_t closeChunk = 256; // moved accounts a source closes per request
+
+    struct Transfer {
+        AuditRecord cmd;
+        string pin;
+        string key;
+        promise<optional<string>> done;
+    };
+
+    ShardLayout layout;
+    map<uint16_t, unique_ptr<ShardClient>> shards;
+    shared_mutex routing; // shared by operations, exclusive while the layout changes
+    mutex moveMtx;        // one migration at a time
+
+    TxLog decisions; // "C <tx>" for every committed transaction; absent means aborted
+    size_t maxBatch;
+    string txPrefix = to_string(AuditLog::nowMillis()) + '-';
+    uint64_t nextTx = 1;
+    bool undelivered = false; // a decision did not reach its shard; keep the log until restart
+    mutex queueMtx;
+    condition_variable_any queueCv;
+    deque<Transfer> queue;
+    jthread coordinator; // declared last: stopped before the state above goes away
+
+    static optional<string> resultOf(const string& reply) {
+        if (reply.starts_with("OK")) return nullopt;
+        istringstream in(reply.substr(min<size_t>(reply.size(), 4)));
+        string reason;
+        in >> quoted(reason);
+        return reason.empty() ? reply : reason;
+    }
+
+    static vector<BankAccount> accountsOf(const string& reply) {
+        istringstream in(reply);
+        in.ignore(numeric_limits<streamsize>::max(), '\n');
+        vector<BankAccount> out;
+        while (auto acc = BankAccount::load(in)) out.push_back(std::move(*acc));
+        return out;
+    }
+
+    static string commandLine(const AuditRecord& cmd, const string& pin, const string& key) {
+        ostringstream out;
+        out << setprecision(17) << "cmd " << cmd.op << ' ' << cmd.account << ' ' << cmd.other << ' ' << cmd.amount << ' '
+            << quoted(pin) << ' ' << quoted(cmd.text);
+        if (!key.empty()) out << ' ' << key;
+        return out.str();
+    }
+
+    ShardClient& shardFor(int accountNum) { return *shards.at(layout.owner(accountNum)); }
+
+    // Settles transactions the shards prepared before a router or shard restart: those with
+    // a logged decision commit, the rest abort. Afterwards no shard waits on the log.
+    void recoverInDoubt() {
+        set<string> committed;
+        for (const auto& line : decisions.lines())
+            if (line.starts_with("C ")) committed.insert(line.substr(2));
+        for (auto& [port, shard] : shards) {
+            istringstream in(shard->call("indoubt").get().substr(2));
+            string commits = "commit", aborts = "abort";
+            for (string tx; in >> tx;) (committed.contains(tx) ? commits : aborts) += ' ' + tx;
+            for (const auto* request : {&commits, &aborts}) {
+                if (request->find(' ') == string::npos) continue;
+                if (auto error = resultOf(shard->call(*request).get()))
+                    throw runtime_error("Shard " + to_string(port) + " cannot settle transactions: " + *error);
+            }
+        }
+        decisions.rewrite({});
+    }
+
+    void coordinate(const stop_token& stop) {
+        while (true) {
+            vector<Transfer> round;
+            {
+                unique_lock lock(queueMtx);
+                if (!queueCv.wait(lock, stop, [&] { return !queue.empty(); })) break;
+                // Transfers sharing an account wait for a later round rather than refuse each other's locks.
+                set<int> touched;
+                for (auto it = queue.begin(); it != queue.end() && round.size() < maxBatch;) {
+                    if (touched.contains(it->cmd.account) || touched.contains(it->cmd.other)) {
+                        ++it;
+                        continue;
+                    }
+                    touched.insert({it->cmd.account, it->cmd.other});
+                    round.push_back(std::move(*it));
+                    it = queue.erase(it);
+                }
+            }
+            runRound(round);
+        }
+        lock_guard lock(queueMtx);
+        for (auto& t : queue) t.done.set_value("Router is shutting down");
+        queue.clear();
+    }
+
+    void runRound(vector<Transfer>& round) {
+        struct Leg {
+            size_t tx;
+            bool debit;
+        };
+        shared_lock lock(routing);
+        vector<string> ids(round.size());
+        vector<optional<string>> refusal(round.size());
+        vector<optional<IdempotencyCache::Outcome>> replayed(round.size()); // retries of a key already used
+        vector<array<string, 2>> currency(round.size()); // of the debit and credit accounts, from their yes votes
+        map<uint16_t, vector<Leg>> legs;
+        for (size_t i = 0; i < round.size(); ++i) {
+            ids[i] = txPrefix + to_string(nextTx++);
+            legs[layout.owner(round[i].cmd.account)].push_back({i, true});
+            legs[layout.owner(round[i].cmd.other)].push_back({i, false});
+        }
+
+        // Phase 1: one prepare per shard, all shards in parallel.
+        vector<pair<const vector<Leg>*, future<string>>> votes;
+        for (auto& [port, list] : legs) {
+            ostringstream request;
+            request << "prepare " << list.size() << setprecision(17);
+            for (const auto& leg : list) {
+                const auto& t = round[leg.tx];
+                request << '\n' << ids[leg.tx] << (leg.debit ? " debit " : " credit ")
+                        << (leg.debit ? t.cmd.account : t.cmd.other) << ' ' << t.cmd.amount << ' '
+                        << quoted(leg.debit ? t.pin : string());
+                if (leg.debit && !t.key.empty()) request << ' ' << t.key;
+            }
+            try {
+                votes.emplace_back(&list, shards.at(port)->call(request.str()));
+            } catch (const exception& e) {
+                for (const auto& leg : list) refusal[leg.tx] = e.what();
+            }
+        }
+        for (auto& [list, reply] : votes) {
+            try {
+                istringstream in(reply.get());
+                in.ignore(numeric_limits<streamsize>::max(), '\n');
+                for (const auto& leg : *list) {
+                    string vote, reason;
+                    in >> vote;
+                    if (vote == "Y") {
+                        in >> currency[leg.tx][leg.debit ? 0 : 1];
+                        continue;
+                    }
+                    in >> quoted(reason);
+                    if (vote == "R") {
+                        replayed[leg.tx] = reason.empty() ? IdempotencyCache::Outcome{} : reason;
+                        continue;
+                    }
+                    if (!refusal[leg.tx])
+                        refusal[leg.tx] = reason == "Account not found" ? "One or both accounts not found" : reason;
+                }
+            } catch (const exception& e) {
+                for (const auto& leg : *list)
+                    if (!refusal[leg.tx]) refusal[leg.tx] = e.what();
+            }
+        }
+
+        // Each leg's shard knows only its own account's currency, so neither can convert
+        // the amount; a transfer between currencies has to stay within one shard.
+        for (size_t i = 0; i < round.size(); ++i)
+            if (!refusal[i] && !replayed[i] && currency[i][0] != currency[i][1])
+                refusal[i] = "Transfers between currencies cannot cross shards";
+
+        // The decision is durable before any shard hears of it.
+        bool anyCommit = false;
+        for (size_t i = 0; i < round.size(); ++i) {
+            if (refusal[i] || replayed[i]) continue;
+            decisions.append("C " + ids[i]);
+            anyCommit = true;
+        }
+        if (anyCommit) decisions.sync();
+
+        // Phase 2: one commit and/or abort per shard, in parallel. A shard that misses its
+        // decision keeps the accounts locked until recoverInDoubt() runs again.
+        vector<future<string>> acks;
+        for (auto& [port, list] : legs) {
+            string commits = "commit", aborts = "abort";
+            for (const auto& leg : list) (refusal[leg.tx] || replayed[leg.tx] ? aborts : commits) += ' ' + ids[leg.tx];
+            try {
+                if (commits.find(' ') != string::npos) acks.push_back(shards.at(port)->call(commits));
+                if (aborts.find(' ') != string::npos) acks.push_back(shards.at(port)->call(aborts));
+            } catch (const exception&) {
+                undelivered = true;
+            }
+        }
+        for (auto& ack : acks) {
+            try {
+                if (resultOf(ack.get())) undelivered = true;
+            } catch (const exception&) {
+                undelivered = true;
+            }
+        }
+        if (!undelivered && decisions.size() > compactTxLogBytes) decisions.rewrite({});
+        for (size_t i = 0; i < round.size(); ++i) round[i].done.set_value(replayed[i] ? *replayed[i] : refusal[i]);
+    }
+
+    // Moves to `target` every account `next` assigns to it while they stay in service:
+    // a bulk copy, catch-up rounds re-copying what changed meanwhile, then a cutover that
+    // holds operations only while the last changes are copied and the layout switches.
+    // Requests sent before the cutover are answered first, as each shard serves its
+    // connection in order. The sources close their copies after the switch.
+    RebalanceStats migrate(const ShardLayout& next, uint16_t target) {
+        auto start = chrono::steady_clock::now();
+        RebalanceStats stats;
+        {
+            unique_lock lock(routing);
+            if (!shards.contains(target)) shards.emplace(target, make_unique<ShardClient>(target));
+        }
+        for (auto [port, count] : counts()) stats.total += count;
+        vector<ShardClient*> sources;
+        ShardClient* dest{};
+        {
+            shared_lock lock(routing);
+            for (auto& [port, shard] : shards)
+                if (port != target) sources.push_back(shard.get());
+            dest = shards.at(target).get();
+        }
+        const string id = "m" + to_string(AuditLog::nowMillis());
+        auto ask = [&](const string& request) {
+            vector<future<string>> replies;
+            for (auto* source : sources) replies.push_back(source->call(request));
+            return replies;
+        };
+        set<int> copies; // on the target, to remove again if the move is abandoned
+        auto ship = [&](vector<future<string>> replies) {
+            size_t changes = 0;
+            for (auto& reply : replies) {
+                auto text = reply.get();
+                if (!text.starts_with("DELTA ")) throw runtime_error("Migration failed: " + resultOf(text).value_or(text));
+                auto newline = text.find('\n');
+                size_t n = stoull(text.substr(6, newline - 6));
+                if (n == 0) continue;
+                istringstream body(text.substr(newline + 1));
+                for (string line; getline(body, line);) {
+                    int num = stoi(line.substr(2));
+                    if (line[0] == '+') copies.insert(num);
+                    else copies.erase(num);
+                }
+                if (auto error = resultOf(dest->call("install " + to_string(n) + text.substr(newline)).get()))
+                    throw runtime_error("Migration failed: " + *error);
+                changes += n;
+            }
+            stats.copied += changes;
+            return changes;
+        };
+
+        try {
+            ship(ask("migrate " + id + ' ' + to_string(target) + ' ' + next.spec()));
+            for (size_t changed = numeric_limits<size_t>::max(); changed > cutoverChanges && stats.rounds < maxCatchUpRounds;
+                 ++stats.rounds)
+                changed = ship(ask("delta " + id));
+            unique_lock lock(routing);
+            auto paused = chrono::steady_clock::now();
+            ship(ask("freeze " + id));
+            layout = next;
+            stats.pausedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - paused).count();
+        } catch (const exception&) {
+            try {
+                for (auto& reply : ask("cancel " + id)) reply.wait();
+                string undo = "install " + to_string(copies.size());
+                for (int num : copies) undo += "\n- " + to_string(num);
+                if (!copies.empty()) dest->call(undo).wait();
+            } catch (const exception&) {
+                // a shard that cannot be reached keeps its copies; all() ignores them
+            }
+            throw;
+        }
+        // In chunks, so requests for the accounts that stay are served in between.
+        while (!sources.empty()) {
+            auto replies = ask("finish " + id + ' ' + to_string(closeChunk));
+            vector<ShardClient*> busy;
+            for (size_t i = 0; i < sources.size(); ++i) {
+                auto text = replies[i].get();
+                if (auto error = resultOf(text)) throw runtime_error("Cannot remove moved accounts: " + *error);
+                auto closed = stoull(text.substr(3));
+                stats.moved += closed;
+                if (closed == closeChunk) busy.push_back(sources[i]);
+            }
+            sources = std::move(busy);
+        }
+        stats.totalMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+
+    optional<string> transferAcrossShards(const AuditRecord& cmd, const string& pin, const string& key) {
+        Transfer t{cmd, pin, key, {}};
+        auto done = t.done.get_future();
+        {
+            lock_guard lock(queueMtx);
+            queue.push_back(std::move(t));
+        }
+        queueCv.notify_one();
+        return done.get();
+    }
+
+public:
+    // decisionFile holds the coordinator's commit decisions; maxBatch caps the transfers
+    // decided in one round.
+    explicit ShardRouter(ShardLayout initial, const fs::path& decisionFile = "cluster_txlog.txt", size_t maxBatch = 256)
+        : layout(std::move(initial)), decisions(decisionFile), maxBatch(maxBatch) {
+        for (auto port : layout.shards()) shards.emplace(port, make_unique<ShardClient>(port));
+        recoverInDoubt();
+        coordinator = jthread([this](stop_token st) { coordinate(st); });
+    }
+
+    ShardRouter(const ShardRouter&) = delete;
+    ShardRouter& operator=(const ShardRouter&) = delete;
+
+    [[nodiscard]] uint16_t ownerOf(int accountNum) {
+        shared_lock lock(routing);
+        return layout.owner(accountNum);
+    }
+
+    // Sends a single-shard command to the owning shard without waiting; pin "" means none.
+    future<string> send(const AuditRecord& cmd, const string& pin, const string& key = {}) {
+        shared_lock lock(routing);
+        return shardFor(cmd.account).call(commandLine(cmd, pin, key));
+    }
+
+    static optional<string> result(future<string>& reply) { return resultOf(reply.get()); }
+
+    // Runs one command; a transfer between two shards goes through two-phase commit. With
+    // an idempotency key, a retry returns the first attempt's result instead of running
+    // again; the key is kept by the shard owning cmd.account.
+    optional<string> execute(const AuditRecord& cmd, const string& pin, const string& key = {}) {
+        {
+            shared_lock lock(routing);
+            if (cmd.op != "transfer" || layout.owner(cmd.account) == layout.owner(cmd.other))
+                return resultOf(shardFor(cmd.account).call(commandLine(cmd, pin, key)).get());
+        }
+        return transferAcrossShards(cmd, pin, key);
+    }
+
+    optional<pair<string, double>> find(int accountNum) {
+        shared_lock lock(routing);
+        auto reply = shardFor(accountNum).call("get " + to_string(accountNum)).get();
+        if (!reply.starts_with("OK ")) return nullopt;
+        istringstream in(reply.substr(3));
+        double balance{};
+        string name;
+        in >> balance >> quoted(name);
+        return pair{name, balance};
+    }
+
+    // Every account in the bank, gathered from all shards in parallel, in account order.
+    // Copies on a shard that does not own them, left by a move in progress or abandoned,
+    // are skipped.
+    vector<BankAccount> all() {
+        shared_lock lock(routing);
+        vector<pair<uint16_t, future<string>>> replies;
+        for (auto& [port, shard] : shards) replies.emplace_back(port, shard->call("list"));
+        vector<BankAccount> out;
+        for (auto& [port, reply] : replies)
+            for (auto& acc : accountsOf(reply.get()))
+                if (layout.owner(acc.getAccountNum()) == port) out.push_back(std::move(acc));
+        ranges::sort(out, {}, &BankAccount::getAccountNum);
+        return out;
+    }
+
+    vector<pair<uint16_t, size_t>> counts() {
+        shared_lock lock(routing);
+        vector<pair<uint16_t, future<string>>> replies;
+        for (auto& [port, shard] : shards) replies.emplace_back(port, shard->call("count"));
+        vector<pair<uint16_t, size_t>> out;
+        for (auto& [port, reply] : replies) out.emplace_back(port, stoull(reply.get().substr(3)));
+        return out;
+    }
+
+    [[nodiscard]] ShardLayout currentLayout() {
+        shared_lock lock(routing);
+        return layout;
+    }
+
+    // Adds a shard to the ring and moves to it the accounts the ring now assigns to it,
+    // about 1/N of the bank.
+    RebalanceStats addShard(uint16_t port) {
+        lock_guard one(moveMtx);
+        auto next = currentLayout();
+        auto members = next.ringMembers();
+        if (ranges::find(members, port) != members.end()) throw runtime_error("Shard " + to_string(port) + " is already a member");
+        next.addToRing(port);
+        return migrate(next, port);
+    }
+
+    // Moves accounts first..last to a shard, which need not be on the ring.
+    RebalanceStats moveRange(int first, int last, uint16_t port) {
+        if (first > last) throw invalid_argument("Range is empty");
+        lock_guard one(moveMtx);
+        auto next = currentLayout();
+        next.pin({first, last, port});
+        return migrate(next, port);
+    }
+};
+#endif
+
+// ---------------- Menu Helper ----------------
+inline void printMenu() {
+    cout << "\n=== Bank Management System (C++23) with PIN ===\n";
+    cout << "1. Create Account\n"
+         << "2. Show All Accounts\n"
+         << "3. Search Account\n"
+         << "4. Deposit Money\n"
+         << "5. Withdraw Money\n"
+         << "6. Transfer Money\n"
+         << "7. Close Account\n"
+         << "8. Update Account Name\n"
+         << "9. Show High Balance Accounts\n"
+         << "10. Sort Accounts by Balance\n"
+         << "11. Verify Audit Log\n"
+         << "12. Online Backup\n"
+         << "13. Balance As Of\n"
+         << "14. Point-in-Time Restore\n"
+         << "15. Place Hold\n"
+         << "16. Capture Hold\n"
+         << "17. Release Hold\n"
+         << "18. Schedule Transfer\n"
+         << "19. Standing Orders\n"
+         << "20. Cancel Standing Order\n"
+         << "21. Interest Products\n"
+         << "22. Define Product\n"
+         << "23. Set Account Product\n"
+         << "24. Assess Fees\n"
+         << "25. Set Credit Limit\n"
+         << "26. Exchange Rates\n"
+         << "27. Revalue Book\n"
+         << "28. Fraud Alerts\n"
+         << "0. Exit\n";
+}
+
+inline int getCurrency(const string& prompt) {
+    while (true) {
+        string text;
+        getNonEmptyString(prompt, text);
+        if (auto code = packCurrency(text)) return *code;
+        cout << "Invalid currency. Please use a three-letter code such as EUR.\n";
+    }
+}
+
+inline int64_t getTimestamp(const string& prompt) {
+    while (true) {
+        string text;
+        getNonEmptyString(prompt, text);
+        if (auto time = PointInTime::parseLocalTime(text)) return *time;
+        cout << "Invalid time. Please use YYYY-MM-DD HH:MM:SS.\n";
+    }
+}
+
+// ---------------- Replication Follower ----------------
+#ifdef BANK_HAVE_SOCKETS
+// Warm standby for a primary started with --replicate; run it in its own directory.
+// Received records are applied on a background thread while this menu serves reads.
+inline int runFollower(BankManagement& bank, const string& socketPath, const string& filename) {
+    mutex bookMutex;
+    {
+        LogFollower follower(
+            socketPath,
+            [&] {
+                lock_guard lock(bookMutex);
+                return bank.lastAuditSeq();
+            },
+            [&](const vector<AuditRecord>& batch) {
+                lock_guard lock(bookMutex);
+                bank.applyReplicated(batch);
+            });
+        int choice{};
+        while (true) {
+            cout << "\n=== Bank Replica (read-only) ===\n"
+                 << "1. Search Account\n"
+                 << "2. Show All Accounts\n"
+                 << "3. Show High Balance Accounts\n"
+                 << "4. Replication Status\n"
+                 << "0. Exit\n";
+            getInt("Enter choice: ", choice, 0, 4);
+            if (choice == 0) break;
+            try {
+                if (choice == 1) {
+                    int num;
+                    getInt("Enter account number: ", num, 1);
+                    lock_guard lock(bookMutex);
+                    if (auto acc = bank.findAccount(num)) {
+                        cout << "Found -> " << acc->get().getName() << " | Balance: " << acc->get().getBalance();
+                        if (acc->get().getCurrency()) cout << ' ' << bank.currencyName(acc->get().getCurrency());
+                        if (acc->get().getAvailableBalance() != acc->get().getBalance())
+                            cout << " | Available: " << acc->get().getAvailableBalance();
+                        cout << '\n';
+                    } else
+                        cout << "Account not found.\n";
+                } else if (choice == 2) {
+                    lock_guard lock(bookMutex);
+                    bank.showAllAccounts();
+                } else if (choice == 3) {
+                    double threshold;
+                    getDouble("Enter threshold: ", threshold, 0.0);
+                    lock_guard lock(bookMutex);
+                    bank.showHighBalance(threshold);
+                } else {
+                    auto st = follower.status();
+                    ostringstream line;
+                    line << (st.connected ? "Connected to " : "Disconnected from ") << socketPath << " | applied "
+                         << st.appliedSeq << " of " << st.primarySeq << " | lag " << st.lastLagMs << " ms (avg "
+                         << fixed << setprecision(1) << st.avgLagMs << ", max " << st.maxLagMs << ")\n";
+                    if (!st.error.empty()) line << "Last error: " << st.error << '\n';
+                    cout << line.str();
+                }
+            } catch (const exception& e) {
+                cerr << "Error: " << e.what() << '\n';
+            }
+        }
+    }
+    cout << "Saving data...\n";
+    bank.saveToFile(filename);
+    return 0;
+}
+#endif
+
+// ---------------- Raft Node ----------------
+#ifdef BANK_HAVE_SOCKETS
+// One member of a cluster started with --raft-peers and --raft-id; run each member in
+// its own directory. Changes go through the leader; reads are served from this node's
+// copy and may trail the leader slightly.
+inline int runRaftNode(BankManagement& bank, const vector<uint16_t>& ports, int self, const string& auditFile) {
+    bank.openAuditLog(auditFile);
+    if (!fs::exists("raft_log.txt") && !fs::exists("raft_snapshot.txt") && bank.lastAuditSeq() > 0) {
+        cerr << "Start a Raft node in an empty directory; this one holds a standalone bank\n";
+        return 1;
+    }
+    RaftNode node(".", ports, self, bank.raftStateMachine(), auditFile);
+
+    // Money movements carry an idempotency key, so one that timed out (and may still
+    // commit) can be proposed again without posting twice.
+    const string keyPrefix = "n" + to_string(self + 1) + '-' + to_string(AuditLog::nowMillis()) + '-';
+    uint64_t nextKey = 1;
+    auto submit = [&](string op, int account, int other, double amount, string text, uint64_t aux, string_view done) {
+        AuditRecord cmd;
+        cmd.op = std::move(op);
+        cmd.account = account;
+        cmd.other = other;
+        cmd.amount = amount;
+        cmd.text = std::move(text);
+        cmd.aux = aux;
+        const bool keyed = IdempotencyCache::takesKey(cmd.op);
+        if (keyed) cmd.text = IdempotencyCache::tag(cmd.text, keyPrefix + to_string(nextKey++));
+        for (int attempt = 1;; ++attempt) {
+            try {
+                if (auto error = node.propose(cmd)) cout << *error << ".\n";
+                else cout << done << '\n';
+                return;
+            } catch (const runtime_error& e) {
+                if (!keyed || attempt == 3 || !string_view(e.what()).starts_with("Timed out")) throw;
+                cout << "No answer from the cluster yet; retrying.\n";
+            }
+        }
+    };
+    auto authenticated = [&](int num) {
+        optional<BankAccount> acc;
+        node.read([&] {
+            if (auto found = bank.findAccount(num)) acc = found->get();
+        });
+        if (!acc) {
+            cout << "Account not found.\n";
+            return false;
+        }
+        string pin;
+        cout << "Enter PIN for account " << num << ": ";
+        getline(cin, pin);
+        if (acc->verifyPIN(pin)) return true;
+        cout << "Authentication failed. Invalid PIN.\n";
+        return false;
+    };
+
+    int choice{};
+    while (true) {
+        cout << "\n=== Bank Raft Node " << self + 1 << " (port " << ports[self] << ") ===\n"
+             << "1. Create Account\n"
+             << "2. Show All Accounts\n"
+             << "3. Search Account\n"
+             << "4. Deposit Money\n"
+             << "5. Withdraw Money\n"
+             << "6. Transfer Money\n"
+             << "7. Close Account\n"
+             << "8. Update Account Name\n"
+             << "9. Cluster Status\n"
+             << "0. Exit\n";
+        getInt("Enter choice: ", choice, 0, 9);
+        if (choice == 0) return 0;
+        try {
+            int num{}, to{};
+            double amt{};
+            string name, pin;
+            switch (choice) {
+                case 1:
+                    getNonEmptyString("Name: ", name);
+                    getInt("Account Number: ", num, 1);
+                    getDouble("Initial Balance: ", amt, 0.0);
+                    getNonEmptyString("Set 4-digit PIN: ", pin);
+                    submit("addAccount", num, 0, amt, name, BankAccount(name, num, amt, pin).getPinHash(),
+                           "Account created successfully.");
+                    break;
+                case 2: node.read([&] { bank.showAllAccounts(); }); break;
+                case 3:
+                    getInt("Enter account number: ", num, 1);
+                    node.read([&] {
+                        if (auto acc = bank.findAccount(num))
+                            cout << "Found -> " << acc->get().getName() << " | Balance: " << acc->get().getBalance() << '\n';
+                        else
+                            cout << "Account not found.\n";
+                    });
+                    break;
+                case 4:
+                case 5:
+                    getInt("Account number: ", num, 1);
+                    getDouble("Amount: ", amt, 0.01);
+                    if (!authenticated(num)) break;
+                    if (choice == 4) submit("deposit", num, 0, amt, {}, 0, "Deposit successful.");
+                    else submit("withdraw", num, 0, amt, {}, 0, "Withdrawal successful.");
+                    break;
+                case 6:
+                    getInt("From account: ", num, 1);
+                    getInt("To account: ", to, 1);
+                    getDouble("Amount: ", amt, 0.01);
+                    if (authenticated(num)) submit("transfer", num, to, amt, {}, 0, "Transfer successful.");
+                    break;
+                case 7:
+                    getInt("Enter account to close: ", num, 1);
+                    if (authenticated(num)) submit("closeAccount", num, 0, 0.0, {}, 0, "Account closed successfully.");
+                    break;
+                case 8:
+                    getInt("Enter account number: ", num, 1);
+                    getNonEmptyString("New Name: ", name);
+                    if (authenticated(num)) submit("updateName", num, 0, 0.0, name, 0, "Account name updated.");
+                    break;
+                case 9: {
+                    auto st = node.status();
+                    cout << "Node " << self + 1 << ": " << st.role << ", term " << st.term << " | leader: "
+                         << (st.leader >= 0 ? "node " + to_string(st.leader + 1) : string("unknown")) << " | log through "
+                         << st.lastIndex << " (snapshot " << st.snapshotIndex << ") | committed " << st.commitIndex
+                         << " | applied " << st.lastApplied << '\n';
+                    break;
+                }
+            }
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << '\n';
+        }
+    }
+}
+#endif
+
+// ---------------- Shard and Router ----------------
+#ifdef BANK_HAVE_SOCKETS
+// One shard of a sharded bank, started with --shard=PORT in its own directory. It serves
+// the router until told to stop.
+inline int runShard(BankManagement& bank, uint16_t port, const string& filename) {
+    {
+        ShardServer server(bank, port);
+        cout << "Shard serving on loopback port " << port << ".\n";
+        int choice{};
+        getInt("Enter 0 to stop the shard: ", choice, 0, 0);
+    }
+    cout << "Saving data...\n";
+    bank.saveToFile(filename);
+    return 0;
+}
+
+// Front end for shards started with --shard. The layout is kept in cluster_shards.txt so
+// that it survives a router restart: one ring member per line, then "range <first>
+// <last> <port>" for each moved range.
+inline int runRouter(const vector<uint16_t>& ports) {
+    const string layoutFile = "cluster_shards.txt";
+    ShardLayout layout(ports);
+    if (ifstream in(layoutFile); in) {
+        layout = ShardLayout();
+        for (string line; getline(in, line);) {
+            istringstream fields(line);
+            if (line.starts_with("range ")) {
+                AccountRange range;
+                fields.ignore(6);
+                fields >> range.first >> range.last >> range.shard;
+                layout.pin(range);
+            } else if (uint16_t port{}; fields >> port) {
+                layout.addToRing(port);
+            }
+        }
+    } else if (ports.empty()) {
+        cerr << "Name the shards with --shards=PORT,PORT,...\n";
+        return 1;
+    }
+    auto saveLayout = [&](const ShardLayout& current) {
+        ofstream out(layoutFile + ".tmp", ios::trunc);
+        for (auto port : current.ringMembers()) out << port << '\n';
+        for (const auto& range : current.pins()) out << "range " << range.first << ' ' << range.last << ' ' << range.shard << '\n';
+        out.close();
+        fs::rename(layoutFile + ".tmp", layoutFile);
+    };
+    ShardRouter router(layout);
+    saveLayout(router.currentLayout());
+
+    auto run = [&](string op, int account, int other, double amount, string text, string_view done) {
+        AuditRecord cmd;
+        cmd.op = std::move(op);
+        cmd.account = account;
+        cmd.other = other;
+        cmd.amount = amount;
+        cmd.text = std::move(text);
+        string pin;
+        cout << (cmd.op == "addAccount" ? string("Set 4-digit PIN: ") : "Enter PIN for account " + to_string(account) + ": ");
+        getline(cin, pin);
+        if (auto error = router.execute(cmd, pin)) cout << *error << ".\n";
+        else cout << done << '\n';
+    };
+
+    int choice{};
+    while (true) {
+        cout << "\n=== Bank Router (" << router.currentLayout().shards().size() << " shards) ===\n"
+             << "1. Create Account\n"
+             << "2. Show All Accounts\n"
+             << "3. Search Account\n"
+             << "4. Deposit Money\n"
+             << "5. Withdraw Money\n"
+             << "6. Transfer Money\n"
+             << "7. Close Account\n"
+             << "8. Update Account Name\n"
+             << "9. Show High Balance Accounts\n"
+             << "10. Cluster Status\n"
+             << "11. Add Shard\n"
+             << "12. Move Account Range\n"
+             << "0. Exit\n";
+        getInt("Enter choice: ", choice, 0, 12);
+        if (choice == 0) return 0;
+        try {
+            int num{}, to{};
+            double amt{};
+            string name;
+            switch (choice) {
+                case 1:
+                    getNonEmptyString("Name: ", name);
+                    getInt("Account Number: ", num, 1);
+                    getDouble("Initial Balance: ", amt, 0.0);
+                    run("addAccount", num, 0, amt, name, "Account created successfully.");
+                    break;
+                case 2:
+                case 9: {
+                    double threshold = 0;
+                    if (choice == 9) getDouble("Enter threshold: ", threshold, 0.0);
+                    cout << (choice == 2 ? string("\n--- All Accounts ---\n") : "--- Accounts above " + to_string(threshold) + " ---\n");
+                    bool any = false;
+                    for (const auto& acc : router.all()) {
+                        if (acc.getBalance() < threshold) continue;
+                        any = true;
+                        cout << "Name: " << acc.getName() << " | Account: " << acc.getAccountNum()
+                             << " | Balance: " << acc.getBalance() << '\n';
+                    }
+                    if (!any) cout << (choice == 2 ? "No accounts available.\n" : "No accounts meet the threshold.\n");
+                    break;
+                }
+                case 3:
+                    getInt("Enter account number: ", num, 1);
+                    if (auto acc = router.find(num)) cout << "Found -> " << acc->first << " | Balance: " << acc->second << '\n';
+                    else cout << "Account not found.\n";
+                    break;
+                case 4:
+                case 5:
+                    getInt("Account number: ", num, 1);
+                    getDouble("Amount: ", amt, 0.01);
+                    if (choice == 4) run("deposit", num, 0, amt, {}, "Deposit successful.");
+                    else run("withdraw", num, 0, amt, {}, "Withdrawal successful.");
+                    break;
+                case 6:
+                    getInt("From account: ", num, 1);
+                    getInt("To account: ", to, 1);
+                    getDouble("Amount: ", amt, 0.01);
+                    run("transfer", num, to, amt, {}, "Transfer successful.");
+                    break;
+                case 7:
+                    getInt("Enter account to close: ", num, 1);
+                    run("closeAccount", num, 0, 0.0, {}, "Account closed successfully.");
+                    break;
+                case 8:
+                    getInt("Enter account number: ", num, 1);
+                    getNonEmptyString("New Name: ", name);
+                    run("updateName", num, 0, 0.0, name, "Account name updated.");
+                    break;
+                case 10:
+                    for (auto [port, count] : router.counts()) cout << "Shard " << port << ": " << count << " accounts\n";
+                    break;
+                case 11:
+                case 12: {
+                    int first{}, last{}, port{};
+                    if (choice == 12) {
+                        getInt("First account: ", first, 1);
+                        getInt("Last account: ", last, first);
+                        getInt("Target shard port: ", port, 1, 65535);
+                    } else {
+                        getInt("New shard port: ", port, 1, 65535);
+                    }
+                    auto st = choice == 11 ? router.addShard(static_cast<uint16_t>(port))
+                                           : router.moveRange(first, last, static_cast<uint16_t>(port));
+                    saveLayout(router.currentLayout());
+                    ostringstream line;
+                    line << "Moved " << st.moved << " of " << st.total << " accounts to shard " << port << " in " << fixed
+                         << setprecision(1) << st.totalMs << " ms (" << st.rounds << " catch-up rounds, operations held "
+                         << st.pausedMs << " ms).\n";
+                    cout << line.str();
+                    break;
+                }
+            }
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << '\n';
+        }
+    }
+}
+#endif
+
+// ---------------- Reporting Reader ----------------
+#ifdef BANK_HAVE_MMAP
+// Read-only client for a teller started with --publish; runs in its own process.
+inline int runReader() {
+    SharedBookReader book;
+    int choice{};
+    while (true) {
+        cout << "\n=== Bank Reports (read-only) ===\n"
+             << "1. Account Balance\n"
+             << "2. Accounts Above Threshold\n"
+             << "3. Book Totals\n"
+             << "0. Exit\n";
+        getInt("Enter choice: ", choice, 0, 3);
+        try {
+            if (choice == 0) return 0;
+            if (choice == 1) {
+                int num;
+                getInt("Account number: ", num, 1);
+                if (auto rec = book.find(num))
+                    cout << "Found -> " << string_view(rec->name, rec->nameLen) << " | Balance: " << rec->balance << '\n';
+                else
+                    cout << "Account not found.\n";
+            } else if (choice == 2) {
+                double threshold;
+                getDouble("Enter threshold: ", threshold, 0.0);
+                bool found = false;
+                book.forEach([&](const AccountRecord& rec) {
+                    if (rec.balance < threshold) return;
+                    found = true;
+                    cout << "Name: " << string_view(rec.name, rec.nameLen)
+                         << " | Account: " << rec.accountNum
+                         << " | Balance: " << rec.balance << '\n';
+                });
+                if (!found) cout << "No accounts meet the threshold.\n";
+            } else {
+                size_t count = 0;
+                double total = 0;
+                book.forEach([&](const AccountRecord& rec) {
+                    ++count;
+                    total += rec.balance;
+                });
+                cout << "Accounts: " << count << " | Total balance: " << total << '\n';
+            }
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << '\n';
+        }
+    }
+}
+#endif
+
+// ---------------- Benchmarks ----------------
+// Buffer pool hit rate and lookup latency as the working set grows past the pool size.
+inline void benchmarkBTree() {
+    constexpr int bookSize = 200'000;
+    constexpr size_t frames = 256; // 1 MiB pool
+    constexpr int lookups = 200'000;
+    const fs::path path = fs::temp_directory_path() / "bank_btree_bench.db";
+    fs::remove(path);
+    {
+        BPlusTreeStore tree(path, frames);
+        for (int ac = 1; ac <= bookSize; ++ac) tree.put(BankAccount("Bench " + to_string(ac), ac, ac, "0000"));
+        tree.flush();
+
+        mt19937 rng(42);
+        cout << "B+tree: " << bookSize << " accounts, " << frames << " x " << BufferPool::pageSize / 1024 << " KiB frames\n";
+        cout << setw(14) << "working set" << setw(12) << "hit rate" << setw(14) << "ns/lookup" << '\n';
+        for (int workingSet : {1'000, 5'000, 20'000, 50'000, bookSize}) {
+            uniform_int_distribution<int> pick(1, workingSet);
+            for (int i = 0; i < lookups / 10; ++i) (void)tree.get(pick(rng)); // warm up
+            tree.resetStats();
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < lookups; ++i) (void)tree.get(pick(rng));
+            auto ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+            auto st = tree.stats();
+            cout << setw(14) << workingSet << setw(11) << fixed << setprecision(1)
+                 << 100.0 * st.hits / max<uint64_t>(1, st.hits + st.misses) << '%'
+                 << setw(14) << setprecision(0) << ns / lookups << '\n' << defaultfloat;
+        }
+    }
+    fs::remove(path);
+}
+
+// Commit latency and throughput of each durability class with concurrent committers.
+inline void benchmarkDurability() {
+    constexpr int threads = 4;
+    constexpr int opsPerThread = 500;
+    const fs::path dir = fs::temp_directory_path() / "bank_durability_bench";
+    cout << "Durability: " << threads << " threads x " << opsPerThread << " commits\n";
+    cout << setw(10) << "class" << setw(14) << "commits/s" << setw(12) << "mean us" << setw(12) << "p99 us" << '\n';
+    for (auto [name, level] : {pair{"memory", Durability::Memory}, pair{"async", Durability::Async},
+                               pair{"group", Durability::Group}, pair{"sync", Durability::Sync}}) {
+        fs::remove_all(dir);
+        fs::create_directories(dir);
+        vector<double> latencies(threads * opsPerThread);
+        double seconds{};
+        {
+            AuditLog log;
+            log.open((dir / "audit_log.txt").string());
+            auto start = chrono::steady_clock::now();
+            vector<jthread> pool;
+            for (int t = 0; t < threads; ++t) {
+                pool.emplace_back([&, t] {
+                    for (int i = 0; i < opsPerThread; ++i) {
+                        auto begin = chrono::steady_clock::now();
+                        log.append("deposit", t + 1, 0, 1.0);
+                        log.commit(level);
+                        latencies[t * opsPerThread + i] = chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count();
+                    }
+                });
+            }
+            pool.clear();
+            seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+        ranges::sort(latencies);
+        double mean = accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+        ostringstream row;
+        row << fixed << setprecision(0) << setw(10) << name << setw(14) << latencies.size() / seconds
+            << setprecision(1) << setw(12) << mean << setw(12) << latencies[latencies.size() * 99 / 100] << '\n';
+        cout << row.str();
+    }
+    fs::remove_all(dir);
+}
+
+// Cost of the idempotency cache at full size, then retried deposits against a bank before
+// and after a restart: every retry must return the first result and move no money.
+inline void benchmarkIdempotency() {
+    constexpr size_t cacheKeys = 1'000'000;
+    constexpr int deposits = 20'000;
+    {
+        IdempotencyCache cache(chrono::hours(24), cacheKeys);
+        vector<string> keys;
+        keys.reserve(cacheKeys);
+        for (size_t i = 0; i < cacheKeys; ++i) keys.push_back("req-" + to_string(i));
+        const auto now = AuditLog::nowMillis();
+        auto timed = [&](auto&& body) {
+            auto start = chrono::steady_clock::now();
+            body();
+            return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / cacheKeys;
+        };
+        auto insert = timed([&] {
+            for (const auto& key : keys) cache.remember(key, now, nullopt);
+        });
+        size_t found = 0;
+        mt19937 rng(7);
+        ranges::shuffle(keys, rng);
+        auto hit = timed([&] {
+            for (const auto& key : keys) found += cache.find(key, now).has_value();
+        });
+        for (auto& key : keys) key[0] = 'x';
+        auto miss = timed([&] {
+            for (const auto& key : keys) found += cache.find(key, now).has_value();
+        });
+        ostringstream row;
+        row << "Idempotency cache: " << cache.size() << " keys; " << fixed << setprecision(0) << insert << " ns/insert, "
+            << hit << " ns/hit, " << miss << " ns/miss (" << found << " found, expected " << cacheKeys << ")\n";
+        cout << row.str();
+    }
+
+    const fs::path dir = fs::temp_directory_path() / "bank_idempotency_bench";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    const string snapshot = (dir / "accounts_secure.txt").string(), log = (dir / "audit_log.txt").string();
+    auto open = [&](BankManagement& bank) {
+        bank.loadFromFile(snapshot);
+        bank.recoverFromLog(log);
+        bank.openAuditLog(log);
+    };
+    auto depositAll = [&](BankManagement& bank) {
+        size_t failures = 0;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < deposits; ++i) {
+            AuditRecord cmd;
+            cmd.op = "deposit";
+            cmd.account = 1;
+            cmd.amount = 1.0;
+            cmd.text = IdempotencyCache::tag("", "dep-" + to_string(i));
+            auto level = i + 1 == deposits ? Durability::Sync : Durability::Async;
+            if (bank.submit(cmd, "0000", level)) ++failures;
+        }
+        if (failures) throw runtime_error(to_string(failures) + " keyed deposits failed");
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+    auto balance = [](BankManagement& bank) { return bank.findAccount(1)->get().getBalance(); };
+    ostringstream out;
+    out << fixed << setprecision(0) << deposits << " keyed deposits, each retried:\n";
+    {
+        BankManagement bank;
+        open(bank);
+        AuditRecord add;
+        add.op = "addAccount";
+        add.account = 1;
+        add.text = "Bench";
+        if (auto error = bank.submit(add, "0000")) throw runtime_error(*error);
+        auto first = depositAll(bank);
+        auto retry = depositAll(bank);
+        out << setw(22) << "first attempt" << setw(12) << deposits / first << " ops/s\n"
+            << setw(22) << "retry" << setw(12) << deposits / retry << " ops/s, balance " << balance(bank) << '\n';
+    } // no snapshot saved: the restart recovers from the log like after a crash
+    {
+        BankManagement bank;
+        auto start = chrono::steady_clock::now();
+        open(bank);
+        auto reopenMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        auto retry = depositAll(bank);
+        out << setw(22) << "retry after restart" << setw(12) << deposits / retry << " ops/s, balance " << balance(bank)
+            << " (expected " << deposits << "); recovery and key reload " << setprecision(1) << reopenMs << " ms\n";
+    }
+    cout << out.str();
+    fs::remove_all(dir);
+}
+
+// Hold expiry on the timer wheel against the full scan it replaces, on a simulated day
+// with holds expiring throughout it, then holds through a bank restart and expiry.
+inline void benchmarkHolds() {
+    constexpr size_t wheelHolds = 2'000'000;
+    constexpr int64_t day = 24 * 3600 * 1000;
+    constexpr int bankHolds = 100'000;
+    {
+        mt19937_64 rng(11);
+        uniform_int_distribution<int64_t> when(1, day);
+        vector<int64_t> due(wheelHolds);
+        for (auto& d : due) d = when(rng);
+        vector<bool> settled(wheelHolds); // every other hold is captured or released first
+        for (size_t i = 0; i < wheelHolds; i += 2) settled[i] = true;
+
+        TimerWheel<uint32_t> wheel(chrono::seconds(1), 0);
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < wheelHolds; ++i) wheel.schedule(static_cast<uint32_t>(i), due[i]);
+        auto scheduleNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / wheelHolds;
+
+        size_t expired = 0;
+        int64_t worstLateMs = 0;
+        start = chrono::steady_clock::now();
+        for (int64_t now = 0; now <= day; now += 1000) {
+            wheel.advance(now, [&](uint32_t id) {
+                if (settled[id]) return;
+                ++expired;
+                worstLateMs = max(worstLateMs, now - due[id]);
+            });
+        }
+        auto advanceMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        unordered_map<uint32_t, int64_t> open; // what a scan would walk every second
+        for (size_t i = 1; i < wheelHolds; i += 2) open.emplace(static_cast<uint32_t>(i), due[i]);
+        start = chrono::steady_clock::now();
+        size_t seen = 0;
+        for (const auto& [id, d] : open) seen += d <= day / 2;
+        auto scanMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        ostringstream out;
+        out << fixed << setprecision(0) << "Timer wheel: " << wheelHolds << " holds over a simulated day, half settled early\n"
+            << "  schedule " << scheduleNs << " ns/hold; 86,400 one-second advances " << advanceMs << " ms in total ("
+            << advanceMs * 1e6 / wheelHolds << " ns/hold); expired " << expired << " of " << wheelHolds / 2
+            << ", at most " << worstLateMs << " ms late\n"
+            << "  one full scan of the open holds " << setprecision(1) << scanMs << " ms (" << seen
+            << " due); once a second for the day " << setprecision(0) << scanMs * 86'400 / 1000 << " s\n";
+        cout << out.str();
+    }
+
+    const fs::path dir = fs::temp_directory_path() / "bank_holds_bench";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    const string snapshot = (dir / "accounts_secure.txt").string(), log = (dir / "audit_log.txt").string();
+    auto open = [&](BankManagement& bank) {
+        bank.loadFromFile(snapshot);
+        bank.recoverFromLog(log);
+        bank.openAuditLog(log);
+    };
+    auto available = [](BankManagement& bank) { return bank.findAccount(1)->get().getAvailableBalance(); };
+    ostringstream out;
+    out << fixed << setprecision(0);
+    const int64_t until = AuditLog::nowMillis() + 5000;
+    {
+        BankManagement bank;
+        open(bank);
+        AuditRecord add;
+        add.op = "addAccount";
+        add.account = 1;
+        add.amount = 1e9;
+        add.text = "Bench";
+        if (auto error = bank.submit(add, "0000")) throw runtime_error(*error);
+        auto start = chrono::steady_clock::now();
+        for (int i = 1; i <= bankHolds; ++i) {
+            auto level = i == bankHolds ? Durability::Sync : Durability::Memory;
+            if (auto error = bank.submit(HoldBook::holdCommand(1, 1.0, static_cast<uint64_t>(i), until), "0000", level))
+                throw runtime_error(*error);
+        }
+        auto seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        out << "Bank: " << bankHolds << " holds placed at " << bankHolds / seconds << "/s; available " << available(bank) << '\n';
+    } // no snapshot saved: the restart recovers from the log like after a crash
+    {
+        BankManagement bank;
+        auto start = chrono::steady_clock::now();
+        open(bank);
+        auto reopenMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        out << "  after restart: " << bank.openHolds() << " open holds, available " << available(bank) << " (reload "
+            << setprecision(1) << reopenMs << " ms)\n";
+        this_thread::sleep_until(chrono::system_clock::time_point(chrono::milliseconds(until + 1000)));
+        start = chrono::steady_clock::now();
+        bank.expireHolds();
+        auto expireMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        out << "  expired in " << expireMs << " ms (" << setprecision(0) << expireMs * 1e6 / bankHolds
+            << " ns/hold); " << bank.openHolds() << " open, available " << available(bank) << '\n';
+    }
+    cout << out.str();
+    fs::remove_all(dir);
+}
+
+// The calendar queue against a scan of every order on each tick, over a simulated month of
+// daily orders, then standing orders due together run as one batch against the same
+// transfers submitted one by one.
+inline void benchmarkStandingOrders() {
+    constexpr size_t queuedOrders = 1'000'000;
+    constexpr int64_t minute = 60'000, day = 24 * 60 * minute;
+    constexpr int bankAccounts = 1000, bankOrders = 20'000, singleTransfers = 2000;
+    {
+        mt19937_64 rng(17);
+        uniform_int_distribution<int64_t> when(1, day);
+        vector<int64_t> next(queuedOrders);
+        for (auto& n : next) n = when(rng);
+
+        CalendarQueue<uint32_t> queue(chrono::minutes(1), 24 * 60, 0);
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < queuedOrders; ++i) queue.push(static_cast<uint32_t>(i), next[i]);
+        auto pushNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / queuedOrders;
+
+        size_t runs = 0;
+        vector<uint32_t> fired;
+        start = chrono::steady_clock::now();
+        for (int64_t now = 0; now < 30 * day; now += minute) {
+            fired.clear();
+            queue.popDue(now, [&](uint32_t id, int64_t) { fired.push_back(id); });
+            for (auto id : fired) queue.push(id, next[id] += day);
+            runs += fired.size();
+        }
+        auto queueMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        start = chrono::steady_clock::now();
+        size_t seen = 0;
+        for (auto n : next) seen += n <= 30 * day; // the next tick's orders
+        auto scanMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        ostringstream out;
+        out << fixed << setprecision(0) << "Calendar queue: " << queuedOrders << " daily orders over a simulated month\n"
+            << "  push " << pushNs << " ns/order; 43,200 one-minute ticks " << queueMs << " ms in total for " << runs
+            << " runs (" << queueMs * 1e6 / max<size_t>(runs, 1) << " ns/run)\n"
+            << "  one scan of every order " << setprecision(2) << scanMs << " ms (" << seen << " due); every minute for the month "
+            << setprecision(0) << scanMs * 43'200 / 1000 << " s\n";
+        cout << out.str();
+    }
+
+    const fs::path dir = fs::temp_directory_path() / "bank_orders_bench";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    BankManagement bank;
+    bank.loadFromFile((dir / "accounts_secure.txt").string());
+    bank.openAuditLog((dir / "audit_log.txt").string());
+    for (int i = 1; i <= bankAccounts; ++i) {
+        AuditRecord add;
+        add.op = "addAccount";
+        add.account = i;
+        add.amount = 1e6;
+        add.text = "Bench";
+        if (auto error = bank.submit(add, "0000", Durability::Memory)) throw runtime_error(*error);
+    }
+    auto total = [&] {
+        double sum = 0;
+        for (int i = 1; i <= bankAccounts; ++i) sum += bank.findAccount(i)->get().getBalance();
+        return sum;
+    };
+    const double before = total();
+    const int64_t firstDue = AuditLog::nowMillis() - minute; // all due on the next tick
+    for (int i = 1; i <= bankOrders; ++i) {
+        auto level = i == bankOrders ? Durability::Sync : Durability::Memory;
+        int from = i % bankAccounts + 1, to = (i * 7) % bankAccounts + 1;
+        if (from == to) to = to % bankAccounts + 1;
+        auto cmd = StandingOrders::scheduleCommand(static_cast<uint64_t>(i), from, to, 1.0, StandingOrders::Period::Monthly, firstDue);
+        if (auto error = bank.submit(cmd, "0000", level)) throw runtime_error(*error);
+    }
+    auto start = chrono::steady_clock::now();
+    auto ran = bank.runDueOrders();
+    auto batchSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (int i = 1; i <= singleTransfers; ++i) {
+        AuditRecord cmd;
+        cmd.op = "transfer";
+        cmd.account = i % bankAccounts + 1;
+        cmd.other = (i + 1) % bankAccounts + 1;
+        cmd.amount = 1.0;
+        if (auto error = bank.submit(cmd, "0000")) throw runtime_error(*error);
+    }
+    auto singleSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    ostringstream out;
+    out << fixed << setprecision(0) << "Bank: " << ran << " of " << bankOrders << " orders due together, one batch "
+        << ran / batchSeconds << " transfers/s; submitted one by one " << singleTransfers / singleSeconds
+        << " transfers/s\n  money before " << before << ", after " << total() << '\n';
+    cout << out.str();
+    fs::remove_all(dir);
+}
+
+// Deposits and withdrawals on a mixed book of savings, checking, loan and standard
+// accounts: BankAccount with its limits resolved ahead and what it can spend kept up to
+// date, against the same rules as a class hierarchy with virtual deposit/withdraw on
+// heap objects.
+inline void benchmarkProducts() {
+    constexpr size_t accountCount = size_t{1} << 20, operations = 20'000'000;
+    struct VirtualAccount {
+        string name;
+        int accountNum{};
+        double balance{}, held{};
+        size_t pinHash{};
+        virtual ~VirtualAccount() = default;
+        virtual double overdraftLimit() const { return 0; }
+        virtual double maxWithdrawal() const { return numeric_limits<double>::infinity(); }
+        virtual double maxBalance() const { return numeric_limits<double>::infinity(); }
+        virtual void deposit(double amount) {
+            if (amount <= 0) throw invalid_argument("Deposit must be positive");
+            if (balance + amount > maxBalance()) throw runtime_error("Deposit exceeds the amount owed");
+            balance += amount;
+        }
+        virtual void withdraw(double amount) {
+            if (amount <= 0) throw invalid_argument("Withdrawal must be positive");
+            if (amount > maxWithdrawal()) throw runtime_error("Withdrawal exceeds the product limit");
+            if (balance - held + overdraftLimit() < amount) throw runtime_error("Insufficient balance");
+            balance -= amount;
+        }
+    };
+    struct VirtualSavings : VirtualAccount {
+        double maxWithdrawal() const override { return SavingsProduct::maxWithdrawal; }
+    };
+    struct VirtualChecking : VirtualAccount {
+        double overdraftLimit() const override { return CheckingProduct::overdraftLimit; }
+    };
+    struct VirtualLoan : VirtualAccount {
+        double overdraftLimit() const override { return LoanProduct::overdraftLimit; }
+        double maxBalance() const override { return LoanProduct::maxBalance; }
+    };
+
+    mt19937_64 rng(23);
+    vector<BankAccount> book;
+    vector<unique_ptr<VirtualAccount>> objects;
+    book.reserve(accountCount);
+    objects.reserve(accountCount);
+    for (size_t i = 0; i < accountCount; ++i) {
+        const auto kind = static_cast<AccountKind>(rng() % 4);
+        const double balance = kind == AccountKind::Loan ? -10'000 : 10'000;
+        book.push_back(BankAccount::restore("Bench", static_cast<int>(i + 1), balance, 0));
+        book.back().setTerms(kind);
+        unique_ptr<VirtualAccount> obj;
+        switch (kind) {
+            case AccountKind::Savings: obj = make_unique<VirtualSavings>(); break;
+            case AccountKind::Checking: obj = make_unique<VirtualChecking>(); break;
+            case AccountKind::Loan: obj = make_unique<VirtualLoan>(); break;
+            case AccountKind::Standard: obj = make_unique<VirtualAccount>(); break;
+        }
+        obj->name = "Bench";
+        obj->accountNum = static_cast<int>(i + 1);
+        obj->balance = balance;
+        objects.push_back(std::move(obj));
+    }
+    struct Op {
+        uint32_t account;
+        float amount; // negative: withdraw
+    };
+    vector<Op> ops(operations);
+    for (auto& op : ops) {
+        const int amount = int(rng() % 200) - 100;
+        op = {static_cast<uint32_t>(rng() % accountCount), static_cast<float>(amount >= 0 ? amount + 1 : amount)};
+    }
+
+    // Over the first `accounts` accounts (a power of two): all of them, and a set that
+    // stays in cache.
+    auto run = [&](size_t accounts, auto&& apply) {
+        size_t refused = 0;
+        auto start = chrono::steady_clock::now();
+        for (const auto& op : ops) {
+            try {
+                apply(op.account & (accounts - 1), double(op.amount));
+            } catch (const exception&) {
+                ++refused;
+            }
+        }
+        return pair{chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / operations, refused};
+    };
+    ostringstream out;
+    out << fixed << "Products: " << operations << " deposits/withdrawals on accounts of four kinds\n";
+    for (size_t accounts : {accountCount, size_t{4096}}) {
+        auto [staticNs, staticRefused] = run(accounts, [&](size_t i, double amount) {
+            amount > 0 ? book[i].deposit(amount) : book[i].withdraw(-amount);
+        });
+        auto [virtualNs, virtualRefused] = run(accounts, [&](size_t i, double amount) {
+            amount > 0 ? objects[i]->deposit(amount) : objects[i]->withdraw(-amount);
+        });
+        out << setprecision(1) << setw(10) << accounts << " accounts: precomputed limits " << staticNs
+            << " ns/op, virtual classes " << virtualNs << " ns/op (" << setprecision(2) << virtualNs / staticNs
+            << "x); refused " << setprecision(0) << staticRefused << " vs " << virtualRefused << '\n';
+    }
+    double staticSum = 0, virtualSum = 0;
+    for (size_t i = 0; i < accountCount; ++i) {
+        staticSum += book[i].getBalance();
+        virtualSum += objects[i]->balance;
+    }
+    out << "  books " << (staticSum == virtualSum ? "agree" : "DIFFER") << '\n';
+    cout << out.str();
+}
+
+// The accrual pass over 100,000,000 accounts of columns, on every core, with the AVX2
+// and portable paths compared one thread each; then one day's accrual in a bank of
+// 1,000,000 accounts, posted as one batch and recovered after a restart.
+inline void benchmarkInterest() {
+    constexpr size_t columnRows = 100'000'000, compareRows = 10'000'000;
+    constexpr int bankAccounts = 1'000'000;
+    {
+        vector<int64_t> cents(columnRows), carry(columnRows), interest(columnRows);
+        vector<int32_t> rates(columnRows);
+        constexpr array<int32_t, 6> productRates{0, 50, 150, 250, 365, 500};
+        parallelFor(columnRows, 1 << 20, [&](size_t begin, size_t end) {
+            mt19937_64 rng(begin);
+            uniform_int_distribution<int64_t> balance(-100'000, 1'000'000'000), owed(0, InterestBook::divisor - 1);
+            for (size_t i = begin; i < end; ++i) {
+                cents[i] = balance(rng);
+                rates[i] = productRates[rng() % productRates.size()];
+                carry[i] = owed(rng);
+            }
+        });
+        vector<int64_t> portableCarry(carry.begin(), carry.begin() + compareRows), portableInterest(compareRows);
+
+        auto start = chrono::steady_clock::now();
+        InterestBook::accrue(cents, rates, carry, interest);
+        auto allMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        vector<int64_t> oneCarry(portableCarry), oneInterest(compareRows);
+        start = chrono::steady_clock::now();
+        InterestBook::accrueRange(cents.data(), rates.data(), oneCarry.data(), oneInterest.data(), 0, compareRows);
+        auto oneNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / compareRows;
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < compareRows; ++i) InterestBook::accrueOne(cents[i], rates[i], portableCarry[i], portableInterest[i]);
+        auto portableNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / compareRows;
+
+        size_t mismatches = 0;
+        for (size_t i = 0; i < compareRows; ++i)
+            mismatches += interest[i] != portableInterest[i] || carry[i] != portableCarry[i];
+        const auto paid = accumulate(interest.begin(), interest.end(), int64_t{0});
+
+        ostringstream out;
+        out << fixed << setprecision(0) << "Accrual pass: " << columnRows << " accounts on " << thread::hardware_concurrency()
+            << " threads in " << allMs << " ms (" << columnRows / allMs * 1000 << " accounts/s), " << paid
+            << " cents paid\n"
+            << setprecision(2) << "  one thread: dispatched " << oneNs << " ns/account, portable " << portableNs
+            << " ns/account; " << mismatches << " of " << compareRows << " rows differ between them\n";
+        cout << out.str();
+    }
+
+    const fs::path dir = fs::temp_directory_path() / "bank_interest_bench";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    const string snapshot = (dir / "accounts_secure.txt").string(), log = (dir / "audit_log.txt").string();
+    const auto day = InterestBook::dayOf(AuditLog::nowMillis()) - 1;
+    {
+        ofstream book(snapshot), terms(dir / "interest.txt");
+        book << "#seq 0\n#time 0\n" << setprecision(17);
+        terms << "#seq 0\nday " << day - 1 << "\nP 1 250 savings \"Savings\"\n";
+        for (int i = 1; i <= bankAccounts; ++i) {
+            BankAccount("Bench", i, 1000 + i % 100'000, "0000").save(book);
+            terms << "A " << i << " 1 0\n";
+        }
+    }
+    auto open = [&](BankManagement& bank) {
+        bank.loadFromFile(snapshot);
+        bank.recoverFromLog(log);
+        bank.openAuditLog(log);
+    };
+    auto total = [](BankManagement& bank) {
+        double sum = 0;
+        bank.forEachAccount([&](const BankAccount& acc) { sum += acc.getBalance(); });
+        return sum;
+    };
+    ostringstream out;
+    out << fixed << setprecision(2);
+    {
+        BankManagement bank;
+        open(bank);
+        const double before = total(bank);
+        auto start = chrono::steady_clock::now();
+        auto paid = bank.accrueInterest(day);
+        auto ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        out << "Bank: " << bankAccounts << " accounts accrued and posted in one batch in " << setprecision(0) << ms
+            << " ms; paid " << setprecision(2) << paid / 100.0 << ", balances up " << total(bank) - before << '\n';
+    } // no snapshot saved: the restart recovers the postings from the log
+    {
+        BankManagement bank;
+        open(bank);
+        auto again = bank.accrueInterest(day);
+        out << "  after restart: total " << total(bank) << ", accruing the same day again pays " << again << '\n';
+    }
+    cout << out.str();
+    fs::remove_all(dir);
+}
+
+// Revaluation of 50,000,000 rows of columns into one currency, on every core, with the
+// AVX2 and portable paths compared one thread each; then a bank of 1,000,000 accounts in
+// four currencies revalued; then transfers in a bank of 1,000 accounts, before and
+// while the rate table is republished about a thousand times a second, recovered after a
+// restart.
+inline void benchmarkCurrencies() {
+    constexpr size_t columnRows = 50'000'000, block = 1 << 16;
+    constexpr int bankAccounts = 1'000'000, traders = 1'000, transfers = 200'000;
+    const array<string, 4> codes{"USD", "EUR", "GBP", "JPY"};
+    const array<double, 4> toBase{1.0, 1.0842, 1.2710, 0.006712};
+    ostringstream out;
+    out << fixed;
+    {
+        vector<double> balances(columnRows), factor(64), values(columnRows), portable(columnRows);
+        vector<int32_t> ids(columnRows);
+        parallelFor(columnRows, 1 << 20, [&](size_t begin, size_t end) {
+            mt19937_64 rng(begin);
+            uniform_real_distribution<double> balance(-1'000, 1'000'000);
+            for (size_t i = begin; i < end; ++i) {
+                balances[i] = round(balance(rng) * 100) / 100;
+                ids[i] = static_cast<int32_t>(rng() % factor.size());
+            }
+        });
+        mt19937_64 rng(74);
+        for (auto& f : factor) f = uniform_real_distribution<double>(0.001, 200)(rng);
+
+        auto start = chrono::steady_clock::now();
+        const double total = FxRates::revalue(balances, ids, factor, values);
+        const auto allMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        auto oneThread = [&](auto range, vector<double>& into, double& sum) {
+            sum = 0;
+            auto begin = chrono::steady_clock::now();
+            for (size_t b = 0; b < columnRows; b += block)
+                sum += range(balances.data(), ids.data(), factor.data(), into.data(), b, min(columnRows, b + block));
+            return chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / columnRows;
+        };
+        double dispatchedSum = 0, portableSum = 0;
+        const auto dispatchedNs = oneThread(FxRates::revalueRange, values, dispatchedSum);
+        const auto portableNs = oneThread(FxRates::revaluePortable, portable, portableSum);
+        size_t mismatches = 0;
+        for (size_t i = 0; i < columnRows; ++i) mismatches += values[i] != portable[i];
+        out << "Revaluation: " << columnRows << " rows in 64 currencies on all cores in " << setprecision(1) << allMs
+            << " ms (" << setprecision(2) << allMs * 1e6 / columnRows << " ns/row)\n"
+            << "  one thread: dispatched " << dispatchedNs << " ns/row, portable " << portableNs << " ns/row; "
+            << mismatches << " rows differ, totals " << (dispatchedSum == portableSum && portableSum == total ? "agree" : "DIFFER")
+            << '\n';
+    }
+
+    const fs::path dir = fs::temp_directory_path() / "bank_fx_bench";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    const string snapshot = (dir / "accounts_secure.txt").string(), log = (dir / "audit_log.txt").string();
+    auto writeRates = [&](double drift) {
+        {
+            ofstream rates(dir / "fx_rates.tmp");
+            rates << setprecision(17);
+            for (size_t c = 1; c < codes.size(); ++c) rates << codes[c] << ' ' << toBase[c] * drift << '\n';
+        }
+        fs::rename(dir / "fx_rates.tmp", dir / "fx_rates.txt");
+    };
+    // A fresh bank of `accounts` accounts, a quarter in each currency.
+    auto writeBook = [&](int accounts) {
+        fs::remove(log);
+        ofstream book(snapshot), currencies(dir / "account_currencies.txt");
+        book << "#seq 0\n#time 0\n" << setprecision(17);
+        currencies << "#seq 0\n";
+        for (int i = 1; i <= accounts; ++i) {
+            BankAccount("Bench", i, 1'000'000, "0000").save(book);
+            if (i % 4) currencies << "A " << i << ' ' << codes[i % 4] << '\n';
+        }
+    };
+    writeBook(bankAccounts);
+    writeRates(1.0);
+    auto open = [&](BankManagement& bank) {
+        bank.loadFromFile(snapshot);
+        bank.recoverFromLog(log);
+        bank.openAuditLog(log);
+    };
+    auto balances = [](BankManagement& bank) {
+        vector<double> all;
+        bank.forEachAccount([&](const BankAccount& acc) { all.push_back(acc.getBalance()); });
+        return all;
+    };
+    vector<double> live;
+    {
+        BankManagement bank;
+        open(bank);
+        const auto eur = *packCurrency("EUR");
+        const auto book = bank.revalueBook(eur);
+        out << "Bank: " << bankAccounts << " accounts in 4 currencies revalued into EUR in " << setprecision(1)
+            << book.seconds * 1000 << " ms; total " << setprecision(2) << book.total << " EUR\n";
+    }
+    writeBook(traders);
+    {
+        BankManagement bank;
+        open(bank);
+        mt19937_64 rng(7);
+        auto run = [&](size_t count) {
+            size_t refused = 0;
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 0; i < count; ++i) {
+                AuditRecord cmd;
+                cmd.op = "transfer";
+                cmd.account = static_cast<int>(rng() % traders) + 1;
+                cmd.other = static_cast<int>(rng() % traders) + 1;
+                cmd.amount = 1 + static_cast<double>(rng() % 10'000) / 100;
+                refused += bank.submit(std::move(cmd), nullopt, Durability::Memory).has_value();
+            }
+            return pair{count / chrono::duration<double>(chrono::steady_clock::now() - start).count(), refused};
+        };
+        auto [quietRate, quietRefused] = run(transfers);
+        atomic<bool> done = false;
+        size_t published = 0;
+        jthread publisher([&] {
+            for (double drift = 1.0; !done; drift += 1e-6) {
+                writeRates(drift);
+                published += bank.reloadRates();
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+        });
+        auto [busyRate, busyRefused] = run(transfers);
+        done = true;
+        publisher.join();
+        out << "  " << traders << " accounts, transfers: " << setprecision(0) << quietRate << "/s with the rates unchanged, " << busyRate << "/s while "
+            << published << " rate tables were published; refused " << quietRefused + busyRefused << '\n';
+        live = balances(bank);
+    } // no snapshot saved: the restart recovers the transfers from the log
+    {
+        writeRates(2.0); // replay must not depend on today's rates
+        BankManagement bank;
+        open(bank);
+        out << "  after restart: balances " << (balances(bank) == live ? "match" : "DIFFER") << '\n';
+    }
+    cout << out.str();
+    fs::remove_all(dir);
+}
+
+// The fraud rules on their own: 20,000,000 debits spread over two hours, on a book of
+// 1,000,000 accounts and on 4,096 busy ones, against keeping every debit in the window
+// and scanning it; then the time they add to withdrawals in a bank.
+inline void benchmarkFraud() {
+    constexpr size_t accountCount = size_t{1} << 20, busy = 4096, operations = 20'000'000, scanned = 2'000'000;
+    constexpr int64_t span = 2 * 3600 * 1000;
+    const string ruleText = "count 5 10\ntotal 5000 60\ncount 200 1440\ntotal 50000 1440 block\n";
+    istringstream ruleStream(ruleText);
+    const auto rules = FraudMonitor::loadRules(ruleStream);
+    struct Debit {
+        uint32_t account;
+        float amount;
+    };
+    vector<Debit> debits(operations);
+    mt19937_64 rng(75);
+    for (auto& d : debits) d = {static_cast<uint32_t>(rng()), static_cast<float>(1 + rng() % 20'000) / 100};
+    const int64_t start = AuditLog::nowMillis();
+    auto timeOf = [&](size_t i) { return start + int64_t(i) * span / int64_t(operations); };
+
+    ostringstream out;
+    out << fixed << "Fraud rules: " << rules.size() << ", " << operations << " debits over two hours\n";
+    for (size_t accounts : {accountCount, busy}) {
+        FraudMonitor monitor;
+        monitor.setRules(rules);
+        for (size_t a = 0; a < accounts; ++a) monitor.record(static_cast<int>(a), 0, start - span); // rows made up front
+        size_t alerts = 0;
+        auto begin = chrono::steady_clock::now();
+        for (size_t i = 0; i < operations; ++i) {
+            const int account = static_cast<int>(debits[i].account & (accounts - 1));
+            const auto broken = monitor.check(account, debits[i].amount, timeOf(i));
+            alerts += popcount(broken);
+            if (!(broken & monitor.blocking())) monitor.record(account, debits[i].amount, timeOf(i));
+        }
+        const auto ns = chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / operations;
+        out << setprecision(1) << setw(10) << accounts << " accounts: " << ns << " ns/debit, " << alerts << " alerts\n";
+    }
+    {
+        // Every debit kept until the longest window has passed, each rule summed by a scan.
+        unordered_map<int, deque<pair<int64_t, int64_t>>> kept;
+        size_t alerts = 0;
+        auto begin = chrono::steady_clock::now();
+        for (size_t i = 0; i < scanned; ++i) {
+            const int account = static_cast<int>(debits[i].account & (busy - 1));
+            const int64_t now = start + int64_t(i) * span / int64_t(scanned), cents = llround(debits[i].amount * 100);
+            auto& events = kept[account];
+            while (!events.empty() && events.front().first <= now - 1440 * 60'000) events.pop_front();
+            bool blocked = false;
+            for (const auto& r : rules) {
+                int64_t count = 1, total = cents;
+                for (auto it = events.rbegin(); it != events.rend() && it->first > now - r.minutes * 60'000; ++it) {
+                    ++count;
+                    total += it->second;
+                }
+                const bool broken = r.measure == FraudMonitor::Measure::Count ? count > r.limit : total > llround(r.limit * 100);
+                alerts += broken;
+                blocked |= broken && r.block;
+            }
+            if (!blocked) events.emplace_back(now, cents);
+        }
+        const auto ns = chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / scanned;
+        out << setprecision(1) << setw(10) << busy << " accounts, every debit kept and scanned: " << ns << " ns/debit ("
+            << scanned << " debits over the same two hours, " << alerts << " alerts)\n";
+    }
+
+    constexpr int bankAccounts = 1'000, withdrawals = 200'000;
+    const fs::path dir = fs::temp_directory_path() / "bank_fraud_bench";
+    double nsWith = numeric_limits<double>::infinity(), nsWithout = nsWith; // best of three rounds, taken in turn
+    size_t refused = 0;
+    for (int round = 0; round < 6; ++round) {
+        const bool screened = round % 2;
+        fs::remove_all(dir);
+        fs::create_directories(dir);
+        const string snapshot = (dir / "accounts_secure.txt").string(), log = (dir / "audit_log.txt").string();
+        {
+            ofstream book(snapshot);
+            book << "#seq 0\n#time 0\n" << setprecision(17);
+            for (int i = 1; i <= bankAccounts; ++i) BankAccount("Bench", i, 1e9, "0000").save(book);
+            // Limits a customer stays under, so that the cost is the one every debit pays.
+            if (screened) ofstream(dir / "fraud_rules.txt") << "count 1000 10\ntotal 1000000 60\ncount 5000 1440\ntotal 10000000 1440 block\n";
+        }
+        BankManagement bank;
+        bank.loadFromFile(snapshot);
+        bank.openAuditLog(log);
+        size_t failed = 0;
+        auto begin = chrono::steady_clock::now();
+        for (int i = 0; i < withdrawals; ++i) {
+            AuditRecord cmd;
+            cmd.op = "withdraw";
+            cmd.account = static_cast<int>(rng() % bankAccounts) + 1;
+            cmd.amount = 1 + static_cast<double>(rng() % 20'000) / 100;
+            failed += bank.submit(std::move(cmd), nullopt, Durability::Memory).has_value();
+        }
+        auto& best = screened ? nsWith : nsWithout;
+        best = min(best, chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / withdrawals);
+        if (screened) refused = failed;
+    }
+    fs::remove_all(dir);
+    out << "Bank: " << withdrawals << " withdrawals, " << setprecision(0) << nsWithout << " ns each without rules, "
+        << nsWith << " ns with them; " << refused << " refused\n";
+    cout << out.str();
+}
+
+// A fee run over a book of 1,000,000 accounts with a three-rule table: the dry run, then
+// the same run posted as one batch, then the book after a restart.
+inline void benchmarkFees() {
+    constexpr int bankAccounts = 1'000'000, deposits = 20'000;
+    const fs::path dir = fs::temp_directory_path() / "bank_fees_bench";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    const string snapshot = (dir / "accounts_secure.txt").string(), log = (dir / "audit_log.txt").string();
+    const auto now = AuditLog::nowMillis();
+    {
+        ofstream book(snapshot), activity(dir / "fees.txt"), rules(dir / "fee_rules.txt");
+        book << "#seq 0\n#time 0\n" << setprecision(17);
+        activity << "#seq 0\nmonth " << FeeBook::monthOf(now) << "\nsince " << now << '\n';
+        rules << "minimum-balance 0 5000 5\nper-transaction 0 3 0.2\ndormancy 0 90 2.5\n";
+        for (int i = 1; i <= bankAccounts; ++i) {
+            BankAccount("Bench", i, i % 10'000, "0000").save(book);
+            activity << "A " << i << ' ' << now - int64_t(i % 120) * 86'400'000 << '\n';
+        }
+    }
+    auto open = [&](BankManagement& bank) {
+        bank.loadFromFile(snapshot);
+        bank.recoverFromLog(log);
+        bank.openAuditLog(log);
+    };
+    auto total = [](BankManagement& bank) {
+        double sum = 0;
+        bank.forEachAccount([&](const BankAccount& acc) { sum += acc.getBalance(); });
+        return sum;
+    };
+    auto charged = [](const FeeBook::Totals& t) { return accumulate(t.charged.begin(), t.charged.end(), 0.0); };
+    ostringstream out;
+    out << fixed << setprecision(2);
+    double after{};
+    {
+        BankManagement bank;
+        open(bank);
+        AuditRecord deposit;
+        deposit.op = "deposit";
+        deposit.amount = 1;
+        for (int i = 0; i < deposits; ++i) { // activity for the per-transaction rule
+            deposit.account = 1 + i % 100;
+            if (auto error = bank.submit(deposit, "0000", i + 1 == deposits ? Durability::Sync : Durability::Memory))
+                throw runtime_error(*error);
+        }
+        const double before = total(bank);
+        auto start = chrono::steady_clock::now();
+        auto preview = bank.assessFees(false);
+        auto dryMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        start = chrono::steady_clock::now();
+        auto posted = bank.assessFees(true);
+        auto postMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        after = total(bank);
+        out << "Fees: " << bankAccounts << " accounts, 3 rules, " << deposits << " transactions in the period\n";
+        for (size_t k = 0; k < posted.rules.size(); ++k)
+            out << "  " << setw(16) << FeeBook::kindName(posted.rules[k].kind) << setw(9) << posted.count[k]
+                << " accounts " << setw(14) << posted.charged[k] << '\n';
+        out << setprecision(0) << "  dry run " << dryMs << " ms, posted " << postMs << " ms" << setprecision(2)
+            << "; dry run " << charged(preview) << ", posted " << charged(posted) << ", balances down " << before - after
+            << ", not collectable " << posted.uncollected << '\n';
+    } // no snapshot saved: the restart recovers the postings from the log
+    {
+        BankManagement bank;
+        open(bank);
+        auto again = bank.assessFees(false);
+        out << "  after restart: balances " << (total(bank) == after ? "match" : "DIFFER") << "; per-transaction fees now "
+            << again.charged[1] << '\n';
+    }
+    cout << out.str();
+    fs::remove_all(dir);
+}
+
+#ifdef BANK_HAVE_SOCKETS
+// Throughput of a three-node loopback cluster with and without batching/pipelining,
+// then the time to fail over after the leader is stopped.
+inline void benchmarkRaft() {
+    constexpr int nodes = 3;
+    constexpr int clients = 64;
+    constexpr auto runFor = chrono::milliseconds(1500);
+    const fs::path root = fs::temp_directory_path() / "bank_raft_bench";
+
+    struct Member {
+        unique_ptr<BankManagement> bank;
+        unique_ptr<RaftNode> node;
+    };
+    auto waitForLeader = [](vector<Member>& cluster) -> int {
+        for (int tries = 0; tries < 1000; ++tries) {
+            for (int i = 0; i < nodes; ++i)
+                if (cluster[i].node && cluster[i].node->isLeader()) return i;
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+        throw runtime_error("No leader elected");
+    };
+    auto command = [](string op, int account, double amount) {
+        AuditRecord cmd;
+        cmd.op = std::move(op);
+        cmd.account = account;
+        cmd.amount = amount;
+        return cmd;
+    };
+
+    cout << "Raft: " << nodes << " nodes on loopback, " << clients << " concurrent clients\n";
+    cout << setw(22) << "mode" << setw(14) << "commits/s" << setw(12) << "mean ms" << '\n';
+    uint16_t basePort = 17100;
+    for (auto [label, batch, inflight] : {tuple{"one entry, no pipeline", size_t{1}, size_t{1}},
+                                         tuple{"batched + pipelined", size_t{512}, size_t{8}}}) {
+        fs::remove_all(root);
+        vector<uint16_t> ports;
+        for (int i = 0; i < nodes; ++i) ports.push_back(basePort++);
+        RaftOptions options;
+        options.maxBatch = batch;
+        options.maxInflight = inflight;
+        vector<Member> cluster(nodes);
+        for (int i = 0; i < nodes; ++i) {
+            const fs::path dir = root / ("node-" + to_string(i + 1));
+            fs::create_directories(dir);
+            cluster[i].bank = make_unique<BankManagement>();
+            cluster[i].bank->openAuditLog((dir / "audit_log.txt").string());
+            cluster[i].node = make_unique<RaftNode>(dir, ports, i, cluster[i].bank->raftStateMachine(),
+                                                    (dir / "audit_log.txt").string(), options);
+        }
+        int leader = waitForLeader(cluster);
+        AuditRecord open = command("addAccount", 1, 0.0);
+        open.text = "Bench";
+        if (auto error = cluster[leader].node->propose(open)) throw runtime_error(*error);
+
+        atomic<uint64_t> committed = 0;
+        atomic<double> latencyMs = 0;
+        auto start = chrono::steady_clock::now();
+        {
+            vector<jthread> pool;
+            for (int c = 0; c < clients; ++c) {
+                pool.emplace_back([&] {
+                    while (chrono::steady_clock::now() - start < runFor) {
+                        auto begin = chrono::steady_clock::now();
+                        if (cluster[leader].node->propose(command("deposit", 1, 1.0))) continue;
+                        ++committed;
+                        latencyMs += chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+                    }
+                });
+            }
+        }
+        auto seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        ostringstream row;
+        row << fixed << setprecision(0) << setw(22) << label << setw(14) << committed / seconds << setprecision(2)
+            << setw(12) << latencyMs / max<uint64_t>(1, committed) << '\n';
+        cout << row.str();
+
+        if (batch > 1) {
+            auto stopped = chrono::steady_clock::now();
+            cluster[leader].node.reset();
+            cluster[leader].bank.reset();
+            int next = waitForLeader(cluster);
+            if (auto error = cluster[next].node->propose(command("deposit", 1, 1.0))) throw runtime_error(*error);
+            auto failoverMs = chrono::duration<double, milli>(chrono::steady_clock::now() - stopped).count();
+            double balance{};
+            cluster[next].node->read([&] { balance = cluster[next].bank->findAccount(1)->get().getBalance(); });
+            ostringstream line;
+            line << "Failover: node " << leader + 1 << " stopped, node " << next + 1 << " leading and committing after "
+                 << fixed << setprecision(0) << failoverMs << " ms; balance " << balance << " (expected "
+                 << committed + 1 << ")\n";
+            cout << line.str();
+        }
+    }
+    fs::remove_all(root);
+}
+#endif
+
+#ifdef BANK_HAVE_SOCKETS
+// Shards served from this process, each in its own temporary directory, with every
+// operation's audit record made durable asynchronously.
+class BenchShards {
+private:
+    struct Shard {
+        unique_ptr<BankManagement> bank;
+        unique_ptr<ShardServer> server;
+    };
+
+    fs::path root;
+    DurabilityPolicy policy;
+    vector<Shard> shards;
+
+public:
+    vector<uint16_t> ports;
+
+    explicit BenchShards(const string& name) : root(fs::temp_directory_path() / name) {
+        fs::remove_all(root);
+        for (auto op : {"addAccount", "deposit", "withdraw", "transfer", "updateName", "closeAccount"})
+            policy.set(string(op) + ":async");
+    }
+
+    BenchShards(const BenchShards&) = delete;
+    BenchShards& operator=(const BenchShards&) = delete;
+
+    ~BenchShards() {
+        shards.clear();
+        fs::remove_all(root);
+    }
+
+    [[nodiscard]] fs::path dir() const { return root; }
+
+    // With setup, which writes files into the shard's directory (rates, rules), the bank is
+    // opened from that directory as a --shard process opens it, side files included.
+    uint16_t start(uint16_t port, const function<void(const fs::path&)>& setup = {}) {
+        const fs::path dir = root / ("shard-" + to_string(port));
+        fs::create_directories(dir);
+        auto& shard = shards.emplace_back();
+        shard.bank = make_unique<BankManagement>();
+        shard.bank->setDurabilityPolicy(policy);
+        if (setup) {
+            setup(dir);
+            shard.bank->loadFromFile((dir / "accounts_secure.txt").string());
+        }
+        shard.bank->openAuditLog((dir / "audit_log.txt").string());
+        shard.server = make_unique<ShardServer>(*shard.bank, port, dir / "shard_tx.txt", (dir / "audit_log.txt").string());
+        ports.push_back(port);
+        return port;
+    }
+
+    BankManagement& bankOn(uint16_t port) { return *shards.at(ranges::find(ports, port) - ports.begin()).bank; }
+};
+
+inline AuditRecord benchCommand(string op, int account, double amount, int other = 0) {
+    AuditRecord cmd;
+    cmd.op = std::move(op);
+    cmd.account = account;
+    cmd.other = other;
+    cmd.amount = amount;
+    if (cmd.op == "addAccount") cmd.text = "Bench " + to_string(account);
+    return cmd;
+}
+
+// Keeps up to `depth` single-shard commands in flight; depth 1 waits for each reply.
+inline void driveShards(ShardRouter& router, size_t depth, int count, const function<AuditRecord(int)>& next) {
+    deque<future<string>> inflight;
+    for (int i = 0; i < count; ++i) {
+        if (inflight.size() == depth) {
+            if (auto error = ShardRouter::result(inflight.front())) throw runtime_error(*error);
+            inflight.pop_front();
+        }
+        inflight.push_back(router.send(next(i), "0000"));
+    }
+    for (auto& reply : inflight)
+        if (auto error = ShardRouter::result(reply)) throw runtime_error(*error);
+}
+
+// Routed throughput one request at a time versus pipelined, then two online moves under
+// a steady stream of deposits and transfers: a fourth shard joining the ring, and a range
+// of accounts pinned to one shard.
+inline void benchmarkShards() {
+    constexpr int startShards = 3;
+    constexpr int accounts = 20'000;
+    constexpr int ops = 20'000;
+    constexpr size_t window = 256;
+    BenchShards cluster("bank_shard_bench");
+    for (int i = 0; i < startShards; ++i) cluster.start(static_cast<uint16_t>(17200 + i));
+    ShardRouter router(ShardLayout(cluster.ports), cluster.dir() / "cluster_txlog.txt");
+    driveShards(router, window, accounts, [](int i) { return benchCommand("addAccount", i + 1, 100.0); });
+
+    cout << "Shards: " << startShards << " shards on loopback, " << accounts << " accounts, async durability\n";
+    cout << setw(22) << "mode" << setw(14) << "ops/s" << '\n';
+    mt19937 rng(42);
+    uniform_int_distribution<int> pick(1, accounts);
+    for (auto [label, depth] : {pair{"one at a time", size_t{1}}, pair{"pipelined", window}}) {
+        auto start = chrono::steady_clock::now();
+        driveShards(router, depth, ops, [&](int) { return benchCommand("deposit", pick(rng), 1.0); });
+        auto seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        ostringstream row;
+        row << fixed << setprecision(0) << setw(22) << label << setw(14) << ops / seconds << '\n';
+        cout << row.str();
+    }
+
+    double expected = 100.0 * accounts + 2.0 * ops;
+    auto underLoad = [&](const string& label, const function<RebalanceStats()>& move) {
+        atomic<bool> done = false;
+        atomic<uint64_t> deposits = 0, transfers = 0, failures = 0;
+        atomic<double> longestMs = 0;
+        RebalanceStats st;
+        {
+            jthread depositor([&] {
+                mt19937 local(7);
+                deque<pair<chrono::steady_clock::time_point, future<string>>> inflight;
+                auto complete = [&] {
+                    auto& [sent, reply] = inflight.front();
+                    if (ShardRouter::result(reply)) ++failures; // e.g. locked by a transfer in progress
+                    else ++deposits;
+                    auto ms = chrono::duration<double, milli>(chrono::steady_clock::now() - sent).count();
+                    if (ms > longestMs) longestMs = ms;
+                    inflight.pop_front();
+                };
+                while (!done) {
+                    if (inflight.size() == 32) complete();
+                    inflight.emplace_back(chrono::steady_clock::now(), router.send(benchCommand("deposit", pick(local), 1.0), "0000"));
+                }
+                while (!inflight.empty()) complete();
+            });
+            jthread transferrer([&] {
+                mt19937 local(9);
+                while (!done) {
+                    if (router.execute(benchCommand("transfer", pick(local), 1.0, pick(local)), "0000")) ++failures;
+                    else ++transfers;
+                }
+            });
+            this_thread::sleep_for(chrono::milliseconds(200));
+            st = move();
+            this_thread::sleep_for(chrono::milliseconds(200));
+            done = true;
+        }
+        expected += deposits;
+        double total = 0;
+        auto book = router.all();
+        for (const auto& acc : book) total += acc.getBalance();
+        ostringstream line;
+        line << label << ": moved " << st.moved << " of " << st.total << " accounts (" << fixed << setprecision(1)
+             << 100.0 * st.moved / max<size_t>(1, st.total) << "%) in " << st.totalMs << " ms; " << st.copied
+             << " copies over " << st.rounds << " catch-up rounds; operations held " << st.pausedMs << " ms\n"
+             << "  meanwhile: " << deposits << " deposits, " << transfers << " transfers, " << failures
+             << " refused; slowest deposit " << longestMs << " ms\n"
+             << setprecision(0) << "  accounts " << book.size() << ", total balance " << total << " (expected "
+             << expected << ")\n";
+        cout << line.str();
+    };
+    underLoad("Add shard", [&] { return router.addShard(cluster.start(17200 + startShards)); });
+    underLoad("Move 1-2000", [&] { return router.moveRange(1, 2000, cluster.ports.front()); });
+    cout << "Counts:";
+    for (auto [port, count] : router.counts()) cout << ' ' << port << '=' << count;
+    cout << '\n';
+}
+
+// Cross-shard transfers through two-phase commit, one transfer per round versus batched
+// rounds, alongside same-shard transfers that are refused while an account is locked.
+inline void benchmarkTwoPhaseCommit() {
+    constexpr int shardCount = 3;
+    constexpr int accounts = 10'000;
+    constexpr double opening = 1'000;
+    constexpr int clients = 32;
+    constexpr auto runFor = chrono::milliseconds(1500);
+
+    cout << "2PC: " << shardCount << " shards on loopback, " << clients << " clients, half of transfers cross-shard\n";
+    cout << setw(12) << "rounds" << setw(10) << "accounts" << setw(14) << "xfers/s" << setw(12) << "2PC/s"
+         << setw(12) << "mean ms" << setw(10) << "aborts" << setw(10) << "balance" << '\n';
+    uint16_t basePort = 17300;
+    for (auto [label, batch] : {pair{"1 transfer", size_t{1}}, pair{"batched", size_t{256}}}) {
+        for (int hot : {accounts, 32}) {
+            BenchShards cluster("bank_2pc_bench");
+            for (int i = 0; i < shardCount; ++i) cluster.start(basePort++);
+            ShardRouter router(ShardLayout(cluster.ports), cluster.dir() / "cluster_txlog.txt", batch);
+            driveShards(router, 256, accounts, [&](int i) { return benchCommand("addAccount", i + 1, opening); });
+
+            atomic<uint64_t> committed = 0, crossCommitted = 0, aborted = 0;
+            atomic<double> latencyMs = 0;
+            auto start = chrono::steady_clock::now();
+            {
+                vector<jthread> pool;
+                for (int c = 0; c < clients; ++c) {
+                    pool.emplace_back([&, c, hot] {
+                        mt19937 rng(static_cast<unsigned>(c));
+                        uniform_int_distribution<int> pick(1, hot);
+                        for (int i = 0; chrono::steady_clock::now() - start < runFor; ++i) {
+                            int from = pick(rng), to = pick(rng);
+                            bool cross = router.ownerOf(from) != router.ownerOf(to);
+                            if (from == to || cross != (i % 2 == 0)) continue;
+                            auto begin = chrono::steady_clock::now();
+                            if (router.execute(benchCommand("transfer", from, 1.0, to), "0000")) {
+                                ++aborted;
+                                continue;
+                            }
+                            ++committed;
+                            if (cross) ++crossCommitted;
+                            latencyMs += chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+                        }
+                    });
+                }
+            }
+            auto seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            double total = 0;
+            for (const auto& acc : router.all()) total += acc.getBalance();
+            ostringstream row;
+            row << fixed << setprecision(0) << setw(12) << label << setw(10) << hot << setw(14) << committed / seconds
+                << setw(12) << crossCommitted / seconds << setprecision(2) << setw(12)
+                << latencyMs / max<uint64_t>(1, committed) << setprecision(1) << setw(9)
+                << 100.0 * aborted / max<uint64_t>(1, committed + aborted) << '%' << setw(10)
+                << (total == opening * accounts ? "ok" : "WRONG") << '\n';
+            cout << row.str();
+        }
+    }
+}
+#endif
+
+// ---------------- Self Test ----------------
+// Scripted scenarios, a group per feature, each checked against the outcome it must have.
+// --selftest prints a line per check and exits nonzero when any fails. Every group works
+// in its own temporary directory and removes it afterwards.
+class SelfTest {
+public:
+    int failed = 0;
+
+    void check(bool ok, const string& what) {
+        cout << (ok ? "  ok    " : "  FAIL  ") << what << '\n';
+        failed += !ok;
+    }
+
+    static bool refused(const optional<string>& error, string_view reason) {
+        return error && error->find(reason) != string::npos;
+    }
+
+    static AuditRecord command(string op, int account, double amount, uint64_t aux = 0) {
+        AuditRecord cmd;
+        cmd.op = std::move(op);
+        cmd.account = account;
+        cmd.amount = amount;
+        cmd.aux = aux;
+        return cmd;
+    }
+
+    static AuditRecord opening(int account, double balance, int currency = 0) {
+        auto cmd = command("addAccount", account, balance);
+        cmd.other = currency;
+        cmd.text = "Test " + to_string(account);
+        return cmd;
+    }
+
+    static fs::path freshDir(const string& name) {
+        const fs::path dir = fs::temp_directory_path() / ("bank_selftest_" + name);
+        fs::remove_all(dir);
+        fs::create_directories(dir);
+        return dir;
+    }
+
+    // A bank opened from dir as the program opens one: snapshot, log replay, then the log.
+    static unique_ptr<BankManagement> openBank(const fs::path& dir) {
+        auto bank = make_unique<BankManagement>();
+        bank->loadFromFile((dir / "accounts_secure.txt").string());
+        bank->recoverFromLog((dir / "audit_log.txt").string());
+        bank->openAuditLog((dir / "audit_log.txt").string());
+        return bank;
+    }
+
+    static double balanceOf(BankManagement& bank, int num) {
+        auto acc = bank.findAccount(num);
+        return acc ? acc->get().getBalance() : NAN;
+    }
+};
+
+inline void selfTestAuditChain(SelfTest& t) {
+    cout << "Audit log\n";
+    const auto dir = SelfTest::freshDir("audit");
+    const auto log = (dir / "audit_log.txt").string();
+    {
+        auto bank = SelfTest::openBank(dir);
+        bank->submit(SelfTest::opening(1, 100), "0000");
+        bank->submit(SelfTest::command("deposit", 1, 50), nullopt);
+        bank->submit(SelfTest::command("withdraw", 1, 30), nullopt);
+    }
+    auto result = AuditLog::verify(log);
+    t.check(result.records == 3 && !result.firstBadSeq, "an untouched log verifies");
+    string text;
+    {
+        ifstream in(log);
+        text.assign(istreambuf_iterator<char>(in), {});
+    }
+    const auto at = text.find(" deposit 1 0 50 ");
+    if (at != string::npos) text.replace(at, 16, " deposit 1 0 500 ");
+    ofstream(log, ios::trunc) << text;
+    result = AuditLog::verify(log);
+    t.check(at != string::npos && result.firstBadSeq == 2u, "an edited record breaks the chain at that record");
+    fs::remove_all(dir);
+}
+
+// Writes, overwrites and erases accounts through a store, reopens it with make and checks
+// that it holds exactly what was left, by lookup and by scan.
+inline void checkStoreReopens(SelfTest& t, const string& label, const function<unique_ptr<AccountStore>()>& make) {
+    constexpr int count = 3000;
+    map<int, double> expected;
+    try {
+        {
+            auto store = make();
+            for (int num = 1; num <= count; ++num) {
+                store->put(BankAccount::restore("Holder " + to_string(num), num, num, 0));
+                expected[num] = num;
+            }
+            for (int num = 5; num <= count; num += 5) {
+                store->put(BankAccount::restore("Holder " + to_string(num), num, 2.0 * num, 0));
+                expected[num] = 2.0 * num;
+            }
+            for (int num = 7; num <= count; num += 7) {
+                store->erase(num);
+                expected.erase(num);
+            }
+            store->flush();
+        }
+        auto store = make();
+        map<int, double> found;
+        store->forEach([&](const BankAccount& acc) { found[acc.getAccountNum()] = acc.getBalance(); });
+        const auto five = store->get(5), seven = store->get(7);
+        t.check(found == expected && five && five->getBalance() == 10 && !seven,
+                label + ": reopened, it holds the last write of each account and none erased");
+    } catch (const exception& e) {
+        t.check(false, label + ": " + e.what());
+    }
+}
+
+inline void selfTestStores(SelfTest& t) {
+    cout << "Storage engines\n";
+    const auto dir = SelfTest::freshDir("stores");
+    // A small memtable and compaction trigger, so the accounts span runs and compactions.
+    checkStoreReopens(t, "LSM tree", [&] { return make_unique<LsmStore>(dir / "lsm", 256, 2); });
+    // 16 frames for a tree of many more pages, so the clock evicts and rereads pages.
+    checkStoreReopens(t, "B+tree", [&] { return make_unique<BPlusTreeStore>(dir / "btree.db", 16); });
+    checkStoreReopens(t, "tiered", [&] { return make_unique<TieredStore>(dir / "cold.seg", 64 << 10); });
+#ifdef BANK_HAVE_MMAP
+    // 16 slots to start with, so the table is remapped several times as it grows.
+    checkStoreReopens(t, "mapped", [&] { return make_unique<MappedStore>(dir / "mapped.db", 16); });
+#endif
+    {
+        TieredStore tiered(dir / "budget.seg", 64 << 10);
+        for (int num = 1; num <= 3000; ++num) tiered.put(BankAccount::restore("Holder", num, num, 0));
+        bool all = true;
+        for (int num = 1; num <= 3000; num += 37) all &= tiered.get(num).has_value();
+        t.check(tiered.residentBytes() <= 64 << 10 && tiered.hotAccounts() < 3000 && all,
+                "tiered: the hot tier stays inside its budget and cold accounts are still found");
+    }
+    fs::remove_all(dir);
+}
+
+#ifdef BANK_HAVE_MMAP
+inline void selfTestSharedBook(SelfTest& t) {
+    cout << "Shared-memory book\n";
+    const string name = "/bank_selftest";
+    auto row = [](int num) { return BankAccount::restore("Holder", num, num * 10.0, 0).toRecord(); };
+    auto count = [](SharedBookReader& reader) {
+        size_t rows = 0;
+        reader.forEach([&](const AccountRecord&) { ++rows; });
+        return rows;
+    };
+    try {
+        SharedBookWriter writer(name, 16);
+        for (int num = 1; num <= 5; ++num) writer.publish(row(num));
+        try {
+            SharedBookReader early(name);
+            t.check(false, "a reader is kept out until the book is complete");
+        } catch (const exception&) {
+            t.check(true, "a reader is kept out until the book is complete");
+        }
+        writer.ready();
+        SharedBookReader reader(name);
+        auto three = reader.find(3);
+        t.check(three && three->balance == 30 && count(reader) == 5, "then it sees every row");
+        try {
+            SharedBookWriter second(name, 16);
+            t.check(false, "a second teller cannot publish under the same name");
+        } catch (const exception& e) {
+            t.check(string_view(e.what()).find("Another teller") != string_view::npos,
+                    "a second teller cannot publish under the same name");
+        }
+        auto again = reader.find(3);
+        t.check(again && again->balance == 30, "and the first teller's book is still there");
+        for (int num = 6; num <= 200; ++num) writer.publish(row(num));
+        SharedBookReader late(name);
+        auto last = reader.find(200);
+        t.check(last && last->balance == 2000 && count(reader) == 200 && count(late) == 200,
+                "after the table is rebuilt larger, old and new readers see all of it");
+    } catch (const exception& e) {
+        t.check(false, string("shared book: ") + e.what());
+    }
+}
+#endif
+
+inline void selfTestRecovery(SelfTest& t) {
+    cout << "Crash recovery\n";
+    const auto dir = SelfTest::freshDir("recovery");
+    const auto snapshot = (dir / "accounts_secure.txt").string();
+    map<int, double> expected;
+    {
+        auto bank = SelfTest::openBank(dir);
+        for (int num = 1; num <= 50; ++num) bank->submit(SelfTest::opening(num, 1'000), "0000");
+        bank->saveToFile(snapshot);
+        // After the snapshot, and never saved: only the log has these.
+        for (int num = 1; num <= 50; ++num) bank->submit(SelfTest::command("deposit", num, num), nullopt);
+        auto transfer = SelfTest::command("transfer", 1, 500);
+        transfer.other = 2;
+        bank->submit(transfer, nullopt);
+        bank->submit(SelfTest::command("closeAccount", 50, 0), nullopt);
+        bank->submit(SelfTest::opening(51, 77), "0000");
+        bank->forEachAccount([&](const BankAccount& acc) { expected[acc.getAccountNum()] = acc.getBalance(); });
+    }
+    auto book = [](BankManagement& bank) {
+        map<int, double> found;
+        bank.forEachAccount([&](const BankAccount& acc) { found[acc.getAccountNum()] = acc.getBalance(); });
+        return found;
+    };
+    t.check(book(*SelfTest::openBank(dir)) == expected, "a bank stopped without saving comes back from its log");
+    ofstream(dir / "audit_log.txt", ios::app) << "999 0 deposit 1 0 1"; // a record torn by the crash
+    t.check(book(*SelfTest::openBank(dir)) == expected, "a torn last record is left out");
+    fs::remove_all(dir);
+}
+
+inline void selfTestCheckpoints(SelfTest& t) {
+    cout << "Checkpoints\n";
+    const auto dir = SelfTest::freshDir("checkpoints");
+    const auto log = (dir / "audit_log.txt").string();
+    double expected = 0;
+    {
+        auto bank = SelfTest::openBank(dir);
+        CheckpointPolicy policy;
+        policy.maxLogBytes = 8 << 10;
+        bank->setCheckpointPolicy(policy);
+        bank->submit(SelfTest::opening(1, 0), "0000");
+        for (int i = 0; i < 300; ++i) bank->submit(SelfTest::command("deposit", 1, 1), nullopt);
+        expected = SelfTest::balanceOf(*bank, 1);
+    }
+    ifstream in(dir / "accounts_secure.txt");
+    const auto folded = readSnapshotHeader(in).seq.value_or(0);
+    t.check(folded > 100 && AuditLog::segments(log).size() > 1,
+            "a growing log is folded into the snapshot and its segment rotated, unasked");
+    t.check(expected == 300 && SelfTest::balanceOf(*SelfTest::openBank(dir), 1) == expected,
+            "the snapshot and the rest of the log recover the book");
+    const auto kept = PointInTime::checkpointDirFor((dir / "accounts_secure.txt").string());
+    t.check(fs::exists(kept) && !fs::is_empty(kept), "a copy of each checkpoint is retained");
+    fs::remove_all(dir);
+}
+
+inline void selfTestDurability(SelfTest& t) {
+    cout << "Durability classes\n";
+    DurabilityPolicy policy;
+    t.check(policy.set("deposit:memory") && !policy.set("deposit:later") && !policy.set("nothing:sync") &&
+                policy.of("deposit", 1) == Durability::Memory && policy.of("transfer", policy.largeTransfer) == Durability::Sync,
+            "per-operation classes parse, and a large transfer is always synchronous");
+    const auto dir = SelfTest::freshDir("durability");
+    const auto log = (dir / "audit_log.txt").string();
+    auto bank = SelfTest::openBank(dir);
+    bank->setDurabilityPolicy(policy);
+    bank->submit(SelfTest::opening(1, 100), "0000");
+    bank->submit(SelfTest::command("deposit", 1, 5), nullopt);
+    const auto written = AuditLog::readAll(log, 0).size();
+    bank->submit(SelfTest::command("withdraw", 1, 5), nullopt, Durability::Sync);
+    t.check(written == 1 && AuditLog::readAll(log, 0).size() == 3,
+            "a memory-class deposit stays in the process until the next synchronous commit writes it");
+    bank.reset();
+    fs::remove_all(dir);
+}
+
+inline void selfTestBackup(SelfTest& t) {
+    cout << "Online backup\n";
+    const auto dir = SelfTest::freshDir("backup"), target = dir / "copy";
+    fs::create_directories(dir / "live");
+    map<int, double> expected;
+    {
+        auto bank = SelfTest::openBank(dir / "live");
+        CheckpointPolicy policy;
+        policy.maxLogBytes = 8 << 10; // so the copy needs archived segments as well as the tail
+        bank->setCheckpointPolicy(policy);
+        for (int num = 1; num <= 20; ++num) bank->submit(SelfTest::opening(num, 100), "0000");
+        for (int i = 0; i < 200; ++i) bank->submit(SelfTest::command("deposit", i % 20 + 1, 1), nullopt);
+        bank->forEachAccount([&](const BankAccount& acc) { expected[acc.getAccountNum()] = acc.getBalance(); });
+        bank->startBackup(target, 64 << 20);
+    } // joins the backup
+    map<int, double> restored;
+    SelfTest::openBank(target)->forEachAccount([&](const BankAccount& acc) { restored[acc.getAccountNum()] = acc.getBalance(); });
+    t.check(restored == expected && AuditLog::verify((target / "audit_log.txt").string()).firstBadSeq == nullopt,
+            "a bank started in the backup has the book as of the backup, on an intact chain");
+    fs::remove_all(dir);
+}
+
+inline void selfTestPointInTime(SelfTest& t) {
+    cout << "Point-in-time queries\n";
+    const auto dir = SelfTest::freshDir("pitr"), target = dir / "then";
+    fs::create_directories(dir / "live");
+    auto bank = SelfTest::openBank(dir / "live");
+    CheckpointPolicy policy;
+    policy.maxLogBytes = 8 << 10; // checkpoints on both sides of the moment asked for
+    bank->setCheckpointPolicy(policy);
+    bank->submit(SelfTest::opening(1, 0), "0000");
+    for (int i = 0; i < 100; ++i) bank->submit(SelfTest::command("deposit", 1, 1), nullopt);
+    this_thread::sleep_for(chrono::milliseconds(5));
+    const auto then = AuditLog::nowMillis();
+    this_thread::sleep_for(chrono::milliseconds(5));
+    for (int i = 0; i < 100; ++i) bank->submit(SelfTest::command("deposit", 1, 2), nullopt);
+    bank->submit(SelfTest::opening(2, 5), "0000");
+    auto past = bank->accountAsOf(1, then);
+    t.check(past && past->getBalance() == 100 && !bank->accountAsOf(2, then) && SelfTest::balanceOf(*bank, 1) == 300,
+            "an account's balance as of a past moment, without touching the live book");
+    const auto restored = bank->restoreAsOf(then, target);
+    auto copy = SelfTest::openBank(target);
+    t.check(restored == 1 && SelfTest::balanceOf(*copy, 1) == 100 && !copy->findAccount(2),
+            "a restore as of that moment starts as the book stood then");
+    copy.reset();
+    bank.reset();
+    fs::remove_all(dir);
+}
+
+#ifdef BANK_HAVE_SOCKETS
+// A follower replicates the primary's log until it has everything, saves and stops, and
+// is then started as a bank of its own, as a promoted follower would be.
+// Follows the primary from followerDir until caught up, then stops and saves the follower
+// there as a promotion would; true when it caught up and matches(follower) holds.
+inline bool followPrimary(BankManagement& primary, const string& socket, const fs::path& followerDir,
+                          const function<bool(BankManagement&)>& matches) {
+    auto follower = SelfTest::openBank(followerDir);
+    mutex bookMutex;
+    bool caughtUp = false;
+    {
+        LogFollower link(
+            socket,
+            [&] {
+                lock_guard lock(bookMutex);
+                return follower->lastAuditSeq();
+            },
+            [&](const vector<AuditRecord>& batch) {
+                lock_guard lock(bookMutex);
+                follower->applyReplicated(batch);
+            });
+        for (int tries = 0; tries < 500 && !caughtUp; ++tries) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+            caughtUp = link.status().appliedSeq == primary.lastAuditSeq();
+        }
+    }
+    follower->saveToFile((followerDir / "accounts_secure.txt").string());
+    return caughtUp && matches(*follower);
+}
+
+inline void selfTestReplication(SelfTest& t) {
+    cout << "Log-shipping replication\n";
+    const auto dir = SelfTest::freshDir("replication");
+    const auto primaryDir = dir / "primary", followerDir = dir / "follower";
+    fs::create_directories(primaryDir);
+    fs::create_directories(followerDir);
+    const auto socket = (dir / "ship.sock").string();
+    auto primary = SelfTest::openBank(primaryDir);
+    primary->startShipping(socket);
+    for (int num = 1; num <= 10; ++num) primary->submit(SelfTest::opening(num, 1'000), "0000");
+    for (int num = 1; num <= 10; ++num) primary->submit(SelfTest::command("deposit", num, num), nullopt);
+    auto transfer = SelfTest::command("transfer", 1, 250);
+    transfer.other = 2;
+    primary->submit(transfer, nullopt);
+    primary->submit(SelfTest::command("closeAccount", 10, 0), nullopt);
+
+    map<int, double> expected;
+    primary->forEachAccount([&](const BankAccount& acc) { expected[acc.getAccountNum()] = acc.getBalance(); });
+    auto book = [](BankManagement& bank) {
+        map<int, double> found;
+        bank.forEachAccount([&](const BankAccount& acc) { found[acc.getAccountNum()] = acc.getBalance(); });
+        return found;
+    };
+    t.check(followPrimary(*primary, socket, followerDir, [&](BankManagement& follower) { return book(follower) == expected; }),
+            "a follower applies the primary's log and matches its book");
+    auto promoted = SelfTest::openBank(followerDir);
+    t.check(book(*promoted) == expected && !AuditLog::verify((followerDir / "audit_log.txt").string()).firstBadSeq,
+            "started on its own, the follower has the same book on an intact chain");
+    promoted.reset();
+    primary.reset();
+    fs::remove_all(dir);
+}
+#endif
+
+#ifdef BANK_HAVE_SOCKETS
+inline void selfTestRaft(SelfTest& t) {
+    cout << "Raft cluster\n";
+    constexpr int nodes = 3;
+    const auto dir = SelfTest::freshDir("raft");
+    const vector<uint16_t> ports{17150, 17151, 17152};
+    struct Member {
+        unique_ptr<BankManagement> bank;
+        unique_ptr<RaftNode> node;
+    };
+    vector<Member> cluster(nodes);
+    for (int i = 0; i < nodes; ++i) {
+        const fs::path home = dir / ("node-" + to_string(i + 1));
+        fs::create_directories(home);
+        cluster[i].bank = make_unique<BankManagement>();
+        cluster[i].bank->openAuditLog((home / "audit_log.txt").string());
+        cluster[i].node = make_unique<RaftNode>(home, ports, i, cluster[i].bank->raftStateMachine(),
+                                                (home / "audit_log.txt").string());
+    }
+    auto leader = [&] {
+        for (int tries = 0; tries < 1000; ++tries) {
+            for (int i = 0; i < nodes; ++i)
+                if (cluster[i].node && cluster[i].node->isLeader()) return i;
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+        throw runtime_error("No leader elected");
+    };
+    // Polls a node's own copy, which may trail the leader briefly.
+    auto reaches = [&](int i, double balance) {
+        for (int tries = 0; tries < 400; ++tries) {
+            double seen = NAN;
+            cluster[i].node->read([&] { seen = SelfTest::balanceOf(*cluster[i].bank, 1); });
+            if (seen == balance) return true;
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+        return false;
+    };
+    try {
+        int first = leader();
+        cluster[first].node->propose(SelfTest::opening(1, 100));
+        for (int i = 0; i < 20; ++i) cluster[first].node->propose(SelfTest::command("deposit", 1, 5));
+        const auto overdrawn = cluster[first].node->propose(SelfTest::command("withdraw", 1, 1'000));
+        const bool refused = SelfTest::refused(overdrawn, "Insufficient");
+        bool everywhere = true;
+        for (int i = 0; i < nodes; ++i) everywhere &= reaches(i, 200);
+        t.check(refused && everywhere, "every node applies the committed changes, and none a refused one");
+        cluster[first].node.reset();
+        cluster[first].bank.reset();
+        int next = leader();
+        const bool committed = !cluster[next].node->propose(SelfTest::command("deposit", 1, 1));
+        bool survivors = true;
+        for (int i = 0; i < nodes; ++i)
+            if (cluster[i].node) survivors &= reaches(i, 201);
+        t.check(next != first && committed && survivors, "with the leader stopped, another is elected and commits");
+    } catch (const exception& e) {
+        t.check(false, string("raft: ") + e.what());
+    }
+    cluster.clear();
+    fs::remove_all(dir);
+}
+#endif
+
+#ifdef BANK_HAVE_SOCKETS
+inline void selfTestShardRouting(SelfTest& t) {
+    cout << "Shard routing\n";
+    const ShardLayout two({17400, 17401}), three({17400, 17401, 17402});
+    int moved = 0, strayed = 0;
+    for (int num = 1; num <= 10'000; ++num) {
+        if (two.owner(num) == three.owner(num)) continue;
+        ++moved;
+        strayed += three.owner(num) != 17402;
+    }
+    t.check(!strayed && moved > 2'000 && moved < 4'500,
+            "a third shard on the ring takes about a third of the accounts, and only accounts move to it");
+
+    BenchShards cluster("bank_selftest_routing");
+    for (uint16_t port : {17410, 17411}) cluster.start(port);
+    ShardRouter router(ShardLayout(cluster.ports), cluster.dir() / "cluster_txlog.txt");
+    for (int num = 1; num <= 40; ++num) router.execute(benchCommand("addAccount", num, 100), "0000");
+    const auto deposited = router.execute(benchCommand("deposit", 7, 5), "0000");
+    const auto counts = router.counts();
+    t.check(router.all().size() == 40 && ranges::all_of(counts, [](const auto& c) { return c.second > 0; }),
+            "accounts are spread over every shard");
+    t.check(!deposited && router.find(7) && router.find(7)->second == 105 &&
+                SelfTest::refused(router.execute(benchCommand("deposit", 7, 5), "9999"), "Invalid PIN"),
+            "an operation reaches the shard owning its account, which checks the PIN");
+}
+#endif
+
+#ifdef BANK_HAVE_SOCKETS
+// The first of the accounts first..last that lives on another shard than account than.
+inline int accountElsewhere(ShardRouter& router, int first, int last, int than) {
+    for (int num = first; num <= last; ++num)
+        if (router.ownerOf(num) != router.ownerOf(than)) return num;
+    throw runtime_error("Every test account is on one shard");
+}
+
+inline void selfTestTwoPhaseCommit(SelfTest& t) {
+    cout << "Two-phase commit\n";
+    BenchShards cluster("bank_selftest_2pc");
+    for (uint16_t port : {17420, 17421}) cluster.start(port);
+    ShardRouter router(ShardLayout(cluster.ports), cluster.dir() / "cluster_txlog.txt");
+    for (int num = 1; num <= 20; ++num) router.execute(benchCommand("addAccount", num, 100), "0000");
+    const int a = 1, b = accountElsewhere(router, 2, 20, a);
+    auto balance = [&](int num) { return router.find(num).value_or(pair{string(), NAN}).second; };
+    auto total = [&] {
+        double sum = 0;
+        for (const auto& acc : router.all()) sum += acc.getBalance();
+        return sum;
+    };
+    t.check(!router.execute(benchCommand("transfer", a, 30, b), "0000") && balance(a) == 70 && balance(b) == 130,
+            "a transfer between shards commits both legs");
+    t.check(SelfTest::refused(router.execute(benchCommand("transfer", a, 1'000, b), "0000"), "Insufficient") &&
+                balance(a) == 70 && balance(b) == 130,
+            "a refusal on the debit shard changes neither leg");
+    t.check(!router.execute(benchCommand("transfer", b, 130, a), "0000") && balance(a) == 200 && balance(b) == 0,
+            "and leaves no account locked");
+    vector<future<string>> inflight;
+    for (int i = 0; i < 200; ++i) {
+        const int from = i % 20 + 1, to = (i * 7) % 20 + 1;
+        if (from != to) inflight.push_back(router.send(benchCommand("transfer", from, 1, to), "0000"));
+    }
+    for (auto& f : inflight) f.wait();
+    t.check(total() == 2'000, "concurrent transfers, batched into rounds, neither make nor lose money");
+}
+#endif
+
+#ifdef BANK_HAVE_SOCKETS
+inline void selfTestMigration(SelfTest& t) {
+    cout << "Online migration\n";
+    BenchShards cluster("bank_selftest_migration");
+    for (uint16_t port : {17430, 17431}) cluster.start(port);
+    ShardRouter router(ShardLayout(cluster.ports), cluster.dir() / "cluster_txlog.txt");
+    for (int num = 1; num <= 40; ++num) router.execute(benchCommand("addAccount", num, num * 10), "0000");
+    auto unchanged = [&] {
+        auto book = router.all();
+        return book.size() == 40 && ranges::all_of(book, [](const BankAccount& acc) {
+                   return acc.getBalance() == acc.getAccountNum() * 10;
+               });
+    };
+    const auto joined = router.addShard(cluster.start(17432));
+    auto counts = router.counts();
+    t.check(joined.moved > 0 && ranges::find(counts, 17432, &pair<uint16_t, size_t>::first)->second > 0 && unchanged(),
+            "a shard joining the ring takes accounts with their balances");
+    router.moveRange(1, 10, 17430);
+    t.check(ranges::all_of(views::iota(1, 11), [&](int num) { return router.ownerOf(num) == 17430; }) && unchanged(),
+            "a pinned range moves to its shard with its balances");
+    t.check(!router.execute(benchCommand("deposit", 5, 1), "0000") && router.find(5)->second == 51,
+            "a moved account takes commands at its new shard");
+}
+#endif
+
+inline void selfTestIdempotency(SelfTest& t) {
+    cout << "Idempotency keys\n";
+    const auto dir = SelfTest::freshDir("idempotency");
+    auto keyed = [](AuditRecord cmd, const string& key) {
+        cmd.text = IdempotencyCache::tag(cmd.text, key);
+        return cmd;
+    };
+    {
+        auto bank = SelfTest::openBank(dir);
+        bank->submit(SelfTest::opening(1, 100), "0000");
+        const auto first = bank->submit(keyed(SelfTest::command("deposit", 1, 50), "dep-1"), "0000");
+        const auto retry = bank->submit(keyed(SelfTest::command("deposit", 1, 50), "dep-1"), "0000");
+        t.check(!first && !retry && SelfTest::balanceOf(*bank, 1) == 150, "a retried deposit returns its result and pays once");
+        const auto refusal = bank->submit(keyed(SelfTest::command("withdraw", 1, 500), "wd-1"), "0000");
+        bank->submit(SelfTest::command("deposit", 1, 1'000), "0000");
+        t.check(SelfTest::refused(refusal, "Insufficient") &&
+                    bank->submit(keyed(SelfTest::command("withdraw", 1, 500), "wd-1"), "0000") == refusal &&
+                    SelfTest::balanceOf(*bank, 1) == 1'150,
+                "a retried refusal is refused again, even once it would succeed");
+    }
+    auto bank = SelfTest::openBank(dir);
+    bank->submit(keyed(SelfTest::command("deposit", 1, 50), "dep-1"), "0000");
+    t.check(SelfTest::balanceOf(*bank, 1) == 1'150, "after a restart the key is still remembered");
+    fs::remove_all(dir);
+#ifdef BANK_HAVE_SOCKETS
+    BenchShards cluster("bank_selftest_idempotency");
+    for (uint16_t port : {17440, 17441}) cluster.start(port);
+    ShardRouter router(ShardLayout(cluster.ports), cluster.dir() / "cluster_txlog.txt");
+    for (int num = 1; num <= 20; ++num) router.execute(benchCommand("addAccount", num, 100), "0000");
+    const int other = accountElsewhere(router, 2, 20, 1);
+    router.execute(benchCommand("transfer", 1, 30, other), "0000", "xfer-1");
+    router.execute(benchCommand("transfer", 1, 30, other), "0000", "xfer-1");
+    t.check(router.find(1)->second == 70 && router.find(other)->second == 130,
+            "a retried transfer between shards moves the money once");
+#endif
+}
+
+inline void selfTestHolds(SelfTest& t) {
+    cout << "Authorization holds\n";
+    const auto dir = SelfTest::freshDir("holds");
+    {
+        auto bank = SelfTest::openBank(dir);
+        bank->submit(SelfTest::opening(1, 1'000), "0000");
+        bank->placeHold(1, 600, chrono::hours(1), "0000");
+        const auto& acc = bank->findAccount(1)->get();
+        t.check(acc.getBalance() == 1'000 && acc.getAvailableBalance() == 400, "a hold lowers the available balance, not the balance");
+        t.check(SelfTest::refused(bank->submit(SelfTest::command("withdraw", 1, 500), "0000"), "Insufficient"),
+                "a withdrawal of held money is refused");
+    }
+    auto bank = SelfTest::openBank(dir);
+    const auto& acc = bank->findAccount(1)->get();
+    t.check(acc.getAvailableBalance() == 400, "after a restart the hold is still open");
+    bank->captureHold(1, 250, "0000");
+    t.check(acc.getBalance() == 750 && acc.getAvailableBalance() == 750, "capturing part of it takes that and frees the rest");
+    fs::remove_all(dir);
+#ifdef BANK_HAVE_SOCKETS
+    BenchShards cluster("bank_selftest_holds");
+    for (uint16_t port : {17450, 17451}) cluster.start(port);
+    ShardRouter router(ShardLayout(cluster.ports), cluster.dir() / "cluster_txlog.txt");
+    for (int num = 1; num <= 20; ++num) router.execute(benchCommand("addAccount", num, 10'000), "0000");
+    const int other = accountElsewhere(router, 2, 20, 1);
+    cluster.bankOn(router.ownerOf(1)).placeHold(1, 9'500, chrono::hours(1), "0000");
+    t.check(SelfTest::refused(router.execute(benchCommand("transfer", 1, 800, other), "0000"), "Insufficient") &&
+                router.find(1)->second == 10'000 && router.find(other)->second == 10'000,
+            "a transfer between shards of held money is refused on both");
+    t.check(!router.execute(benchCommand("transfer", 1, 400, other), "0000") && router.find(1)->second == 9'600 &&
+                router.find(other)->second == 10'400,
+            "and one within what is not held goes through");
+#endif
+}
+
+inline void selfTestStandingOrders(SelfTest& t) {
+    cout << "Standing orders\n";
+    const auto dir = SelfTest::freshDir("orders");
+    constexpr int64_t day = 24 * 60 * 60 * 1000;
+    const auto now = AuditLog::nowMillis();
+    {
+        auto bank = SelfTest::openBank(dir);
+        bank->submit(SelfTest::opening(1, 1'000), "0000");
+        bank->submit(SelfTest::opening(2, 0), "0000");
+        bank->submit(SelfTest::opening(3, 0), "0000");
+        bank->scheduleTransfer(1, 2, 100, StandingOrders::Period::Daily, now - 1'000, "0000");
+        // Unfunded, and its next occurrence is within the retry delay: skipped at once.
+        bank->scheduleTransfer(3, 2, 50, StandingOrders::Period::Daily, now - day + 30 * 60 * 1000, "0000");
+        t.check(bank->runDueOrders() == 1 && SelfTest::balanceOf(*bank, 1) == 900 && SelfTest::balanceOf(*bank, 2) == 100,
+                "a due order runs as a transfer");
+        t.check(bank->runDueOrders() == 0 && SelfTest::balanceOf(*bank, 2) == 100, "and once per occurrence");
+    }
+    {
+        auto bank = SelfTest::openBank(dir);
+        bank->submit(SelfTest::command("deposit", 3, 500), "0000");
+        t.check(bank->standingOrderCount() == 2 && bank->runDueOrders() == 0 && SelfTest::balanceOf(*bank, 2) == 100,
+                "after a restart neither the paid nor the skipped occurrence runs again");
+    }
+#ifdef BANK_HAVE_SOCKETS
+    BenchShards cluster("bank_selftest_orders");
+    for (uint16_t port : {17460, 17461}) cluster.start(port);
+    ShardRouter router(ShardLayout(cluster.ports), cluster.dir() / "cluster_txlog.txt");
+    for (int num = 1; num <= 20; ++num) router.execute(benchCommand("addAccount", num, 1'000), "0000");
+    const uint16_t home = router.ownerOf(1), away = router.ownerOf(accountElsewhere(router, 2, 20, 1));
+    int neighbour = 2;
+    while (router.ownerOf(neighbour) != home) ++neighbour;
+    cluster.bankOn(home).scheduleTransfer(1, neighbour, 10, StandingOrders::Period::Monthly, now + day, "0000");
+    auto moveRefused = [&](int num, string_view reason) {
+        try {
+            router.moveRange(num, num, away);
+            return false;
+        } catch (const exception& e) {
+            return string_view(e.what()).find(reason) != string_view::npos && router.ownerOf(num) == home;
+        }
+    };
+    t.check(moveRefused(1, "standing orders") && moveRefused(neighbour, "standing orders"),
+            "an account with standing orders does not move to another shard");
+
+    const auto primaryDir = dir / "primary", followerDir = dir / "follower";
+    fs::create_directories(primaryDir);
+    fs::create_directories(followerDir);
+    const auto socket = (dir / "ship.sock").string();
+    {
+        auto primary = SelfTest::openBank(primaryDir);
+        primary->startShipping(socket);
+        for (int num = 1; num <= 3; ++num) primary->submit(SelfTest::opening(num, num == 3 ? 0 : 1'000), "0000");
+        primary->scheduleTransfer(1, 2, 100, StandingOrders::Period::Daily, now - 1'000, "0000");
+        primary->scheduleTransfer(3, 2, 50, StandingOrders::Period::Daily, now - day + 30 * 60 * 1000, "0000");
+        primary->scheduleTransfer(2, 1, 5, StandingOrders::Period::Weekly, now + day, "0000");
+        primary->cancelStandingOrder(3, "0000");
+        primary->runDueOrders();
+        t.check(followPrimary(*primary, socket, followerDir,
+                              [](BankManagement& follower) { return follower.standingOrderCount() == 2; }),
+                "a follower keeps the primary's standing orders");
+    }
+    auto promoted = SelfTest::openBank(followerDir);
+    promoted->submit(SelfTest::command("deposit", 3, 500), "0000");
+    t.check(promoted->standingOrderCount() == 2 && promoted->runDueOrders() == 0 &&
+                SelfTest::balanceOf(*promoted, 2) == 1'100,
+            "promoted, it runs neither the paid nor the skipped occurrence again");
+    promoted->scheduleTransfer(2, 3, 1, StandingOrders::Period::Weekly, now + day, "0000");
+    promoted->cancelStandingOrder(4, "0000");
+    t.check(promoted->standingOrderCount() == 2, "and numbers new orders after the cancelled one");
+    promoted.reset();
+#endif
+    fs::remove_all(dir);
+}
+
+inline void selfTestInterest(SelfTest& t) {
+    cout << "Interest products\n";
+    const auto dir = SelfTest::freshDir("interest");
+    const auto yesterday = InterestBook::dayOf(AuditLog::nowMillis()) - 1; // a new bank has accrued through it
+    {
+        auto bank = SelfTest::openBank(dir);
+        bank->submit(SelfTest::opening(1, 1'000'000), "0000");
+        bank->submit(SelfTest::opening(2, 10), "0000");
+        bank->submit(SelfTest::opening(3, 10), "0000");
+        bank->defineProduct(1, "Saver", 3.65, AccountKind::Standard); // 1/10000 of the balance a day
+        bank->setAccountProduct(1, 1, "0000");
+        bank->setAccountProduct(2, 1, "0000");
+        t.check(bank->accrueInterest(yesterday + 1) == 10'000 && SelfTest::balanceOf(*bank, 1) == 1'000'100 &&
+                    SelfTest::balanceOf(*bank, 2) == 10 && SelfTest::balanceOf(*bank, 3) == 10,
+                "a day's interest is paid on the product's accounts only");
+        bank->accrueInterest(yesterday + 10);
+        t.check(SelfTest::balanceOf(*bank, 2) == 10.01, "a fraction of a cent is carried until it makes a cent");
+    }
+    auto bank = SelfTest::openBank(dir);
+    t.check(bank->accrueInterest(yesterday + 10) == 0 && SelfTest::balanceOf(*bank, 2) == 10.01,
+            "after a restart the days already paid are not paid again");
+    bank.reset();
+#ifdef BANK_HAVE_SOCKETS
+    const auto primaryDir = dir / "primary", followerDir = dir / "follower";
+    fs::create_directories(primaryDir);
+    fs::create_directories(followerDir);
+    const auto socket = (dir / "ship.sock").string();
+    {
+        auto primary = SelfTest::openBank(primaryDir);
+        primary->startShipping(socket);
+        for (int num = 1; num <= 3; ++num) primary->submit(SelfTest::opening(num, 1'000'000), "0000");
+        primary->defineProduct(1, "Saver", 3.65, AccountKind::Standard);
+        primary->defineProduct(2, "Overdraft", 0, AccountKind::Standard);
+        primary->setAccountProduct(1, 1, "0000");
+        primary->setAccountProduct(2, 2, "0000");
+        primary->setCreditLimit(0, 2, 500, "0000");
+        primary->setCreditLimit(3, 0, 2'000, "0000");
+        primary->accrueInterest(yesterday + 1);
+        t.check(followPrimary(*primary, socket, followerDir,
+                              [](BankManagement& follower) { return SelfTest::balanceOf(follower, 1) == 1'000'100; }),
+                "a follower applies the primary's interest postings");
+    }
+    auto promoted = SelfTest::openBank(followerDir);
+    t.check(promoted->accrueInterest(yesterday + 1) == 0 && promoted->accrueInterest(yesterday + 2) == 10'001,
+            "promoted, it pays interest from the day after the primary's last");
+    t.check(!promoted->submit(SelfTest::command("withdraw", 2, 1'000'400), "0000") &&
+                SelfTest::refused(promoted->submit(SelfTest::command("withdraw", 2, 200), "0000"), "Insufficient"),
+            "and keeps the product's credit line");
+    t.check(!promoted->submit(SelfTest::command("withdraw", 3, 1'001'900), "0000"), "and the account's");
+    promoted.reset();
+#endif
+    fs::remove_all(dir);
+}
+
+inline void selfTestFees(SelfTest& t) {
+    cout << "Fee assessment\n";
+    const auto dir = SelfTest::freshDir("fees");
+    ofstream(dir / "fee_rules.txt") << "minimum-balance 0 100 5\nper-transaction 0 2 1\n";
+    auto charged = [](const FeeBook::Totals& totals) { return totals.charged[0] + totals.charged[1]; };
+    {
+        auto bank = SelfTest::openBank(dir);
+        bank->submit(SelfTest::opening(1, 50), "0000");
+        bank->submit(SelfTest::opening(2, 1'000), "0000");
+        bank->submit(SelfTest::opening(3, 3), "0000");
+        for (int i = 0; i < 4; ++i) bank->submit(SelfTest::command("deposit", 2, 1), "0000");
+        const auto dry = bank->assessFees(false);
+        t.check(dry.charged[0] == 8 && dry.uncollected == 2 && dry.charged[1] == 2 && SelfTest::balanceOf(*bank, 1) == 50,
+                "a dry run charges below the minimum and past the free transactions, and changes nothing");
+        const auto posted = bank->assessFees(true);
+        t.check(charged(posted) == 10 && SelfTest::balanceOf(*bank, 1) == 45 && SelfTest::balanceOf(*bank, 2) == 1'002 &&
+                    SelfTest::balanceOf(*bank, 3) == 0,
+                "posting withdraws the fees, never past the balance");
+    }
+    auto bank = SelfTest::openBank(dir);
+    const auto next = bank->assessFees(false);
+    t.check(SelfTest::balanceOf(*bank, 2) == 1'002 && next.charged[0] == 5 && next.charged[1] == 0,
+            "after a restart the postings stand, and the next period counts neither them nor earlier transactions");
+    bank.reset();
+    fs::remove_all(dir);
+}
+
+inline void selfTestAccountKinds(SelfTest& t) {
+    cout << "Account kinds\n";
+    const auto dir = SelfTest::freshDir("kinds");
+    ofstream(dir / "fee_rules.txt") << "minimum-balance 0 100000 6000\n";
+    auto withdraw = [](BankManagement& bank, int num, double amount) {
+        return bank.submit(SelfTest::command("withdraw", num, amount), "0000");
+    };
+    {
+        auto bank = SelfTest::openBank(dir);
+        bank->defineProduct(1, "Savings", 0, AccountKind::Savings);
+        bank->defineProduct(2, "Checking", 0, AccountKind::Checking);
+        bank->defineProduct(3, "Loan", 0, AccountKind::Loan);
+        bank->submit(SelfTest::opening(1, 20'000), "0000");
+        bank->submit(SelfTest::opening(2, 100), "0000");
+        bank->submit(SelfTest::opening(3, 0), "0000");
+        bank->submit(SelfTest::opening(4, 1'000), "0000");
+        for (auto [num, product] : {pair{1, 1u}, {2, 2u}, {3, 3u}}) bank->submit(InterestBook::assignCommand(num, product), "0000");
+        t.check(SelfTest::refused(withdraw(*bank, 1, 6'000), "product limit") && !withdraw(*bank, 1, 5'000),
+                "a savings account limits a single withdrawal");
+        t.check(!withdraw(*bank, 2, 1'000) && SelfTest::balanceOf(*bank, 2) == -900 &&
+                    SelfTest::refused(withdraw(*bank, 2, 200), "Insufficient"),
+                "a checking account overdraws up to its limit");
+        t.check(SelfTest::refused(bank->submit(InterestBook::assignCommand(2, 1), "0000"), "savings account allows"),
+                "an overdrawn account cannot become a savings account");
+        t.check(!withdraw(*bank, 3, 1'000) &&
+                    SelfTest::refused(bank->submit(SelfTest::command("deposit", 3, 2'000), "0000"), "owed") &&
+                    SelfTest::refused(bank->submit(SelfTest::command("closeAccount", 3, 0), "0000"), "owing"),
+                "a loan takes repayments up to what it owes, and cannot close owing");
+        bank->submit(SelfTest::command("deposit", 2, 910), "0000");
+        bank->placeHold(4, 900, chrono::hours(1), "0000");
+        const auto posted = bank->assessFees(true);
+        t.check(SelfTest::balanceOf(*bank, 1) == 9'000 && SelfTest::balanceOf(*bank, 2) == 0 &&
+                    SelfTest::balanceOf(*bank, 4) == 900 && SelfTest::balanceOf(*bank, 3) == -1'000 &&
+                    posted.charged[0] == 6'110,
+                "fees are charged past a savings limit, but not into an overdraft, a hold or a loan");
+    }
+    auto bank = SelfTest::openBank(dir);
+    t.check(SelfTest::refused(withdraw(*bank, 1, 6'000), "product limit") &&
+                SelfTest::refused(withdraw(*bank, 2, 1'001), "Insufficient") && bank->assessFees(false).charged[0] == 6'000,
+            "after a restart every account has its kind's limits again");
+    bank.reset();
+    fs::remove_all(dir);
+}
+
+inline void selfTestCreditLimits(SelfTest& t) {
+    cout << "Credit limits\n";
+    const auto dir = SelfTest::freshDir("credit");
+    auto spendable = [](BankManagement& bank, int num) { return bank.findAccount(num)->get().getAvailableBalance(); };
+    {
+        auto bank = SelfTest::openBank(dir);
+        bank->defineProduct(1, "Savings", 0, AccountKind::Savings);
+        bank->defineProduct(2, "Checking", 0, AccountKind::Checking);
+        for (int num = 1; num <= 3; ++num) bank->submit(SelfTest::opening(num, 100), "0000");
+        bank->submit(InterestBook::assignCommand(1, 1), "0000");
+        bank->submit(InterestBook::assignCommand(2, 2), "0000");
+        bank->submit(InterestBook::assignCommand(3, 2), "0000");
+        bank->setCreditLimit(0, 2, 300, "0000");
+        bank->setCreditLimit(3, 0, 500, "0000");
+        t.check(spendable(*bank, 2) == 400 && spendable(*bank, 3) == 600,
+                "an account's credit line overrides its product's, which overrides its kind's");
+        bank->setCreditLimit(3, 0, nullopt, "0000");
+        bank->setCreditLimit(0, 2, nullopt, "0000");
+        t.check(spendable(*bank, 3) == 1'100, "and clearing them goes back to the kind's");
+        bank->setCreditLimit(3, 0, 500, "0000");
+        bank->submit(SelfTest::command("deposit", 1, 10'000), "0000");
+        t.check(SelfTest::refused(bank->submit(HoldBook::holdCommand(1, 6'000, 1, AuditLog::nowMillis() + 60'000), "0000"),
+                                  "product limit"),
+                "a hold past the savings limit is refused");
+        bank->placeHold(3, 550, chrono::hours(1), "0000");
+        t.check(SelfTest::refused(bank->submit(SelfTest::command("withdraw", 3, 60), "0000"), "Insufficient") &&
+                    !bank->submit(SelfTest::command("withdraw", 3, 50), "0000") && SelfTest::balanceOf(*bank, 3) == 50,
+                "a hold and a credit line together bound what the account can spend");
+    }
+    auto bank = SelfTest::openBank(dir);
+    t.check(spendable(*bank, 3) == 0 && spendable(*bank, 2) == 1'100,
+            "after a restart the lines and holds are rebuilt");
+    bank.reset();
+    fs::remove_all(dir);
+#ifdef BANK_HAVE_SOCKETS
+    BenchShards cluster("bank_selftest_credit");
+    for (uint16_t port : {17470, 17471}) cluster.start(port);
+    ShardRouter router(ShardLayout(cluster.ports), cluster.dir() / "cluster_txlog.txt");
+    for (int num = 1; num <= 20; ++num) router.execute(benchCommand("addAccount", num, 100), "0000");
+    const int other = accountElsewhere(router, 2, 20, 1);
+    cluster.bankOn(router.ownerOf(1)).setCreditLimit(1, 0, 500, "0000");
+    t.check(!router.execute(benchCommand("transfer", 1, 550, other), "0000") && router.find(1)->second == -450 &&
+                SelfTest::refused(router.execute(benchCommand("transfer", 1, 100, other), "0000"), "Insufficient"),
+            "a transfer between shards may use the debit account's credit line, and no more");
+#endif
+}
+
+inline void selfTestCurrencies(SelfTest& t) {
+    cout << "Currencies\n";
+    const auto dir = SelfTest::freshDir("currencies");
+    const int eur = *packCurrency("EUR");
+    auto writeRates = [](const fs::path& in) { ofstream(in / "fx_rates.txt") << "EUR 1.25\n"; };
+    auto currencyOf = [](BankManagement& bank, int num) { return bank.accountTerms(bank.findAccount(num)->get()).currency; };
+    writeRates(dir);
+    {
+        auto bank = SelfTest::openBank(dir);
+        bank->submit(SelfTest::opening(1, 1'000), "0000");
+        bank->submit(SelfTest::opening(2, 1'000, eur), "0000");
+        auto transfer = SelfTest::command("transfer", 1, 100);
+        transfer.other = 2;
+        t.check(!bank->submit(transfer, "0000") && SelfTest::balanceOf(*bank, 1) == 900 && SelfTest::balanceOf(*bank, 2) == 1'080,
+                "a transfer between currencies credits the converted amount");
+    }
+    ofstream(dir / "fx_rates.txt") << "EUR 2\n"; // a later rate does not change what the log recorded
+    auto bank = SelfTest::openBank(dir);
+    t.check(currencyOf(*bank, 2) == "EUR" && currencyOf(*bank, 1) == "USD" && SelfTest::balanceOf(*bank, 2) == 1'080,
+            "after a restart each account keeps its currency and the converted balance");
+    bank.reset();
+#ifdef BANK_HAVE_SOCKETS
+    {
+        BenchShards cluster("bank_selftest_currencies");
+        for (uint16_t port : {17480, 17481}) cluster.start(port, writeRates);
+        ShardRouter router(ShardLayout(cluster.ports), cluster.dir() / "cluster_txlog.txt");
+        for (int num = 1; num <= 20; ++num) {
+            auto open = benchCommand("addAccount", num, 1'000);
+            open.other = num % 2 ? 0 : eur;
+            router.execute(open, "0000");
+        }
+        int usd = 1, euro = 2;
+        while (router.ownerOf(euro) == router.ownerOf(usd)) euro += 2;
+        t.check(SelfTest::refused(router.execute(benchCommand("transfer", usd, 100, euro), "0000"), "between currencies") &&
+                    router.find(usd)->second == 1'000 && router.find(euro)->second == 1'000,
+                "a transfer between currencies across shards is refused");
+        const uint16_t home = router.ownerOf(euro), away = router.ownerOf(usd);
+        auto& before = cluster.bankOn(home);
+        before.defineProduct(7, "Checking", 0, AccountKind::Checking);
+        before.setAccountProduct(euro, 7, "0000");
+        before.setCreditLimit(euro, 0, 2'000, "0000");
+        router.execute(benchCommand("withdraw", euro, 2'000), "0000");
+        router.moveRange(euro, euro, away);
+        auto& after = cluster.bankOn(away);
+        const auto* moved = after.findAccount(euro) ? &after.findAccount(euro)->get() : nullptr;
+        t.check(router.ownerOf(euro) == away && moved && moved->getBalance() == -1'000 && currencyOf(after, euro) == "EUR" &&
+                    moved->getKind() == AccountKind::Checking && moved->getAvailableBalance() == 1'000,
+                "a moved account keeps its currency, its kind and its credit line");
+    }
+    const auto primaryDir = dir / "primary", followerDir = dir / "follower";
+    fs::create_directories(primaryDir);
+    fs::create_directories(followerDir);
+    writeRates(primaryDir);
+    writeRates(followerDir);
+    const auto socket = (dir / "ship.sock").string();
+    {
+        auto primary = SelfTest::openBank(primaryDir);
+        primary->startShipping(socket);
+        primary->submit(SelfTest::opening(1, 1'000), "0000");
+        primary->submit(SelfTest::opening(2, 1'000, eur), "0000");
+        auto transfer = SelfTest::command("transfer", 1, 100);
+        transfer.other = 2;
+        primary->submit(transfer, "0000");
+        t.check(followPrimary(*primary, socket, followerDir,
+                              [&](BankManagement& follower) {
+                                  return currencyOf(follower, 2) == "EUR" && SelfTest::balanceOf(follower, 2) == 1'080;
+                              }),
+                "a follower keeps each account's currency");
+    }
+    auto promoted = SelfTest::openBank(followerDir);
+    t.check(currencyOf(*promoted, 2) == "EUR", "and so does it once promoted");
+    promoted.reset();
+#endif
+    fs::remove_all(dir);
+}
+
+inline void selfTestFraud(SelfTest& t) {
+    cout << "Fraud screening\n";
+    const auto dir = SelfTest::freshDir("fraud");
+    ofstream(dir / "fraud_rules.txt") << "count 0 60\ntotal 5000 60 block\n";
+    ofstream(dir / "fee_rules.txt") << "minimum-balance 0 100 1\n";
+    auto alerts = [](const fs::path& in) {
+        ifstream file(in / "fraud_alerts.txt");
+        return ranges::count(istreambuf_iterator<char>(file), istreambuf_iterator<char>(), '\n');
+    };
+    auto withdraw = [](BankManagement& bank, int num, double amount) {
+        return bank.submit(SelfTest::command("withdraw", num, amount), "0000");
+    };
+    {
+        auto bank = SelfTest::openBank(dir);
+        bank->submit(SelfTest::opening(1, 100'000), "0000");
+        bank->submit(SelfTest::opening(2, 10), "0000");
+        t.check(SelfTest::refused(withdraw(*bank, 2, 20), "Insufficient") && alerts(dir) == 0,
+                "a debit refused for another reason raises no alert");
+        t.check(!withdraw(*bank, 2, 5) && alerts(dir) == 1, "one made raises an alert for each rule it breaks");
+        t.check(SelfTest::refused(withdraw(*bank, 1, 6'000), "fraud rule 2") && alerts(dir) == 3 &&
+                    SelfTest::balanceOf(*bank, 1) == 100'000,
+                "a blocking rule refuses the debit, which raises its alerts");
+        bank->assessFees(true);
+        t.check(SelfTest::balanceOf(*bank, 2) == 4 && alerts(dir) == 3, "fee postings are not screened");
+    }
+    auto bank = SelfTest::openBank(dir);
+    t.check(!withdraw(*bank, 1, 4'000) && SelfTest::refused(withdraw(*bank, 1, 1'500), "fraud rule 2"),
+            "after a restart the windows are rebuilt from the log");
+    bank.reset();
+    fs::remove_all(dir);
+#ifdef BANK_HAVE_SOCKETS
+    BenchShards cluster("bank_selftest_fraud");
+    for (uint16_t port : {17490, 17491})
+        cluster.start(port, [](const fs::path& in) { ofstream(in / "fraud_rules.txt") << "total 5000 60 block\n"; });
+    ShardRouter router(ShardLayout(cluster.ports), cluster.dir() / "cluster_txlog.txt");
+    for (int num = 1; num <= 20; ++num) router.execute(benchCommand("addAccount", num, 10'000), "0000");
+    const int other = accountElsewhere(router, 2, 20, 1);
+    t.check(SelfTest::refused(router.execute(benchCommand("transfer", 1, 6'000, other), "0000"), "fraud rule 1") &&
+                router.find(1)->second == 10'000 && router.find(other)->second == 10'000,
+            "a transfer between shards is screened as its debit shard votes, and neither leg commits");
+    t.check(!router.execute(benchCommand("transfer", 1, 4'000, other), "0000") &&
+                SelfTest::refused(router.execute(benchCommand("transfer", 1, 1'500, other), "0000"), "fraud rule 1"),
+            "and counted once it commits");
+#endif
+}
+
+inline int runSelfTest() {
+    SelfTest t;
+    selfTestAuditChain(t);
+    selfTestStores(t);
+#ifdef BANK_HAVE_MMAP
+    selfTestSharedBook(t);
+#endif
+    selfTestRecovery(t);
+    selfTestCheckpoints(t);
+    selfTestDurability(t);
+    selfTestBackup(t);
+    selfTestPointInTime(t);
+#ifdef BANK_HAVE_SOCKETS
+    selfTestReplication(t);
+    selfTestRaft(t);
+    selfTestShardRouting(t);
+    selfTestTwoPhaseCommit(t);
+    selfTestMigration(t);
+#endif
+    selfTestIdempotency(t);
+    selfTestHolds(t);
+    selfTestStandingOrders(t);
+    selfTestInterest(t);
+    selfTestFees(t);
+    selfTestAccountKinds(t);
+    selfTestCreditLimits(t);
+    selfTestCurrencies(t);
+    selfTestFraud(t);
+    cout << (t.failed ? to_string(t.failed) + " checks failed\n" : "All checks passed\n");
+    return t.failed;
+}
+
+// ---------------- Main ----------------
+int main(int argc, char* argv[]) {
+    BankManagement bank;
+    const string filename = "accounts_secure.txt";
+
+    string engine;
+    size_t memoryBudgetMiB = 64;
+    bool publish = false;
+    string replicateTo, followFrom;
+    vector<uint16_t> raftPorts;
+    int raftId = 0;
+    uint16_t shardPort = 0;
+    bool router = false;
+    vector<uint16_t> shardPorts;
+    CheckpointPolicy checkpoints;
+    DurabilityPolicy durabilityPolicy;
+    double backupRateMiB = 32;
+    int64_t idempotencySeconds = 24 * 3600;
+    for (string_view arg : span(argv + 1, argc - 1)) {
+        if (arg.starts_with("--engine=")) {
+            engine = arg.substr(9);
+        } else if (arg.starts_with("--checkpoint-log-mb=")) {
+            auto digits = arg.substr(20);
+            if (from_chars(digits.data(), digits.data() + digits.size(), checkpoints.maxLogBytes).ec != errc{}) {
+                cerr << "Invalid checkpoint log size: " << digits << '\n';
+                return 1;
+            }
+            checkpoints.maxLogBytes <<= 20;
+        } else if (arg.starts_with("--checkpoint-replay-sec=")) {
+            auto digits = arg.substr(24);
+            if (from_chars(digits.data(), digits.data() + digits.size(), checkpoints.maxReplaySeconds).ec != errc{}) {
+                cerr << "Invalid replay bound: " << digits << '\n';
+                return 1;
+            }
+        } else if (arg.starts_with("--durability=")) {
+            if (!durabilityPolicy.set(arg.substr(13))) {
+                cerr << "Invalid durability setting (expected op:memory|async|group|sync): " << arg.substr(13) << '\n';
+                return 1;
+            }
+        } else if (arg.starts_with("--backup-rate-mb=")) {
+            auto digits = arg.substr(17);
+            if (from_chars(digits.data(), digits.data() + digits.size(), backupRateMiB).ec != errc{}) {
+                cerr << "Invalid backup rate: " << digits << '\n';
+                return 1;
+            }
+        } else if (arg.starts_with("--idempotency-window=")) {
+            auto digits = arg.substr(21);
+            if (from_chars(digits.data(), digits.data() + digits.size(), idempotencySeconds).ec != errc{} || idempotencySeconds <= 0) {
+                cerr << "Invalid idempotency window: " << digits << '\n';
+                return 1;
+            }
+        } else if (arg.starts_with("--base-currency=")) {
+            auto code = packCurrency(arg.substr(16));
+            if (!code) {
+                cerr << "Invalid base currency (expected a code such as USD): " << arg.substr(16) << '\n';
+                return 1;
+            }
+            bank.setBaseCurrency(*code);
+        } else if (arg.starts_with("--memory-budget=")) {
+            auto digits = arg.substr(16);
+            if (from_chars(digits.data(), digits.data() + digits.size(), memoryBudgetMiB).ec != errc{}) {
+                cerr << "Invalid memory budget: " << digits << '\n';
+                return 1;
+            }
+#ifdef BANK_HAVE_SOCKETS
+        } else if (arg.starts_with("--replicate=")) {
+            replicateTo = arg.substr(12);
+        } else if (arg.starts_with("--follow=")) {
+            followFrom = arg.substr(9);
+        } else if (arg.starts_with("--raft-peers=")) {
+            for (auto part : views::split(arg.substr(13), ',')) {
+                string_view digits(part.begin(), part.end());
+                uint16_t port{};
+                if (from_chars(digits.data(), digits.data() + digits.size(), port).ec != errc{} || !port) {
+                    cerr << "Invalid Raft peer port: " << digits << '\n';
+                    return 1;
+                }
+                raftPorts.push_back(port);
+            }
+        } else if (arg.starts_with("--raft-id=")) {
+            auto digits = arg.substr(10);
+            if (from_chars(digits.data(), digits.data() + digits.size(), raftId).ec != errc{}) {
+                cerr << "Invalid Raft node id: " << digits << '\n';
+                return 1;
+            }
+        } else if (arg.starts_with("--shard=")) {
+            auto digits = arg.substr(8);
+            if (from_chars(digits.data(), digits.data() + digits.size(), shardPort).ec != errc{} || !shardPort) {
+                cerr << "Invalid shard port: " << digits << '\n';
+                return 1;
+            }
+        } else if (arg == "--router") {
+            router = true;
+        } else if (arg.starts_with("--shards=")) {
+            for (auto part : views::split(arg.substr(9), ',')) {
+                string_view digits(part.begin(), part.end());
+                uint16_t port{};
+                if (from_chars(digits.data(), digits.data() + digits.size(), port).ec != errc{} || !port) {
+                    cerr << "Invalid shard port: " << digits << '\n';
+                    return 1;
+                }
+                shardPorts.push_back(port);
+            }
+        } else if (arg == "--bench=raft") {
+            benchmarkRaft();
+            return 0;
+        } else if (arg == "--bench=shards") {
+            benchmarkShards();
+            return 0;
+        } else if (arg == "--bench=2pc") {
+            benchmarkTwoPhaseCommit();
+            return 0;
+#endif
+#ifdef BANK_HAVE_MMAP
+        } else if (arg == "--publish") {
+            publish = true;
+        } else if (arg == "--reader") {
+            try {
+                return runReader();
+            } catch (const exception& e) {
+                cerr << "Error: " << e.what() << '\n';
+                return 1;
+            }
+#endif
+        } else if (arg == "--bench=btree") {
+            benchmarkBTree();
+            return 0;
+        } else if (arg == "--bench=durability") {
+            benchmarkDurability();
+            return 0;
+        } else if (arg == "--bench=idempotency") {
+            benchmarkIdempotency();
+            return 0;
+        } else if (arg == "--bench=holds") {
+            benchmarkHolds();
+            return 0;
+        } else if (arg == "--bench=orders") {
+            benchmarkStandingOrders();
+            return 0;
+        } else if (arg == "--bench=products") {
+            benchmarkProducts();
+            return 0;
+        } else if (arg == "--bench=interest") {
+            benchmarkInterest();
+            return 0;
+        } else if (arg == "--bench=fees") {
+            benchmarkFees();
+            return 0;
+        } else if (arg == "--bench=fx") {
+            benchmarkCurrencies();
+            return 0;
+        } else if (arg == "--bench=fraud") {
+            benchmarkFraud();
+            return 0;
+        } else if (arg == "--selftest") {
+            return runSelfTest() ? 1 : 0;
+        } else {
+            cerr << "Unknown option: " << arg << '\n';
+            return 1;
+        }
+    }
+    if (engine == "lsm") bank.useStore(make_unique<LsmStore>("accounts_lsm"));
+    else if (engine == "btree") bank.useStore(make_unique<BPlusTreeStore>("accounts_btree.db", 1024));
+#ifdef BANK_HAVE_MMAP
+    else if (engine == "mapped") bank.useStore(make_unique<MappedStore>("accounts_mapped.db"));
+#endif
+    else if (engine == "tiered") bank.useStore(make_unique<TieredStore>("accounts_cold.seg", memoryBudgetMiB << 20));
+    else if (!engine.empty()) {
+        cerr << "Unknown engine: " << engine << '\n';
+        return 1;
+    }
+
+    const string auditFile = "audit_log.txt";
+    bank.setCheckpointPolicy(checkpoints);
+    bank.setDurabilityPolicy(durabilityPolicy);
+    bank.setIdempotencyWindow(chrono::seconds(idempotencySeconds));
+#ifdef BANK_HAVE_SOCKETS
+    if (!raftPorts.empty()) {
+        if (raftId < 1 || raftId > static_cast<int>(raftPorts.size())) {
+            cerr << "--raft-id must name one of the --raft-peers (1.." << raftPorts.size() << ")\n";
+            return 1;
+        }
+        try {
+            return runRaftNode(bank, raftPorts, raftId - 1, auditFile);
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << '\n';
+            return 1;
+        }
+    }
+    if (router) {
+        try {
+            return runRouter(shardPorts);
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << '\n';
+            return 1;
+        }
+    }
+#endif
+    bank.loadFromFile(filename);
+    bank.recoverFromLog(auditFile);
+    bank.openAuditLog(auditFile);
+#ifdef BANK_HAVE_MMAP
+    if (publish) {
+        try {
+            bank.publishShared();
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << '\n';
+            return 1;
+        }
+    }
+#endif
+#ifdef BANK_HAVE_SOCKETS
+    if (!replicateTo.empty() && !followFrom.empty()) {
+        cerr << "A follower cannot also act as a primary\n";
+        return 1;
+    }
+    if (!followFrom.empty()) return runFollower(bank, followFrom, filename);
+    if (shardPort) {
+        try {
+            return runShard(bank, shardPort, filename);
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << '\n';
+            return 1;
+        }
+    }
+    if (!replicateTo.empty()) {
+        try {
+            bank.startShipping(replicateTo);
+        } catch (const exception& e) {
+            cerr << "Error: " << e.what() << '\n';
+            return 1;
+        }
+    }
+#endif
+
+    // Standing orders and hold expiry run on time, not on the next menu choice.
+    mutex bookMutex;
+    condition_variable_any tick;
+    jthread scheduler([&](stop_token stop) {
+        unique_lock lock(bookMutex);
+        while (!tick.wait_for(lock, stop, chrono::seconds(1), [] { return false; }) && !stop.stop_requested()) {
+            try {
+                bank.runScheduled();
+            } catch (const exception& e) {
+                cerr << "Scheduler: " << e.what() << '\n';
+            }
+        }
+    });
+
+    // Exchange rates are published when fx_rates.txt changes, without taking the book:
+    // an operation in progress keeps the table it started with.
+    jthread rateWatcher([&](stop_token stop) {
+        mutex idle;
+        condition_variable_any never;
+        unique_lock lock(idle);
+        while (!never.wait_for(lock, stop, chrono::seconds(1), [] { return false; }) && !stop.stop_requested()) {
+            try {
+                bank.reloadRates();
+            } catch (const exception& e) {
+                cerr << "Exchange rates: " << e.what() << '\n';
+            }
+        }
+    });
+
+    // The book is taken only around the bank's own work, never while a prompt waits on
+    // the teller, so the scheduler keeps running behind an open menu.
+    auto locked = [&](auto&& work) {
+        lock_guard lock(bookMutex);
+        return work();
+    };
+    auto getPin = [](const string& whose) {
+        string pin;
+        cout << "Enter PIN for " << whose << ": ";
+        getline(cin, pin);
+        return pin;
+    };
+
+    int choice{};
+    do {
+        printMenu();
+        if (!getInt("Enter choice: ", choice, 0, 28)) continue;
+        try {
+            switch (static_cast<Menu>(choice)) {
+                case Menu::CreateAccount: {
+                    string name, pin;
+                    int num;
+                    double bal;
+                    getNonEmptyString("Name: ", name);
                     getInt("Account Number: ", num, 1);
                     getDouble("Initial Balance: ", bal, 0.0);
                     getNonEmptyString("Set 4-digit PIN: ", pin);
                     if (pin.size() != 4 || !ranges::all_of(pin, ::isdigit))
                         throw invalid_argument("PIN must be 4 digits.");
-                    bank.addAccount(name, num, bal, pin);
+                    const auto base = locked([&] { return bank.baseCurrency(); });
+                    const auto currency = getCurrency("Currency (" + currencyCode(base) + " is the base): ");
+                    locked([&] { bank.addAccount(name, num, bal, pin, currency); });
                     break;
                 }
-                case Menu::ShowAll: bank.showAllAccounts(); break;
+                case Menu::ShowAll: locked([&] { bank.showAllAccounts(); }); break;
                 case Menu::Search: {
                     int num;
                     getInt("Enter account number: ", num, 1);
-                    if (auto acc = bank.findAccount(num))
-                        cout << "Found -> " << acc->get().getName()
-                             << " | Balance: " << acc->get().getBalance() << '\n';
-                    else
+                    lock_guard lock(bookMutex);
+                    if (auto acc = bank.findAccount(num)) {
+                        cout << "Found -> " << acc->get().getName() << " | Balance: " << acc->get().getBalance();
+                        if (acc->get().getCurrency()) cout << ' ' << bank.currencyName(acc->get().getCurrency());
+                        if (acc->get().getAvailableBalance() != acc->get().getBalance())
+                            cout << " | Available: " << acc->get().getAvailableBalance();
+                        cout << '\n';
+                    } else
                         cout << "Account not found.\n";
                     break;
                 }
@@ -316,7 +10743,8 @@ int main() {
                     double amt;
                     getInt("Account number: ", num, 1);
                     getDouble("Amount: ", amt, 0.01);
-                    bank.deposit(num, amt);
+                    const auto pin = getPin("account " + to_string(num));
+                    locked([&] { bank.deposit(num, amt, pin); });
                     break;
                 }
                 case Menu::Withdraw: {
@@ -324,7 +10752,8 @@ int main() {
                     double amt;
                     getInt("Account number: ", num, 1);
                     getDouble("Amount: ", amt, 0.01);
-                    bank.withdraw(num, amt);
+                    const auto pin = getPin("account " + to_string(num));
+                    locked([&] { bank.withdraw(num, amt, pin); });
                     break;
                 }
                 case Menu::Transfer: {
@@ -333,13 +10762,15 @@ int main() {
                     getInt("From account: ", from, 1);
                     getInt("To account: ", to, 1);
                     getDouble("Amount: ", amt, 0.01);
-                    bank.transfer(from, to, amt);
+                    const auto pin = getPin("account " + to_string(from));
+                    locked([&] { bank.transfer(from, to, amt, pin); });
                     break;
                 }
                 case Menu::CloseAccount: {
                     int num;
                     getInt("Enter account to close: ", num, 1);
-                    bank.closeAccount(num);
+                    const auto pin = getPin("account " + to_string(num));
+                    locked([&] { bank.closeAccount(num, pin); });
                     break;
                 }
                 case Menu::UpdateName: {
@@ -347,19 +10778,141 @@ int main() {
                     string newName;
                     getInt("Enter account number: ", num, 1);
                     getNonEmptyString("New Name: ", newName);
-                    bank.updateName(num, newName);
+                    const auto pin = getPin("account " + to_string(num));
+                    locked([&] { bank.updateName(num, newName, pin); });
                     break;
                 }
                 case Menu::HighBalance: {
                     double threshold;
                     getDouble("Enter threshold: ", threshold, 0.0);
-                    bank.showHighBalance(threshold);
+                    locked([&] { bank.showHighBalance(threshold); });
+                    break;
+                }
+                case Menu::SortAccounts: locked([&] { bank.sortAccountsByBalance(); }); break;
+                case Menu::VerifyAudit: locked([&] { bank.verifyAuditLog(); }); break;
+                case Menu::Backup: {
+                    string dir;
+                    getNonEmptyString("Backup directory: ", dir);
+                    locked([&] { bank.startBackup(dir, backupRateMiB * 1024.0 * 1024.0); });
+                    cout << "Backup started in the background.\n";
+                    break;
+                }
+                case Menu::BalanceAsOf: {
+                    int num;
+                    getInt("Account Number: ", num, 1);
+                    auto when = getTimestamp("As of (YYYY-MM-DD HH:MM:SS): ");
+                    if (auto acc = locked([&] { return bank.accountAsOf(num, when); }))
+                        cout << "Then -> " << acc->getName() << " | Balance: " << acc->getBalance() << '\n';
+                    else
+                        cout << "Account did not exist at that time.\n";
+                    break;
+                }
+                case Menu::RestoreAsOf: {
+                    auto when = getTimestamp("Restore as of (YYYY-MM-DD HH:MM:SS): ");
+                    string dir;
+                    getNonEmptyString("Target directory: ", dir);
+                    auto count = locked([&] { return bank.restoreAsOf(when, dir); });
+                    cout << "Restored " << count << " accounts into " << dir << ".\n";
+                    break;
+                }
+                case Menu::PlaceHold: {
+                    int num, minutes;
+                    double amt;
+                    getInt("Account number: ", num, 1);
+                    getDouble("Amount: ", amt, 0.01);
+                    getInt("Expires in (minutes): ", minutes, 1, 30 * 24 * 60);
+                    const auto pin = getPin("account " + to_string(num));
+                    locked([&] { bank.placeHold(num, amt, chrono::minutes(minutes), pin); });
+                    break;
+                }
+                case Menu::CaptureHold: {
+                    int id;
+                    double amt;
+                    getInt("Hold id: ", id, 1);
+                    getDouble("Amount to capture: ", amt, 0.01);
+                    const auto pin = getPin("the account of hold " + to_string(id));
+                    locked([&] { bank.captureHold(static_cast<uint64_t>(id), amt, pin); });
+                    break;
+                }
+                case Menu::ReleaseHold: {
+                    int id;
+                    getInt("Hold id: ", id, 1);
+                    const auto pin = getPin("the account of hold " + to_string(id));
+                    locked([&] { bank.releaseHold(static_cast<uint64_t>(id), pin); });
+                    break;
+                }
+                case Menu::ScheduleTransfer: {
+                    int from, to, repeat;
+                    double amt;
+                    getInt("From account: ", from, 1);
+                    getInt("To account: ", to, 1);
+                    getDouble("Amount: ", amt, 0.01);
+                    auto first = getTimestamp("First run (YYYY-MM-DD HH:MM:SS): ");
+                    getInt("Repeat (0 once, 1 daily, 2 weekly, 3 monthly): ", repeat, 0, 3);
+                    const auto pin = getPin("account " + to_string(from));
+                    const auto period = static_cast<StandingOrders::Period>(repeat);
+                    locked([&] { bank.scheduleTransfer(from, to, amt, period, first, pin); });
+                    break;
+                }
+                case Menu::StandingOrders: locked([&] { bank.showStandingOrders(); }); break;
+                case Menu::CancelOrder: {
+                    int id;
+                    getInt("Standing order id: ", id, 1);
+                    const auto pin = getPin("the account of standing order " + to_string(id));
+                    locked([&] { bank.cancelStandingOrder(static_cast<uint64_t>(id), pin); });
+                    break;
+                }
+                case Menu::Products: locked([&] { bank.showProducts(); }); break;
+                case Menu::DefineProduct: {
+                    int id, kind;
+                    string name;
+                    double rate;
+                    getInt("Product id: ", id, 1);
+                    getNonEmptyString("Name: ", name);
+                    getDouble("Annual rate (%): ", rate, 0.0);
+                    getInt("Kind (0 standard, 1 savings, 2 checking, 3 loan): ", kind, 0, 3);
+                    const auto product = static_cast<uint32_t>(id);
+                    locked([&] { bank.defineProduct(product, name, rate, static_cast<AccountKind>(kind)); });
+                    break;
+                }
+                case Menu::SetProduct: {
+                    int num, id;
+                    getInt("Account number: ", num, 1);
+                    getInt("Product id: ", id, 1);
+                    const auto pin = getPin("account " + to_string(num));
+                    locked([&] { bank.setAccountProduct(num, static_cast<uint32_t>(id), pin); });
+                    break;
+                }
+                case Menu::AssessFees: {
+                    BankManagement::printFees(locked([&] { return bank.assessFees(false); }), false);
+                    int post;
+                    getInt("Post these fees now? (1 yes, 0 no): ", post, 0, 1);
+                    // Assessed again: the book may have changed while the teller decided.
+                    if (post) BankManagement::printFees(locked([&] { return bank.assessFees(true); }), true);
+                    break;
+                }
+                case Menu::CreditLimit: {
+                    int num, id = 0;
+                    double line;
+                    getInt("Account number (0 for a whole product): ", num, 0);
+                    if (!num) getInt("Product id: ", id, 1);
+                    getDouble("Credit limit (-1 for the default): ", line, -1.0);
+                    const auto pin = num ? getPin("account " + to_string(num)) : string();
+                    locked([&] {
+                        bank.setCreditLimit(num, static_cast<uint32_t>(id), line < 0 ? nullopt : optional(line), pin);
+                    });
+                    break;
+                }
+                case Menu::ExchangeRates: locked([&] { bank.showRates(); }); break;
+                case Menu::FraudAlerts: locked([&] { bank.showFraudAlerts(); }); break;
+                case Menu::Revalue: {
+                    const auto currency = getCurrency("Reporting currency: ");
+                    BankManagement::printRevaluation(locked([&] { return bank.revalueBook(currency); }), currency);
                     break;
                 }
-                case Menu::SortAccounts: bank.sortAccountsByBalance(); break;
                 case Menu::Exit:
                     cout << "Saving data...\n";
-                    bank.saveToFile(filename);
+                    locked([&] { bank.saveToFile(filename); });
                     return 0;
             }
         } catch (const exception& e) {